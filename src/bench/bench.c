@@ -0,0 +1,762 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <math.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../btree.h"
+
+// YCSB-style workloads over an int tree: the tree is loaded with keys 0 to keys - 1, then threads run a mix
+// of operations on keys drawn from a distribution, timing every one. Prints throughput, latency percentiles
+// per operation, and the syscalls and I/O the run cost, as CSV or JSON.
+
+typedef enum bench_op {
+    BENCH_READ,
+    BENCH_UPDATE,
+    BENCH_INSERT,
+    BENCH_DELETE,
+    BENCH_SCAN,
+    BENCH_RMW, // read then update of the same key, timed as one operation
+    BENCH_COUNT_OPS,
+} Bench_Op;
+
+static const char *bench_op_names[BENCH_COUNT_OPS] = {"read", "update", "insert", "delete", "scan", "rmw"};
+
+typedef enum bench_dist {
+    BENCH_UNIFORM,
+    BENCH_ZIPFIAN,    // popular keys scattered over the key space
+    BENCH_SEQUENTIAL, // every thread walks the keys in order from its own starting point
+    BENCH_LATEST,     // zipfian over the most recent inserts
+} Bench_Dist;
+
+static const char *bench_dist_names[] = {"uniform", "zipfian", "sequential", "latest"};
+
+// Latencies in nanoseconds: exact below 16, then 16 buckets for every power of two, so a value is never
+// reported more than about 6% off.
+#define BENCH_BUCKETS 1024
+
+typedef struct bench_histogram {
+    uint64_t counts[BENCH_BUCKETS];
+    uint64_t count;
+    uint64_t sum;
+    uint64_t max;
+} Bench_Histogram;
+
+typedef struct bench_config {
+    const char *path; // NULL benchmarks an in-memory tree
+    const char *workload;
+    int keys;
+    long ops;
+    int threads;
+    int t;
+    int mix[BENCH_COUNT_OPS]; // weights, in any unit
+    Bench_Dist dist;
+    double theta;
+    int scan_length;
+    size_t cache_size;
+    Btree_Backend backend;
+    bool wal;
+    bool concurrent_puts;
+    bool bulk_load;
+    bool cold;
+    bool json;
+    uint64_t seed;
+} Bench_Config;
+
+typedef struct bench_zipf {
+    long items;
+    double theta;
+    double alpha;
+    double zeta_n;
+    double eta;
+    double half_pow_theta;
+} Bench_Zipf;
+
+typedef struct bench_io {
+    long long syscr;
+    long long syscw;
+    long long rchar;
+    long long wchar;
+    long long read_bytes;
+    long long write_bytes;
+    long minflt;
+    long majflt;
+    long nvcsw;
+    long nivcsw;
+} Bench_Io;
+
+typedef struct bench_shared {
+    const Bench_Config *config;
+    Btree *btree;
+    Bench_Zipf zipf;
+    int total_weight;
+    long next_key; // keys below it were loaded or inserted
+} Bench_Shared;
+
+typedef struct bench_thread {
+    Bench_Shared *shared;
+    pthread_t thread;
+    int id;
+    long ops;
+    uint64_t rng;
+    long sequence;
+    long misses;
+    long errors;
+    Bench_Histogram histograms[BENCH_COUNT_OPS];
+} Bench_Thread;
+
+static uint64_t bench_now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+// xorshift64*, one state per thread
+static uint64_t bench_random(uint64_t *state) {
+    uint64_t x = *state;
+    x ^= x >> 12;
+    x ^= x << 25;
+    x ^= x >> 27;
+    *state = x;
+    return x * 0x2545F4914F6CDD1DULL;
+}
+
+static double bench_random_unit(uint64_t *state) {
+    return (bench_random(state) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+static uint64_t bench_hash(uint64_t x) {
+    uint64_t hash = 0xCBF29CE484222325ULL;
+    for (int i = 0; i < 8; i++) {
+        hash = (hash ^ (x & 0xFF)) * 0x100000001B3ULL;
+        x >>= 8;
+    }
+    return hash;
+}
+
+static int bench_bucket(uint64_t ns) {
+    if (ns < 16) {
+        return (int)ns;
+    }
+    int exponent = 63 - __builtin_clzll(ns);
+    return (exponent - 3) * 16 + (int)((ns >> (exponent - 4)) & 15);
+}
+
+static uint64_t bench_bucket_value(int bucket) {
+    if (bucket < 16) {
+        return bucket;
+    }
+    int exponent = bucket / 16 + 3;
+    return (uint64_t)(16 + bucket % 16) << (exponent - 4);
+}
+
+static void bench_record(Bench_Histogram *histogram, uint64_t ns) {
+    histogram->counts[bench_bucket(ns)]++;
+    histogram->count++;
+    histogram->sum += ns;
+    histogram->max = ns > histogram->max ? ns : histogram->max;
+}
+
+static void bench_merge(Bench_Histogram *into, const Bench_Histogram *from) {
+    for (int i = 0; i < BENCH_BUCKETS; i++) {
+        into->counts[i] += from->counts[i];
+    }
+    into->count += from->count;
+    into->sum += from->sum;
+    into->max = from->max > into->max ? from->max : into->max;
+}
+
+static double bench_percentile_us(const Bench_Histogram *histogram, double percentile) {
+    if (histogram->count == 0) {
+        return 0;
+    }
+    uint64_t rank = (uint64_t)ceil(percentile / 100 * histogram->count);
+    uint64_t seen = 0;
+    for (int i = 0; i < BENCH_BUCKETS; i++) {
+        seen += histogram->counts[i];
+        if (seen >= rank && histogram->counts[i] > 0) {
+            return bench_bucket_value(i) / 1000.0;
+        }
+    }
+    return histogram->max / 1000.0;
+}
+
+// Zipfian ranks as YCSB draws them (Gray et al., "Quickly generating billion-record synthetic databases").
+static void bench_zipf_init(Bench_Zipf *zipf, long items, double theta) {
+    zipf->items = items;
+    zipf->theta = theta;
+    zipf->zeta_n = 0;
+    for (long i = 1; i <= items; i++) {
+        zipf->zeta_n += 1 / pow((double)i, theta);
+    }
+    double zeta_2 = 1 + 1 / pow(2, theta);
+    zipf->alpha = 1 / (1 - theta);
+    zipf->eta = (1 - pow(2.0 / items, 1 - theta)) / (1 - zeta_2 / zipf->zeta_n);
+    zipf->half_pow_theta = 1 + pow(0.5, theta);
+}
+
+static long bench_zipf_next(const Bench_Zipf *zipf, uint64_t *rng) {
+    double u = bench_random_unit(rng);
+    double uz = u * zipf->zeta_n;
+    if (uz < 1) {
+        return 0;
+    }
+    if (uz < zipf->half_pow_theta) {
+        return 1;
+    }
+    long rank = (long)(zipf->items * pow(zipf->eta * u - zipf->eta + 1, zipf->alpha));
+    return rank < zipf->items ? rank : zipf->items - 1;
+}
+
+static int bench_key(Bench_Thread *thread) {
+    Bench_Shared *shared = thread->shared;
+    long count = __atomic_load_n(&shared->next_key, __ATOMIC_RELAXED);
+    switch (shared->config->dist) {
+    case BENCH_ZIPFIAN:
+        return (int)(bench_hash(bench_zipf_next(&shared->zipf, &thread->rng)) % (uint64_t)count);
+    case BENCH_SEQUENTIAL:
+        return (int)(thread->sequence++ % count);
+    case BENCH_LATEST: {
+        long rank = bench_zipf_next(&shared->zipf, &thread->rng);
+        return (int)(rank < count ? count - 1 - rank : 0);
+    }
+    default:
+        return (int)(bench_random(&thread->rng) % (uint64_t)count);
+    }
+}
+
+static Bench_Op bench_pick_op(Bench_Thread *thread) {
+    const Bench_Config *config = thread->shared->config;
+    int draw = (int)(bench_random(&thread->rng) % (uint64_t)thread->shared->total_weight);
+    for (int op = 0; op < BENCH_COUNT_OPS; op++) {
+        if (draw < config->mix[op]) {
+            return (Bench_Op)op;
+        }
+        draw -= config->mix[op];
+    }
+    return BENCH_READ;
+}
+
+static Btree_Result bench_run_op(Bench_Thread *thread, Bench_Op op) {
+    Bench_Shared *shared = thread->shared;
+    Btree *btree = shared->btree;
+    int value = 0;
+    switch (op) {
+    case BENCH_READ:
+        return btree_find(btree, bench_key(thread), &value);
+    case BENCH_UPDATE: {
+        int key = bench_key(thread);
+        return btree_put(btree, key, ~key);
+    }
+    case BENCH_INSERT: {
+        int key = (int)__atomic_fetch_add(&shared->next_key, 1, __ATOMIC_RELAXED);
+        return btree_put(btree, key, ~key);
+    }
+    case BENCH_DELETE:
+        return btree_delete(btree, bench_key(thread));
+    case BENCH_SCAN: {
+        Btree_Cursor cursor;
+        int key = 0;
+        Btree_Result res = btree_cursor_open(btree, &cursor);
+        res = res == BTREE_OK ? btree_cursor_seek(&cursor, bench_key(thread)) : res;
+        for (int i = 0; i < shared->config->scan_length && res == BTREE_OK; i++) {
+            res = btree_cursor_get(&cursor, &key, &value);
+            res = res == BTREE_OK ? btree_cursor_next(&cursor) : res;
+        }
+        btree_cursor_close(&cursor);
+        return res == BTREE_ERROR_END ? BTREE_OK : res;
+    }
+    case BENCH_RMW: {
+        int key = bench_key(thread);
+        Btree_Result res = btree_find(btree, key, &value);
+        return res == BTREE_OK ? btree_put(btree, key, value + 1) : res;
+    }
+    default:
+        return BTREE_ERROR_INTERNAL;
+    }
+}
+
+static void *bench_worker(void *arg) {
+    Bench_Thread *thread = (Bench_Thread *)arg;
+    for (long i = 0; i < thread->ops; i++) {
+        Bench_Op op = bench_pick_op(thread);
+        uint64_t start = bench_now_ns();
+        Btree_Result res = bench_run_op(thread, op);
+        bench_record(&thread->histograms[op], bench_now_ns() - start);
+        if (res == BTREE_ERROR_KEY_NOT_FOUND) {
+            thread->misses++;
+        } else if (res != BTREE_OK) {
+            thread->errors++;
+        }
+    }
+    return NULL;
+}
+
+static void bench_io_read(Bench_Io *io) {
+    memset(io, 0, sizeof(*io));
+    FILE *file = fopen("/proc/self/io", "r");
+    if (file != NULL) {
+        char name[32];
+        long long value;
+        while (fscanf(file, "%31[^:]: %lld\n", name, &value) == 2) {
+            if (strcmp(name, "syscr") == 0) {
+                io->syscr = value;
+            } else if (strcmp(name, "syscw") == 0) {
+                io->syscw = value;
+            } else if (strcmp(name, "rchar") == 0) {
+                io->rchar = value;
+            } else if (strcmp(name, "wchar") == 0) {
+                io->wchar = value;
+            } else if (strcmp(name, "read_bytes") == 0) {
+                io->read_bytes = value;
+            } else if (strcmp(name, "write_bytes") == 0) {
+                io->write_bytes = value;
+            }
+        }
+        fclose(file);
+    }
+
+    struct rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage) == 0) {
+        io->minflt = usage.ru_minflt;
+        io->majflt = usage.ru_majflt;
+        io->nvcsw = usage.ru_nvcsw;
+        io->nivcsw = usage.ru_nivcsw;
+    }
+}
+
+static void bench_io_diff(Bench_Io *io, const Bench_Io *start) {
+    io->syscr -= start->syscr;
+    io->syscw -= start->syscw;
+    io->rchar -= start->rchar;
+    io->wchar -= start->wchar;
+    io->read_bytes -= start->read_bytes;
+    io->write_bytes -= start->write_bytes;
+    io->minflt -= start->minflt;
+    io->majflt -= start->majflt;
+    io->nvcsw -= start->nvcsw;
+    io->nivcsw -= start->nivcsw;
+}
+
+static Btree_Options bench_options(const Bench_Config *config) {
+    return (Btree_Options){
+        .path = config->path,
+        .t = config->t,
+        .log_handler = btree_default_log_handler,
+        .cache_size = config->cache_size,
+        .backend = config->backend,
+        .wal = config->wal,
+        .concurrent = config->threads > 1,
+        .concurrent_puts = config->concurrent_puts,
+    };
+}
+
+typedef struct bench_range {
+    int next;
+    int end;
+} Bench_Range;
+
+static bool bench_range_next(void *ctx, Item *item) {
+    Bench_Range *range = (Bench_Range *)ctx;
+    if (range->next == range->end) {
+        return false;
+    }
+    *item = (Item){range->next, ~range->next};
+    range->next++;
+    return true;
+}
+
+static Btree_Result bench_load(Btree *btree, const Bench_Config *config) {
+    if (config->bulk_load) {
+        Bench_Range range = {0, config->keys};
+        return btree_bulk_load(btree, (Btree_Iterator){bench_range_next, &range});
+    }
+
+    int *keys = malloc(config->keys * sizeof(*keys));
+    if (keys == NULL) {
+        return BTREE_ERROR_UNIX;
+    }
+    uint64_t rng = config->seed;
+    for (int i = 0; i < config->keys; i++) {
+        keys[i] = i;
+    }
+    for (int i = config->keys - 1; i > 0; i--) {
+        int j = (int)(bench_random(&rng) % (uint64_t)(i + 1));
+        int key = keys[i];
+        keys[i] = keys[j];
+        keys[j] = key;
+    }
+
+    Btree_Result res = BTREE_OK;
+    for (int i = 0; i < config->keys && res == BTREE_OK; i++) {
+        res = btree_put(btree, keys[i], ~keys[i]);
+    }
+    free(keys);
+    return res;
+}
+
+// Reopens the tree after asking the kernel to drop the file from its page cache, so the run starts from disk.
+static Btree_Result bench_make_cold(Btree *btree, const Bench_Config *config) {
+    Btree_Result res = btree_destroy(btree);
+    if (res != BTREE_OK) {
+        return res;
+    }
+    int fd = open(config->path, O_RDONLY);
+    if (fd != -1) {
+        fdatasync(fd);
+        posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+        close(fd);
+    }
+    return btree_init(btree, bench_options(config));
+}
+
+// Reads every key once, so the run starts with whatever the cache and the page cache can hold.
+static void bench_make_warm(Btree *btree) {
+    Btree_Cursor cursor;
+    int key, value;
+    if (btree_cursor_open(btree, &cursor) != BTREE_OK) {
+        return;
+    }
+    Btree_Result res = btree_cursor_seek(&cursor, 0);
+    while (res == BTREE_OK && btree_cursor_get(&cursor, &key, &value) == BTREE_OK) {
+        res = btree_cursor_next(&cursor);
+    }
+    btree_cursor_close(&cursor);
+}
+
+static void bench_print(const Bench_Config *config, double load_s, double run_s, const Bench_Histogram *histograms,
+                        const Bench_Histogram *total, long misses, long errors, const Bench_Io *io) {
+    double throughput = run_s > 0 ? total->count / run_s : 0;
+    if (!config->json) {
+        printf("workload,op,keys,threads,t,dist,cache_size,count,ops_per_s,mean_us,p50_us,p99_us,p999_us,max_us,"
+               "load_s,run_s,misses,errors,syscr,syscw,rchar,wchar,read_bytes,write_bytes,minflt,majflt,nvcsw,"
+               "nivcsw\n");
+        for (int op = 0; op <= BENCH_COUNT_OPS; op++) {
+            const Bench_Histogram *histogram = op < BENCH_COUNT_OPS ? &histograms[op] : total;
+            if (op < BENCH_COUNT_OPS && histogram->count == 0) {
+                continue;
+            }
+            printf("%s,%s,%d,%d,%d,%s,%zu,%llu,%.1f,%.3f,%.3f,%.3f,%.3f,%.3f,%.3f,%.3f,%ld,%ld,%lld,%lld,%lld,"
+                   "%lld,%lld,%lld,%ld,%ld,%ld,%ld\n",
+                   config->workload, op < BENCH_COUNT_OPS ? bench_op_names[op] : "all", config->keys,
+                   config->threads, config->t, bench_dist_names[config->dist], config->cache_size,
+                   (unsigned long long)histogram->count, run_s > 0 ? histogram->count / run_s : 0,
+                   histogram->count ? histogram->sum / 1000.0 / histogram->count : 0,
+                   bench_percentile_us(histogram, 50), bench_percentile_us(histogram, 99),
+                   bench_percentile_us(histogram, 99.9), histogram->max / 1000.0, load_s, run_s, misses, errors,
+                   io->syscr, io->syscw, io->rchar, io->wchar, io->read_bytes, io->write_bytes, io->minflt,
+                   io->majflt, io->nvcsw, io->nivcsw);
+        }
+        return;
+    }
+
+    printf("{\n  \"workload\": \"%s\", \"keys\": %d, \"ops\": %ld, \"threads\": %d, \"t\": %d, \"dist\": \"%s\",\n"
+           "  \"cache_size\": %zu, \"load_s\": %.3f, \"run_s\": %.3f, \"ops_per_s\": %.1f, \"misses\": %ld, "
+           "\"errors\": %ld,\n",
+           config->workload, config->keys, config->ops, config->threads, config->t, bench_dist_names[config->dist],
+           config->cache_size, load_s, run_s, throughput, misses, errors);
+    printf("  \"io\": {\"syscr\": %lld, \"syscw\": %lld, \"rchar\": %lld, \"wchar\": %lld, \"read_bytes\": %lld, "
+           "\"write_bytes\": %lld, \"minflt\": %ld, \"majflt\": %ld, \"nvcsw\": %ld, \"nivcsw\": %ld},\n",
+           io->syscr, io->syscw, io->rchar, io->wchar, io->read_bytes, io->write_bytes, io->minflt, io->majflt,
+           io->nvcsw, io->nivcsw);
+    printf("  \"ops\": [\n");
+    bool first = true;
+    for (int op = 0; op <= BENCH_COUNT_OPS; op++) {
+        const Bench_Histogram *histogram = op < BENCH_COUNT_OPS ? &histograms[op] : total;
+        if (op < BENCH_COUNT_OPS && histogram->count == 0) {
+            continue;
+        }
+        printf("%s    {\"op\": \"%s\", \"count\": %llu, \"ops_per_s\": %.1f, \"mean_us\": %.3f, \"p50_us\": %.3f, "
+               "\"p99_us\": %.3f, \"p999_us\": %.3f, \"max_us\": %.3f}",
+               first ? "" : ",\n", op < BENCH_COUNT_OPS ? bench_op_names[op] : "all",
+               (unsigned long long)histogram->count, run_s > 0 ? histogram->count / run_s : 0,
+               histogram->count ? histogram->sum / 1000.0 / histogram->count : 0, bench_percentile_us(histogram, 50),
+               bench_percentile_us(histogram, 99), bench_percentile_us(histogram, 99.9), histogram->max / 1000.0);
+        first = false;
+    }
+    printf("\n  ]\n}\n");
+}
+
+// The core YCSB workloads. E scans and F reads, modifies and writes back.
+static bool bench_workload(Bench_Config *config, const char *name) {
+    static const struct {
+        const char *name;
+        int mix[BENCH_COUNT_OPS];
+        Bench_Dist dist;
+    } workloads[] = {
+        {"a", {50, 50, 0, 0, 0, 0}, BENCH_ZIPFIAN}, {"b", {95, 5, 0, 0, 0, 0}, BENCH_ZIPFIAN},
+        {"c", {100, 0, 0, 0, 0, 0}, BENCH_ZIPFIAN}, {"d", {95, 0, 5, 0, 0, 0}, BENCH_LATEST},
+        {"e", {0, 0, 5, 0, 95, 0}, BENCH_ZIPFIAN},  {"f", {50, 0, 0, 0, 0, 50}, BENCH_ZIPFIAN},
+    };
+    for (size_t i = 0; i < sizeof(workloads) / sizeof(*workloads); i++) {
+        if (strcmp(workloads[i].name, name) == 0) {
+            config->workload = workloads[i].name;
+            memcpy(config->mix, workloads[i].mix, sizeof(config->mix));
+            config->dist = workloads[i].dist;
+            return true;
+        }
+    }
+    return false;
+}
+
+// Parses a mix like read=90,insert=10; operations left out get no weight.
+static bool bench_parse_mix(Bench_Config *config, const char *text) {
+    memset(config->mix, 0, sizeof(config->mix));
+    config->workload = "custom";
+    char *copy = strdup(text);
+    bool ok = copy != NULL;
+    for (char *part = ok ? strtok(copy, ",") : NULL; part != NULL && ok; part = strtok(NULL, ",")) {
+        char *equals = strchr(part, '=');
+        ok = false;
+        for (int op = 0; op < BENCH_COUNT_OPS && equals != NULL; op++) {
+            if (strncmp(part, bench_op_names[op], equals - part) == 0 &&
+                bench_op_names[op][equals - part] == '\0') {
+                config->mix[op] = atoi(equals + 1);
+                ok = config->mix[op] >= 0;
+            }
+        }
+    }
+    free(copy);
+    return ok;
+}
+
+static void bench_usage(const char *name) {
+    fprintf(stderr,
+            "Usage: %s [options]\n"
+            "  --path FILE          tree file, recreated for the run (default: in-memory tree)\n"
+            "  --keys N             keys loaded before the run (default 1000000)\n"
+            "  --ops N              operations in the run, shared by the threads (default 1000000)\n"
+            "  --workload a-f       YCSB core workload (default a)\n"
+            "  --mix OP=W,...       weights of read, update, insert, delete, scan and rmw, replacing the workload's\n"
+            "  --dist NAME          uniform, zipfian, sequential or latest\n"
+            "  --theta X            zipfian skew (default 0.99)\n"
+            "  --scan-length N      keys read by a scan (default 100)\n"
+            "  --threads N          threads running operations (default 1)\n"
+            "  --concurrent-puts    let puts from different threads run in parallel\n"
+            "  -t N                 minimum degree (default 64)\n"
+            "  --cache-size BYTES   node cache (default 0)\n"
+            "  --mmap               use the mmap backend\n"
+            "  --wal                log operations to a WAL, needs --cache-size\n"
+            "  --bulk-load          load keys in order with btree_bulk_load instead of random puts\n"
+            "  --cold               drop the file from the page cache before the run (default: warm it)\n"
+            "  --json               print JSON instead of CSV\n"
+            "  --seed N             random seed (default 42)\n",
+            name);
+}
+
+int main(int argc, char **argv) {
+    Bench_Config config = {
+        .keys = 1000000,
+        .ops = 1000000,
+        .threads = 1,
+        .t = 64,
+        .theta = 0.99,
+        .scan_length = 100,
+        .seed = 42,
+    };
+    bench_workload(&config, "a");
+    int dist = -1;
+
+    enum {
+        OPT_PATH = 256,
+        OPT_KEYS,
+        OPT_OPS,
+        OPT_WORKLOAD,
+        OPT_MIX,
+        OPT_DIST,
+        OPT_THETA,
+        OPT_SCAN_LENGTH,
+        OPT_THREADS,
+        OPT_CONCURRENT_PUTS,
+        OPT_CACHE_SIZE,
+        OPT_MMAP,
+        OPT_WAL,
+        OPT_BULK_LOAD,
+        OPT_COLD,
+        OPT_JSON,
+        OPT_SEED,
+    };
+    static const struct option long_options[] = {
+        {"path", required_argument, NULL, OPT_PATH},
+        {"keys", required_argument, NULL, OPT_KEYS},
+        {"ops", required_argument, NULL, OPT_OPS},
+        {"workload", required_argument, NULL, OPT_WORKLOAD},
+        {"mix", required_argument, NULL, OPT_MIX},
+        {"dist", required_argument, NULL, OPT_DIST},
+        {"theta", required_argument, NULL, OPT_THETA},
+        {"scan-length", required_argument, NULL, OPT_SCAN_LENGTH},
+        {"threads", required_argument, NULL, OPT_THREADS},
+        {"concurrent-puts", no_argument, NULL, OPT_CONCURRENT_PUTS},
+        {"cache-size", required_argument, NULL, OPT_CACHE_SIZE},
+        {"mmap", no_argument, NULL, OPT_MMAP},
+        {"wal", no_argument, NULL, OPT_WAL},
+        {"bulk-load", no_argument, NULL, OPT_BULK_LOAD},
+        {"cold", no_argument, NULL, OPT_COLD},
+        {"json", no_argument, NULL, OPT_JSON},
+        {"seed", required_argument, NULL, OPT_SEED},
+        {"help", no_argument, NULL, 'h'},
+        {NULL, 0, NULL, 0},
+    };
+
+    int option;
+    bool ok = true;
+    while ((option = getopt_long(argc, argv, "t:h", long_options, NULL)) != -1 && ok) {
+        switch (option) {
+        case OPT_PATH:
+            config.path = optarg;
+            break;
+        case OPT_KEYS:
+            config.keys = atoi(optarg);
+            break;
+        case OPT_OPS:
+            config.ops = atol(optarg);
+            break;
+        case OPT_WORKLOAD:
+            ok = bench_workload(&config, optarg);
+            break;
+        case OPT_MIX:
+            ok = bench_parse_mix(&config, optarg);
+            break;
+        case OPT_DIST:
+            dist = -1;
+            for (int i = 0; i < (int)(sizeof(bench_dist_names) / sizeof(*bench_dist_names)); i++) {
+                dist = strcmp(optarg, bench_dist_names[i]) == 0 ? i : dist;
+            }
+            ok = dist != -1;
+            break;
+        case OPT_THETA:
+            config.theta = atof(optarg);
+            break;
+        case OPT_SCAN_LENGTH:
+            config.scan_length = atoi(optarg);
+            break;
+        case OPT_THREADS:
+            config.threads = atoi(optarg);
+            break;
+        case OPT_CONCURRENT_PUTS:
+            config.concurrent_puts = true;
+            break;
+        case 't':
+            config.t = atoi(optarg);
+            break;
+        case OPT_CACHE_SIZE:
+            config.cache_size = strtoull(optarg, NULL, 10);
+            break;
+        case OPT_MMAP:
+            config.backend = BTREE_BACKEND_MMAP;
+            break;
+        case OPT_WAL:
+            config.wal = true;
+            break;
+        case OPT_BULK_LOAD:
+            config.bulk_load = true;
+            break;
+        case OPT_COLD:
+            config.cold = true;
+            break;
+        case OPT_JSON:
+            config.json = true;
+            break;
+        case OPT_SEED:
+            config.seed = strtoull(optarg, NULL, 10);
+            break;
+        default:
+            ok = false;
+        }
+    }
+    if (dist != -1) {
+        config.dist = (Bench_Dist)dist;
+    }
+
+    int total_weight = 0;
+    for (int op = 0; op < BENCH_COUNT_OPS; op++) {
+        total_weight += config.mix[op];
+    }
+    if (!ok || optind < argc || config.keys < 1 || config.ops < 0 || config.threads < 1 || total_weight <= 0 ||
+        config.theta <= 0 || config.theta >= 1 || (config.cold && config.path == NULL) || config.seed == 0) {
+        bench_usage(argv[0]);
+        return 2;
+    }
+
+    Btree btree;
+    if (config.path != NULL) {
+        remove(config.path);
+        char wal_path[4096];
+        snprintf(wal_path, sizeof(wal_path), "%s-wal", config.path);
+        remove(wal_path);
+    }
+    Btree_Result res = btree_init(&btree, bench_options(&config));
+    if (res != BTREE_OK) {
+        fprintf(stderr, "btree_init: %s\n", btree_strerr(res));
+        return 1;
+    }
+
+    uint64_t start = bench_now_ns();
+    res = bench_load(&btree, &config);
+    double load_s = (bench_now_ns() - start) / 1e9;
+    if (res == BTREE_OK && config.cold) {
+        res = bench_make_cold(&btree, &config);
+    } else if (res == BTREE_OK) {
+        bench_make_warm(&btree);
+    }
+    if (res != BTREE_OK) {
+        fprintf(stderr, "load: %s\n", btree_strerr(res));
+        return 1;
+    }
+
+    Bench_Shared shared = {.config = &config, .btree = &btree, .total_weight = total_weight, .next_key = config.keys};
+    if (config.dist == BENCH_ZIPFIAN || config.dist == BENCH_LATEST) {
+        bench_zipf_init(&shared.zipf, config.keys, config.theta);
+    }
+
+    Bench_Thread *threads = calloc(config.threads, sizeof(*threads));
+    if (threads == NULL) {
+        fprintf(stderr, "Out of memory\n");
+        return 1;
+    }
+    for (int i = 0; i < config.threads; i++) {
+        threads[i].shared = &shared;
+        threads[i].id = i;
+        threads[i].ops = config.ops / config.threads + (i < config.ops % config.threads);
+        threads[i].rng = bench_hash(config.seed + i + 1) | 1;
+        threads[i].sequence = (long)config.keys * i / config.threads;
+    }
+
+    Bench_Io io_start, io;
+    bench_io_read(&io_start);
+    start = bench_now_ns();
+    for (int i = 1; i < config.threads; i++) {
+        pthread_create(&threads[i].thread, NULL, bench_worker, &threads[i]);
+    }
+    bench_worker(&threads[0]);
+    for (int i = 1; i < config.threads; i++) {
+        pthread_join(threads[i].thread, NULL);
+    }
+    double run_s = (bench_now_ns() - start) / 1e9;
+    bench_io_read(&io);
+    bench_io_diff(&io, &io_start);
+
+    Bench_Histogram histograms[BENCH_COUNT_OPS] = {0};
+    Bench_Histogram total = {0};
+    long misses = 0, errors = 0;
+    for (int i = 0; i < config.threads; i++) {
+        for (int op = 0; op < BENCH_COUNT_OPS; op++) {
+            bench_merge(&histograms[op], &threads[i].histograms[op]);
+            bench_merge(&total, &threads[i].histograms[op]);
+        }
+        misses += threads[i].misses;
+        errors += threads[i].errors;
+    }
+    bench_print(&config, load_s, run_s, histograms, &total, misses, errors, &io);
+
+    free(threads);
+    btree_destroy(&btree);
+    return errors == 0 ? 0 : 1;
+}
@@ -0,0 +1,208 @@
+#include <getopt.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../btree.h"
+
+// Runs a trace recorded through .trace_path against a tree opened with the options given, and prints how
+// long it took and what it cost, as CSV or JSON. The tree is created afresh unless --keep asks to replay
+// against an existing one, such as a copy of the tree the trace was recorded on.
+
+static const char *replay_op_names[] = {"find", "put", "delete"};
+
+static const Btree_Op replay_ops[] = {BTREE_OP_FIND, BTREE_OP_PUT, BTREE_OP_DELETE};
+
+// Upper end of the power-of-two bucket holding the given percentile, in microseconds.
+static double replay_percentile_us(const uint64_t *buckets, double percentile) {
+    uint64_t count = 0;
+    for (int i = 0; i < BTREE_STATS_LATENCY_BUCKETS; i++) {
+        count += buckets[i];
+    }
+    uint64_t rank = (uint64_t)(percentile / 100 * count + 0.999999);
+    uint64_t seen = 0;
+    for (int i = 0; i < BTREE_STATS_LATENCY_BUCKETS && count > 0; i++) {
+        seen += buckets[i];
+        if (seen >= rank && buckets[i] > 0) {
+            return ((uint64_t)1 << i) / 1000.0;
+        }
+    }
+    return 0;
+}
+
+static void replay_usage(const char *name) {
+    fprintf(stderr,
+            "Usage: %s [options] TRACE\n"
+            "  --path FILE          tree file, recreated for the run (default: in-memory tree)\n"
+            "  --keep               replay against the tree already at --path\n"
+            "  -t N                 minimum degree of a new tree (default: from the page size, or 64)\n"
+            "  --page-size BYTES    page size of a new tree\n"
+            "  --cache-size BYTES   node cache (default 0)\n"
+            "  --mmap               use the mmap backend\n"
+            "  --wal                log operations to a WAL, needs --cache-size\n"
+            "  --compress-leaves    write leaves bit-packed\n"
+            "  --direct             use O_DIRECT, needs a paged tree\n"
+            "  --latency            time every operation for the percentiles\n"
+            "  --json               print JSON instead of CSV\n",
+            name);
+}
+
+int main(int argc, char **argv) {
+    Btree_Options options = {.log_handler = btree_default_log_handler};
+    bool keep = false, latency = false, json = false;
+
+    enum {
+        OPT_PATH = 256,
+        OPT_KEEP,
+        OPT_PAGE_SIZE,
+        OPT_CACHE_SIZE,
+        OPT_MMAP,
+        OPT_WAL,
+        OPT_COMPRESS_LEAVES,
+        OPT_DIRECT,
+        OPT_LATENCY,
+        OPT_JSON,
+    };
+    static const struct option long_options[] = {
+        {"path", required_argument, NULL, OPT_PATH},
+        {"keep", no_argument, NULL, OPT_KEEP},
+        {"page-size", required_argument, NULL, OPT_PAGE_SIZE},
+        {"cache-size", required_argument, NULL, OPT_CACHE_SIZE},
+        {"mmap", no_argument, NULL, OPT_MMAP},
+        {"wal", no_argument, NULL, OPT_WAL},
+        {"compress-leaves", no_argument, NULL, OPT_COMPRESS_LEAVES},
+        {"direct", no_argument, NULL, OPT_DIRECT},
+        {"latency", no_argument, NULL, OPT_LATENCY},
+        {"json", no_argument, NULL, OPT_JSON},
+        {"help", no_argument, NULL, 'h'},
+        {NULL, 0, NULL, 0},
+    };
+
+    int option;
+    bool ok = true;
+    while ((option = getopt_long(argc, argv, "t:h", long_options, NULL)) != -1 && ok) {
+        switch (option) {
+        case OPT_PATH:
+            options.path = optarg;
+            break;
+        case OPT_KEEP:
+            keep = true;
+            break;
+        case 't':
+            options.t = atoi(optarg);
+            break;
+        case OPT_PAGE_SIZE:
+            options.page_size = strtoull(optarg, NULL, 10);
+            break;
+        case OPT_CACHE_SIZE:
+            options.cache_size = strtoull(optarg, NULL, 10);
+            break;
+        case OPT_MMAP:
+            options.backend = BTREE_BACKEND_MMAP;
+            break;
+        case OPT_WAL:
+            options.wal = true;
+            break;
+        case OPT_COMPRESS_LEAVES:
+            options.compress_leaves = true;
+            break;
+        case OPT_DIRECT:
+            options.direct = true;
+            break;
+        case OPT_LATENCY:
+            latency = true;
+            break;
+        case OPT_JSON:
+            json = true;
+            break;
+        default:
+            ok = false;
+        }
+    }
+    if (!ok || optind != argc - 1 || (keep && options.path == NULL)) {
+        replay_usage(argv[0]);
+        return 2;
+    }
+    const char *trace_path = argv[optind];
+    if (options.t == 0 && options.page_size == 0) {
+        options.t = 64;
+    }
+
+    if (options.path != NULL && !keep) {
+        remove(options.path);
+        char wal_path[4096];
+        snprintf(wal_path, sizeof(wal_path), "%s-wal", options.path);
+        remove(wal_path);
+    }
+    Btree btree;
+    Btree_Result res = btree_init(&btree, options);
+    if (res != BTREE_OK) {
+        fprintf(stderr, "btree_init: %s\n", btree_strerr(res));
+        return 1;
+    }
+
+    btree_stats_latency(&btree, latency);
+    Btree_Replay replay;
+    res = btree_replay(&btree, trace_path, &replay);
+    Btree_Result synced = btree_sync(&btree);
+    if (res != BTREE_OK || synced != BTREE_OK) {
+        fprintf(stderr, "btree_replay: %s\n", btree_strerr(res != BTREE_OK ? res : synced));
+        btree_destroy(&btree);
+        return 1;
+    }
+
+    Btree_Stats stats;
+    btree_stats(&btree, &stats);
+    const Btree_Counters *counters = &stats.counters;
+    uint64_t count = replay.count_ops[BTREE_TRACE_FIND] + replay.count_ops[BTREE_TRACE_PUT] +
+                     replay.count_ops[BTREE_TRACE_DELETE];
+    double run_s = replay.elapsed_ns / 1e9;
+    double throughput = run_s > 0 ? count / run_s : 0;
+
+    if (!json) {
+        printf("ops,finds,puts,deletes,missing,run_s,ops_per_s,height,count_nodes,node_reads,node_writes,bytes_read,"
+               "bytes_written,splits,merges,rotations,cache_hits,cache_misses");
+        for (int i = 0; i < 3 && latency; i++) {
+            printf(",%s_p50_us,%s_p99_us,%s_p999_us", replay_op_names[i], replay_op_names[i], replay_op_names[i]);
+        }
+        printf("\n%llu,%llu,%llu,%llu,%llu,%.3f,%.1f,%d,%d,%llu,%llu,%llu,%llu,%llu,%llu,%llu,%llu,%llu",
+               (unsigned long long)count, (unsigned long long)replay.count_ops[BTREE_TRACE_FIND],
+               (unsigned long long)replay.count_ops[BTREE_TRACE_PUT],
+               (unsigned long long)replay.count_ops[BTREE_TRACE_DELETE], (unsigned long long)replay.count_missing,
+               run_s, throughput, stats.height, stats.count_nodes, (unsigned long long)counters->node_reads,
+               (unsigned long long)counters->node_writes, (unsigned long long)counters->bytes_read,
+               (unsigned long long)counters->bytes_written, (unsigned long long)counters->splits,
+               (unsigned long long)counters->merges, (unsigned long long)counters->rotations,
+               (unsigned long long)counters->cache_hits, (unsigned long long)counters->cache_misses);
+        for (int i = 0; i < 3 && latency; i++) {
+            const uint64_t *buckets = counters->latencies[replay_ops[i]];
+            printf(",%.3f,%.3f,%.3f", replay_percentile_us(buckets, 50), replay_percentile_us(buckets, 99),
+                   replay_percentile_us(buckets, 99.9));
+        }
+        printf("\n");
+    } else {
+        printf("{\n  \"ops\": %llu, \"finds\": %llu, \"puts\": %llu, \"deletes\": %llu, \"missing\": %llu,\n"
+               "  \"run_s\": %.3f, \"ops_per_s\": %.1f, \"height\": %d, \"count_nodes\": %d,\n"
+               "  \"node_reads\": %llu, \"node_writes\": %llu, \"bytes_read\": %llu, \"bytes_written\": %llu,\n"
+               "  \"splits\": %llu, \"merges\": %llu, \"rotations\": %llu, \"cache_hits\": %llu, "
+               "\"cache_misses\": %llu",
+               (unsigned long long)count, (unsigned long long)replay.count_ops[BTREE_TRACE_FIND],
+               (unsigned long long)replay.count_ops[BTREE_TRACE_PUT],
+               (unsigned long long)replay.count_ops[BTREE_TRACE_DELETE], (unsigned long long)replay.count_missing,
+               run_s, throughput, stats.height, stats.count_nodes, (unsigned long long)counters->node_reads,
+               (unsigned long long)counters->node_writes, (unsigned long long)counters->bytes_read,
+               (unsigned long long)counters->bytes_written, (unsigned long long)counters->splits,
+               (unsigned long long)counters->merges, (unsigned long long)counters->rotations,
+               (unsigned long long)counters->cache_hits, (unsigned long long)counters->cache_misses);
+        for (int i = 0; i < 3 && latency; i++) {
+            const uint64_t *buckets = counters->latencies[replay_ops[i]];
+            printf(",\n  \"%s\": {\"p50_us\": %.3f, \"p99_us\": %.3f, \"p999_us\": %.3f}", replay_op_names[i],
+                   replay_percentile_us(buckets, 50), replay_percentile_us(buckets, 99),
+                   replay_percentile_us(buckets, 99.9));
+        }
+        printf("\n}\n");
+    }
+
+    return btree_destroy(&btree) == BTREE_OK ? 0 : 1;
+}
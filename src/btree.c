@@ -1,43 +1,104 @@
+#define _GNU_SOURCE // writer-preferring rwlocks
 #include "btree.h"
 #include <assert.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
 #include <sys/uio.h>
+#include <time.h>
 #include <unistd.h>
 
+#ifdef __linux__
+#include <linux/io_uring.h>
+#endif
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define BTREE_SEARCH_X86
+#endif
+
+// Nodes start with count_keys padded to 8 bytes so every array of a node is naturally aligned in the file.
+// Part of the layout btree_magic_bytes stands for, as is the first node starting on that alignment.
+#define BTREE_NODE_HEADER_SIZE 8
+
+// Set in count_keys of packed leaves, which store keys and values as bit-packed offsets from a base: after the
+// node header come key_base, value_base, key_bits and value_bits padded to 16 bytes, then the key offsets and
+// the value offsets, each rounded up to a byte, then 8 spare bytes so decoding can always load a whole word.
+#define BTREE_NODE_PACKED 0x40000000
+#define BTREE_PACKED_HEADER_SIZE 16
+
+// Node latches are spread over this many buckets, each with its own mutex.
+#define BTREE_LATCH_BUCKETS 1024
+
+// The thread fallback of io_uring keeps at most this many reads in flight.
+#define BTREE_IO_MAX_THREADS 32
+
+// Smallest cache a WAL can run with: frames changed by an unfinished operation cannot be evicted.
+#define BTREE_WAL_MIN_FRAMES 256
+
+// Log bytes kept in memory before they are written out, synced or not.
+#define BTREE_WAL_BUFFER_SIZE ((size_t)1 << 20)
+
+// Below this many keys the search kernel scans the whole window instead of bisecting.
+#define BTREE_SEARCH_WINDOW 64
+
+// Byte-string node pages start with count_keys, the heap start and is_leaf; overflow pages with the offset of
+// the next page and the bytes this one holds.
+#define BTREE_BYTES_NODE_HEADER_SIZE 8
+#define BTREE_BYTES_OVERFLOW_HEADER_SIZE 16
+
 int btree_node_is_valid(const Btree *btree, const Btree_Node *node);
 
 size_t btree_node_size_in_file(const Btree *btree);
 
-void btree_node_write(const Btree *btree, const Btree_Node *node);
+void btree_node_write(const Btree *btree, Btree_Node *node);
 
 void btree_node_read2(const Btree *btree, Btree_Node *node, size_t offset);
 
+void btree_node_read_at(const Btree *btree, Btree_Node *node, size_t offset, bool settle);
+
 void btree_node_destroy(Btree_Node *node);
 
-void btree_header_write(const Btree *btree);
+void btree_header_write(Btree *btree);
+
+void btree_header_touch(Btree *btree);
+
+void btree_header_flush(const Btree *btree);
+
+bool btree_header_checkpoint(Btree *btree);
+
+bool btree_header_checkpoint_due(Btree *btree);
+
+Btree_Result btree_header_recover(Btree *btree);
 
 void btree_header_read(Btree *btree, uint8_t *magic_bytes);
 
 void btree_set_root(Btree *btree, Btree_Node *node);
 
+bool btree_release(Btree *btree, bool write_back);
+
 Btree_Result btree_node_delete(Btree *btree, Btree_Node *node, int key);
 
 Btree_Node *btree_append_node(Btree *btree);
 
+void btree_node_append(Btree *btree, Btree_Node *node);
+
 Btree_Result btree_node_find(const Btree *btree, Btree_Node *x, int key, int *value);
 
-void btree_node_split_child(Btree *btree, Btree_Node *x, Btree_Node *x_ci, int i);
+void btree_node_split_child(Btree *btree, Btree_Node *x, Btree_Node *y, Btree_Node *z, int i);
 
 Btree_Result btree_node_put_nonfull(Btree *btree, Btree_Node *x, int key, int value);
 
 Btree_Node *btree_node_init(const Btree *btree);
 
-Item btree_node_get_pred(const Btree *btree, const Btree_Node *node, int i);
+Item btree_node_get_pred(const Btree *btree, const Btree_Node *node, int i, Btree_Node *pred);
 
-Item btree_node_get_post(const Btree *btree, const Btree_Node *node, int i);
+Item btree_node_get_post(const Btree *btree, const Btree_Node *node, int i, Btree_Node *post);
 
 void btree_node_merge(Btree *btree, Btree_Node *x, Btree_Node *y, Btree_Node *z, int i);
 
@@ -51,412 +112,2391 @@ void btree_node_rotate_left(const Btree *btree, Btree_Node *x, Btree_Node *y, Bt
 
 void btree_node_rotate_right(const Btree *btree, Btree_Node *x, Btree_Node *y, Btree_Node *z, int i);
 
-void btree_remove_node(Btree *btree, Btree_Node *x);
+void btree_node_remove_key(const Btree *btree, Btree_Node *node, int i);
 
-void btree_log(const Btree *btree, Btree_Log_Level level, const char *fmt, ...);
+Btree_Result btree_node_delete_lazy(Btree *btree, Btree_Node *node, int key, bool *rebalance);
 
-bool btree_queue_init(Btree_Queue *queue, int capacity);
+bool btree_compact_init(Btree *btree, Btree_Options options);
 
-bool btree_queue_enqueue(Btree_Queue *queue, size_t offset);
+void btree_compact_note(Btree *btree, int key);
 
-size_t btree_queue_dequeue(Btree_Queue *queue);
+void btree_compact_wake(const Btree *btree);
 
-void btree_queue_destroy(Btree_Queue *queue);
+void *btree_compact_worker(void *arg);
 
-Btree_Result btree_init(Btree *btree, Btree_Options options) {
-    if (btree == NULL) {
-        return BTREE_ERROR_NIL;
-    }
+void btree_compact_destroy(Btree *btree);
 
-    memset(btree, 0, sizeof(*btree));
-    btree->log_handler = options.log_handler;
-    btree->fd = open(options.path, O_RDWR);
+bool btree_node_compact(Btree *btree, Btree_Node *x, Btree_Path *path, int depth);
 
-    if (btree->fd == -1 && errno == ENOENT) {
-        if (options.t < 2) {
-            return BTREE_ERROR_BAD_T;
-        }
+bool btree_compact_path(Btree *btree, Btree_Path *path, int key);
 
-        btree->header.t = options.t;
-        btree->header.M = 2 * options.t;
-        btree->header.next_offset = sizeof(btree_magic_bytes) + sizeof(btree->header);
-        btree->fd = open(options.path, O_RDWR | O_CREAT, S_IRUSR | S_IWUSR);
-        if (btree->fd == -1) {
-            return BTREE_ERROR_UNIX;
-        }
+bool btree_node_compact_child(Btree *btree, Btree_Node *x, Btree_Node **slot, Btree_Node **spare, int i);
 
-        btree->root = btree_append_node(btree);
-        btree->header.root_offset = btree->root->offset;
-        btree_header_write(btree);
-        return BTREE_OK;
-    }
+bool btree_node_compact_pair(Btree *btree, Btree_Node *x, Btree_Node *y, Btree_Node *z, int i);
 
-    uint8_t magic_bytes[sizeof(btree_magic_bytes)] = {0};
-    btree_header_read(btree, magic_bytes);
-    if (memcmp(magic_bytes, btree_magic_bytes, sizeof(magic_bytes)) != 0) {
-        close(btree->fd);
-        return BTREE_ERROR_FORMAT;
-    }
+void btree_path_replace(Btree_Path *path, Btree_Node *node, Btree_Node *by);
 
-    Btree_Node *root = btree_node_init(btree);
-    if (root == NULL) {
-        close(btree->fd);
-        return BTREE_ERROR_UNIX;
-    }
+void btree_remove_node(Btree *btree, Btree_Node *x);
 
-    btree_node_read2(btree, root, btree->header.root_offset);
-    btree_set_root(btree, root);
-    return BTREE_OK;
-}
+bool btree_paths_init(Btree *btree);
 
-Btree_Result btree_find(const Btree *btree, int key, int *value) {
-    return btree ? btree_node_find(btree, btree->root, key, value) : BTREE_ERROR_NIL;
-}
+Btree_Path *btree_path_take(const Btree *btree);
 
-Btree_Result btree_put(Btree *btree, int key, int value) {
-    if (btree == NULL) {
-        return BTREE_ERROR_NIL;
-    }
+void btree_path_give(const Btree *btree, Btree_Path *path);
 
-    if (btree->root->count_keys < btree->header.M - 1) {
-        return btree_node_put_nonfull(btree, btree->root, key, value);
-    }
+Btree_Node *btree_path_node(const Btree *btree, Btree_Node **slot);
 
-    Btree_Node *s = btree_append_node(btree);
-    s->is_leaf = 0;
-    s->count_keys = 0;
-    s->children[0] = btree->root->offset;
-    btree_node_split_child(btree, s, btree->root, 0);
-    btree_node_destroy(btree->root);
-    btree_set_root(btree, s);
-    btree_header_write(btree);
-    return btree_node_put_nonfull(btree, s, key, value);
-}
+void btree_paths_destroy(Btree *btree);
 
-Btree_Result btree_delete(Btree *btree, int key) {
-    if (btree == NULL) {
-        return BTREE_ERROR_NIL;
-    }
-    return btree_node_delete(btree, btree->root, key);
-}
+bool btree_paged_options_ok(Btree_Options options);
 
-Btree_Result btree_destroy(Btree *btree) {
-    if (btree == NULL) {
-        return BTREE_ERROR_NIL;
-    }
-    btree_node_destroy(btree->root);
-    if (close(btree->fd) == -1) {
-        return BTREE_ERROR_UNIX;
-    }
-    return BTREE_OK;
-}
+int btree_page_t(size_t page_size);
 
-void btree_node_destroy(Btree_Node *node) {
-    free(node);
-}
+bool btree_direct_init(Btree *btree, Btree_Options options);
 
-Btree_Result btree_node_find(const Btree *btree, Btree_Node *x, int key, int *value) {
-    int i = 0;
-    while (i < x->count_keys && key > x->items[i].key) {
-        i++;
-    }
+uint8_t *btree_image_alloc(const Btree *btree, size_t size);
 
-    if (i < x->count_keys && key == x->items[i].key) {
-        if (value) {
-            *value = x->items[i].value;
-        }
-        return BTREE_OK;
-    }
+size_t btree_node_io_size(const Btree *btree, const uint8_t *data);
 
-    if (x->is_leaf) {
-        return BTREE_ERROR_KEY_NOT_FOUND;
-    }
+size_t btree_header_image(const Btree *btree, uint8_t *data);
 
-    Btree_Node *x_ci = btree_node_init(btree);
-    btree_node_read2(btree, x_ci, x->children[i]);
-    Btree_Result res = btree_node_find(btree, x_ci, key, value);
-    btree_node_destroy(x_ci);
-    return res;
-}
+size_t btree_data_offset(const Btree *btree);
 
-int btree_pop_free_offset(Btree *btree) {
-    if (btree->header.next_free_offset == 0) {
-        long offset = btree->header.next_offset;
-        btree->header.next_offset += btree_node_size_in_file(btree);
-        return offset;
-    }
+bool btree_free_space_init(Btree *btree);
 
-    long offset = btree->header.next_free_offset;
-    ssize_t bytes_read = pread(btree->fd, &btree->header.next_free_offset, sizeof(btree->header.next_free_offset),
-                               btree->header.next_free_offset);
-    if (bytes_read == -1) {
-        btree_log(btree, BTREE_LOG_ERROR, "Failed to read freeded offset: %s", btree_strerr(BTREE_ERROR_UNIX));
-    }
-    return offset;
-}
+bool btree_free_space_push(Btree *btree, size_t offset);
 
-Btree_Node *btree_append_node(Btree *btree) {
-    Btree_Node *node = btree_node_init(btree);
-    if (node == NULL) {
-        return NULL;
-    }
+bool btree_free_space_mark(Btree *btree, size_t offset, bool free);
 
-    node->offset = btree_pop_free_offset(btree);
-    node->is_leaf = 1;
-    node->count_keys = 0;
-    btree->header.count_nodes++;
-    btree_node_write(btree, node);
-    return node;
-}
+bool btree_free_space_has(const Btree *btree, size_t offset);
 
-void btree_node_split_child(Btree *btree, Btree_Node *x, Btree_Node *y, int i) {
-    Btree_Node *z = btree_append_node(btree);
-    int t = btree->header.t;
+void btree_free_space_relink(Btree *btree, size_t end);
 
-    z->is_leaf = y->is_leaf;
-    z->count_keys = t - 1;
-    memcpy(z->items, y->items + t, (t - 1) * sizeof(*z->items));
-    if (!y->is_leaf) {
-        memcpy(z->children, y->children + t, t * sizeof(*z->children));
-    }
+void btree_free_space_destroy(Btree *btree);
 
-    y->count_keys = t - 1;
-    memmove(x->children + i + 1, x->children + i, (x->count_keys - i + 1) * sizeof(*x->children));
-    x->children[i + 1] = z->offset;
-    memmove(x->items + i + 1, x->items + i, (x->count_keys - i) * sizeof(*x->items));
-    x->items[i] = y->items[t - 1];
-    x->count_keys++;
-    memset(y->items + y->count_keys, 0, t * sizeof(*y->items));
-    if (!y->is_leaf) {
-        memset(y->children + y->count_keys + 1, 0, t * sizeof(*y->children));
-    }
+size_t btree_vacuum_move(Btree *btree, size_t target);
 
-    btree_node_write(btree, x);
-    btree_node_write(btree, y);
-    btree_node_write(btree, z);
-    btree_header_write(btree);
-    btree_node_destroy(z);
-}
+size_t btree_vacuum_slot(Btree *btree, size_t *low, size_t before);
 
-Btree_Result btree_node_put_nonfull(Btree *btree, Btree_Node *x, int key, int value) {
-    int i = x->count_keys - 1;
+bool btree_vacuum_truncate(Btree *btree, size_t end);
 
-    if (x->is_leaf) {
-        while (i >= 0 && key < x->items[i].key) {
-            x->items[i + 1] = x->items[i];
-            i--;
-        }
+void btree_cache_drop(const Btree *btree, size_t end);
 
-        x->items[i + 1] = (Item){.key = key, .value = value};
-        x->count_keys++;
-        btree_node_write(btree, x);
-        return BTREE_OK;
-    }
+void btree_count(const uint64_t *counter, uint64_t n);
 
-    while (i >= 0 && key < x->items[i].key) {
-        i--;
-    }
+void btree_count_bytes(const uint64_t *counter, ssize_t bytes);
 
-    i++;
-    Btree_Node *x_ci = btree_node_init(btree);
-    btree_node_read2(btree, x_ci, x->children[i]);
+void btree_stats_fill(const Btree *btree, Btree_Stats *stats);
 
-    if (x_ci->count_keys < btree->header.M - 1) {
-        Btree_Result res = btree_node_put_nonfull(btree, x_ci, key, value);
-        btree_node_destroy(x_ci);
-        return res;
-    }
+uint64_t btree_op_start(const Btree *btree);
 
-    btree_node_split_child(btree, x, x_ci, i);
+void btree_op_end(const Btree *btree, Btree_Op op, uint64_t start);
 
-    if (key > x->items[i].key) {
-        i++;
-        btree_node_read2(btree, x_ci, x->children[i]);
-    }
+uint64_t btree_now_ns(void);
 
-    Btree_Result res = btree_node_put_nonfull(btree, x_ci, key, value);
-    btree_node_destroy(x_ci);
-    return res;
-}
+bool btree_reorganize_shape(Btree *btree, size_t *offsets, int *firsts, Btree_Node *x);
 
-Btree_Result btree_node_delete(Btree *btree, Btree_Node *node, int key) {
-    int i = 0;
-    int t = btree->header.t;
-    Btree_Node *y = NULL, *z = NULL, *x_ci = NULL, *sibbling_left = NULL, *sibbling_right = NULL;
-    Btree_Result res = BTREE_OK;
+void btree_reorganize_veb(const int *firsts, int node, int height, int *order, int *count);
 
-    while (i < node->count_keys && key > node->items[i].key) {
-        i++;
-    }
+bool btree_reorganize_switch(Btree *btree, size_t root_offset, size_t next_offset);
 
-    if (i < node->count_keys && key == node->items[i].key) {
-        if (node->is_leaf) {
-            memmove(node->items + i, node->items + i + 1, (node->count_keys - i - 1) * sizeof(*node->items));
-            node->count_keys--;
-            memset(&node->items[node->count_keys], 0, sizeof(*node->items));
-            btree_node_write(btree, node);
-            return BTREE_OK;
-        }
+void btree_node_copy(const Btree *btree, Btree_Node *dst, const Btree_Node *src);
 
-        y = btree_node_init(btree);
-        btree_node_read2(btree, y, node->children[i]);
+void btree_log(const Btree *btree, Btree_Log_Level level, const char *fmt, ...);
 
-        if (y->count_keys >= t) {
-            Item pred = btree_node_get_pred(btree, node, i);
-            node->items[i] = pred;
-            btree_node_write(btree, node);
-            res = btree_node_delete(btree, y, pred.key);
-            btree_node_destroy(y);
-            return res;
-        }
+bool btree_queue_init(Btree_Queue *queue, int capacity);
 
-        z = btree_node_init(btree);
-        btree_node_read2(btree, z, node->children[i + 1]);
+bool btree_queue_enqueue(Btree_Queue *queue, size_t offset);
 
-        if (z->count_keys >= t) {
-            btree_node_destroy(y);
-            Item post = btree_node_get_post(btree, node, i);
-            node->items[i] = post;
-            btree_node_write(btree, node);
-            res = btree_node_delete(btree, z, post.key);
-            btree_node_destroy(z);
-            return res;
-        }
+size_t btree_queue_dequeue(Btree_Queue *queue);
 
-        btree_node_merge(btree, node, y, z, i);
-        res = btree_node_delete(btree, y, key);
-        if (btree->root != y) {
-            btree_node_destroy(y);
-        }
+void btree_queue_destroy(Btree_Queue *queue);
 
-        return res;
-    }
+int btree_search_lower(const int *keys, int n, int key);
 
-    if (node->is_leaf) {
-        return BTREE_ERROR_KEY_NOT_FOUND;
-    }
+int btree_search_upper(const int *keys, int n, int key);
 
-    x_ci = btree_node_init(btree);
-    btree_node_read2(btree, x_ci, node->children[i]);
+void btree_search_select(void);
 
-    if (x_ci->count_keys > t - 1) {
-        res = btree_node_delete(btree, x_ci, key);
+extern pthread_once_t btree_search_once;
 
-        if (btree->root != x_ci) {
-            btree_node_destroy(x_ci);
-        }
+void btree_node_pack(const Btree *btree, const Btree_Node *node, uint8_t *data);
 
-        return res;
-    }
+void btree_node_unpack(const Btree *btree, Btree_Node *node, const uint8_t *data);
 
-    if (i > 0) {
-        sibbling_left = btree_node_init(btree);
-        btree_node_read2(btree, sibbling_left, node->children[i - 1]);
-    }
+size_t btree_node_image_size(const Btree *btree, const uint8_t *data);
 
-    if (i < node->count_keys) {
-        sibbling_right = btree_node_init(btree);
-        btree_node_read2(btree, sibbling_right, node->children[i + 1]);
-    }
+void btree_bits_put(uint8_t *data, size_t bit, uint32_t value);
 
-    if (btree_node_redistribute(btree, node, x_ci, sibbling_left, sibbling_right, i)) {
-        if (sibbling_left) {
-            btree_node_destroy(sibbling_left);
-        }
-        if (sibbling_right) {
-            btree_node_destroy(sibbling_right);
-        }
-        res = btree_node_delete(btree, x_ci, key);
-    } else {
-        x_ci = btree_node_concatenate(btree, node, x_ci, sibbling_left, sibbling_right, i);
-        res = btree_node_delete(btree, x_ci, key);
-    }
+uint32_t btree_bits_get(const uint8_t *data, size_t bit, int bits);
 
-    if (btree->root != x_ci) {
-        btree_node_destroy(x_ci);
-    }
+int btree_bits_width(uint32_t range);
 
-    return res;
-}
+size_t btree_free_link_read(const Btree *btree, size_t offset);
 
-Item btree_node_get_pred(const Btree *btree, const Btree_Node *node, int i) {
-    Btree_Node *pred = btree_node_init(btree);
-    btree_node_read2(btree, pred, node->children[i]);
+void btree_free_link_write(const Btree *btree, size_t offset, size_t next);
 
-    while (!pred->is_leaf) {
-        btree_node_read2(btree, pred, pred->children[pred->count_keys]);
-    }
+bool btree_cache_init(Btree *btree, size_t cache_size);
 
-    Item item = pred->items[pred->count_keys - 1];
-    btree_node_destroy(pred);
-    return item;
-}
+Btree_Frame *btree_cache_pin(const Btree *btree, size_t offset, bool load);
 
-Item btree_node_get_post(const Btree *btree, const Btree_Node *node, int i) {
-    Btree_Node *post = btree_node_init(btree);
-    btree_node_read2(btree, post, node->children[i + 1]);
+void btree_cache_unpin(const Btree *btree, Btree_Frame *frame, bool dirty);
 
-    while (!post->is_leaf) {
-        btree_node_read2(btree, post, post->children[0]);
-    }
+bool btree_cache_flush(const Btree *btree);
 
-    Item item = post->items[0];
-    btree_node_destroy(post);
-    return item;
-}
+void btree_cache_destroy(Btree *btree);
 
-void btree_remove_node(Btree *btree, Btree_Node *x) {
-    x->count_keys = 0;
-    x->is_leaf = 0;
-    memset(x->items, 0, (btree->header.M - 1) * sizeof(*x->items));
-    memset(x->children, 0, btree->header.M * sizeof(*x->children));
-    btree_node_write(btree, x);
-    ssize_t bytes_written =
-        pwrite(btree->fd, &btree->header.next_free_offset, sizeof(btree->header.next_free_offset), x->offset);
-    if (bytes_written == -1) {
-        btree_log(btree, BTREE_LOG_ERROR, "Failed to write freeded offset: %s", btree_strerr(BTREE_ERROR_UNIX));
-    }
-    btree->header.next_free_offset = x->offset;
-    btree_node_destroy(x);
-    btree->header.count_nodes--;
-}
+bool btree_map_init(Btree *btree, size_t map_size);
 
-void btree_node_merge(Btree *btree, Btree_Node *x, Btree_Node *y, Btree_Node *z, int i) {
-    int t = btree->header.t;
-    y->items[y->count_keys] = x->items[i];
-    y->count_keys++;
-    memmove(x->items + i, x->items + i + 1, (x->count_keys - i - 1) * sizeof(*x->items));
-    memmove(x->children + i + 1, x->children + i + 2, (x->count_keys - i - 1) * sizeof(*x->children));
-    x->children[x->count_keys] = 0;
-    x->count_keys--;
-    memcpy(y->items + y->count_keys, z->items, (t - 1) * sizeof(*y->items));
-    if (!y->is_leaf) {
-        memcpy(y->children + y->count_keys, z->children, t * sizeof(*y->children));
-    }
+bool btree_map_grow(Btree *btree, size_t end);
 
-    y->count_keys = 2 * t - 1;
-    btree_node_write(btree, x);
+uint8_t *btree_map_node(const Btree *btree, size_t offset);
 
-    if (btree->root == x && x->count_keys == 0) {
-        btree_remove_node(btree, x);
-        btree_set_root(btree, y);
-    }
+bool btree_map_destroy(Btree *btree, bool write_back);
 
-    btree_remove_node(btree, z);
-    btree_node_write(btree, y);
-    btree_header_write(btree);
-}
+bool btree_storage_init(Btree *btree, Btree_Options options);
 
-bool btree_node_redistribute(const Btree *btree, Btree_Node *x, Btree_Node *x_ci, Btree_Node *sibbling_left,
-                             Btree_Node *sibbling_right, int i) {
-    int t = btree->header.t;
+void btree_node_own(const Btree *btree, Btree_Node *node);
 
-    if (sibbling_left && sibbling_left->count_keys >= t) {
-        btree_node_rotate_right(btree, x, sibbling_left, x_ci, i - 1);
-        return true;
-    }
+size_t btree_pop_free_offset(Btree *btree);
 
-    if (sibbling_right && sibbling_right->count_keys >= t) {
+size_t btree_room(const Btree *btree);
+
+bool btree_has_room(const Btree *btree, size_t count);
+
+size_t btree_put_need(const Btree *btree);
+
+size_t btree_reserve(Btree *btree);
+
+void btree_unreserve(Btree *btree, size_t count);
+
+bool btree_bulk_add(Btree *btree, Btree_Bulk_Level *levels, int *height, int fill, int level, Item item);
+
+bool btree_bulk_close(Btree *btree, Btree_Bulk_Level *levels, int level);
+
+bool btree_bulk_finish(Btree *btree, Btree_Bulk_Level *levels, int height);
+
+void btree_bulk_redistribute(Btree_Node *left, Btree_Node *right, Btree_Node *parent, int j, int *keys, int *values,
+                             size_t *children);
+
+void btree_bulk_merge(Btree_Node *left, Btree_Node *right, Btree_Node *parent, int j);
+
+void btree_node_clear(const Btree *btree, Btree_Node *node);
+
+bool btree_cursor_push(Btree_Cursor *cursor, size_t offset);
+
+size_t btree_cursor_root(const Btree_Cursor *cursor);
+
+void btree_cursor_latch(const Btree_Cursor *cursor);
+
+void btree_cursor_unlatch(const Btree_Cursor *cursor);
+
+void btree_grow_root(Btree *btree);
+
+int btree_item_cmp(const void *a, const void *b);
+
+void btree_node_find_batch(const Btree *btree, Btree_Node *x, const Item *probes, int count, int *values,
+                           Btree_Result *results);
+
+int btree_node_put_batch(Btree *btree, Btree_Node *x, const Item *items, int count);
+
+Btree_Result btree_commit(Btree *btree, Btree_Result res);
+
+Btree_Result btree_wal_open(Btree *btree, Btree_Options options, bool replay);
+
+bool btree_wal_replay(Btree *btree);
+
+void btree_wal_touch(const Btree *btree, Btree_Frame *frame);
+
+void btree_wal_mark(Btree_Frame *frame, const Btree_Node *node, int from, int to);
+
+bool btree_wal_append_frame(const Btree *btree, const Btree_Frame *frame);
+
+bool btree_wal_commit(Btree *btree);
+
+bool btree_wal_record(const Btree *btree);
+
+void btree_wal_commit_if_full(Btree *btree);
+
+bool btree_wal_sync(const Btree *btree);
+
+bool btree_wal_checkpoint(Btree *btree);
+
+void btree_wal_destroy(Btree *btree);
+
+bool btree_wal_flusher_init(Btree *btree);
+
+void *btree_wal_flusher_worker(void *arg);
+
+void btree_wal_flusher_stop(Btree *btree);
+
+void btree_wal_lock(const Btree_Wal *wal);
+
+void btree_wal_unlock(const Btree_Wal *wal);
+
+bool btree_latch_init(Btree *btree, Btree_Options options);
+
+void btree_latch_shared(const Btree *btree);
+
+void btree_latch_exclusive(const Btree *btree);
+
+void btree_latch_release(const Btree *btree);
+
+void btree_latch_destroy(Btree *btree);
+
+bool btree_node_latches_init(Btree *btree);
+
+void btree_latch_scan(const Btree *btree);
+
+void btree_node_latch(const Btree *btree, size_t offset, bool exclusive);
+
+void btree_node_unlatch(const Btree *btree, size_t offset);
+
+Btree_Result btree_bulk_build(Btree *btree, Btree_Iterator iterator);
+
+Btree_Result btree_display_levels(const Btree *btree, FILE *fp);
+
+bool btree_node_is_shared(const Btree *btree, const Btree_Node *node);
+
+void btree_node_read_child(Btree *btree, Btree_Node *x, int i, Btree_Node *node);
+
+void btree_node_relocate(Btree *btree, Btree_Node *node);
+
+void btree_root_own(Btree *btree);
+
+void btree_retire(Btree *btree, size_t offset);
+
+void btree_retired_free(Btree *btree, bool all);
+
+void btree_node_view(const Btree *btree, Btree_Node *node, uint8_t *data);
+
+bool btree_node_is_packed(const uint8_t *data);
+
+bool btree_node_read_image(const Btree *btree, Btree_Node *node, size_t offset, bool settle);
+
+uint8_t *btree_node_image(const Btree *btree, Btree_Node *node);
+
+const Btree_Node *btree_node_decode(const Btree *btree, Btree_Node *scratch, uint8_t *data);
+
+size_t btree_find_step(const Btree_Node *node, int key, int *value, Btree_Result *res);
+
+bool btree_find_async_advance(const Btree *btree, const Btree_Node *node, int key, int *value, Btree_Result *res,
+                              uint8_t *data, int tag, Btree_Node *scratch);
+
+bool btree_cache_peek(const Btree *btree, size_t offset, uint8_t *data);
+
+void btree_io_init(Btree *btree, Btree_Options options);
+
+bool btree_trace_init(Btree *btree, Btree_Options options);
+
+void btree_trace_record(const Btree *btree, Btree_Trace_Op op, int key, int value);
+
+bool btree_trace_flush(const Btree *btree);
+
+bool btree_trace_sync(const Btree *btree);
+
+bool btree_trace_destroy(Btree *btree);
+
+uint8_t *btree_trace_read(const char *trace_path, size_t *size);
+
+void btree_node_dirty(Btree_Node *node, int from, int to);
+
+int btree_node_spans(const Btree *btree, bool is_leaf, int from, int to, size_t spans[][2]);
+
+bool btree_writes_init(Btree *btree);
+
+void btree_writes_begin(const Btree *btree);
+
+bool btree_writes_end(const Btree *btree);
+
+ssize_t btree_write_vec(const Btree *btree, const struct iovec *vec, int n, size_t offset);
+
+bool btree_writes_flush(const Btree *btree);
+
+bool btree_writes_run(const Btree *btree, Btree_Write *ranges, int count, size_t start, size_t end, bool overlap);
+
+int btree_write_cmp(const void *a, const void *b);
+
+int btree_write_seq_cmp(const void *a, const void *b);
+
+void btree_writes_settle(const Btree *btree, size_t offset, size_t size);
+
+void btree_writes_destroy(Btree *btree);
+
+int btree_frame_cmp(const void *a, const void *b);
+
+size_t btree_node_part_size(const Btree *btree, int p);
+
+bool btree_io_uring_init(Btree_Io *io);
+
+bool btree_io_uring_probe(int ring_fd);
+
+bool btree_io_threads_init(Btree_Io *io);
+
+void *btree_io_worker(void *arg);
+
+void btree_io_submit(const Btree *btree, size_t offset, uint8_t *data, int tag);
+
+int btree_io_wait(const Btree *btree, Btree_Io_Request *completed);
+
+void btree_io_destroy(Btree *btree);
+
+Btree_Frame *btree_cache_pin_latched(const Btree *btree, size_t offset, bool load);
+
+Btree_Result btree_cursor_descend(Btree_Cursor *cursor, size_t offset, bool backward);
+
+Btree_Result btree_cursor_climb(Btree_Cursor *cursor, bool backward);
+
+bool btree_bytes_layout(Btree_Bytes *btree);
+
+void btree_bytes_grow_root(Btree_Bytes *btree);
+
+Btree_Result btree_bytes_node_put_nonfull(Btree_Bytes *btree, Btree_Bytes_Node *x, const uint8_t *local, int key_len,
+                                          uint32_t value_len);
+
+void btree_bytes_node_split_child(Btree_Bytes *btree, Btree_Bytes_Node *x, Btree_Bytes_Node *y, int i);
+
+Btree_Result btree_bytes_value_read(const Btree_Bytes *btree, const Btree_Bytes_Node *node, int i, void *value,
+                                    size_t *value_len);
+
+Btree_Result btree_bytes_node_delete(Btree_Bytes *btree, Btree_Bytes_Node *node, const uint8_t *key, size_t key_len,
+                                     bool drop);
+
+Btree_Bytes_Node *btree_bytes_node_get_pred(const Btree_Bytes *btree, const Btree_Bytes_Node *node, int i);
+
+Btree_Bytes_Node *btree_bytes_node_get_post(const Btree_Bytes *btree, const Btree_Bytes_Node *node, int i);
+
+void btree_bytes_node_merge(Btree_Bytes *btree, Btree_Bytes_Node *x, Btree_Bytes_Node *y, Btree_Bytes_Node *z, int i);
+
+bool btree_bytes_node_redistribute(Btree_Bytes *btree, Btree_Bytes_Node *x, Btree_Bytes_Node *x_ci,
+                                   Btree_Bytes_Node *sibbling_left, Btree_Bytes_Node *sibbling_right, int i);
+
+Btree_Bytes_Node *btree_bytes_node_concatenate(Btree_Bytes *btree, Btree_Bytes_Node *x, Btree_Bytes_Node *x_ci,
+                                               Btree_Bytes_Node *sibbling_left, Btree_Bytes_Node *sibbling_right,
+                                               int i);
+
+void btree_bytes_node_rotate_left(const Btree_Bytes *btree, Btree_Bytes_Node *x, Btree_Bytes_Node *y,
+                                  Btree_Bytes_Node *z, int i);
+
+void btree_bytes_node_rotate_right(const Btree_Bytes *btree, Btree_Bytes_Node *x, Btree_Bytes_Node *y,
+                                   Btree_Bytes_Node *z, int i);
+
+int btree_bytes_node_is_valid(const Btree_Bytes *btree, const Btree_Bytes_Node *node);
+
+Btree_Bytes_Node *btree_bytes_node_init(const Btree_Bytes *btree);
+
+void btree_bytes_node_destroy(Btree_Bytes_Node *node);
+
+Btree_Bytes_Node *btree_bytes_append_node(Btree_Bytes *btree);
+
+void btree_bytes_remove_node(Btree_Bytes *btree, Btree_Bytes_Node *x);
+
+size_t btree_bytes_pop_free_offset(Btree_Bytes *btree);
+
+void btree_bytes_free_page(Btree_Bytes *btree, size_t offset);
+
+void btree_bytes_node_read(const Btree_Bytes *btree, Btree_Bytes_Node *node, size_t offset);
+
+void btree_bytes_node_write(const Btree_Bytes *btree, Btree_Bytes_Node *node);
+
+uint8_t *btree_bytes_key(const Btree_Bytes_Node *node, int i);
+
+int btree_bytes_local_size(const Btree_Bytes_Slot *slot);
+
+int btree_bytes_cmp(const uint8_t *a, size_t a_len, const uint8_t *b, size_t b_len);
+
+int btree_bytes_search(const Btree_Bytes_Node *node, const uint8_t *key, size_t key_len, bool upper);
+
+void btree_bytes_node_insert(const Btree_Bytes *btree, Btree_Bytes_Node *node, int i, const uint8_t *local,
+                             int key_len, uint32_t value_len);
+
+void btree_bytes_node_copy(const Btree_Bytes *btree, Btree_Bytes_Node *node, int i, const Btree_Bytes_Node *src,
+                           int j);
+
+void btree_bytes_node_remove(Btree_Bytes_Node *node, int i);
+
+void btree_bytes_node_truncate(Btree_Bytes_Node *node, int count);
+
+void btree_bytes_node_compact(const Btree_Bytes *btree, Btree_Bytes_Node *node);
+
+size_t btree_bytes_overflow_write(Btree_Bytes *btree, const uint8_t *value, size_t len);
+
+bool btree_bytes_overflow_read(const Btree_Bytes *btree, size_t offset, uint8_t *value, size_t len);
+
+void btree_bytes_overflow_free(Btree_Bytes *btree, size_t offset);
+
+void btree_bytes_value_drop(Btree_Bytes *btree, const Btree_Bytes_Node *node, int i);
+
+void btree_bytes_header_read(Btree_Bytes *btree, uint8_t *magic_bytes);
+
+void btree_bytes_header_write(const Btree_Bytes *btree);
+
+void btree_bytes_log(const Btree_Bytes *btree, Btree_Log_Level level, const char *fmt, ...);
+
+Btree_Result btree_init(Btree *btree, Btree_Options options) {
+    if (btree == NULL) {
+        return BTREE_ERROR_NIL;
+    }
+
+    memset(btree, 0, sizeof(*btree));
+    if (!btree_paged_options_ok(options)) {
+        return BTREE_ERROR_OPTIONS;
+    }
+
+    // past opening the file, failures go to fail, which frees what was set up so far without writing anything
+    Btree_Result res = BTREE_ERROR_UNIX;
+
+    pthread_once(&btree_search_once, btree_search_select);
+    btree->log_handler = options.log_handler;
+    btree->fill_factor = options.fill_factor > 0 ? options.fill_factor : BTREE_DEFAULT_FILL_FACTOR;
+    btree->compress_leaves = options.compress_leaves;
+    btree->lazy_header = options.lazy_header && options.path != NULL && !options.wal;
+    btree->header_interval = options.header_interval > 0 ? options.header_interval : 0;
+    btree->fd = options.path != NULL ? open(options.path, O_RDWR) : -1;
+
+    if (options.path == NULL || (btree->fd == -1 && errno == ENOENT)) {
+        int t = options.t == 0 && options.page_size != 0 ? btree_page_t(options.page_size) : options.t;
+        if (t < 2) {
+            return BTREE_ERROR_BAD_T;
+        }
+        if (options.direct && options.page_size == 0) {
+            return BTREE_ERROR_OPTIONS;
+        }
+
+        btree->header.t = t;
+        btree->header.M = 2 * t;
+        btree->header.page_size = options.page_size;
+        btree->header.next_offset = btree_data_offset(btree);
+        btree->fd = options.path != NULL ? open(options.path, O_RDWR | O_CREAT, S_IRUSR | S_IWUSR) : -1;
+        if (btree->fd == -1 && options.path != NULL) {
+            return BTREE_ERROR_UNIX;
+        }
+        if (!btree_direct_init(btree, options)) {
+            goto fail;
+        }
+
+        // a log left next to a tree that no longer exists has nothing to replay into
+        res = btree_wal_open(btree, options, false);
+        if (res != BTREE_OK) {
+            goto fail;
+        }
+        res = BTREE_ERROR_UNIX;
+        if (!btree_storage_init(btree, options)) {
+            goto fail;
+        }
+
+        btree->root = btree_append_node(btree);
+        if (btree->root == NULL) {
+            goto fail;
+        }
+        btree->header.root_offset = btree->root->offset;
+        btree_header_write(btree);
+        if (btree->wal != NULL && !btree_wal_checkpoint(btree)) {
+            goto fail;
+        }
+        if (!btree_paths_init(btree) || !btree_latch_init(btree, options) || !btree_trace_init(btree, options) ||
+            !btree_writes_init(btree) || !btree_compact_init(btree, options)) {
+            goto fail;
+        }
+        // every node of an in-memory tree is mapped, so lookups never wait for a read
+        if (options.path != NULL) {
+            btree_io_init(btree, options);
+        }
+        return BTREE_OK;
+    }
+
+    if (btree->fd == -1) {
+        return BTREE_ERROR_UNIX;
+    }
+
+    res = btree_wal_open(btree, options, true);
+    if (res != BTREE_OK) {
+        goto fail;
+    }
+
+    uint8_t magic_bytes[sizeof(btree_magic_bytes)] = {0};
+    btree_header_read(btree, magic_bytes);
+    bool dirty = memcmp(magic_bytes, btree_dirty_magic_bytes, sizeof(magic_bytes)) == 0 ||
+                 memcmp(magic_bytes, btree_paged_dirty_magic_bytes, sizeof(magic_bytes)) == 0;
+    if (memcmp(magic_bytes, btree_old_magic_bytes, sizeof(magic_bytes)) == 0) {
+        btree_log(btree, BTREE_LOG_ERROR, "Tree was written with an older node layout and must be rebuilt");
+        res = BTREE_ERROR_FORMAT;
+        goto fail;
+    }
+    if (memcmp(magic_bytes, btree_magic_bytes, sizeof(magic_bytes)) == 0 ||
+        memcmp(magic_bytes, btree_dirty_magic_bytes, sizeof(magic_bytes)) == 0) {
+        btree->header.page_size = 0;
+    } else if ((memcmp(magic_bytes, btree_paged_magic_bytes, sizeof(magic_bytes)) != 0 &&
+                memcmp(magic_bytes, btree_paged_dirty_magic_bytes, sizeof(magic_bytes)) != 0) ||
+               btree->header.page_size < BTREE_MIN_PAGE_SIZE) {
+        res = BTREE_ERROR_FORMAT;
+        goto fail;
+    }
+
+    if (options.direct && btree->header.page_size == 0) {
+        res = BTREE_ERROR_OPTIONS;
+        goto fail;
+    }
+    res = BTREE_ERROR_UNIX;
+    if (!btree_direct_init(btree, options) || !btree_storage_init(btree, options)) {
+        goto fail;
+    }
+
+    // a header left dirty may be behind on everything but the root
+    res = dirty ? btree_header_recover(btree) : BTREE_OK;
+    Btree_Node *root = res == BTREE_OK ? btree_node_init(btree) : NULL;
+    if (root == NULL) {
+        res = res != BTREE_OK ? res : BTREE_ERROR_UNIX;
+        goto fail;
+    }
+
+    btree->header_clean = true;
+    btree->header_root = btree->header.root_offset;
+    btree_node_read2(btree, root, btree->header.root_offset);
+    btree_set_root(btree, root);
+    res = BTREE_ERROR_UNIX;
+    if (!btree_free_space_init(btree) || !btree_paths_init(btree) || !btree_latch_init(btree, options) ||
+        !btree_trace_init(btree, options) || !btree_writes_init(btree) || !btree_compact_init(btree, options)) {
+        goto fail;
+    }
+    btree_io_init(btree, options);
+    return BTREE_OK;
+
+fail:
+    btree_release(btree, false);
+    return res;
+}
+
+Btree_Result btree_find(const Btree *btree, int key, int *value) {
+    if (btree == NULL) {
+        return BTREE_ERROR_NIL;
+    }
+
+    uint64_t start = btree_op_start(btree);
+    btree_latch_shared(btree);
+    btree_node_latch(btree, btree->root->offset, false);
+    Btree_Result res = btree_node_find(btree, btree->root, key, value);
+    btree_latch_release(btree);
+    btree_op_end(btree, BTREE_OP_FIND, start);
+    return res;
+}
+
+Btree_Result btree_put(Btree *btree, int key, int value) {
+    if (btree == NULL) {
+        return BTREE_ERROR_NIL;
+    }
+
+    uint64_t start = btree_op_start(btree);
+    size_t reserved = btree_reserve(btree);
+    if (reserved == 0) {
+        btree_op_end(btree, BTREE_OP_PUT, start);
+        return BTREE_ERROR_UNIX;
+    }
+    while (true) {
+        if (btree->node_latches != NULL) {
+            btree_latch_shared(btree);
+        } else {
+            btree_latch_exclusive(btree);
+        }
+        btree_node_latch(btree, btree->root->offset, true);
+        if (btree_node_is_shared(btree, btree->root)) {
+            btree_node_unlatch(btree, btree->root->offset);
+            btree_latch_release(btree);
+            btree_latch_exclusive(btree);
+            btree_root_own(btree);
+            btree_latch_release(btree);
+            continue;
+        }
+        if (btree->root->count_keys < btree->header.M - 1) {
+            break;
+        }
+        if (btree->node_latches == NULL) {
+            btree_grow_root(btree);
+            break;
+        }
+
+        // replacing the root needs the tree to itself
+        btree_node_unlatch(btree, btree->root->offset);
+        btree_latch_release(btree);
+        btree_latch_exclusive(btree);
+        if (btree->root->count_keys == btree->header.M - 1) {
+            btree_grow_root(btree);
+        }
+        btree_latch_release(btree);
+    }
+
+    // puts running side by side write as they go
+    if (btree->node_latches == NULL) {
+        btree_writes_begin(btree);
+    }
+    Btree_Result res = btree_commit(btree, btree_node_put_nonfull(btree, btree->root, key, value));
+    if (!btree_writes_end(btree) || (btree->node_latches == NULL && !btree_header_checkpoint_due(btree))) {
+        res = BTREE_ERROR_UNIX;
+    }
+    btree_latch_release(btree);
+    btree_unreserve(btree, reserved);
+    btree_op_end(btree, BTREE_OP_PUT, start);
+    return res;
+}
+
+void btree_grow_root(Btree *btree) {
+    Btree_Node *s = btree_append_node(btree);
+    Btree_Node *z = btree_node_init(btree);
+    s->is_leaf = 0;
+    s->count_keys = 0;
+    s->children[0] = btree->root->offset;
+    btree_node_split_child(btree, s, btree->root, z, 0);
+    btree_node_destroy(z);
+    btree_node_destroy(btree->root);
+    btree_set_root(btree, s);
+    btree_header_write(btree);
+}
+
+int btree_item_cmp(const void *a, const void *b) {
+    const Item *x = a;
+    const Item *y = b;
+    if (x->key != y->key) {
+        return x->key < y->key ? -1 : 1;
+    }
+    return x->value < y->value ? -1 : x->value > y->value;
+}
+
+// Looks up every key in one sorted walk: each node on the way is read once for all the keys below it.
+Btree_Result btree_find_batch(const Btree *btree, const int *keys, int count, int *values, Btree_Result *results) {
+    if (btree == NULL || keys == NULL) {
+        return BTREE_ERROR_NIL;
+    }
+    if (count == 0) {
+        return BTREE_OK;
+    }
+
+    // probes carry the position of their key in the caller arrays as value
+    uint64_t start = btree_op_start(btree);
+    Item *probes = (Item *)malloc(count * sizeof(*probes));
+    Btree_Result *found = results ? results : (Btree_Result *)malloc(count * sizeof(*found));
+    if (probes == NULL || found == NULL) {
+        free(probes);
+        if (found != results) {
+            free(found);
+        }
+        return BTREE_ERROR_UNIX;
+    }
+
+    for (int i = 0; i < count; i++) {
+        probes[i] = (Item){.key = keys[i], .value = i};
+    }
+    qsort(probes, count, sizeof(*probes), btree_item_cmp);
+    btree_latch_shared(btree);
+    btree_node_latch(btree, btree->root->offset, false);
+    btree_node_find_batch(btree, btree->root, probes, count, values, found);
+    // the root stayed latched throughout, so no put came between the lookups and their records
+    for (int i = 0; i < count; i++) {
+        btree_trace_record(btree, BTREE_TRACE_FIND, keys[i], 0);
+    }
+    btree_node_unlatch(btree, btree->root->offset);
+    btree_latch_release(btree);
+
+    Btree_Result res = BTREE_OK;
+    for (int i = 0; i < count && res == BTREE_OK; i++) {
+        res = found[i];
+    }
+
+    free(probes);
+    if (found != results) {
+        free(found);
+    }
+    btree_op_end(btree, BTREE_OP_FIND_BATCH, start);
+    return res;
+}
+
+Btree_Result btree_find_async(const Btree *btree, const int *keys, int count, int *values, Btree_Result *results) {
+    if (btree == NULL || keys == NULL) {
+        return BTREE_ERROR_NIL;
+    }
+    if (count == 0) {
+        return BTREE_OK;
+    }
+
+    uint64_t start = btree_op_start(btree);
+    Btree_Result *found = results ? results : (Btree_Result *)malloc(count * sizeof(*found));
+    if (found == NULL) {
+        return BTREE_ERROR_UNIX;
+    }
+
+    Btree_Io *io = btree->io;
+    int depth = io == NULL ? 0 : io->depth < count ? io->depth : count;
+    size_t node_size = btree_node_size_in_file(btree);
+    int *slots = (int *)malloc(depth * sizeof(*slots));
+    uint8_t *buffers = btree_image_alloc(btree, depth * node_size);
+    Btree_Io_Request *completed = (Btree_Io_Request *)malloc(depth * sizeof(*completed));
+    Btree_Node *scratch = btree_node_init(btree);
+    if (io == NULL || slots == NULL || buffers == NULL || completed == NULL || scratch == NULL) {
+        for (int i = 0; i < count; i++) {
+            found[i] = btree_find(btree, keys[i], values ? &values[i] : NULL);
+        }
+        depth = 0;
+    }
+
+    if (depth > 0) {
+        pthread_mutex_lock(&io->busy);
+        btree_latch_scan(btree);
+        int next = 0;
+        int in_flight = 0;
+        // a slot whose key resolves without a read takes the next key at once
+        for (int s = 0; s < depth; s++) {
+            while (next < count) {
+                int k = next++;
+                if (btree_find_async_advance(btree, btree->root, keys[k], values ? &values[k] : NULL, &found[k],
+                                             buffers + s * node_size, s, scratch)) {
+                    slots[s] = k;
+                    in_flight++;
+                    break;
+                }
+            }
+        }
+
+        while (in_flight > 0) {
+            int n = btree_io_wait(btree, completed);
+            for (int c = 0; c < n; c++) {
+                int s = completed[c].tag;
+                int k = slots[s];
+                in_flight--;
+                if (!completed[c].failed) {
+                    btree_count(&btree->counters.node_reads, 1);
+                    btree_count(&btree->counters.bytes_read, node_size);
+                }
+                if (completed[c].failed) {
+                    found[k] = BTREE_ERROR_UNIX;
+                } else if (btree_find_async_advance(btree, btree_node_decode(btree, scratch, buffers + s * node_size),
+                                                    keys[k], values ? &values[k] : NULL, &found[k],
+                                                    buffers + s * node_size, s, scratch)) {
+                    in_flight++;
+                    continue;
+                }
+
+                while (next < count) {
+                    k = next++;
+                    if (btree_find_async_advance(btree, btree->root, keys[k], values ? &values[k] : NULL, &found[k],
+                                                 buffers + s * node_size, s, scratch)) {
+                        slots[s] = k;
+                        in_flight++;
+                        break;
+                    }
+                }
+            }
+        }
+        // keys that fell back to btree_find were recorded there
+        for (int i = 0; i < count; i++) {
+            btree_trace_record(btree, BTREE_TRACE_FIND, keys[i], 0);
+        }
+        btree_latch_release(btree);
+        pthread_mutex_unlock(&io->busy);
+    }
+
+    Btree_Result res = BTREE_OK;
+    for (int i = 0; i < count && res == BTREE_OK; i++) {
+        res = found[i];
+    }
+
+    free(slots);
+    free(buffers);
+    free(completed);
+    free(scratch);
+    if (found != results) {
+        free(found);
+    }
+    btree_op_end(btree, BTREE_OP_FIND_ASYNC, start);
+    return res;
+}
+
+// Follows key down from node as far as it gets without waiting. Returns true when the read of the next node
+// is in flight, false once the key is resolved into res.
+bool btree_find_async_advance(const Btree *btree, const Btree_Node *node, int key, int *value, Btree_Result *res,
+                              uint8_t *data, int tag, Btree_Node *scratch) {
+    while (true) {
+        size_t offset = btree_find_step(node, key, value, res);
+        if (offset == 0) {
+            return false;
+        }
+
+        uint8_t *mapped = btree->map != NULL ? btree_map_node(btree, offset) : NULL;
+        if (mapped == NULL && !btree_cache_peek(btree, offset, data)) {
+            btree_io_submit(btree, offset, data, tag);
+            return true;
+        }
+        node = btree_node_decode(btree, scratch, mapped ? mapped : data);
+    }
+}
+
+// Returns the child to descend into, or 0 once the key is resolved into res.
+size_t btree_find_step(const Btree_Node *node, int key, int *value, Btree_Result *res) {
+    int i = btree_search_lower(node->keys, node->count_keys, key);
+    if (i < node->count_keys && node->keys[i] == key) {
+        if (value) {
+            *value = node->values[i];
+        }
+        *res = BTREE_OK;
+        return 0;
+    }
+
+    if (node->is_leaf) {
+        *res = BTREE_ERROR_KEY_NOT_FOUND;
+        return 0;
+    }
+    return node->children[i];
+}
+
+void btree_node_find_batch(const Btree *btree, Btree_Node *x, const Item *probes, int count, int *values,
+                           Btree_Result *results) {
+    Btree_Node *x_ci = NULL;
+    int done = 0;
+    while (done < count) {
+        int key = probes[done].key;
+        int i = btree_search_lower(x->keys, x->count_keys, key);
+        if (i < x->count_keys && x->keys[i] == key) {
+            if (values) {
+                values[probes[done].value] = x->values[i];
+            }
+            results[probes[done].value] = BTREE_OK;
+            done++;
+            continue;
+        }
+
+        if (x->is_leaf) {
+            results[probes[done].value] = BTREE_ERROR_KEY_NOT_FOUND;
+            done++;
+            continue;
+        }
+
+        // every probe below the next separator goes down the same child
+        int end = done + 1;
+        while (end < count && (i == x->count_keys || probes[end].key < x->keys[i])) {
+            end++;
+        }
+
+        if (x_ci == NULL) {
+            x_ci = btree_node_init(btree);
+        }
+        btree_node_latch(btree, x->children[i], false);
+        btree_node_read2(btree, x_ci, x->children[i]);
+        btree_node_find_batch(btree, x_ci, probes + done, end - done, values, results);
+        btree_node_unlatch(btree, x->children[i]);
+        done = end;
+    }
+
+    if (x_ci != NULL) {
+        btree_node_destroy(x_ci);
+    }
+}
+
+// Inserts every item in one sorted walk per pass. A pass stops early only when a full node would have to
+// split under a parent that filled up during the same pass; the next pass starts from the root again.
+Btree_Result btree_put_batch(Btree *btree, const Item *items, int count) {
+    if (btree == NULL || items == NULL) {
+        return BTREE_ERROR_NIL;
+    }
+    if (count == 0) {
+        return BTREE_OK;
+    }
+
+    uint64_t start = btree_op_start(btree);
+    Item *sorted = (Item *)malloc(count * sizeof(*sorted));
+    if (sorted == NULL) {
+        return BTREE_ERROR_UNIX;
+    }
+    memcpy(sorted, items, count * sizeof(*sorted));
+    qsort(sorted, count, sizeof(*sorted), btree_item_cmp);
+
+    Btree_Result res = BTREE_OK;
+    btree_latch_exclusive(btree);
+    btree_writes_begin(btree);
+    for (int done = 0; done < count && res == BTREE_OK;) {
+        // an in-memory tree takes only as many items per pass as it has nodes left for
+        size_t need = btree_put_need(btree);
+        if (!btree_has_room(btree, need)) {
+            res = BTREE_ERROR_UNIX;
+            break;
+        }
+        size_t room = btree_room(btree) / need;
+        int n = room < (size_t)(count - done) ? (int)room : count - done;
+        btree_root_own(btree);
+        if (btree->root->count_keys == btree->header.M - 1) {
+            btree_grow_root(btree);
+        }
+        done += btree_node_put_batch(btree, btree->root, sorted + done, n);
+        res = btree_commit(btree, BTREE_OK);
+    }
+    if (!btree_writes_end(btree) || !btree_header_checkpoint_due(btree)) {
+        res = BTREE_ERROR_UNIX;
+    }
+    for (int i = 0; i < count; i++) {
+        btree_trace_record(btree, BTREE_TRACE_PUT, items[i].key, items[i].value);
+    }
+    btree_latch_release(btree);
+
+    free(sorted);
+    btree_op_end(btree, BTREE_OP_PUT_BATCH, start);
+    return res;
+}
+
+// x must not be full. Returns how many of the items were inserted below x.
+int btree_node_put_batch(Btree *btree, Btree_Node *x, const Item *items, int count) {
+    int M = btree->header.M;
+
+    if (x->is_leaf) {
+        int n = count < M - 1 - x->count_keys ? count : M - 1 - x->count_keys;
+        int i = x->count_keys - 1;
+        int j = n - 1;
+        int k = x->count_keys + n - 1;
+        // merge from the back, new items going after equal keys like btree_node_put_nonfull does
+        for (; j >= 0; k--) {
+            if (i >= 0 && x->keys[i] > items[j].key) {
+                x->keys[k] = x->keys[i];
+                x->values[k] = x->values[i];
+                i--;
+            } else {
+                x->keys[k] = items[j].key;
+                x->values[k] = items[j].value;
+                j--;
+            }
+        }
+        x->count_keys += n;
+        btree_node_dirty(x, k + 1, x->count_keys);
+        btree_node_write(btree, x);
+        return n;
+    }
+
+    Btree_Node *x_ci = btree_node_init(btree);
+    Btree_Node *z = btree_node_init(btree);
+    int done = 0;
+    while (done < count) {
+        int i = btree_search_upper(x->keys, x->count_keys, items[done].key);
+        // a child just filled is still in the buffer as written, so it is not read back
+        if (x_ci->offset != x->children[i]) {
+            btree_node_read_child(btree, x, i, x_ci);
+        }
+
+        if (x_ci->count_keys == M - 1) {
+            if (x->count_keys == M - 1) {
+                break;
+            }
+            btree_node_split_child(btree, x, x_ci, z, i);
+            // the right half is still in z, so the buffers trade places instead of reading it back
+            if (items[done].key >= x->keys[i]) {
+                i++;
+                Btree_Node *right = z;
+                z = x_ci;
+                x_ci = right;
+            }
+        }
+
+        int end = done + 1;
+        while (end < count && (i == x->count_keys || items[end].key < x->keys[i])) {
+            end++;
+        }
+        done += btree_node_put_batch(btree, x_ci, items + done, end - done);
+        btree_wal_commit_if_full(btree);
+    }
+
+    btree_node_destroy(x_ci);
+    btree_node_destroy(z);
+    return done;
+}
+
+Btree_Result btree_delete(Btree *btree, int key) {
+    if (btree == NULL) {
+        return BTREE_ERROR_NIL;
+    }
+    uint64_t start = btree_op_start(btree);
+    btree_latch_exclusive(btree);
+    btree_writes_begin(btree);
+    btree_root_own(btree);
+    bool rebalance = !btree->lazy_delete;
+    Btree_Result res = btree->lazy_delete ? btree_node_delete_lazy(btree, btree->root, key, &rebalance) : BTREE_OK;
+    if (rebalance) {
+        res = btree_node_delete(btree, btree->root, key);
+    }
+    res = btree_commit(btree, res);
+    if (!btree_writes_end(btree) || !btree_header_checkpoint_due(btree)) {
+        res = BTREE_ERROR_UNIX;
+    }
+    btree_trace_record(btree, BTREE_TRACE_DELETE, key, 0);
+    btree_latch_release(btree);
+    btree_compact_wake(btree);
+    btree_op_end(btree, BTREE_OP_DELETE, start);
+    return res;
+}
+
+Btree_Result btree_destroy(Btree *btree) {
+    if (btree == NULL) {
+        return BTREE_ERROR_NIL;
+    }
+    btree_compact_destroy(btree);
+    btree_retired_free(btree, true);
+    btree_io_destroy(btree);
+    btree_wal_flusher_stop(btree);
+    bool flushed = btree_wal_checkpoint(btree) &&
+                   (btree->lazy_header ? btree_header_checkpoint(btree) : btree_cache_flush(btree));
+    flushed &= btree_release(btree, true);
+    return flushed ? BTREE_OK : BTREE_ERROR_UNIX;
+}
+
+// Frees whatever btree_init set up and closes the file. Only btree_destroy writes the mapping back; an init
+// that fails leaves the file as it found it. Returns false when the file could not be synced or closed.
+bool btree_release(Btree *btree, bool write_back) {
+    btree_compact_destroy(btree);
+    btree_io_destroy(btree);
+    btree_node_destroy(btree->root);
+    btree->root = NULL;
+    btree_wal_destroy(btree);
+    btree_cache_destroy(btree);
+    bool ok = btree_map_destroy(btree, write_back);
+    btree_latch_destroy(btree);
+    btree_paths_destroy(btree);
+    btree_free_space_destroy(btree);
+    free(btree->retired);
+    btree->retired = NULL;
+    ok &= btree_trace_destroy(btree);
+    btree_writes_destroy(btree);
+    ok &= btree->fd == -1 || close(btree->fd) != -1;
+    btree->fd = -1;
+    return ok;
+}
+
+// Builds the tree bottom-up from a sorted stream. Each level keeps the node being filled (open) and its
+// finished left sibling (pending), so the last two nodes of a level can still be balanced once the stream
+// ends; every other node is written exactly once, in allocation order.
+Btree_Result btree_bulk_load(Btree *btree, Btree_Iterator iterator) {
+    if (btree == NULL || iterator.next == NULL) {
+        return BTREE_ERROR_NIL;
+    }
+
+    btree_latch_exclusive(btree);
+    if (!btree_has_room(btree, 1)) {
+        btree_latch_release(btree);
+        return BTREE_ERROR_UNIX;
+    }
+    btree_root_own(btree);
+    Btree_Result res = btree_bulk_build(btree, iterator);
+    btree_latch_release(btree);
+    return res;
+}
+
+Btree_Result btree_bulk_build(Btree *btree, Btree_Iterator iterator) {
+    if (btree->root->count_keys != 0 || !btree->root->is_leaf) {
+        return BTREE_ERROR_NOT_EMPTY;
+    }
+
+    int t = btree->header.t;
+    int fill = (int)(btree->fill_factor * (btree->header.M - 1) + 0.5);
+    fill = fill < t - 1 ? t - 1 : fill > btree->header.M - 1 ? btree->header.M - 1 : fill;
+
+    Btree_Bulk_Level levels[BTREE_MAX_HEIGHT] = {0};
+    int height = 1;
+    levels[0].open = btree_node_init(btree);
+    if (levels[0].open == NULL) {
+        return BTREE_ERROR_UNIX;
+    }
+    levels[0].open->is_leaf = 1;
+
+    Btree_Result res = BTREE_OK;
+    Item item;
+    Item last = {0};
+    bool first = true;
+    while (iterator.next(iterator.ctx, &item)) {
+        if (!first && item.key < last.key) {
+            res = BTREE_ERROR_UNSORTED;
+            break;
+        }
+        if (!btree_bulk_add(btree, levels, &height, fill, 0, item)) {
+            res = BTREE_ERROR_UNIX;
+            break;
+        }
+        last = item;
+        first = false;
+    }
+
+    // on bad input the sorted prefix read so far is still turned into a valid tree
+    if (!btree_bulk_finish(btree, levels, height) && res == BTREE_OK) {
+        res = BTREE_ERROR_UNIX;
+    }
+    btree_header_write(btree);
+    return btree_commit(btree, res);
+}
+
+bool btree_bulk_add(Btree *btree, Btree_Bulk_Level *levels, int *height, int fill, int level, Item item) {
+    Btree_Node *node = levels[level].open;
+    if (node->count_keys < fill) {
+        node->keys[node->count_keys] = item.key;
+        node->values[node->count_keys] = item.value;
+        node->count_keys++;
+        for (int l = level - 1; l >= 0 && levels[l].sep_level == -1; l--) {
+            levels[l].sep_level = level;
+            levels[l].sep_index = node->count_keys - 1;
+        }
+        return true;
+    }
+
+    // the node is full: close it and send the item up as the separator from the next node of this level
+    if (level + 1 == *height) {
+        if (*height == BTREE_MAX_HEIGHT) {
+            return false;
+        }
+        levels[level + 1].open = btree_node_init(btree);
+        if (levels[level + 1].open == NULL) {
+            return false;
+        }
+        (*height)++;
+    }
+
+    // besides the node closed here, finishing takes one more for every level below the top
+    if (!btree_has_room(btree, *height) || !btree_bulk_close(btree, levels, level)) {
+        return false;
+    }
+    levels[level].sep_level = -1;
+    return btree_bulk_add(btree, levels, height, fill, level + 1, item);
+}
+
+bool btree_bulk_close(Btree *btree, Btree_Bulk_Level *levels, int level) {
+    Btree_Bulk_Level *lv = &levels[level];
+    Btree_Node *node = lv->open;
+    Btree_Node *parent = levels[level + 1].open;
+
+    node->offset = btree_pop_free_offset(btree);
+    btree->header.count_nodes++;
+    parent->children[parent->count_keys] = node->offset;
+
+    Btree_Node *spare = lv->pending;
+    if (spare != NULL) {
+        btree_node_write(btree, spare);
+        btree_node_clear(btree, spare);
+        // finished nodes are unreachable until the root is replaced, so logging them early is harmless
+        btree_wal_commit_if_full(btree);
+    } else {
+        spare = btree_node_init(btree);
+        if (spare == NULL) {
+            return false;
+        }
+    }
+
+    spare->is_leaf = level == 0;
+    lv->pending = node;
+    lv->open = spare;
+    return true;
+}
+
+bool btree_bulk_finish(Btree *btree, Btree_Bulk_Level *levels, int height) {
+    int t = btree->header.t;
+    int M = btree->header.M;
+    int *keys = (int *)malloc(2 * M * sizeof(*keys));
+    int *values = (int *)malloc(2 * M * sizeof(*values));
+    size_t *children = (size_t *)malloc(2 * M * sizeof(*children));
+    bool ok = keys != NULL && values != NULL && children != NULL;
+
+    for (int level = 0; level < height; level++) {
+        Btree_Bulk_Level *lv = &levels[level];
+        Btree_Node *node = lv->open;
+        Btree_Node *left = lv->pending;
+
+        if (node != NULL && left != NULL && node->count_keys < t - 1) {
+            Btree_Node *parent = levels[lv->sep_level].open;
+            if (left->count_keys + node->count_keys >= 2 * (t - 1) && ok) {
+                btree_bulk_redistribute(left, node, parent, lv->sep_index, keys, values, children);
+            } else {
+                // the separator is the last key of its node and every level between only leads to this node
+                btree_bulk_merge(left, node, parent, lv->sep_index);
+                for (int l = level; l < lv->sep_level; l++) {
+                    btree_node_destroy(levels[l].open);
+                    levels[l].open = NULL;
+                }
+                node = NULL;
+            }
+        }
+
+        if (left != NULL) {
+            btree_node_write(btree, left);
+            btree_node_destroy(left);
+            lv->pending = NULL;
+        }
+
+        if (node == NULL) {
+            continue;
+        }
+
+        if (level + 1 < height) {
+            Btree_Node *parent = levels[level + 1].open;
+            node->offset = btree_pop_free_offset(btree);
+            btree->header.count_nodes++;
+            parent->children[parent->count_keys] = node->offset;
+            btree_node_write(btree, node);
+            btree_node_destroy(node);
+            continue;
+        }
+
+        // the old empty root stays in place until here, then it is either reused or freed
+        if (!node->is_leaf && node->count_keys == 0) {
+            size_t offset = node->children[0];
+            btree_node_clear(btree, node);
+            btree_node_read2(btree, node, offset);
+            btree_remove_node(btree, btree->root);
+            btree_node_destroy(btree->root);
+        } else {
+            node->offset = btree->root->offset;
+            btree_node_write(btree, node);
+            btree_node_destroy(btree->root);
+        }
+        btree_set_root(btree, node);
+    }
+
+    free(keys);
+    free(values);
+    free(children);
+    return ok;
+}
+
+// Spreads the keys of two neighbours and their separator evenly, the right node getting the smaller half.
+void btree_bulk_redistribute(Btree_Node *left, Btree_Node *right, Btree_Node *parent, int j, int *keys, int *values,
+                             size_t *children) {
+    int total = left->count_keys + 1 + right->count_keys;
+    memcpy(keys, left->keys, left->count_keys * sizeof(*keys));
+    memcpy(values, left->values, left->count_keys * sizeof(*values));
+    keys[left->count_keys] = parent->keys[j];
+    values[left->count_keys] = parent->values[j];
+    memcpy(keys + left->count_keys + 1, right->keys, right->count_keys * sizeof(*keys));
+    memcpy(values + left->count_keys + 1, right->values, right->count_keys * sizeof(*values));
+    memcpy(children, left->children, (left->count_keys + 1) * sizeof(*children));
+    memcpy(children + left->count_keys + 1, right->children, (right->count_keys + 1) * sizeof(*children));
+
+    int count_right = (total - 1) / 2;
+    int count_left = total - 1 - count_right;
+    int old_left = left->count_keys;
+
+    memcpy(left->keys, keys, count_left * sizeof(*keys));
+    memcpy(left->values, values, count_left * sizeof(*values));
+    memcpy(left->children, children, (count_left + 1) * sizeof(*children));
+    memset(left->keys + count_left, 0, (old_left - count_left) * sizeof(*keys));
+    memset(left->values + count_left, 0, (old_left - count_left) * sizeof(*values));
+    memset(left->children + count_left + 1, 0, (old_left - count_left) * sizeof(*children));
+    left->count_keys = count_left;
+
+    parent->keys[j] = keys[count_left];
+    parent->values[j] = values[count_left];
+
+    memcpy(right->keys, keys + count_left + 1, count_right * sizeof(*keys));
+    memcpy(right->values, values + count_left + 1, count_right * sizeof(*values));
+    memcpy(right->children, children + count_left + 1, (count_right + 1) * sizeof(*children));
+    right->count_keys = count_right;
+}
+
+void btree_bulk_merge(Btree_Node *left, Btree_Node *right, Btree_Node *parent, int j) {
+    int i = left->count_keys;
+    left->keys[i] = parent->keys[j];
+    left->values[i] = parent->values[j];
+    memcpy(left->keys + i + 1, right->keys, right->count_keys * sizeof(*left->keys));
+    memcpy(left->values + i + 1, right->values, right->count_keys * sizeof(*left->values));
+    if (!left->is_leaf) {
+        memcpy(left->children + i + 1, right->children, (right->count_keys + 1) * sizeof(*left->children));
+    }
+    left->count_keys += 1 + right->count_keys;
+
+    parent->count_keys--;
+    parent->keys[j] = 0;
+    parent->values[j] = 0;
+}
+
+void btree_node_clear(const Btree *btree, Btree_Node *node) {
+    btree_node_own(btree, node);
+    node->count_keys = 0;
+    node->dirty_from = node->dirty_to = 0;
+    memset(node->keys, 0, (btree->header.M - 1) * sizeof(*node->keys));
+    memset(node->values, 0, (btree->header.M - 1) * sizeof(*node->values));
+    memset(node->children, 0, btree->header.M * sizeof(*node->children));
+}
+
+Btree_Result btree_cursor_open(const Btree *btree, Btree_Cursor *cursor) {
+    if (btree == NULL || cursor == NULL) {
+        return BTREE_ERROR_NIL;
+    }
+    memset(cursor, 0, sizeof(*cursor));
+    cursor->btree = btree;
+    return BTREE_OK;
+}
+
+// Positions the cursor at the first key >= key.
+Btree_Result btree_cursor_seek(Btree_Cursor *cursor, int key) {
+    if (cursor == NULL) {
+        return BTREE_ERROR_NIL;
+    }
+
+    btree_cursor_latch(cursor);
+    cursor->depth = 0;
+    size_t offset = btree_cursor_root(cursor);
+    Btree_Result res = BTREE_OK;
+    while (true) {
+        if (!btree_cursor_push(cursor, offset)) {
+            cursor->depth = 0;
+            res = BTREE_ERROR_UNIX;
+            break;
+        }
+
+        int d = cursor->depth - 1;
+        Btree_Node *node = cursor->path[d];
+        cursor->index[d] = btree_search_lower(node->keys, node->count_keys, key);
+        if (node->is_leaf) {
+            res = btree_cursor_climb(cursor, false);
+            break;
+        }
+        offset = node->children[cursor->index[d]];
+    }
+    btree_cursor_unlatch(cursor);
+    return res;
+}
+
+// Moves to the next key; an unpositioned cursor moves to the first one.
+Btree_Result btree_cursor_next(Btree_Cursor *cursor) {
+    if (cursor == NULL) {
+        return BTREE_ERROR_NIL;
+    }
+
+    btree_cursor_latch(cursor);
+    Btree_Result res = BTREE_OK;
+    if (cursor->depth == 0) {
+        res = btree_cursor_descend(cursor, btree_cursor_root(cursor), false);
+    } else {
+        int d = cursor->depth - 1;
+        Btree_Node *node = cursor->path[d];
+        cursor->index[d]++;
+        res = node->is_leaf ? btree_cursor_climb(cursor, false)
+                            : btree_cursor_descend(cursor, node->children[cursor->index[d]], false);
+    }
+    btree_cursor_unlatch(cursor);
+    return res;
+}
+
+// Moves to the previous key; an unpositioned cursor moves to the last one.
+Btree_Result btree_cursor_prev(Btree_Cursor *cursor) {
+    if (cursor == NULL) {
+        return BTREE_ERROR_NIL;
+    }
+
+    btree_cursor_latch(cursor);
+    Btree_Result res = BTREE_OK;
+    if (cursor->depth == 0) {
+        res = btree_cursor_descend(cursor, btree_cursor_root(cursor), true);
+    } else {
+        int d = cursor->depth - 1;
+        Btree_Node *node = cursor->path[d];
+        if (node->is_leaf) {
+            cursor->index[d]--;
+            res = btree_cursor_climb(cursor, true);
+        } else {
+            res = btree_cursor_descend(cursor, node->children[cursor->index[d]], true);
+        }
+    }
+    btree_cursor_unlatch(cursor);
+    return res;
+}
+
+Btree_Result btree_cursor_get(const Btree_Cursor *cursor, int *key, int *value) {
+    if (cursor == NULL) {
+        return BTREE_ERROR_NIL;
+    }
+
+    if (cursor->depth == 0) {
+        return BTREE_ERROR_END;
+    }
+
+    const Btree_Node *node = cursor->path[cursor->depth - 1];
+    int i = cursor->index[cursor->depth - 1];
+    if (key) {
+        *key = node->keys[i];
+    }
+    if (value) {
+        *value = node->values[i];
+    }
+    return BTREE_OK;
+}
+
+void btree_cursor_close(Btree_Cursor *cursor) {
+    if (cursor == NULL) {
+        return;
+    }
+    for (int d = 0; d < BTREE_MAX_HEIGHT && cursor->path[d] != NULL; d++) {
+        btree_node_destroy(cursor->path[d]);
+    }
+    memset(cursor, 0, sizeof(*cursor));
+}
+
+size_t btree_cursor_root(const Btree_Cursor *cursor) {
+    return cursor->root_offset ? cursor->root_offset : cursor->btree->header.root_offset;
+}
+
+// Snapshot nodes never change, so only cursors over the live tree keep writers out.
+void btree_cursor_latch(const Btree_Cursor *cursor) {
+    if (cursor->root_offset == 0) {
+        btree_latch_scan(cursor->btree);
+    }
+}
+
+void btree_cursor_unlatch(const Btree_Cursor *cursor) {
+    if (cursor->root_offset == 0) {
+        btree_latch_release(cursor->btree);
+    }
+}
+
+bool btree_cursor_push(Btree_Cursor *cursor, size_t offset) {
+    int d = cursor->depth;
+    if (d == BTREE_MAX_HEIGHT) {
+        return false;
+    }
+    if (cursor->path[d] == NULL) {
+        cursor->path[d] = btree_node_init(cursor->btree);
+        if (cursor->path[d] == NULL) {
+            return false;
+        }
+    }
+    btree_node_read_at(cursor->btree, cursor->path[d], offset, cursor->root_offset == 0);
+    cursor->depth++;
+    return true;
+}
+
+// Walks down from the node at offset to the first key of its subtree, or to the last one when backward.
+Btree_Result btree_cursor_descend(Btree_Cursor *cursor, size_t offset, bool backward) {
+    while (true) {
+        if (!btree_cursor_push(cursor, offset)) {
+            cursor->depth = 0;
+            return BTREE_ERROR_UNIX;
+        }
+
+        int d = cursor->depth - 1;
+        Btree_Node *node = cursor->path[d];
+        if (node->is_leaf) {
+            cursor->index[d] = backward ? node->count_keys - 1 : 0;
+            return btree_cursor_climb(cursor, backward);
+        }
+        cursor->index[d] = backward ? node->count_keys : 0;
+        offset = node->children[cursor->index[d]];
+    }
+}
+
+// Leaves exhausted nodes. Going forward, the key after child c of an ancestor is its key c; going
+// backward, the key before it is key c - 1.
+Btree_Result btree_cursor_climb(Btree_Cursor *cursor, bool backward) {
+    int d = cursor->depth - 1;
+    Btree_Node *node = cursor->path[d];
+    if (cursor->index[d] >= 0 && cursor->index[d] < node->count_keys) {
+        return BTREE_OK;
+    }
+
+    while (--cursor->depth > 0) {
+        d = cursor->depth - 1;
+        node = cursor->path[d];
+        if (!backward && cursor->index[d] < node->count_keys) {
+            return BTREE_OK;
+        }
+        if (backward && cursor->index[d] > 0) {
+            cursor->index[d]--;
+            return BTREE_OK;
+        }
+    }
+    return BTREE_ERROR_END;
+}
+
+Btree_Result btree_sync(Btree *btree) {
+    if (btree == NULL) {
+        return BTREE_ERROR_NIL;
+    }
+    if (!btree_trace_sync(btree)) {
+        return BTREE_ERROR_UNIX;
+    }
+    if (btree->fd == -1) {
+        return BTREE_OK;
+    }
+
+    btree_latch_exclusive(btree);
+    bool synced = btree_wal_checkpoint(btree) && btree_header_checkpoint(btree);
+    if (synced) {
+        synced = btree->map == NULL || msync(btree->map, btree->file_size, MS_SYNC) != -1;
+    }
+    synced = synced && fsync(btree->fd) != -1;
+    btree_latch_release(btree);
+    return synced ? BTREE_OK : BTREE_ERROR_UNIX;
+}
+
+Btree_Result btree_checkpoint(Btree *btree) {
+    if (btree == NULL) {
+        return BTREE_ERROR_NIL;
+    }
+    if (btree->fd == -1) {
+        return BTREE_OK;
+    }
+
+    btree_latch_exclusive(btree);
+    bool done = btree->wal != NULL ? btree_wal_checkpoint(btree) : btree_header_checkpoint(btree);
+    btree_latch_release(btree);
+    return done ? BTREE_OK : BTREE_ERROR_UNIX;
+}
+
+Btree_Result btree_compact(Btree *btree, int count) {
+    if (btree == NULL) {
+        return BTREE_ERROR_NIL;
+    }
+
+    btree_latch_exclusive(btree);
+    btree_writes_begin(btree);
+    btree_root_own(btree);
+    Btree_Path *path = btree_path_take(btree);
+    bool done = path != NULL;
+    if (done && count == 0) {
+        done = btree_node_compact(btree, btree->root, path, 0);
+        if (done) {
+            __atomic_store_n(&btree->count_underfull, 0, __ATOMIC_RELEASE);
+        }
+    }
+    // a leaf stays noted until its path has been walked
+    for (int i = 0; done && i < count && btree->count_underfull > 0; i++) {
+        done = btree_compact_path(btree, path, btree->underfull[btree->count_underfull - 1]);
+        if (done) {
+            __atomic_store_n(&btree->count_underfull, btree->count_underfull - 1, __ATOMIC_RELEASE);
+        }
+    }
+    if (path != NULL) {
+        btree_path_give(btree, path);
+    }
+
+    Btree_Result res = btree_commit(btree, done ? BTREE_OK : BTREE_ERROR_UNIX);
+    if (!btree_writes_end(btree) || !btree_header_checkpoint_due(btree)) {
+        res = BTREE_ERROR_UNIX;
+    }
+    btree_latch_release(btree);
+    return res;
+}
+
+Btree_Result btree_vacuum(Btree *btree) {
+    if (btree == NULL) {
+        return BTREE_ERROR_NIL;
+    }
+
+    btree_latch_exclusive(btree);
+    if (btree->snapshots != NULL) {
+        btree_latch_release(btree);
+        return BTREE_ERROR_BUSY;
+    }
+
+    // slots are handed out below, so until the list is rebuilt the one on disk would offer taken slots
+    btree->header.next_free_offset = 0;
+    btree_header_write(btree);
+
+    size_t node_size = btree_node_size_in_file(btree);
+    size_t target = btree_data_offset(btree) + btree->header.count_nodes * node_size;
+    size_t end = btree_vacuum_move(btree, target);
+    btree_free_space_relink(btree, end);
+    btree->header.next_offset = end;
+    btree_header_write(btree);
+
+    Btree_Result res = btree_commit(btree, end != 0 ? BTREE_OK : BTREE_ERROR_UNIX);
+    if (res == BTREE_OK && !btree_vacuum_truncate(btree, end)) {
+        res = BTREE_ERROR_UNIX;
+    }
+    btree_latch_release(btree);
+    return res;
+}
+
+// Walks the tree breadth-first, moving each node at or past target into the lowest free slot before it and
+// rewriting its parent once all of its children are placed. Returns the end of the last node, or 0 when
+// the walk could not be done.
+size_t btree_vacuum_move(Btree *btree, size_t target) {
+    size_t node_size = btree_node_size_in_file(btree);
+    size_t low = btree_data_offset(btree);
+    Btree_Node *root = btree->root;
+    if (root->offset >= target) {
+        size_t offset = btree_vacuum_slot(btree, &low, root->offset);
+        if (offset != 0) {
+            btree_free_space_mark(btree, root->offset, true);
+            root->offset = offset;
+            btree_node_write(btree, root);
+            btree_node_read2(btree, root, offset);
+            btree->header.root_offset = offset;
+        }
+    }
+
+    Btree_Queue queue;
+    Btree_Node *x = btree_node_init(btree);
+    Btree_Node *y = btree_node_init(btree);
+    if (x == NULL || y == NULL || !btree_queue_init(&queue, btree->header.count_nodes)) {
+        btree_node_destroy(x);
+        btree_node_destroy(y);
+        return 0;
+    }
+
+    size_t end = root->offset + node_size;
+    btree_queue_enqueue(&queue, root->offset);
+    while (queue.count > 0) {
+        btree_node_read2(btree, x, btree_queue_dequeue(&queue));
+        if (x->is_leaf) {
+            continue;
+        }
+
+        bool moved = false;
+        for (int i = 0; i <= x->count_keys; i++) {
+            size_t child = x->children[i];
+            size_t offset = child >= target ? btree_vacuum_slot(btree, &low, child) : 0;
+            if (offset != 0) {
+                btree_node_read2(btree, y, child);
+                y->offset = offset;
+                btree_node_write(btree, y);
+                btree_free_space_mark(btree, child, true);
+                x->children[i] = child = offset;
+                moved = true;
+            }
+            end = child + node_size > end ? child + node_size : end;
+            btree_queue_enqueue(&queue, child);
+        }
+        if (moved) {
+            btree_node_write(btree, x);
+            btree_wal_commit_if_full(btree);
+        }
+    }
+
+    // the walk rewrote the root through x
+    btree_node_read2(btree, root, root->offset);
+    btree_node_destroy(x);
+    btree_node_destroy(y);
+    btree_queue_destroy(&queue);
+    return end;
+}
+
+// Takes the lowest free slot at or after *low and before both before and the vacuum target, or returns 0.
+size_t btree_vacuum_slot(Btree *btree, size_t *low, size_t before) {
+    const Btree_Free_Space *free_space = &btree->free_space;
+    size_t node_size = btree_node_size_in_file(btree);
+    size_t data_offset = btree_data_offset(btree);
+    size_t slot = (*low - data_offset) / node_size;
+    size_t last = (before - data_offset) / node_size;
+    size_t limit = btree->header.count_nodes;
+    last = last < limit ? last : limit;
+
+    while (slot < last && slot / 64 < free_space->count_words) {
+        uint64_t bits = free_space->bits[slot / 64] >> (slot % 64);
+        if (bits == 0) {
+            slot = (slot / 64 + 1) * 64;
+            continue;
+        }
+        slot += __builtin_ctzll(bits);
+        if (slot >= last) {
+            break;
+        }
+
+        size_t offset = data_offset + slot * node_size;
+        btree_free_space_mark(btree, offset, false);
+        *low = offset + node_size;
+        return offset;
+    }
+    return 0;
+}
+
+Btree_Result btree_reorganize(Btree *btree, Btree_Layout layout) {
+    if (btree == NULL) {
+        return BTREE_ERROR_NIL;
+    }
+    if (layout != BTREE_LAYOUT_BFS && layout != BTREE_LAYOUT_VEB) {
+        return BTREE_ERROR_OPTIONS;
+    }
+
+    btree_latch_exclusive(btree);
+    if (btree->snapshots != NULL) {
+        btree_latch_release(btree);
+        return BTREE_ERROR_BUSY;
+    }
+
+    int count = btree->header.count_nodes;
+    size_t *offsets = (size_t *)malloc(count * sizeof(*offsets));
+    int *firsts = (int *)malloc((count + 1) * sizeof(*firsts));
+    int *order = (int *)malloc(count * sizeof(*order));
+    int *slots = (int *)malloc(count * sizeof(*slots));
+    Btree_Node *x = btree_node_init(btree);
+    Btree_Node *y = btree_node_init(btree);
+    bool ok = offsets != NULL && firsts != NULL && order != NULL && slots != NULL && x != NULL && y != NULL &&
+              btree_reorganize_shape(btree, offsets, firsts, x);
+
+    if (ok) {
+        int height = 1;
+        for (int i = 0; firsts[i] < firsts[i + 1]; i = firsts[i]) {
+            height++;
+        }
+        int placed = 0;
+        if (layout == BTREE_LAYOUT_VEB) {
+            btree_reorganize_veb(firsts, 0, height, order, &placed);
+        } else {
+            for (; placed < count; placed++) {
+                order[placed] = placed;
+            }
+        }
+        for (int p = 0; p < count; p++) {
+            slots[order[p]] = p;
+        }
+    }
+
+    // the copy goes after every slot in use, so the old nodes stay untouched until the root moves to it
+    size_t node_size = btree_node_size_in_file(btree);
+    size_t data_offset = btree_data_offset(btree);
+    size_t copy = btree->header.next_offset;
+    size_t copy_end = copy + count * node_size;
+    if (ok) {
+        btree->header.next_offset = copy_end;
+        ok = btree->map == NULL || btree_map_grow(btree, copy_end);
+    }
+    for (int p = 0; p < count && ok; p++) {
+        int i = order[p];
+        btree_node_read2(btree, x, offsets[i]);
+        btree_node_copy(btree, y, x);
+        for (int j = firsts[i]; j < firsts[i + 1]; j++) {
+            y->children[j - firsts[i]] = copy + slots[j] * node_size;
+        }
+        y->offset = copy + p * node_size;
+        btree_node_write(btree, y);
+        btree_wal_commit_if_full(btree);
+    }
+    ok = ok && btree_reorganize_switch(btree, copy, copy_end);
+
+    // then back to the start of the file, in the same order, now that nothing there is in use
+    for (int p = 0; p < count && ok; p++) {
+        btree_node_read2(btree, x, copy + p * node_size);
+        btree_node_copy(btree, y, x);
+        for (int j = 0; !y->is_leaf && j <= y->count_keys; j++) {
+            y->children[j] = y->children[j] - copy + data_offset;
+        }
+        y->offset = data_offset + p * node_size;
+        btree_node_write(btree, y);
+        btree_wal_commit_if_full(btree);
+    }
+    ok = ok && btree_reorganize_switch(btree, data_offset, data_offset + count * node_size);
+    ok = ok && btree_vacuum_truncate(btree, btree->header.next_offset);
+
+    btree_node_destroy(x);
+    btree_node_destroy(y);
+    free(offsets);
+    free(firsts);
+    free(order);
+    free(slots);
+    btree_latch_release(btree);
+    return ok ? BTREE_OK : BTREE_ERROR_UNIX;
+}
+
+// Lists the nodes level by level into offsets. The children of node i are the nodes firsts[i] up to
+// firsts[i + 1], so the nodes any subtree has at one depth are always listed next to each other.
+bool btree_reorganize_shape(Btree *btree, size_t *offsets, int *firsts, Btree_Node *x) {
+    int count = btree->header.count_nodes;
+    int listed = 1;
+    offsets[0] = btree->root->offset;
+    for (int i = 0; i < listed; i++) {
+        firsts[i] = listed;
+        btree_node_read2(btree, x, offsets[i]);
+        for (int j = 0; !x->is_leaf && j <= x->count_keys; j++) {
+            if (listed == count) {
+                btree_log(btree, BTREE_LOG_ERROR, "More nodes than the header counts");
+                return false;
+            }
+            offsets[listed++] = x->children[j];
+        }
+    }
+    firsts[listed] = listed;
+    if (listed != count) {
+        btree_log(btree, BTREE_LOG_ERROR, "Fewer nodes than the header counts");
+        return false;
+    }
+    return true;
+}
+
+// Appends to order the subtree of height levels under node: its top half recursively, then each subtree
+// hanging below that half, left to right.
+void btree_reorganize_veb(const int *firsts, int node, int height, int *order, int *count) {
+    if (height == 1) {
+        order[(*count)++] = node;
+        return;
+    }
+
+    int top = height / 2;
+    btree_reorganize_veb(firsts, node, top, order, count);
+    int low = node, high = node;
+    for (int d = 0; d < top; d++) {
+        low = firsts[low];
+        high = firsts[high + 1] - 1;
+    }
+    for (int child = low; child <= high; child++) {
+        btree_reorganize_veb(firsts, child, height - top, order, count);
+    }
+}
+
+// Points the tree at the copy rooted at root_offset. Without a WAL the copy is made durable first, so the
+// header never names nodes that are not on disk yet; with one, the whole switch is a single record.
+bool btree_reorganize_switch(Btree *btree, size_t root_offset, size_t next_offset) {
+    if (btree->wal == NULL && btree->fd != -1) {
+        if (!btree_cache_flush(btree) ||
+            (btree->map != NULL && msync(btree->map, btree->file_size, MS_SYNC) == -1) ||
+            fdatasync(btree->fd) == -1) {
+            btree_log(btree, BTREE_LOG_ERROR, "Failed to sync copy: %s", btree_strerr(BTREE_ERROR_UNIX));
+            return false;
+        }
+    }
+
+    // nothing before the copy is in use any more, and the slots behind it are dropped by the truncate
+    btree_free_space_destroy(btree);
+    btree->header.next_free_offset = 0;
+    btree->header.next_offset = next_offset;
+    btree->header.root_offset = root_offset;
+    btree_header_write(btree);
+    btree_node_read2(btree, btree->root, root_offset);
+    return btree_commit(btree, BTREE_OK) == BTREE_OK;
+}
+
+// Gives the space from end on back: the log is checkpointed so no replay writes there again, cached nodes
+// there are forgotten, and the file, or the pages of an in-memory tree, shrink to end.
+bool btree_vacuum_truncate(Btree *btree, size_t end) {
+    if (!btree_wal_checkpoint(btree) || !btree_cache_flush(btree)) {
+        return false;
+    }
+    btree_cache_drop(btree, end);
+
+    if (btree->map != NULL) {
+        size_t size = __atomic_load_n(&btree->file_size, __ATOMIC_ACQUIRE);
+        size_t page = (size_t)sysconf(_SC_PAGESIZE);
+        size_t from = (end + page - 1) & ~(page - 1);
+        if (btree->fd == -1 && size > from) {
+            madvise(btree->map + from, size - from, MADV_DONTNEED);
+        }
+        __atomic_store_n(&btree->file_size, end, __ATOMIC_RELEASE);
+    }
+    if (btree->fd != -1 && ftruncate(btree->fd, end) == -1) {
+        btree_log(btree, BTREE_LOG_ERROR, "Failed to truncate: %s", btree_strerr(BTREE_ERROR_UNIX));
+        return false;
+    }
+    return true;
+}
+
+void btree_node_destroy(Btree_Node *node) {
+    if (node != NULL) {
+        free(node->image);
+    }
+    free(node);
+}
+
+// x comes latched and is released as soon as its child on the way is latched. The nodes below x are read
+// into a path, so the descent allocates nothing.
+Btree_Result btree_node_find(const Btree *btree, Btree_Node *x, int key, int *value) {
+    Btree_Path *path = btree_path_take(btree);
+    if (path == NULL) {
+        btree_node_unlatch(btree, x->offset);
+        return BTREE_ERROR_UNIX;
+    }
+    Btree_Result res = BTREE_ERROR_KEY_NOT_FOUND;
+
+    for (int depth = 0;; depth++) {
+        int i = btree_search_lower(x->keys, x->count_keys, key);
+
+        if (i < x->count_keys && key == x->keys[i]) {
+            if (value) {
+                *value = x->values[i];
+            }
+            res = BTREE_OK;
+            break;
+        }
+
+        if (x->is_leaf) {
+            break;
+        }
+
+        Btree_Node *x_ci = btree_path_node(btree, &path->nodes[depth]);
+        if (x_ci == NULL) {
+            res = BTREE_ERROR_UNIX;
+            break;
+        }
+        btree_node_latch(btree, x->children[i], false);
+        btree_node_read2(btree, x_ci, x->children[i]);
+        btree_node_unlatch(btree, x->offset);
+        x = x_ci;
+    }
+
+    // recorded before the node that settled it is released, so puts beside it are traced in the order it saw
+    btree_trace_record(btree, BTREE_TRACE_FIND, key, 0);
+    btree_node_unlatch(btree, x->offset);
+    btree_path_give(btree, path);
+    return res;
+}
+
+size_t btree_pop_free_offset(Btree *btree) {
+    // a slot handed out here may be written before the header, which must not claim it is still free
+    btree_header_touch(btree);
+    Btree_Free_Space *free_space = &btree->free_space;
+    if (free_space->count == 0) {
+        btree_count(&btree->counters.appends, 1);
+        size_t offset = btree->header.next_offset;
+        btree->header.next_offset += btree_node_size_in_file(btree);
+        if (btree->map != NULL) {
+            btree_map_grow(btree, btree->header.next_offset);
+        }
+        return offset;
+    }
+
+    btree_count(&btree->counters.free_pops, 1);
+    size_t offset = free_space->stack[--free_space->count];
+    btree_free_space_mark(btree, offset, false);
+    btree->header.next_free_offset = free_space->count > 0 ? free_space->stack[free_space->count - 1] : 0;
+    return offset;
+}
+
+// Nodes that can still be allocated and are not promised to a running put. Only an in-memory tree runs out,
+// once its mapping is used up; callers hold the header latch or the tree exclusively.
+size_t btree_room(const Btree *btree) {
+    if (btree->fd != -1 || btree->map == NULL) {
+        return SIZE_MAX;
+    }
+
+    size_t end = btree->header.next_offset < btree->map_size ? btree->header.next_offset : btree->map_size;
+    size_t room = btree->free_space.count + (btree->map_size - end) / btree_node_size_in_file(btree);
+    return room > btree->reserved ? room - btree->reserved : 0;
+}
+
+bool btree_has_room(const Btree *btree, size_t count) {
+    if (btree_room(btree) >= count) {
+        return true;
+    }
+
+    errno = ENOMEM;
+    btree_log(btree, BTREE_LOG_ERROR, "In-memory tree is full: %s", btree_strerr(BTREE_ERROR_UNIX));
+    return false;
+}
+
+// Nodes one put may allocate: a split on every level and a new root, and with snapshots open a copy of every
+// node on the way down. A tree of height h has more than t^(h-2) nodes, which bounds the height.
+size_t btree_put_need(const Btree *btree) {
+    size_t height = 2;
+    for (size_t n = btree->header.t; n <= (size_t)btree->header.count_nodes; n *= btree->header.t) {
+        height++;
+    }
+    return btree->snapshots != NULL ? 2 * (height + 1) : height + 1;
+}
+
+// Sets aside room for one put, so puts running side by side cannot together overrun an in-memory tree.
+// Returns the count to hand back to btree_unreserve, 0 with errno set when the tree is full.
+size_t btree_reserve(Btree *btree) {
+    if (btree->header_latch != NULL) {
+        pthread_mutex_lock(btree->header_latch);
+    }
+    size_t need = btree_put_need(btree);
+    bool ok = btree_has_room(btree, need);
+    if (ok && btree->fd == -1 && btree->map != NULL) {
+        btree->reserved += need;
+    }
+    if (btree->header_latch != NULL) {
+        pthread_mutex_unlock(btree->header_latch);
+    }
+    return ok ? need : 0;
+}
+
+void btree_unreserve(Btree *btree, size_t count) {
+    if (btree->fd != -1 || btree->map == NULL) {
+        return;
+    }
+
+    if (btree->header_latch != NULL) {
+        pthread_mutex_lock(btree->header_latch);
+    }
+    btree->reserved -= count;
+    if (btree->header_latch != NULL) {
+        pthread_mutex_unlock(btree->header_latch);
+    }
+}
+
+Btree_Node *btree_append_node(Btree *btree) {
+    Btree_Node *node = btree_node_init(btree);
+    if (node == NULL) {
+        return NULL;
+    }
+
+    btree_node_append(btree, node);
+    return node;
+}
+
+// Turns the buffer node into a new empty leaf at a fresh offset.
+void btree_node_append(Btree *btree, Btree_Node *node) {
+    btree_node_clear(btree, node);
+    if (btree->header_latch != NULL) {
+        pthread_mutex_lock(btree->header_latch);
+    }
+    node->offset = btree_pop_free_offset(btree);
+    btree->header.count_nodes++;
+    if (btree->header_latch != NULL) {
+        pthread_mutex_unlock(btree->header_latch);
+    }
+
+    node->is_leaf = 1;
+    node->generation = btree->header.generation;
+    btree_node_write(btree, node);
+}
+
+// Moves the upper half of the full child y of x into the buffer z, which becomes a new node.
+void btree_node_split_child(Btree *btree, Btree_Node *x, Btree_Node *y, Btree_Node *z, int i) {
+    btree_count(&btree->counters.splits, 1);
+    btree_node_append(btree, z);
+    int t = btree->header.t;
+
+    z->is_leaf = y->is_leaf;
+    z->count_keys = t - 1;
+    memcpy(z->keys, y->keys + t, (t - 1) * sizeof(*z->keys));
+    memcpy(z->values, y->values + t, (t - 1) * sizeof(*z->values));
+    if (!y->is_leaf) {
+        memcpy(z->children, y->children + t, t * sizeof(*z->children));
+    }
+
+    y->count_keys = t - 1;
+    memmove(x->children + i + 1, x->children + i, (x->count_keys - i + 1) * sizeof(*x->children));
+    x->children[i + 1] = z->offset;
+    memmove(x->keys + i + 1, x->keys + i, (x->count_keys - i) * sizeof(*x->keys));
+    memmove(x->values + i + 1, x->values + i, (x->count_keys - i) * sizeof(*x->values));
+    x->keys[i] = y->keys[t - 1];
+    x->values[i] = y->values[t - 1];
+    x->count_keys++;
+    memset(y->keys + y->count_keys, 0, t * sizeof(*y->keys));
+    memset(y->values + y->count_keys, 0, t * sizeof(*y->values));
+    if (!y->is_leaf) {
+        memset(y->children + y->count_keys + 1, 0, t * sizeof(*y->children));
+    }
+
+    btree_node_dirty(x, i, x->count_keys);
+    btree_node_dirty(y, t - 1, 2 * t - 1);
+    btree_node_write(btree, x);
+    btree_node_write(btree, y);
+    btree_node_write(btree, z);
+    btree_header_write(btree);
+}
+
+// x comes latched exclusively. Since it is not full, nothing below can make it change once its child on the
+// way has been split, so it is released as soon as that child is latched.
+Btree_Result btree_node_put_nonfull(Btree *btree, Btree_Node *x, int key, int value) {
+    Btree_Path *path = btree_path_take(btree);
+    if (path == NULL) {
+        btree_node_unlatch(btree, x->offset);
+        return BTREE_ERROR_UNIX;
+    }
+
+    for (int depth = 0; !x->is_leaf; depth++) {
+        int i = btree_search_upper(x->keys, x->count_keys, key);
+        Btree_Node *x_ci = btree_path_node(btree, &path->nodes[depth]);
+        if (x_ci == NULL) {
+            // the splits made on the way down leave the tree whole
+            btree_node_unlatch(btree, x->offset);
+            btree_path_give(btree, path);
+            return BTREE_ERROR_UNIX;
+        }
+        size_t latched = x->children[i];
+        btree_node_latch(btree, latched, true);
+        btree_node_read_child(btree, x, i, x_ci);
+        if (x_ci->offset != latched) {
+            btree_node_latch(btree, x_ci->offset, true);
+            btree_node_unlatch(btree, latched);
+        }
+
+        if (x_ci->count_keys == btree->header.M - 1) {
+            Btree_Node *z = btree_path_node(btree, &path->spares[0]);
+            btree_node_split_child(btree, x, x_ci, z, i);
+
+            // the new right half is only reachable through x, so nobody else can hold it yet
+            if (key > x->keys[i]) {
+                btree_node_latch(btree, z->offset, true);
+                btree_node_unlatch(btree, x_ci->offset);
+                path->spares[0] = x_ci;
+                path->nodes[depth] = z;
+                x_ci = z;
+            }
+        }
+
+        btree_node_unlatch(btree, x->offset);
+        x = x_ci;
+    }
+
+    int i = btree_search_upper(x->keys, x->count_keys, key);
+    memmove(x->keys + i + 1, x->keys + i, (x->count_keys - i) * sizeof(*x->keys));
+    memmove(x->values + i + 1, x->values + i, (x->count_keys - i) * sizeof(*x->values));
+    x->keys[i] = key;
+    x->values[i] = value;
+    x->count_keys++;
+    btree_node_dirty(x, i, x->count_keys);
+    btree_node_write(btree, x);
+    btree_trace_record(btree, BTREE_TRACE_PUT, key, value);
+    btree_node_unlatch(btree, x->offset);
+    btree_path_give(btree, path);
+    return BTREE_OK;
+}
+
+// Walks down from node with every child on the way holding at least t keys before it is entered. The child
+// is read into the path buffer of its level and its siblings into the spares; when a merge empties the root,
+// the merged child becomes the root and the old root's buffer takes its place in the path.
+Btree_Result btree_node_delete(Btree *btree, Btree_Node *node, int key) {
+    int t = btree->header.t;
+    Btree_Path *path = btree_path_take(btree);
+    if (path == NULL) {
+        return BTREE_ERROR_UNIX;
+    }
+    Btree_Result res = BTREE_ERROR_KEY_NOT_FOUND;
+
+    for (int depth = 0;; depth++) {
+        Btree_Node **slot = &path->nodes[depth];
+        Btree_Node **left = &path->spares[0];
+        Btree_Node **right = &path->spares[1];
+        Btree_Node *root = btree->root;
+        int i = btree_search_lower(node->keys, node->count_keys, key);
+
+        if (i < node->count_keys && key == node->keys[i]) {
+            if (node->is_leaf) {
+                btree_node_remove_key(btree, node, i);
+                res = BTREE_OK;
+                break;
+            }
+
+            Btree_Node *y = btree_path_node(btree, slot);
+            if (y == NULL) {
+                res = BTREE_ERROR_UNIX;
+                break;
+            }
+            btree_node_read_child(btree, node, i, y);
+
+            if (y->count_keys >= t) {
+                Item pred = btree_node_get_pred(btree, node, i, btree_path_node(btree, right));
+                node->keys[i] = pred.key;
+                node->values[i] = pred.value;
+                btree_node_dirty(node, i, i + 1);
+                btree_node_write(btree, node);
+                node = y;
+                key = pred.key;
+                continue;
+            }
+
+            Btree_Node *z = btree_path_node(btree, left);
+            btree_node_read_child(btree, node, i + 1, z);
+
+            if (z->count_keys >= t) {
+                Item post = btree_node_get_post(btree, node, i, btree_path_node(btree, right));
+                node->keys[i] = post.key;
+                node->values[i] = post.value;
+                btree_node_dirty(node, i, i + 1);
+                btree_node_write(btree, node);
+                *left = y;
+                *slot = z;
+                node = z;
+                key = post.key;
+                continue;
+            }
+
+            btree_node_merge(btree, node, y, z, i);
+            if (btree->root != root) {
+                *slot = root;
+            }
+            node = y;
+            continue;
+        }
+
+        if (node->is_leaf) {
+            break;
+        }
+
+        Btree_Node *x_ci = btree_path_node(btree, slot);
+        if (x_ci == NULL) {
+            res = BTREE_ERROR_UNIX;
+            break;
+        }
+        btree_node_read_child(btree, node, i, x_ci);
+
+        if (x_ci->count_keys > t - 1) {
+            node = x_ci;
+            continue;
+        }
+
+        Btree_Node *sibbling_left = NULL, *sibbling_right = NULL;
+        if (i > 0) {
+            sibbling_left = btree_path_node(btree, left);
+            btree_node_read_child(btree, node, i - 1, sibbling_left);
+        }
+
+        if (i < node->count_keys) {
+            sibbling_right = btree_path_node(btree, right);
+            btree_node_read_child(btree, node, i + 1, sibbling_right);
+        }
+
+        if (!btree_node_redistribute(btree, node, x_ci, sibbling_left, sibbling_right, i)) {
+            x_ci = btree_node_concatenate(btree, node, x_ci, sibbling_left, sibbling_right, i);
+            if (x_ci == sibbling_left) {
+                *left = *slot;
+                *slot = x_ci;
+            }
+            if (btree->root != root) {
+                *slot = root;
+            }
+        }
+        node = x_ci;
+    }
+
+    btree_path_give(btree, path);
+    return res;
+}
+
+// Deletes without preparing the path: a key in a leaf is taken out in place, and a key in an inner node is
+// replaced by its predecessor, taken out of the leaf below. A leaf left with fewer than t - 1 keys is noted
+// for btree_compact. When the leaf holds only delete_min_keys, nothing is changed and rebalance is set, for
+// the delete to be done the eager way.
+Btree_Result btree_node_delete_lazy(Btree *btree, Btree_Node *node, int key, bool *rebalance) {
+    Btree_Path *path = btree_path_take(btree);
+    if (path == NULL) {
+        *rebalance = false;
+        return BTREE_ERROR_UNIX;
+    }
+    Btree_Result res = BTREE_ERROR_KEY_NOT_FOUND;
+
+    for (int depth = 0;; depth++) {
+        int i = btree_search_lower(node->keys, node->count_keys, key);
+        bool found = i < node->count_keys && key == node->keys[i];
+        if (!found && node->is_leaf) {
+            break;
+        }
+        if (!found) {
+            Btree_Node *x_ci = btree_path_node(btree, &path->nodes[depth]);
+            if (x_ci == NULL) {
+                res = BTREE_ERROR_UNIX;
+                break;
+            }
+            btree_node_read_child(btree, node, i, x_ci);
+            node = x_ci;
+            continue;
+        }
+
+        Btree_Node *leaf = node;
+        for (int j = i; leaf != NULL && !leaf->is_leaf; depth++) {
+            Btree_Node *child = btree_path_node(btree, &path->nodes[depth]);
+            if (child != NULL) {
+                btree_node_read_child(btree, leaf, j, child);
+                j = child->count_keys;
+            }
+            leaf = child;
+        }
+        if (leaf == NULL) {
+            res = BTREE_ERROR_UNIX;
+            break;
+        }
+        if (leaf != btree->root && leaf->count_keys <= btree->delete_min_keys) {
+            *rebalance = true;
+            break;
+        }
+
+        int j = leaf == node ? i : leaf->count_keys - 1;
+        if (leaf != node) {
+            node->keys[i] = leaf->keys[j];
+            node->values[i] = leaf->values[j];
+            btree_node_dirty(node, i, i + 1);
+            btree_node_write(btree, node);
+        }
+        btree_node_remove_key(btree, leaf, j);
+        if (leaf != btree->root && leaf->count_keys == btree->header.t - 2) {
+            btree_compact_note(btree, leaf->keys[0]);
+        }
+        res = BTREE_OK;
+        break;
+    }
+
+    btree_path_give(btree, path);
+    return res;
+}
+
+void btree_node_remove_key(const Btree *btree, Btree_Node *node, int i) {
+    memmove(node->keys + i, node->keys + i + 1, (node->count_keys - i - 1) * sizeof(*node->keys));
+    memmove(node->values + i, node->values + i + 1, (node->count_keys - i - 1) * sizeof(*node->values));
+    node->count_keys--;
+    node->keys[node->count_keys] = 0;
+    node->values[node->count_keys] = 0;
+    btree_node_dirty(node, i, node->count_keys + 1);
+    btree_node_write(btree, node);
+}
+
+Item btree_node_get_pred(const Btree *btree, const Btree_Node *node, int i, Btree_Node *pred) {
+    btree_node_read2(btree, pred, node->children[i]);
+
+    while (!pred->is_leaf) {
+        btree_node_read2(btree, pred, pred->children[pred->count_keys]);
+    }
+
+    return (Item){pred->keys[pred->count_keys - 1], pred->values[pred->count_keys - 1]};
+}
+
+Item btree_node_get_post(const Btree *btree, const Btree_Node *node, int i, Btree_Node *post) {
+    btree_node_read2(btree, post, node->children[i + 1]);
+
+    while (!post->is_leaf) {
+        btree_node_read2(btree, post, post->children[0]);
+    }
+
+    return (Item){post->keys[0], post->values[0]};
+}
+
+void btree_remove_node(Btree *btree, Btree_Node *x) {
+    btree_header_touch(btree);
+    x->count_keys = 0;
+    x->is_leaf = 0;
+    memset(x->keys, 0, (btree->header.M - 1) * sizeof(*x->keys));
+    memset(x->values, 0, (btree->header.M - 1) * sizeof(*x->values));
+    memset(x->children, 0, btree->header.M * sizeof(*x->children));
+    btree_node_write(btree, x);
+    btree->header.count_nodes--;
+    // a slot that cannot be noted is kept off the list on disk too, and never used again
+    if (!btree_free_space_push(btree, x->offset)) {
+        return;
+    }
+    btree_free_link_write(btree, x->offset, btree->header.next_free_offset);
+    btree->header.next_free_offset = x->offset;
+}
+
+// Moves x's key i and all of z into y. Besides the siblings of t - 1 keys a delete merges, it takes the
+// underfull ones lazy deletes leave, as long as the two fit one node.
+void btree_node_merge(Btree *btree, Btree_Node *x, Btree_Node *y, Btree_Node *z, int i) {
+    btree_count(&btree->counters.merges, 1);
+    int from = y->count_keys;
+    y->keys[y->count_keys] = x->keys[i];
+    y->values[y->count_keys] = x->values[i];
+    y->count_keys++;
+    memmove(x->keys + i, x->keys + i + 1, (x->count_keys - i - 1) * sizeof(*x->keys));
+    memmove(x->values + i, x->values + i + 1, (x->count_keys - i - 1) * sizeof(*x->values));
+    memmove(x->children + i + 1, x->children + i + 2, (x->count_keys - i - 1) * sizeof(*x->children));
+    x->children[x->count_keys] = 0;
+    x->count_keys--;
+    memcpy(y->keys + y->count_keys, z->keys, z->count_keys * sizeof(*y->keys));
+    memcpy(y->values + y->count_keys, z->values, z->count_keys * sizeof(*y->values));
+    if (!y->is_leaf) {
+        memcpy(y->children + y->count_keys, z->children, (z->count_keys + 1) * sizeof(*y->children));
+    }
+
+    y->count_keys += z->count_keys;
+    btree_node_dirty(x, i, x->count_keys + 1);
+    btree_node_dirty(y, from, y->count_keys);
+    btree_node_write(btree, x);
+
+    if (btree->root == x && x->count_keys == 0) {
+        btree_remove_node(btree, x);
+        btree_set_root(btree, y);
+    }
+
+    btree_remove_node(btree, z);
+    btree_node_write(btree, y);
+    btree_header_write(btree);
+}
+
+bool btree_node_redistribute(const Btree *btree, Btree_Node *x, Btree_Node *x_ci, Btree_Node *sibbling_left,
+                             Btree_Node *sibbling_right, int i) {
+    int t = btree->header.t;
+
+    if (sibbling_left && sibbling_left->count_keys >= t) {
+        btree_node_rotate_right(btree, x, sibbling_left, x_ci, i - 1);
+        return true;
+    }
+
+    if (sibbling_right && sibbling_right->count_keys >= t) {
         btree_node_rotate_left(btree, x, x_ci, sibbling_right, i);
         return true;
     }
@@ -464,257 +2504,3945 @@ bool btree_node_redistribute(const Btree *btree, Btree_Node *x, Btree_Node *x_ci
     return false;
 }
 
-Btree_Node *btree_node_concatenate(Btree *btree, Btree_Node *x, Btree_Node *x_ci, Btree_Node *sibbling_left,
-                                   Btree_Node *sibbling_right, int i) {
-    if (sibbling_left) {
-        btree_node_merge(btree, x, sibbling_left, x_ci, i - 1);
+Btree_Node *btree_node_concatenate(Btree *btree, Btree_Node *x, Btree_Node *x_ci, Btree_Node *sibbling_left,
+                                   Btree_Node *sibbling_right, int i) {
+    if (sibbling_left) {
+        btree_node_merge(btree, x, sibbling_left, x_ci, i - 1);
+        return sibbling_left;
+    }
+
+    btree_node_merge(btree, x, x_ci, sibbling_right, i);
+    return x_ci;
+}
+
+void btree_node_rotate_left(const Btree *btree, Btree_Node *x, Btree_Node *y, Btree_Node *z, int i) {
+    btree_count(&btree->counters.rotations, 1);
+    y->keys[y->count_keys] = x->keys[i];
+    y->values[y->count_keys] = x->values[i];
+    if (!y->is_leaf) {
+        y->children[y->count_keys + 1] = z->children[0];
+    }
+    y->count_keys++;
+
+    x->keys[i] = z->keys[0];
+    x->values[i] = z->values[0];
+
+    memmove(z->keys, z->keys + 1, (z->count_keys - 1) * sizeof(*z->keys));
+    memmove(z->values, z->values + 1, (z->count_keys - 1) * sizeof(*z->values));
+    if (!z->is_leaf) {
+        memmove(z->children, z->children + 1, z->count_keys * sizeof(*z->children));
+    }
+    z->count_keys--;
+    z->keys[z->count_keys] = 0;
+    z->values[z->count_keys] = 0;
+    if (!z->is_leaf) {
+        z->children[z->count_keys + 1] = 0;
+    }
+
+    btree_node_dirty(x, i, i + 1);
+    btree_node_dirty(y, y->count_keys - 1, y->count_keys);
+    btree_node_write(btree, x);
+    btree_node_write(btree, y);
+    btree_node_write(btree, z);
+}
+
+void btree_node_rotate_right(const Btree *btree, Btree_Node *x, Btree_Node *y, Btree_Node *z, int i) {
+    btree_count(&btree->counters.rotations, 1);
+    memmove(z->keys + 1, z->keys, z->count_keys * sizeof(*z->keys));
+    memmove(z->values + 1, z->values, z->count_keys * sizeof(*z->values));
+    if (!z->is_leaf) {
+        memmove(z->children + 1, z->children, (z->count_keys + 1) * sizeof(*z->children));
+    }
+    z->keys[0] = x->keys[i];
+    z->values[0] = x->values[i];
+    if (!z->is_leaf) {
+        z->children[0] = y->children[y->count_keys];
+    }
+    z->count_keys++;
+
+    x->keys[i] = y->keys[y->count_keys - 1];
+    x->values[i] = y->values[y->count_keys - 1];
+
+    y->count_keys--;
+    y->keys[y->count_keys] = 0;
+    y->values[y->count_keys] = 0;
+    if (!y->is_leaf) {
+        y->children[y->count_keys + 1] = 0;
+    }
+
+    btree_node_dirty(x, i, i + 1);
+    btree_node_dirty(y, y->count_keys, y->count_keys + 1);
+    btree_node_write(btree, x);
+    btree_node_write(btree, y);
+    btree_node_write(btree, z);
+}
+
+// Compacts the subtree of x, children before their parent: once compacted, each child is evened out with
+// its left sibling, so that a run of underfull children merges into one node after another. Returns false
+// when out of memory for the path, with the nodes compacted so far left as they are.
+bool btree_node_compact(Btree *btree, Btree_Node *x, Btree_Path *path, int depth) {
+    for (int i = 0; !x->is_leaf && i <= x->count_keys; i++) {
+        Btree_Node *root = btree->root;
+        Btree_Node *child = btree_path_node(btree, &path->nodes[depth]);
+        if (child == NULL) {
+            return false;
+        }
+        btree_node_read_child(btree, x, i, child);
+        if (!btree_node_compact(btree, child, path, depth + 1)) {
+            return false;
+        }
+        if (i == 0) {
+            continue;
+        }
+
+        Btree_Node *sibling = btree_path_node(btree, &path->spares[0]);
+        btree_node_read_child(btree, x, i - 1, sibling);
+        if (btree_node_compact_pair(btree, x, sibling, child, i)) {
+            i--;
+        }
+        if (btree->root != root) {
+            btree_path_replace(path, btree->root, root);
+        }
+    }
+    return true;
+}
+
+// Walks down to the leaf key leads to, then back up: an underfull node is mended with a sibling, and when
+// that took a key from its parent, the parent is looked at next. Returns false when out of memory for the
+// path, before anything is changed.
+bool btree_compact_path(Btree *btree, Btree_Path *path, int key) {
+    int index[BTREE_MAX_HEIGHT];
+    int height = 0;
+    for (Btree_Node *node = btree->root; !node->is_leaf; height++) {
+        index[height] = btree_search_lower(node->keys, node->count_keys, key);
+        Btree_Node *child = btree_path_node(btree, &path->nodes[height]);
+        if (child == NULL) {
+            return false;
+        }
+        btree_node_read_child(btree, node, index[height], child);
+        node = child;
+    }
+
+    for (int depth = height - 1; depth >= 0; depth--) {
+        Btree_Node *root = btree->root;
+        Btree_Node *parent = depth > 0 ? path->nodes[depth - 1] : root;
+        bool merged = btree_node_compact_child(btree, parent, &path->nodes[depth], &path->spares[0], index[depth]);
+        if (btree->root != root) {
+            btree_path_replace(path, btree->root, root);
+        }
+        if (!merged) {
+            break;
+        }
+    }
+    return true;
+}
+
+// Brings child i of x, held in slot, back to t - 1 keys with the help of a sibling, read into spare. Returns
+// true when a merge took keys from x.
+bool btree_node_compact_child(Btree *btree, Btree_Node *x, Btree_Node **slot, Btree_Node **spare, int i) {
+    bool merged = false;
+    while ((*slot)->count_keys < btree->header.t - 1 && x->count_keys > 0) {
+        Btree_Node *sibling = btree_path_node(btree, spare);
+        if (i > 0) {
+            btree_node_read_child(btree, x, i - 1, sibling);
+            if (!btree_node_compact_pair(btree, x, sibling, *slot, i)) {
+                break;
+            }
+            // the left sibling took the child in and stands in for it
+            *spare = *slot;
+            *slot = sibling;
+            i--;
+        } else {
+            btree_node_read_child(btree, x, i + 1, sibling);
+            if (!btree_node_compact_pair(btree, x, *slot, sibling, i + 1)) {
+                break;
+            }
+        }
+        merged = true;
+    }
+    return merged;
+}
+
+// Evens out y and z, children i - 1 and i of x, when either is underfull: z is merged into y if both fit one
+// node, otherwise keys rotate over from the fuller one. Returns true when they were merged.
+bool btree_node_compact_pair(Btree *btree, Btree_Node *x, Btree_Node *y, Btree_Node *z, int i) {
+    int t = btree->header.t;
+    if (y->count_keys >= t - 1 && z->count_keys >= t - 1) {
+        return false;
+    }
+    if (y->count_keys + z->count_keys < btree->header.M - 1) {
+        btree_node_merge(btree, x, y, z, i - 1);
+        return true;
+    }
+
+    while (y->count_keys < t - 1) {
+        btree_node_rotate_left(btree, x, y, z, i - 1);
+    }
+    while (z->count_keys < t - 1) {
+        btree_node_rotate_right(btree, x, y, z, i - 1);
+    }
+    return false;
+}
+
+// A merge that empties the root makes the merged child, held in a path buffer, the new root; the old root's
+// buffer takes the place of that one.
+void btree_path_replace(Btree_Path *path, Btree_Node *node, Btree_Node *by) {
+    for (int d = 0; d < BTREE_MAX_HEIGHT; d++) {
+        if (path->nodes[d] == node) {
+            path->nodes[d] = by;
+            return;
+        }
+    }
+    for (int i = 0; i < BTREE_PATH_SPARES; i++) {
+        if (path->spares[i] == node) {
+            path->spares[i] = by;
+            return;
+        }
+    }
+}
+
+bool btree_compact_init(Btree *btree, Btree_Options options) {
+    int t = btree->header.t;
+    btree->lazy_delete = options.lazy_delete;
+    btree->delete_min_keys = options.delete_min_keys > 0 ? options.delete_min_keys : 1;
+    btree->delete_min_keys = btree->delete_min_keys < t - 1 ? btree->delete_min_keys : t - 1;
+    if (!options.lazy_delete || !options.compact_background) {
+        return true;
+    }
+
+    Btree_Compactor *compactor = (Btree_Compactor *)calloc(1, sizeof(*compactor));
+    if (compactor == NULL) {
+        return false;
+    }
+    pthread_mutex_init(&compactor->mutex, NULL);
+    pthread_cond_init(&compactor->pending, NULL);
+    btree->compactor = compactor;
+    if (pthread_create(&compactor->thread, NULL, btree_compact_worker, btree) != 0) {
+        pthread_mutex_destroy(&compactor->mutex);
+        pthread_cond_destroy(&compactor->pending);
+        free(compactor);
+        btree->compactor = NULL;
+        return false;
+    }
+    return true;
+}
+
+// Takes note of a leaf a lazy delete left underfull, through a key that leads to it. Needs the tree
+// exclusively. The delete is done either way, so a leaf that cannot be noted is only left for a compaction
+// of the whole tree.
+void btree_compact_note(Btree *btree, int key) {
+    if (btree->count_underfull == btree->capacity_underfull) {
+        int capacity = btree->capacity_underfull ? 2 * btree->capacity_underfull : 64;
+        int *underfull = (int *)realloc(btree->underfull, capacity * sizeof(*underfull));
+        if (underfull == NULL) {
+            btree_log(btree, BTREE_LOG_WARN, "Failed to note underfull leaf: %s", btree_strerr(BTREE_ERROR_UNIX));
+            return;
+        }
+        btree->underfull = underfull;
+        btree->capacity_underfull = capacity;
+    }
+    btree->underfull[btree->count_underfull] = key;
+    __atomic_store_n(&btree->count_underfull, btree->count_underfull + 1, __ATOMIC_RELEASE);
+}
+
+void btree_compact_wake(const Btree *btree) {
+    Btree_Compactor *compactor = btree->compactor;
+    if (compactor == NULL || __atomic_load_n(&btree->count_underfull, __ATOMIC_ACQUIRE) < BTREE_COMPACT_BATCH) {
+        return;
+    }
+    pthread_mutex_lock(&compactor->mutex);
+    pthread_cond_signal(&compactor->pending);
+    pthread_mutex_unlock(&compactor->mutex);
+}
+
+void *btree_compact_worker(void *arg) {
+    Btree *btree = arg;
+    Btree_Compactor *compactor = btree->compactor;
+    pthread_mutex_lock(&compactor->mutex);
+    while (true) {
+        while (!compactor->stop &&
+               __atomic_load_n(&btree->count_underfull, __ATOMIC_ACQUIRE) < BTREE_COMPACT_BATCH) {
+            pthread_cond_wait(&compactor->pending, &compactor->mutex);
+        }
+        if (compactor->stop) {
+            break;
+        }
+        pthread_mutex_unlock(&compactor->mutex);
+
+        // a leaf at a time, so that other operations get the tree in between
+        while (__atomic_load_n(&btree->count_underfull, __ATOMIC_ACQUIRE) > 0 &&
+               !__atomic_load_n(&compactor->stop, __ATOMIC_ACQUIRE) && btree_compact(btree, 1) == BTREE_OK) {
+        }
+        pthread_mutex_lock(&compactor->mutex);
+    }
+    pthread_mutex_unlock(&compactor->mutex);
+    return NULL;
+}
+
+void btree_compact_destroy(Btree *btree) {
+    Btree_Compactor *compactor = btree->compactor;
+    if (compactor != NULL) {
+        pthread_mutex_lock(&compactor->mutex);
+        __atomic_store_n(&compactor->stop, true, __ATOMIC_RELEASE);
+        pthread_cond_signal(&compactor->pending);
+        pthread_mutex_unlock(&compactor->mutex);
+        pthread_join(compactor->thread, NULL);
+        pthread_mutex_destroy(&compactor->mutex);
+        pthread_cond_destroy(&compactor->pending);
+        free(compactor);
+        btree->compactor = NULL;
+    }
+    free(btree->underfull);
+    btree->underfull = NULL;
+}
+
+const char *btree_strerr(int err) {
+    switch (err) {
+    case BTREE_OK:
+        return "Ok";
+    case BTREE_ERROR_BAD_T:
+        return "Param t must be >= 2";
+    case BTREE_ERROR_KEY_NOT_FOUND:
+        return "Key not found";
+    case BTREE_ERROR_NIL:
+        return "Null pointer to struct";
+    case BTREE_ERROR_FORMAT:
+        return "Invalid file format";
+    case BTREE_ERROR_NOT_EMPTY:
+        return "Tree is not empty";
+    case BTREE_ERROR_UNSORTED:
+        return "Keys are not sorted";
+    case BTREE_ERROR_END:
+        return "No more keys";
+    case BTREE_ERROR_OPTIONS:
+        return "Incompatible options";
+    case BTREE_ERROR_TOO_LONG:
+        return "Key or value too long";
+    case BTREE_ERROR_BUSY:
+        return "Tree is busy";
+    case BTREE_ERROR_UNIX:
+        return strerror(errno); // fallback to errno
+    default:
+        return "Unknown";
+    }
+}
+
+void btree_header_read(Btree *btree, uint8_t *magic_bytes) {
+    int n = 2;
+    struct iovec vec[n];
+    vec[0].iov_base = magic_bytes;
+    vec[0].iov_len = sizeof(btree_magic_bytes);
+    vec[1].iov_base = &btree->header;
+    vec[1].iov_len = sizeof(btree->header);
+    ssize_t bytes_read = preadv(btree->fd, vec, n, 0);
+    btree_count_bytes(&btree->counters.bytes_read, bytes_read);
+    if (bytes_read == -1) {
+        btree_log(btree, BTREE_LOG_ERROR, "Failed to read header: %s", btree_strerr(BTREE_ERROR_UNIX));
+    }
+}
+
+// With a WAL the header travels in every log record and only reaches the file at checkpoints.
+void btree_header_write(Btree *btree) {
+    if (btree->wal != NULL) {
+        return;
+    }
+
+    if (btree->header_latch != NULL) {
+        pthread_mutex_lock(btree->header_latch);
+    }
+    if (btree->lazy_header) {
+        btree->header_pending++;
+        btree_header_touch(btree);
+    } else {
+        btree_header_flush(btree);
+    }
+    if (btree->header_latch != NULL) {
+        pthread_mutex_unlock(btree->header_latch);
+    }
+}
+
+// A lazy header is written only to mark the file dirty, before the first change after a checkpoint, and to
+// follow the root: recovery walks the tree from the root on disk, so that one must always be right.
+void btree_header_touch(Btree *btree) {
+    if (!btree->lazy_header || (!btree->header_clean && btree->header_root == btree->header.root_offset)) {
+        return;
+    }
+    btree->header_clean = false;
+    btree->header_root = btree->header.root_offset;
+    btree_header_flush(btree);
+}
+
+// Brings the file up to date with the tree and marks its header clean. Needs the tree exclusively.
+bool btree_header_checkpoint(Btree *btree) {
+    if (!btree_cache_flush(btree)) {
+        return false;
+    }
+    btree->header_clean = true;
+    btree->header_root = btree->header.root_offset;
+    btree->header_pending = 0;
+    btree_header_flush(btree);
+    return true;
+}
+
+// Checkpoints once header_interval header changes are waiting. Needs the tree exclusively.
+bool btree_header_checkpoint_due(Btree *btree) {
+    if (btree->header_interval == 0 || btree->header_pending < btree->header_interval) {
+        return true;
+    }
+    return btree_header_checkpoint(btree);
+}
+
+// Rebuilds a header left dirty by a tree that was not closed. The root it names is always current, so the
+// nodes reachable from it are the whole tree and every other slot before the last of them is free, nodes a
+// snapshot kept alive included.
+Btree_Result btree_header_recover(Btree *btree) {
+    struct stat st;
+    if (fstat(btree->fd, &st) == -1) {
+        return BTREE_ERROR_UNIX;
+    }
+    size_t node_size = btree_node_size_in_file(btree);
+    size_t data_offset = btree_data_offset(btree);
+    // a packed node at the end of the file may stop short of its slot
+    size_t count_slots = (size_t)st.st_size > data_offset ? (st.st_size - data_offset + node_size - 1) / node_size : 0;
+    size_t root_slot = (btree->header.root_offset - data_offset) / node_size;
+    if (btree->header.root_offset < data_offset || (btree->header.root_offset - data_offset) % node_size != 0 ||
+        root_slot >= count_slots) {
+        btree_log(btree, BTREE_LOG_ERROR, "Dirty header names no root");
+        return BTREE_ERROR_FORMAT;
+    }
+
+    Btree_Queue queue;
+    uint8_t *seen = (uint8_t *)calloc(count_slots, sizeof(*seen));
+    Btree_Node *node = btree_node_init(btree);
+    if (seen == NULL || node == NULL || !btree_queue_init(&queue, count_slots)) {
+        free(seen);
+        btree_node_destroy(node);
+        return BTREE_ERROR_UNIX;
+    }
+
+    Btree_Result res = BTREE_OK;
+    int count_nodes = 0;
+    size_t end = data_offset;
+    uint32_t generation = btree->header.generation;
+    seen[root_slot] = 1;
+    btree_queue_enqueue(&queue, btree->header.root_offset);
+    while (queue.count > 0 && res == BTREE_OK) {
+        size_t offset = btree_queue_dequeue(&queue);
+        btree_node_read2(btree, node, offset);
+        count_nodes++;
+        end = offset + node_size > end ? offset + node_size : end;
+        generation = node->generation > generation ? node->generation : generation;
+        if (node->count_keys < 0 || node->count_keys > btree->header.M - 1) {
+            res = BTREE_ERROR_FORMAT;
+        }
+
+        for (int i = 0; !node->is_leaf && i <= node->count_keys && res == BTREE_OK; i++) {
+            size_t child = node->children[i];
+            size_t slot = (child - data_offset) / node_size;
+            if (child < data_offset || (child - data_offset) % node_size != 0 || slot >= count_slots || seen[slot]) {
+                res = BTREE_ERROR_FORMAT;
+                break;
+            }
+            seen[slot] = 1;
+            btree_queue_enqueue(&queue, child);
+        }
+    }
+    btree_node_destroy(node);
+    btree_queue_destroy(&queue);
+    if (res != BTREE_OK) {
+        free(seen);
+        btree_log(btree, BTREE_LOG_ERROR, "Dirty header over a broken tree");
+        return res;
+    }
+
+    // linked from the top down, so the list hands out the lowest slot first
+    size_t next_free_offset = 0;
+    int count_free = 0;
+    for (size_t slot = (end - data_offset) / node_size; slot-- > 0;) {
+        if (!seen[slot]) {
+            size_t offset = data_offset + slot * node_size;
+            btree_free_link_write(btree, offset, next_free_offset);
+            next_free_offset = offset;
+            count_free++;
+        }
+    }
+    free(seen);
+
+    btree->header.count_nodes = count_nodes;
+    btree->header.next_offset = end;
+    btree->header.next_free_offset = next_free_offset;
+    btree->header.generation = generation;
+    if (!btree_header_checkpoint(btree)) {
+        return BTREE_ERROR_UNIX;
+    }
+    btree_log(btree, BTREE_LOG_INFO, "Recovered header: %d nodes, %d free slots", count_nodes, count_free);
+    return BTREE_OK;
+}
+
+void btree_header_flush(const Btree *btree) {
+    if (btree->fd == -1) {
+        return;
+    }
+
+    uint8_t header[sizeof(btree_magic_bytes) + sizeof(btree->header)];
+    size_t size = btree_header_image(btree, header);
+    uint8_t *data = header;
+    if (btree->direct) {
+        // the header has the first page to itself, so writing all of it clobbers nothing
+        size = btree->header.page_size;
+        data = btree_image_alloc(btree, size);
+        if (data == NULL) {
+            btree_log(btree, BTREE_LOG_ERROR, "Failed to write header: %s", btree_strerr(BTREE_ERROR_UNIX));
+            return;
+        }
+        memset(data, 0, size);
+        memcpy(data, header, sizeof(header));
+    }
+
+    struct iovec vec = {.iov_base = data, .iov_len = size};
+    if (btree_write_vec(btree, &vec, 1, 0) == -1) {
+        btree_log(btree, BTREE_LOG_ERROR, "Failed to write header: %s", btree_strerr(BTREE_ERROR_UNIX));
+    }
+    if (data != header) {
+        free(data);
+    }
+}
+
+// Lays out the magic and header as they sit at the start of the file. Trees without a page size keep the
+// layout from before it existed, ending right before the field. Returns the bytes used.
+size_t btree_header_image(const Btree *btree, uint8_t *data) {
+    bool paged = btree->header.page_size != 0;
+    size_t size = paged ? sizeof(btree->header) : offsetof(Btree_Header, page_size);
+    if (btree->lazy_header && !btree->header_clean) {
+        memcpy(data, paged ? btree_paged_dirty_magic_bytes : btree_dirty_magic_bytes, sizeof(btree_magic_bytes));
+    } else {
+        memcpy(data, paged ? btree_paged_magic_bytes : btree_magic_bytes, sizeof(btree_magic_bytes));
+    }
+    memcpy(data + sizeof(btree_magic_bytes), &btree->header, size);
+    return sizeof(btree_magic_bytes) + size;
+}
+
+// Offset of the first node slot, right after the header.
+size_t btree_data_offset(const Btree *btree) {
+    if (btree->header.page_size != 0) {
+        return btree->header.page_size;
+    }
+    return (sizeof(btree_magic_bytes) + offsetof(Btree_Header, page_size) + BTREE_NODE_HEADER_SIZE - 1) &
+           ~(size_t)(BTREE_NODE_HEADER_SIZE - 1);
+}
+
+// Follows the free list on disk once, when an existing tree opens.
+bool btree_free_space_init(Btree *btree) {
+    size_t count_slots = (btree->header.next_offset - btree_data_offset(btree)) / btree_node_size_in_file(btree);
+    size_t offset = btree->header.next_free_offset;
+    while (offset != 0 && btree->free_space.count < count_slots) {
+        if (!btree_free_space_push(btree, offset)) {
+            return false;
+        }
+        offset = btree_free_link_read(btree, offset);
+    }
+    if (offset != 0) {
+        btree_log(btree, BTREE_LOG_ERROR, "Free list longer than the file");
+        return false;
+    }
+
+    // the head of the list goes on top
+    Btree_Free_Space *free_space = &btree->free_space;
+    for (size_t i = 0; i < free_space->count / 2; i++) {
+        size_t other = free_space->stack[free_space->count - 1 - i];
+        free_space->stack[free_space->count - 1 - i] = free_space->stack[i];
+        free_space->stack[i] = other;
+    }
+    return true;
+}
+
+// Returns false when out of memory, with offset left out of both the stack and the bitmap.
+bool btree_free_space_push(Btree *btree, size_t offset) {
+    Btree_Free_Space *free_space = &btree->free_space;
+    if (free_space->count == free_space->capacity) {
+        size_t capacity = free_space->capacity ? 2 * free_space->capacity : 64;
+        size_t *stack = (size_t *)realloc(free_space->stack, capacity * sizeof(*stack));
+        if (stack == NULL) {
+            btree_log(btree, BTREE_LOG_ERROR, "Failed to grow free space: %s", btree_strerr(BTREE_ERROR_UNIX));
+            return false;
+        }
+        free_space->stack = stack;
+        free_space->capacity = capacity;
+    }
+    if (!btree_free_space_mark(btree, offset, true)) {
+        return false;
+    }
+    free_space->stack[free_space->count++] = offset;
+    return true;
+}
+
+// Returns false when the bitmap could not grow to hold a freed slot. Slots past its end are taken, so taking
+// one never needs it to grow.
+bool btree_free_space_mark(Btree *btree, size_t offset, bool free) {
+    Btree_Free_Space *free_space = &btree->free_space;
+    size_t slot = (offset - btree_data_offset(btree)) / btree_node_size_in_file(btree);
+    size_t word = slot / 64;
+    if (word >= free_space->count_words && !free) {
+        return true;
+    }
+    if (word >= free_space->count_words) {
+        size_t count_words = 2 * free_space->count_words > word + 1 ? 2 * free_space->count_words : word + 1;
+        uint64_t *bits = (uint64_t *)realloc(free_space->bits, count_words * sizeof(*bits));
+        if (bits == NULL) {
+            btree_log(btree, BTREE_LOG_ERROR, "Failed to grow free space: %s", btree_strerr(BTREE_ERROR_UNIX));
+            return false;
+        }
+        memset(bits + free_space->count_words, 0, (count_words - free_space->count_words) * sizeof(*bits));
+        free_space->bits = bits;
+        free_space->count_words = count_words;
+    }
+
+    if (free) {
+        free_space->bits[word] |= (uint64_t)1 << (slot % 64);
+    } else {
+        free_space->bits[word] &= ~((uint64_t)1 << (slot % 64));
+    }
+    return true;
+}
+
+bool btree_free_space_has(const Btree *btree, size_t offset) {
+    const Btree_Free_Space *free_space = &btree->free_space;
+    size_t slot = (offset - btree_data_offset(btree)) / btree_node_size_in_file(btree);
+    return slot / 64 < free_space->count_words && (free_space->bits[slot / 64] >> (slot % 64) & 1) != 0;
+}
+
+// Rebuilds the stack and the list on disk from the bitmap, keeping only the slots before end. The lowest
+// slots end up on top, so they are taken first.
+void btree_free_space_relink(Btree *btree, size_t end) {
+    Btree_Free_Space *free_space = &btree->free_space;
+    size_t node_size = btree_node_size_in_file(btree);
+    size_t data_offset = btree_data_offset(btree);
+    size_t count_slots = (end - data_offset) / node_size;
+    free_space->count = 0;
+    btree->header.next_free_offset = 0;
+
+    for (size_t slot = count_slots; slot-- > 0;) {
+        size_t offset = data_offset + slot * node_size;
+        if (btree_free_space_has(btree, offset) && btree_free_space_push(btree, offset)) {
+            btree_free_link_write(btree, offset, btree->header.next_free_offset);
+            btree->header.next_free_offset = offset;
+        }
+    }
+
+    size_t first_word = (count_slots + 63) / 64;
+    if (count_slots % 64 != 0 && first_word <= free_space->count_words) {
+        free_space->bits[count_slots / 64] &= ((uint64_t)1 << (count_slots % 64)) - 1;
+    }
+    if (first_word < free_space->count_words) {
+        memset(free_space->bits + first_word, 0, (free_space->count_words - first_word) * sizeof(*free_space->bits));
+    }
+}
+
+void btree_free_space_destroy(Btree *btree) {
+    free(btree->free_space.stack);
+    free(btree->free_space.bits);
+    memset(&btree->free_space, 0, sizeof(btree->free_space));
+}
+
+Btree_Result btree_display(const Btree *btree, FILE *fp) {
+    if (btree == NULL) {
+        return BTREE_ERROR_NIL;
+    }
+
+    btree_latch_scan(btree);
+    Btree_Result res = btree_display_levels(btree, fp);
+    btree_latch_release(btree);
+    return res;
+}
+
+Btree_Result btree_display_levels(const Btree *btree, FILE *fp) {
+    size_t last_level_offset = btree->root->offset;
+    Btree_Queue queue;
+    if (!btree_queue_init(&queue, btree->header.count_nodes)) {
+        btree_log(btree, BTREE_LOG_ERROR, "Error to init offset queue");
+        return BTREE_ERROR_UNIX;
+    }
+    btree_queue_enqueue(&queue, btree->root->offset);
+    Btree_Node *node = btree_node_init(btree);
+
+    while (queue.count > 0) {
+        size_t offset = btree_queue_dequeue(&queue);
+        btree_node_read2(btree, node, offset);
+
+        fprintf(fp, "[ ");
+        for (int i = 0; i < node->count_keys; i++) {
+            fprintf(fp, "%d ", node->keys[i]);
+        }
+        fprintf(fp, "] ");
+
+        if (offset == last_level_offset) {
+            last_level_offset = node->children[node->count_keys];
+            fprintf(fp, "\n");
+        }
+
+        if (!node->is_leaf) {
+            for (int i = 0; i <= node->count_keys; i++) {
+                btree_queue_enqueue(&queue, node->children[i]);
+            }
+        }
+    }
+
+    btree_node_destroy(node);
+    btree_queue_destroy(&queue);
+    return BTREE_OK;
+}
+
+Btree_Node *btree_node_init(const Btree *btree) {
+    size_t node_size = sizeof(*btree->root);
+    size_t keys_size = (btree->header.M - 1) * sizeof(*btree->root->keys);
+    size_t values_size = (btree->header.M - 1) * sizeof(*btree->root->values);
+    size_t children_size = (btree->header.M) * sizeof(*btree->root->children);
+    Btree_Node *node = (Btree_Node *)calloc(1, node_size + keys_size + values_size + children_size);
+    if (node == NULL) {
+        return NULL;
+    }
+    btree_node_own(btree, node);
+    return node;
+}
+
+// Points the node arrays back at the storage allocated right after the struct by btree_node_init.
+void btree_node_own(const Btree *btree, Btree_Node *node) {
+    size_t keys_size = (btree->header.M - 1) * sizeof(*node->keys);
+    uint8_t *storage = (uint8_t *)node + sizeof(*node);
+    node->keys = (int *)storage;
+    node->values = (int *)(storage + keys_size);
+    node->children = (size_t *)(storage + 2 * keys_size);
+}
+
+void btree_node_read2(const Btree *btree, Btree_Node *node, size_t offset) {
+    btree_node_read_at(btree, node, offset, true);
+}
+
+// Reads the node at offset. Only the latched writer settles its staged writes first; a snapshot reader runs
+// beside it unlatched, and the versions a snapshot sees were all written before it was taken.
+void btree_node_read_at(const Btree *btree, Btree_Node *node, size_t offset, bool settle) {
+    btree_count(&btree->counters.node_reads, 1);
+    node->offset = offset;
+    node->dirty_from = node->dirty_to = 0;
+    if (btree->map != NULL) {
+        uint8_t *data = btree_map_node(btree, offset);
+        if (data != NULL && !btree_node_is_packed(data)) {
+            btree_node_view(btree, node, data);
+            return;
+        }
+        btree_node_own(btree, node);
+        if (data != NULL) {
+            btree_node_unpack(btree, node, data);
+            node->is_leaf = node->children[0] == 0;
+            return;
+        }
+    }
+
+    Btree_Frame *frame = btree_cache_pin(btree, offset, true);
+    if (frame != NULL) {
+        btree_node_unpack(btree, node, frame->data);
+        btree_cache_unpin(btree, frame, false);
+        node->is_leaf = node->children[0] == 0;
+        return;
+    }
+
+    if (settle) {
+        btree_writes_settle(btree, offset, btree_node_size_in_file(btree));
+    }
+    if ((btree->compress_leaves || btree->direct) && btree_node_read_image(btree, node, offset, settle)) {
+        return;
+    }
+
+    int head[BTREE_NODE_HEADER_SIZE / sizeof(int)];
+    int n = 4;
+    struct iovec vec[n];
+    vec[0].iov_base = head;
+    vec[0].iov_len = BTREE_NODE_HEADER_SIZE;
+    vec[1].iov_base = node->keys;
+    vec[1].iov_len = (btree->header.M - 1) * sizeof(*node->keys);
+    vec[2].iov_base = node->values;
+    vec[2].iov_len = (btree->header.M - 1) * sizeof(*node->values);
+    vec[3].iov_base = node->children;
+    vec[3].iov_len = (btree->header.M) * sizeof(*node->children);
+    ssize_t bytes_read = preadv(btree->fd, vec, n, offset);
+    btree_count_bytes(&btree->counters.bytes_read, bytes_read);
+    if (bytes_read == -1) {
+        btree_log(btree, BTREE_LOG_ERROR, "Failed to read node: %s", btree_strerr(BTREE_ERROR_UNIX));
+    }
+    node->count_keys = head[0];
+    node->generation = head[1];
+    node->is_leaf = node->children[0] == 0;
+    if (!(node->count_keys & BTREE_NODE_PACKED)) {
+        return;
+    }
+
+    // a packed leaf written by a tree with compress_leaves: the arrays hold its image, decoded from a copy
+    uint8_t *data = btree_node_image(btree, node);
+    if (data == NULL) {
+        btree_log(btree, BTREE_LOG_ERROR, "Failed to decode packed leaf: %s", btree_strerr(BTREE_ERROR_UNIX));
+        return;
+    }
+    for (int p = 0, at = 0; p < n; at += vec[p].iov_len, p++) {
+        memcpy(data + at, vec[p].iov_base, vec[p].iov_len);
+    }
+    btree_node_unpack(btree, node, data);
+    node->is_leaf = true;
+    node->dirty_to = -1;
+}
+
+// The image buffer of node, allocated on its first whole-image read. NULL when no memory is left.
+uint8_t *btree_node_image(const Btree *btree, Btree_Node *node) {
+    if (node->image == NULL) {
+        node->image = btree_image_alloc(btree, btree_node_size_in_file(btree));
+    }
+    return node->image;
+}
+
+// Reads the whole node image at once, for leaves that may be packed. Returns false when no buffer is left.
+bool btree_node_read_image(const Btree *btree, Btree_Node *node, size_t offset, bool settle) {
+    size_t node_size = btree_node_size_in_file(btree);
+    uint8_t *data = btree_node_image(btree, node);
+    if (data == NULL) {
+        return false;
+    }
+
+    if (settle) {
+        btree_writes_settle(btree, offset, node_size);
+    }
+    ssize_t bytes_read = pread(btree->fd, data, node_size, offset);
+    btree_count_bytes(&btree->counters.bytes_read, bytes_read);
+    if (bytes_read == -1) {
+        btree_log(btree, BTREE_LOG_ERROR, "Failed to read node: %s", btree_strerr(BTREE_ERROR_UNIX));
+    }
+    btree_node_unpack(btree, node, data);
+    node->is_leaf = node->children[0] == 0;
+    if (btree_node_is_packed(data)) {
+        node->dirty_to = -1;
+    }
+    return true;
+}
+
+void btree_node_write(const Btree *btree, Btree_Node *node) {
+    btree_count(&btree->counters.node_writes, 1);
+    int dirty_from = node->dirty_from, dirty_to = node->dirty_to;
+    node->dirty_from = node->dirty_to = 0;
+    if (btree->map != NULL) {
+        uint8_t *data = btree_map_node(btree, node->offset);
+        if (data != NULL && (uint8_t *)node->keys == data + BTREE_NODE_HEADER_SIZE) {
+            memcpy(data, &node->count_keys, sizeof(node->count_keys));
+            memcpy(data + sizeof(node->count_keys), &btree->header.generation, sizeof(btree->header.generation));
+            return;
+        }
+        if (data != NULL) {
+            btree_node_pack(btree, node, data);
+            return;
+        }
+    }
+
+    Btree_Frame *frame = btree_cache_pin(btree, node->offset, false);
+    // with a WAL a node never reaches the file around the log: when every frame holds changes of the running
+    // operation, logging them so far frees them for eviction, and a node that still finds no frame is lost
+    if (frame == NULL && btree->wal != NULL) {
+        btree_wal_lock(btree->wal);
+        bool logged = btree_wal_record(btree);
+        btree_wal_unlock(btree->wal);
+        frame = logged ? btree_cache_pin(btree, node->offset, false) : NULL;
+        if (frame == NULL) {
+            btree->wal->broken = true;
+            btree_log(btree, BTREE_LOG_ERROR, "Failed to log node, failing every later commit");
+            return;
+        }
+    }
+    if (frame != NULL) {
+        btree_node_pack(btree, node, frame->data);
+        // a leaf image may be packed, so with compressed leaves the log takes whole nodes
+        if (btree->wal != NULL && btree->compress_leaves) {
+            btree_wal_mark(frame, node, 0, 0);
+        } else if (btree->wal != NULL) {
+            btree_wal_mark(frame, node, dirty_from, dirty_to);
+        }
+        btree_cache_unpin(btree, frame, true);
+        return;
+    }
+
+    size_t node_size = btree_node_size_in_file(btree);
+    uint8_t *data = (btree->compress_leaves && node->is_leaf) || btree->direct ? btree_image_alloc(btree, node_size)
+                                                                                : NULL;
+    if (data != NULL) {
+        if (btree->direct) {
+            memset(data, 0, node_size);
+        }
+        btree_node_pack(btree, node, data);
+        struct iovec vec = {.iov_base = data, .iov_len = btree_node_io_size(btree, data)};
+        if (btree_write_vec(btree, &vec, 1, node->offset) == -1) {
+            btree_log(btree, BTREE_LOG_ERROR, "Failed to write node: %s", btree_strerr(BTREE_ERROR_UNIX));
+        }
+        free(data);
+        return;
+    }
+
+    // only the plain layout is known to match the node outside its dirty slots: with compressed leaves the
+    // slot may hold a packed image, and with a cache the node may have been read from a frame not written back
+    if (btree->compress_leaves || btree->cache != NULL || dirty_to <= dirty_from) {
+        dirty_from = dirty_to = 0;
+    }
+
+    int head[BTREE_NODE_HEADER_SIZE / sizeof(int)] = {node->count_keys, btree->header.generation};
+    const uint8_t *parts[] = {(const uint8_t *)head, (const uint8_t *)node->keys, (const uint8_t *)node->values,
+                              (const uint8_t *)node->children};
+    size_t spans[4][2];
+    int count_spans = btree_node_spans(btree, node->is_leaf, dirty_from, dirty_to, spans);
+    for (int s = 0; s < count_spans; s++) {
+        // the image of the node is cut into the four arrays, so a span takes one buffer from each it crosses
+        struct iovec vec[4];
+        int n = 0;
+        size_t part_start = 0;
+        for (int p = 0; p < 4; p++) {
+            size_t part_end = part_start + btree_node_part_size(btree, p);
+            size_t from = spans[s][0] > part_start ? spans[s][0] : part_start;
+            size_t to = spans[s][1] < part_end ? spans[s][1] : part_end;
+            if (from < to) {
+                vec[n].iov_base = (void *)(parts[p] + from - part_start);
+                vec[n].iov_len = to - from;
+                n++;
+            }
+            part_start = part_end;
+        }
+        if (btree_write_vec(btree, vec, n, node->offset + spans[s][0]) == -1) {
+            btree_log(btree, BTREE_LOG_ERROR, "Failed to write node: %s", btree_strerr(BTREE_ERROR_UNIX));
+        }
+    }
+}
+
+// Byte size of part p of a node image: the head, then the keys, the values and the children.
+size_t btree_node_part_size(const Btree *btree, int p) {
+    int M = btree->header.M;
+    size_t sizes[] = {BTREE_NODE_HEADER_SIZE, (M - 1) * sizeof(int), (M - 1) * sizeof(int), M * sizeof(size_t)};
+    return sizes[p];
+}
+
+// Lays out the byte ranges of the node image a write must cover: all of it when no slots are marked dirty,
+// else the head and the dirty slots of each array, children one past them, joined where the gap between two
+// is at most BTREE_WRITE_GAP. Returns how many ranges were stored.
+int btree_node_spans(const Btree *btree, bool is_leaf, int from, int to, size_t spans[][2]) {
+    size_t keys_at = BTREE_NODE_HEADER_SIZE;
+    size_t values_at = keys_at + btree_node_part_size(btree, 1);
+    size_t children_at = values_at + btree_node_part_size(btree, 2);
+    size_t end = children_at + btree_node_part_size(btree, 3);
+    if (from == to) {
+        spans[0][0] = 0;
+        spans[0][1] = end;
+        return 1;
+    }
+
+    size_t ranges[4][2] = {
+        {0, BTREE_NODE_HEADER_SIZE},
+        {keys_at + from * sizeof(int), keys_at + to * sizeof(int)},
+        {values_at + from * sizeof(int), values_at + to * sizeof(int)},
+        {children_at + from * sizeof(size_t), children_at + (to + 1) * sizeof(size_t)},
+    };
+    int count = 0;
+    for (int r = 0; r < (is_leaf ? 3 : 4); r++) {
+        if (count > 0 && ranges[r][0] <= spans[count - 1][1] + BTREE_WRITE_GAP) {
+            spans[count - 1][1] = ranges[r][1];
+            continue;
+        }
+        spans[count][0] = ranges[r][0];
+        spans[count][1] = ranges[r][1];
+        count++;
+    }
+    return count;
+}
+
+// Widens the slots the next write of node covers to take in [from, to).
+void btree_node_dirty(Btree_Node *node, int from, int to) {
+    if (node->dirty_to < 0) {
+        return;
+    }
+    if (node->dirty_from != node->dirty_to) {
+        from = from < node->dirty_from ? from : node->dirty_from;
+        to = to > node->dirty_to ? to : node->dirty_to;
+    }
+    node->dirty_from = from;
+    node->dirty_to = to;
+}
+
+bool btree_writes_init(Btree *btree) {
+    if (btree->fd == -1 || btree->map != NULL || btree->cache != NULL || btree->direct) {
+        return true;
+    }
+
+    btree->writes = (Btree_Writes *)calloc(1, sizeof(*btree->writes));
+    return btree->writes != NULL;
+}
+
+// Holds back the writes of the operation that has just taken the tree exclusively.
+void btree_writes_begin(const Btree *btree) {
+    if (btree->writes != NULL) {
+        btree->writes->active = true;
+    }
+}
+
+// Sends what the operation held back. Called before it releases the tree.
+bool btree_writes_end(const Btree *btree) {
+    if (btree->writes == NULL || !btree->writes->active) {
+        return true;
+    }
+
+    bool ok = btree_writes_flush(btree);
+    btree->writes->active = false;
+    return ok;
+}
+
+// Writes the buffers to the tree file at offset, or stages a copy of them while an operation holds writes
+// back. Returns the bytes written or staged, or -1.
+ssize_t btree_write_vec(const Btree *btree, const struct iovec *vec, int n, size_t offset) {
+    Btree_Writes *writes = btree->writes;
+    size_t size = 0;
+    for (int i = 0; i < n; i++) {
+        size += vec[i].iov_len;
+    }
+
+    if (writes != NULL && writes->active && writes->count_buffer + size > BTREE_WRITES_BUFFER_SIZE &&
+        !btree_writes_flush(btree)) {
+        return -1;
+    }
+    if (writes != NULL && writes->active && writes->count == writes->capacity) {
+        int capacity = writes->capacity > 0 ? 2 * writes->capacity : 16;
+        Btree_Write *ranges = (Btree_Write *)realloc(writes->ranges, capacity * sizeof(*ranges));
+        if (ranges != NULL) {
+            writes->ranges = ranges;
+            writes->capacity = capacity;
+        }
+    }
+    if (writes != NULL && writes->active && writes->count_buffer + size > writes->capacity_buffer) {
+        size_t capacity = writes->capacity_buffer > 0 ? writes->capacity_buffer : 1 << 12;
+        while (capacity < writes->count_buffer + size) {
+            capacity *= 2;
+        }
+        uint8_t *buffer = (uint8_t *)realloc(writes->buffer, capacity);
+        if (buffer != NULL) {
+            writes->buffer = buffer;
+            writes->capacity_buffer = capacity;
+        }
+    }
+
+    if (writes != NULL && writes->active && writes->count < writes->capacity &&
+        writes->count_buffer + size <= writes->capacity_buffer) {
+        Btree_Write *write = &writes->ranges[writes->count];
+        *write = (Btree_Write){.offset = offset, .size = size, .data = writes->count_buffer, .seq = writes->count};
+        for (int i = 0; i < n; i++) {
+            memcpy(writes->buffer + writes->count_buffer, vec[i].iov_base, vec[i].iov_len);
+            writes->count_buffer += vec[i].iov_len;
+        }
+        writes->count++;
+        return size;
+    }
+
+    // with no room to stage it, the write goes out now, after the ones before it
+    if (writes != NULL && !btree_writes_flush(btree)) {
+        return -1;
+    }
+    ssize_t bytes_written = pwritev(btree->fd, vec, n, offset);
+    btree_count_bytes(&btree->counters.bytes_written, bytes_written);
+    btree_count(&btree->counters.file_writes, 1);
+    return bytes_written;
+}
+
+// Sends the staged writes, one call per run of them that covers a contiguous range of the file.
+bool btree_writes_flush(const Btree *btree) {
+    Btree_Writes *writes = btree->writes;
+    if (writes == NULL || writes->count == 0) {
+        return true;
+    }
+
+    qsort(writes->ranges, writes->count, sizeof(*writes->ranges), btree_write_cmp);
+    bool ok = true;
+    for (int a = 0, b; a < writes->count; a = b) {
+        size_t start = writes->ranges[a].offset;
+        size_t end = start + writes->ranges[a].size;
+        bool overlap = false;
+        for (b = a + 1; b < writes->count && writes->ranges[b].offset <= end; b++) {
+            overlap |= writes->ranges[b].offset < end;
+            size_t range_end = writes->ranges[b].offset + writes->ranges[b].size;
+            end = range_end > end ? range_end : end;
+        }
+        ok &= btree_writes_run(btree, writes->ranges + a, b - a, start, end, overlap);
+    }
+
+    writes->count = 0;
+    writes->count_buffer = 0;
+    return ok;
+}
+
+// Writes ranges that together cover [start, end) of the file in one call. Overlapping ones are first laid
+// over each other in the order they were staged.
+bool btree_writes_run(const Btree *btree, Btree_Write *ranges, int count, size_t start, size_t end, bool overlap) {
+    Btree_Writes *writes = btree->writes;
+    ssize_t bytes_written = -1;
+    if (!overlap && count <= IOV_MAX) {
+        struct iovec vec[count];
+        for (int i = 0; i < count; i++) {
+            vec[i].iov_base = writes->buffer + ranges[i].data;
+            vec[i].iov_len = ranges[i].size;
+        }
+        bytes_written = pwritev(btree->fd, vec, count, start);
+    } else {
+        qsort(ranges, count, sizeof(*ranges), btree_write_seq_cmp);
+        uint8_t *data = (uint8_t *)malloc(end - start);
+        for (int i = 0; i < count && data != NULL; i++) {
+            memcpy(data + ranges[i].offset - start, writes->buffer + ranges[i].data, ranges[i].size);
+        }
+        bytes_written = data != NULL ? pwrite(btree->fd, data, end - start, start) : -1;
+        free(data);
+    }
+
+    btree_count_bytes(&btree->counters.bytes_written, bytes_written);
+    btree_count(&btree->counters.file_writes, 1);
+    if (bytes_written == -1) {
+        btree_log(btree, BTREE_LOG_ERROR, "Failed to write nodes: %s", btree_strerr(BTREE_ERROR_UNIX));
+        return false;
+    }
+    return true;
+}
+
+int btree_write_cmp(const void *a, const void *b) {
+    const Btree_Write *x = a;
+    const Btree_Write *y = b;
+    if (x->offset != y->offset) {
+        return x->offset < y->offset ? -1 : 1;
+    }
+    return x->seq - y->seq;
+}
+
+int btree_write_seq_cmp(const void *a, const void *b) {
+    return ((const Btree_Write *)a)->seq - ((const Btree_Write *)b)->seq;
+}
+
+// Sends the staged writes first when one of them falls in [offset, offset + size), so a read sees it.
+void btree_writes_settle(const Btree *btree, size_t offset, size_t size) {
+    Btree_Writes *writes = btree->writes;
+    if (writes == NULL) {
+        return;
+    }
+
+    for (int i = 0; i < writes->count; i++) {
+        if (writes->ranges[i].offset < offset + size && offset < writes->ranges[i].offset + writes->ranges[i].size) {
+            btree_writes_flush(btree);
+            return;
+        }
+    }
+}
+
+void btree_writes_destroy(Btree *btree) {
+    if (btree->writes == NULL) {
+        return;
+    }
+
+    free(btree->writes->ranges);
+    free(btree->writes->buffer);
+    free(btree->writes);
+    btree->writes = NULL;
+}
+
+int btree_count_less_scalar(const int *keys, int n, int key) {
+    int count = 0;
+    for (int i = 0; i < n; i++) {
+        count += keys[i] < key;
+    }
+    return count;
+}
+
+#ifdef BTREE_SEARCH_X86
+int btree_count_less_sse2(const int *keys, int n, int key) {
+    __m128i needle = _mm_set1_epi32(key);
+    int count = 0;
+    int i = 0;
+    for (; i + 4 <= n; i += 4) {
+        __m128i lt = _mm_cmplt_epi32(_mm_loadu_si128((const __m128i *)(keys + i)), needle);
+        count += __builtin_popcount(_mm_movemask_ps(_mm_castsi128_ps(lt)));
+    }
+    return count + btree_count_less_scalar(keys + i, n - i, key);
+}
+
+__attribute__((target("avx2,popcnt"))) int btree_count_less_avx2(const int *keys, int n, int key) {
+    __m256i needle = _mm256_set1_epi32(key);
+    int count = 0;
+    int i = 0;
+    for (; i + 8 <= n; i += 8) {
+        __m256i lt = _mm256_cmpgt_epi32(needle, _mm256_loadu_si256((const __m256i *)(keys + i)));
+        count += __builtin_popcount(_mm256_movemask_ps(_mm256_castsi256_ps(lt)));
+    }
+    return count + btree_count_less_scalar(keys + i, n - i, key);
+}
+#endif
+
+int (*btree_count_less)(const int *keys, int n, int key) = btree_count_less_scalar;
+
+// Trees may open on several threads at once while others search, so the kernel is picked only once.
+pthread_once_t btree_search_once = PTHREAD_ONCE_INIT;
+
+void btree_search_select(void) {
+#ifdef BTREE_SEARCH_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        btree_count_less = btree_count_less_avx2;
+    } else {
+        btree_count_less = btree_count_less_sse2;
+    }
+#endif
+}
+
+// Index of the first key >= key: bisect down to a small window, then count it with the selected kernel.
+int btree_search_lower(const int *keys, int n, int key) {
+    int lo = 0;
+    while (n > BTREE_SEARCH_WINDOW) {
+        int half = n / 2;
+        if (keys[lo + half] < key) {
+            lo += half + 1;
+            n -= half + 1;
+        } else {
+            n = half;
+        }
+    }
+    return lo + btree_count_less(keys + lo, n, key);
+}
+
+// Index of the first key > key.
+int btree_search_upper(const int *keys, int n, int key) {
+    return key == INT_MAX ? n : btree_search_lower(keys, n, key + 1);
+}
+
+// In-memory trees keep their nodes in an anonymous mapping laid out like the file, so node offsets index
+// straight into it.
+bool btree_storage_init(Btree *btree, Btree_Options options) {
+    if (options.backend == BTREE_BACKEND_MMAP || options.path == NULL) {
+        return btree_map_init(btree, options.map_size ? options.map_size : BTREE_DEFAULT_MAP_SIZE);
+    }
+    return btree_cache_init(btree, options.cache_size);
+}
+
+// Points the node arrays into a node image instead of copying it.
+void btree_node_view(const Btree *btree, Btree_Node *node, uint8_t *data) {
+    size_t keys_size = (btree->header.M - 1) * sizeof(*node->keys);
+    memcpy(&node->count_keys, data, sizeof(node->count_keys));
+    memcpy(&node->generation, data + sizeof(node->count_keys), sizeof(node->generation));
+    data += BTREE_NODE_HEADER_SIZE;
+    node->keys = (int *)data;
+    node->values = (int *)(data + keys_size);
+    node->children = (size_t *)(data + 2 * keys_size);
+    node->is_leaf = node->children[0] == 0;
+}
+
+void btree_node_pack(const Btree *btree, const Btree_Node *node, uint8_t *data) {
+    if (btree->compress_leaves && node->is_leaf && node->count_keys > 0) {
+        int n = node->count_keys;
+        int value_base = node->values[0];
+        int value_max = node->values[0];
+        for (int i = 1; i < n; i++) {
+            value_base = node->values[i] < value_base ? node->values[i] : value_base;
+            value_max = node->values[i] > value_max ? node->values[i] : value_max;
+        }
+        int key_bits = btree_bits_width((uint32_t)node->keys[n - 1] - (uint32_t)node->keys[0]);
+        int value_bits = btree_bits_width((uint32_t)value_max - (uint32_t)value_base);
+
+        int count = n | BTREE_NODE_PACKED;
+        memcpy(data, &count, sizeof(count));
+        memcpy(data + sizeof(count), &btree->header.generation, sizeof(btree->header.generation));
+        uint8_t *head = data + BTREE_NODE_HEADER_SIZE;
+        memset(head, 0, BTREE_PACKED_HEADER_SIZE);
+        memcpy(head, &node->keys[0], sizeof(int));
+        memcpy(head + sizeof(int), &value_base, sizeof(int));
+        head[2 * sizeof(int)] = key_bits;
+        head[2 * sizeof(int) + 1] = value_bits;
+
+        uint8_t *keys = head + BTREE_PACKED_HEADER_SIZE;
+        uint8_t *values = keys + ((size_t)n * key_bits + 7) / 8;
+        memset(keys, 0, btree_node_image_size(btree, data) - BTREE_NODE_HEADER_SIZE - BTREE_PACKED_HEADER_SIZE);
+        for (int i = 0; i < n; i++) {
+            btree_bits_put(keys, (size_t)i * key_bits, (uint32_t)node->keys[i] - (uint32_t)node->keys[0]);
+            btree_bits_put(values, (size_t)i * value_bits, (uint32_t)node->values[i] - (uint32_t)value_base);
+        }
+        return;
+    }
+
+    size_t keys_size = (btree->header.M - 1) * sizeof(*node->keys);
+    memcpy(data, &node->count_keys, sizeof(node->count_keys));
+    memcpy(data + sizeof(node->count_keys), &btree->header.generation, sizeof(btree->header.generation));
+    data += BTREE_NODE_HEADER_SIZE;
+    memcpy(data, node->keys, keys_size);
+    data += keys_size;
+    memcpy(data, node->values, keys_size);
+    data += keys_size;
+    memcpy(data, node->children, btree->header.M * sizeof(*node->children));
+}
+
+void btree_node_unpack(const Btree *btree, Btree_Node *node, const uint8_t *data) {
+    size_t keys_size = (btree->header.M - 1) * sizeof(*node->keys);
+    memcpy(&node->count_keys, data, sizeof(node->count_keys));
+    memcpy(&node->generation, data + sizeof(node->count_keys), sizeof(node->generation));
+    data += BTREE_NODE_HEADER_SIZE;
+    if (node->count_keys & BTREE_NODE_PACKED) {
+        node->count_keys &= ~BTREE_NODE_PACKED;
+        int n = node->count_keys;
+        uint32_t key_base, value_base;
+        memcpy(&key_base, data, sizeof(key_base));
+        memcpy(&value_base, data + sizeof(int), sizeof(value_base));
+        int key_bits = data[2 * sizeof(int)];
+        int value_bits = data[2 * sizeof(int) + 1];
+
+        const uint8_t *keys = data + BTREE_PACKED_HEADER_SIZE;
+        const uint8_t *values = keys + ((size_t)n * key_bits + 7) / 8;
+        for (int i = 0; i < n; i++) {
+            node->keys[i] = (int)(key_base + btree_bits_get(keys, (size_t)i * key_bits, key_bits));
+        }
+        for (int i = 0; i < n; i++) {
+            node->values[i] = (int)(value_base + btree_bits_get(values, (size_t)i * value_bits, value_bits));
+        }
+        memset(node->children, 0, btree->header.M * sizeof(*node->children));
+        return;
+    }
+
+    memcpy(node->keys, data, keys_size);
+    data += keys_size;
+    memcpy(node->values, data, keys_size);
+    data += keys_size;
+    memcpy(node->children, data, btree->header.M * sizeof(*node->children));
+}
+
+// Bytes of the node image that hold data: all of it for plain nodes, the used prefix for packed leaves.
+size_t btree_node_image_size(const Btree *btree, const uint8_t *data) {
+    size_t node_size = btree_node_size_in_file(btree);
+    if (!btree_node_is_packed(data)) {
+        return node_size;
+    }
+
+    int count;
+    memcpy(&count, data, sizeof(count));
+    size_t n = count & ~BTREE_NODE_PACKED;
+    const uint8_t *head = data + BTREE_NODE_HEADER_SIZE;
+    size_t size = BTREE_NODE_HEADER_SIZE + BTREE_PACKED_HEADER_SIZE + (n * head[2 * sizeof(int)] + 7) / 8 +
+                  (n * head[2 * sizeof(int) + 1] + 7) / 8 + sizeof(uint64_t);
+    return size < node_size ? size : node_size;
+}
+
+bool btree_node_is_packed(const uint8_t *data) {
+    int count;
+    memcpy(&count, data, sizeof(count));
+    return (count & BTREE_NODE_PACKED) != 0;
+}
+
+// Views a plain image in place, or decodes a packed one into scratch.
+const Btree_Node *btree_node_decode(const Btree *btree, Btree_Node *scratch, uint8_t *data) {
+    if (!btree_node_is_packed(data)) {
+        btree_node_view(btree, scratch, data);
+        return scratch;
+    }
+
+    btree_node_own(btree, scratch);
+    btree_node_unpack(btree, scratch, data);
+    scratch->is_leaf = true;
+    return scratch;
+}
+
+// ORs value into the bits from bit on, which must still be zero. The word written may reach 7 bytes past them.
+void btree_bits_put(uint8_t *data, size_t bit, uint32_t value) {
+    uint64_t word;
+    memcpy(&word, data + (bit >> 3), sizeof(word));
+    word |= (uint64_t)value << (bit & 7);
+    memcpy(data + (bit >> 3), &word, sizeof(word));
+}
+
+uint32_t btree_bits_get(const uint8_t *data, size_t bit, int bits) {
+    uint64_t word;
+    memcpy(&word, data + (bit >> 3), sizeof(word));
+    return (uint32_t)((word >> (bit & 7)) & (((uint64_t)1 << bits) - 1));
+}
+
+// Bits needed to store every offset up to range.
+int btree_bits_width(uint32_t range) {
+    return range == 0 ? 0 : 32 - __builtin_clz(range);
+}
+
+size_t btree_free_link_read(const Btree *btree, size_t offset) {
+    size_t next = 0;
+    uint8_t *data = btree->map != NULL ? btree_map_node(btree, offset) : NULL;
+    if (data != NULL) {
+        memcpy(&next, data, sizeof(next));
+        return next;
+    }
+
+    Btree_Frame *frame = btree_cache_pin(btree, offset, true);
+    if (frame != NULL) {
+        memcpy(&next, frame->data, sizeof(next));
+        btree_cache_unpin(btree, frame, false);
+        return next;
+    }
+
+    size_t size = btree->direct ? btree_node_size_in_file(btree) : sizeof(next);
+    data = btree->direct ? btree_image_alloc(btree, size) : (uint8_t *)&next;
+    ssize_t bytes_read = data != NULL ? pread(btree->fd, data, size, offset) : -1;
+    btree_count_bytes(&btree->counters.bytes_read, bytes_read);
+    if (bytes_read == -1) {
+        btree_log(btree, BTREE_LOG_ERROR, "Failed to read freeded offset: %s", btree_strerr(BTREE_ERROR_UNIX));
+    }
+    if (btree->direct && data != NULL) {
+        memcpy(&next, data, sizeof(next));
+        free(data);
+    }
+    return next;
+}
+
+void btree_free_link_write(const Btree *btree, size_t offset, size_t next) {
+    uint8_t *data = btree->map != NULL ? btree_map_node(btree, offset) : NULL;
+    if (data != NULL) {
+        memcpy(data, &next, sizeof(next));
+        return;
+    }
+
+    Btree_Frame *frame = btree_cache_pin(btree, offset, true);
+    if (frame != NULL) {
+        memcpy(frame->data, &next, sizeof(next));
+        btree_cache_unpin(btree, frame, true);
+        return;
+    }
+
+    // a freed node holds nothing but the link, so direct writes may zero the rest of it
+    size_t size = btree->direct ? btree_node_size_in_file(btree) : sizeof(next);
+    data = btree->direct ? btree_image_alloc(btree, size) : (uint8_t *)&next;
+    if (btree->direct && data != NULL) {
+        memset(data, 0, size);
+        memcpy(data, &next, sizeof(next));
+    }
+    struct iovec vec = {.iov_base = data, .iov_len = size};
+    if (data == NULL || btree_write_vec(btree, &vec, 1, offset) == -1) {
+        btree_log(btree, BTREE_LOG_ERROR, "Failed to write freeded offset: %s", btree_strerr(BTREE_ERROR_UNIX));
+    }
+    if (btree->direct && data != NULL) {
+        free(data);
+    }
+}
+
+void btree_set_root(Btree *btree, Btree_Node *node) {
+    btree->root = node;
+    btree->header.root_offset = node->offset;
+}
+
+bool btree_paths_init(Btree *btree) {
+    btree->paths = (Btree_Paths *)calloc(1, sizeof(*btree->paths));
+    return btree->paths != NULL;
+}
+
+// Hands out an idle path, or a new one when every path is in use by another thread. The spares are made
+// here, as they are only ever swapped with other buffers after that. Returns NULL when out of memory.
+Btree_Path *btree_path_take(const Btree *btree) {
+    Btree_Paths *paths = btree->paths;
+    if (paths->latch != NULL) {
+        pthread_mutex_lock(paths->latch);
+    }
+    Btree_Path *path = paths->idle;
+    if (path != NULL) {
+        paths->idle = path->next;
+    }
+    if (paths->latch != NULL) {
+        pthread_mutex_unlock(paths->latch);
+    }
+
+    if (path == NULL) {
+        path = (Btree_Path *)calloc(1, sizeof(*path));
+        if (path == NULL) {
+            btree_log(btree, BTREE_LOG_ERROR, "Failed to allocate path: %s", btree_strerr(BTREE_ERROR_UNIX));
+            return NULL;
+        }
+    }
+    for (int s = 0; s < BTREE_PATH_SPARES; s++) {
+        if (btree_path_node(btree, &path->spares[s]) == NULL) {
+            btree_path_give(btree, path);
+            return NULL;
+        }
+    }
+    return path;
+}
+
+void btree_path_give(const Btree *btree, Btree_Path *path) {
+    Btree_Paths *paths = btree->paths;
+    if (paths->latch != NULL) {
+        pthread_mutex_lock(paths->latch);
+    }
+    path->next = paths->idle;
+    paths->idle = path;
+    if (paths->latch != NULL) {
+        pthread_mutex_unlock(paths->latch);
+    }
+}
+
+// Returns the buffer in slot, creating it the first time, or NULL when out of memory.
+Btree_Node *btree_path_node(const Btree *btree, Btree_Node **slot) {
+    if (*slot == NULL) {
+        *slot = btree_node_init(btree);
+        if (*slot == NULL) {
+            btree_log(btree, BTREE_LOG_ERROR, "Failed to allocate path: %s", btree_strerr(BTREE_ERROR_UNIX));
+        }
+    }
+    return *slot;
+}
+
+void btree_paths_destroy(Btree *btree) {
+    if (btree->paths == NULL) {
+        return;
+    }
+
+    while (btree->paths->idle != NULL) {
+        Btree_Path *path = btree->paths->idle;
+        btree->paths->idle = path->next;
+        for (int d = 0; d < BTREE_MAX_HEIGHT; d++) {
+            btree_node_destroy(path->nodes[d]);
+        }
+        for (int s = 0; s < BTREE_PATH_SPARES; s++) {
+            btree_node_destroy(path->spares[s]);
+        }
+        free(path);
+    }
+    if (btree->paths->latch != NULL) {
+        pthread_mutex_destroy(btree->paths->latch);
+        free(btree->paths->latch);
+    }
+    free(btree->paths);
+    btree->paths = NULL;
+}
+
+size_t btree_node_size_in_file(const Btree *btree) {
+    size_t size = BTREE_NODE_HEADER_SIZE + (btree->header.M - 1) * sizeof(*btree->root->keys) +
+                  (btree->header.M - 1) * sizeof(*btree->root->values) +
+                  (btree->header.M) * sizeof(*btree->root->children);
+    size_t page_size = btree->header.page_size;
+    return page_size != 0 ? (size + page_size - 1) & ~(page_size - 1) : size;
+}
+
+bool btree_paged_options_ok(Btree_Options options) {
+    size_t page_size = options.page_size;
+    if (page_size != 0 && (page_size < BTREE_MIN_PAGE_SIZE || (page_size & (page_size - 1)) != 0)) {
+        return false;
+    }
+    return !options.direct || (options.path != NULL && options.backend != BTREE_BACKEND_MMAP && !options.wal);
+}
+
+// The largest t whose nodes fit one page.
+int btree_page_t(size_t page_size) {
+    size_t item_size = sizeof(int) + sizeof(int) + sizeof(size_t);
+    return (int)((page_size - BTREE_NODE_HEADER_SIZE + sizeof(int) + sizeof(int)) / (2 * item_size));
+}
+
+bool btree_direct_init(Btree *btree, Btree_Options options) {
+    if (!options.direct) {
+        return true;
+    }
+
+    int flags = fcntl(btree->fd, F_GETFL);
+    if (flags == -1 || fcntl(btree->fd, F_SETFL, flags | O_DIRECT) == -1) {
+        btree_log(btree, BTREE_LOG_ERROR, "Failed to enable direct I/O: %s", btree_strerr(BTREE_ERROR_UNIX));
+        return false;
+    }
+    btree->direct = true;
+    return true;
+}
+
+// Allocates a buffer for node images, page-aligned when the file is opened for direct I/O.
+uint8_t *btree_image_alloc(const Btree *btree, size_t size) {
+    if (!btree->direct) {
+        return (uint8_t *)malloc(size);
+    }
+
+    void *data = NULL;
+    return posix_memalign(&data, btree->header.page_size, size) == 0 ? (uint8_t *)data : NULL;
+}
+
+// Bytes written for a node image: the part that holds data, or all of it when writes must cover whole pages.
+size_t btree_node_io_size(const Btree *btree, const uint8_t *data) {
+    return btree->direct ? btree_node_size_in_file(btree) : btree_node_image_size(btree, data);
+}
+
+int btree_is_valid(const Btree *btree) {
+    if (btree->header.M != btree->header.t * 2) {
+        return 0;
+    }
+
+    btree_latch_scan(btree);
+    int valid = btree_node_is_valid(btree, btree->root);
+    btree_latch_release(btree);
+    return valid;
+}
+
+Btree_Result btree_stats(const Btree *btree, Btree_Stats *stats) {
+    if (btree == NULL || stats == NULL) {
+        return BTREE_ERROR_NIL;
+    }
+
+    memset(stats, 0, sizeof(*stats));
+    const uint64_t *from = (const uint64_t *)&btree->counters;
+    uint64_t *to = (uint64_t *)&stats->counters;
+    for (size_t i = 0; i < sizeof(stats->counters) / sizeof(*to); i++) {
+        to[i] = __atomic_load_n(&from[i], __ATOMIC_RELAXED);
+    }
+
+    // the walk reads every node, after the counters were taken so it does not show in them
+    btree_latch_scan(btree);
+    stats->count_nodes = btree->header.count_nodes;
+    btree_stats_fill(btree, stats);
+    btree_latch_release(btree);
+    return BTREE_OK;
+}
+
+void btree_stats_fill(const Btree *btree, Btree_Stats *stats) {
+    Btree_Queue queue;
+    Btree_Node *node = btree_node_init(btree);
+    if (node == NULL || !btree_queue_init(&queue, btree->header.count_nodes)) {
+        btree_node_destroy(node);
+        return;
+    }
+
+    // every leaf sits at the same depth, so the levels are counted down the leftmost path
+    size_t leftmost = btree->root->offset;
+    btree_queue_enqueue(&queue, btree->root->offset);
+    while (queue.count > 0) {
+        size_t offset = btree_queue_dequeue(&queue);
+        btree_node_read2(btree, node, offset);
+        if (offset == leftmost) {
+            stats->height++;
+            leftmost = node->is_leaf ? 0 : node->children[0];
+        }
+
+        stats->count_underfull += offset != btree->root->offset && node->count_keys < btree->header.t - 1;
+        int bucket = node->count_keys * BTREE_STATS_FILL_BUCKETS / (btree->header.M - 1);
+        stats->fill[bucket < BTREE_STATS_FILL_BUCKETS ? bucket : BTREE_STATS_FILL_BUCKETS - 1]++;
+        for (int i = 0; !node->is_leaf && i <= node->count_keys; i++) {
+            btree_queue_enqueue(&queue, node->children[i]);
+        }
+    }
+    btree_node_destroy(node);
+    btree_queue_destroy(&queue);
+}
+
+void btree_stats_reset(Btree *btree) {
+    if (btree == NULL) {
+        return;
+    }
+    uint64_t *counters = (uint64_t *)&btree->counters;
+    for (size_t i = 0; i < sizeof(btree->counters) / sizeof(*counters); i++) {
+        __atomic_store_n(&counters[i], 0, __ATOMIC_RELAXED);
+    }
+}
+
+void btree_stats_latency(Btree *btree, bool enabled) {
+    if (btree != NULL) {
+        __atomic_store_n(&btree->latency, enabled, __ATOMIC_RELAXED);
+    }
+}
+
+// Counters are only ever added to, from any thread, so a relaxed add is all they need. The tree is const
+// for lookups, yet they count too.
+void btree_count(const uint64_t *counter, uint64_t n) {
+    __atomic_fetch_add((uint64_t *)counter, n, __ATOMIC_RELAXED);
+}
+
+void btree_count_bytes(const uint64_t *counter, ssize_t bytes) {
+    if (bytes > 0) {
+        btree_count(counter, bytes);
+    }
+}
+
+uint64_t btree_op_start(const Btree *btree) {
+    return __atomic_load_n(&btree->latency, __ATOMIC_RELAXED) ? btree_now_ns() : 0;
+}
+
+void btree_op_end(const Btree *btree, Btree_Op op, uint64_t start) {
+    if (start == 0) {
+        return;
+    }
+    uint64_t ns = btree_now_ns() - start;
+    int bucket = ns == 0 ? 0 : 64 - __builtin_clzll(ns);
+    bucket = bucket < BTREE_STATS_LATENCY_BUCKETS ? bucket : BTREE_STATS_LATENCY_BUCKETS - 1;
+    btree_count(&btree->counters.latencies[op][bucket], 1);
+}
+
+int btree_node_is_valid(const Btree *btree, const Btree_Node *node) {
+    int t = btree->header.t;
+    int M = btree->header.M;
+
+    // leaves lazy deletes leave underfull only need to hold a key
+    int min_keys = btree->lazy_delete && node->is_leaf ? 1 : t - 1;
+    if (btree->root != node && !(min_keys <= node->count_keys && node->count_keys <= M - 1)) {
+        btree_log(btree, BTREE_LOG_ERROR, "Keys out of bounds [t-1,2t-1]");
+        return 0;
+    }
+
+    if (btree_free_space_has(btree, node->offset)) {
+        btree_log(btree, BTREE_LOG_ERROR, "Node on the free list");
+        return 0;
+    }
+
+    if (node->is_leaf) {
+        for (int i = 0; i <= node->count_keys; i++) {
+            if (node->children[i] != 0) {
+                btree_log(btree, BTREE_LOG_ERROR, "Dirty children in leaf node");
+                return 0;
+            }
+        }
+    } else {
+        for (int i = 0; i <= node->count_keys; i++) {
+            if (node->children[i] == 0) {
+                btree_log(btree, BTREE_LOG_ERROR, "Fewer children");
+                return 0;
+            }
+        }
+        for (int i = node->count_keys + 1; i < M; i++) {
+            if (node->children[i] != 0) {
+                btree_log(btree, BTREE_LOG_ERROR, "Dirty children in internal node");
+                return 0;
+            }
+        }
+    }
+
+    for (int i = 1; i < node->count_keys; i++) {
+        if (node->keys[i] < node->keys[i - 1]) {
+            btree_log(btree, BTREE_LOG_ERROR, "Unordered keys");
+            return 0;
+        }
+    }
+
+    if (node->is_leaf) {
+        return 1;
+    }
+
+    Btree_Node *child = btree_node_init(btree);
+    for (int i = 0; i <= node->count_keys; i++) {
+        btree_node_read2(btree, child, node->children[i]);
+        if (!btree_node_is_valid(btree, child)) {
+            btree_node_destroy(child);
+            return 0;
+        }
+    }
+
+    btree_node_destroy(child);
+    return 1;
+}
+
+#define LOG_LEVELS                                                                                                     \
+    LEVEL(BTREE_LOG_DEBUG, "DEBUG")                                                                                    \
+    LEVEL(BTREE_LOG_WARN, "WARN")                                                                                      \
+    LEVEL(BTREE_LOG_INFO, "INFO")                                                                                      \
+    LEVEL(BTREE_LOG_ERROR, "ERROR")
+
+void btree_default_log_handler(Btree_Log_Level level, const char *fmt, va_list args) {
+    switch (level) {
+#define LEVEL(kind, prefix)                                                                                            \
+    case kind:                                                                                                         \
+        fprintf(stderr, "[%s] ", prefix);                                                                              \
+        break;
+        LOG_LEVELS
+#undef LEVEL
+    }
+
+    vfprintf(stderr, fmt, args);
+    fprintf(stderr, "\n");
+}
+
+void btree_discard_log_handler(Btree_Log_Level level, const char *fmt, va_list args) {
+    BTREE_UNUSED(level);
+    BTREE_UNUSED(fmt);
+    BTREE_UNUSED(args);
+}
+
+void btree_log(const Btree *btree, Btree_Log_Level level, const char *fmt, ...) {
+    va_list args;
+    va_start(args, fmt);
+    btree->log_handler(level, fmt, args);
+    va_end(args);
+}
+
+bool btree_queue_init(Btree_Queue *queue, int capacity) {
+    if (queue == NULL) {
+        return false;
+    }
+    memset(queue, 0, sizeof(*queue));
+    queue->capacity = capacity;
+    queue->items = (size_t *)malloc(capacity * sizeof(*queue->items));
+    return queue->items != NULL;
+}
+
+bool btree_queue_enqueue(Btree_Queue *queue, size_t offset) {
+    if (queue == NULL || offset == 0 || queue->count == queue->capacity) {
+        return false;
+    }
+    queue->items[queue->head++] = offset;
+    queue->head %= queue->capacity;
+    queue->count++;
+    return true;
+}
+
+size_t btree_queue_dequeue(Btree_Queue *queue) {
+    if (queue == NULL || queue->count == 0) {
+        return 0;
+    }
+    size_t offset = queue->items[queue->tail++];
+    queue->tail %= queue->capacity;
+    queue->count--;
+    return offset;
+}
+
+void btree_queue_destroy(Btree_Queue *queue) {
+    if (queue == NULL) {
+        return;
+    }
+    free(queue->items);
+    memset(queue, 0, sizeof(*queue));
+}
+
+bool btree_cache_init(Btree *btree, size_t cache_size) {
+    size_t frame_size = btree_node_size_in_file(btree);
+    int capacity = cache_size / (frame_size + sizeof(Btree_Frame));
+    if (btree->wal != NULL && capacity < BTREE_WAL_MIN_FRAMES) {
+        capacity = BTREE_WAL_MIN_FRAMES;
+    }
+    if (capacity == 0) {
+        btree->cache = NULL;
+        return true;
+    }
+
+    Btree_Cache *cache = (Btree_Cache *)calloc(1, sizeof(*cache));
+    if (cache == NULL) {
+        return false;
+    }
+
+    cache->capacity = capacity;
+    cache->count_buckets = 1;
+    while (cache->count_buckets < capacity) {
+        cache->count_buckets *= 2;
+    }
+
+    cache->buckets = (int *)malloc(cache->count_buckets * sizeof(*cache->buckets));
+    cache->frames = (Btree_Frame *)calloc(capacity, sizeof(*cache->frames));
+    cache->data = btree_image_alloc(btree, capacity * frame_size);
+    if (cache->buckets == NULL || cache->frames == NULL || cache->data == NULL) {
+        free(cache->buckets);
+        free(cache->frames);
+        free(cache->data);
+        free(cache);
+        return false;
+    }
+
+    memset(cache->buckets, -1, cache->count_buckets * sizeof(*cache->buckets));
+    for (int i = 0; i < capacity; i++) {
+        cache->frames[i].next = -1;
+        cache->frames[i].data = cache->data + i * frame_size;
+    }
+
+    btree->cache = cache;
+    return true;
+}
+
+int btree_cache_bucket(const Btree_Cache *cache, size_t offset) {
+    return (int)((offset * 0x9E3779B97F4A7C15ULL) >> 32) & (cache->count_buckets - 1);
+}
+
+void btree_cache_unlink(Btree_Cache *cache, Btree_Frame *frame) {
+    int *link = &cache->buckets[btree_cache_bucket(cache, frame->offset)];
+    while (*link != -1 && &cache->frames[*link] != frame) {
+        link = &cache->frames[*link].next;
+    }
+    if (*link != -1) {
+        *link = frame->next;
+    }
+    frame->next = -1;
+    frame->offset = 0;
+}
+
+bool btree_cache_write_back(const Btree *btree, Btree_Frame *frame) {
+    ssize_t bytes_written = pwrite(btree->fd, frame->data, btree_node_io_size(btree, frame->data), frame->offset);
+    btree_count_bytes(&btree->counters.bytes_written, bytes_written);
+    btree_count(&btree->counters.file_writes, 1);
+    if (bytes_written == -1) {
+        btree_log(btree, BTREE_LOG_ERROR, "Failed to write back node: %s", btree_strerr(BTREE_ERROR_UNIX));
+        return false;
+    }
+    frame->dirty = false;
+    return true;
+}
+
+// CLOCK: sweep the hand over unpinned frames, giving referenced ones a second chance.
+Btree_Frame *btree_cache_evict(const Btree *btree) {
+    Btree_Cache *cache = btree->cache;
+    if (cache->count < cache->capacity) {
+        return &cache->frames[cache->count++];
+    }
+
+    for (int step = 0; step < 2 * cache->capacity; step++) {
+        Btree_Frame *frame = &cache->frames[cache->hand];
+        cache->hand = (cache->hand + 1) % cache->capacity;
+
+        if (frame->pins > 0 || frame->lsn == BTREE_LSN_UNCOMMITTED) {
+            continue;
+        }
+
+        if (frame->referenced) {
+            frame->referenced = false;
+            continue;
+        }
+
+        // the log must be on disk before any image it covers overwrites the tree file
+        if (frame->dirty && btree->wal != NULL && frame->lsn > btree->wal->durable_lsn && !btree_wal_sync(btree)) {
+            return NULL;
+        }
+
+        if (frame->dirty && !btree_cache_write_back(btree, frame)) {
+            return NULL;
+        }
+
+        if (frame->offset != 0) {
+            btree_cache_unlink(cache, frame);
+        }
+        return frame;
+    }
+
+    return NULL;
+}
+
+// Readers of a concurrent tree share the pool, so its bookkeeping is serialized; misses do their I/O under
+// the latch too, which keeps two readers from loading the same node into two frames.
+Btree_Frame *btree_cache_pin(const Btree *btree, size_t offset, bool load) {
+    Btree_Cache *cache = btree->cache;
+    if (cache == NULL) {
+        return NULL;
+    }
+
+    if (cache->latch == NULL) {
+        return btree_cache_pin_latched(btree, offset, load);
+    }
+    pthread_mutex_lock(cache->latch);
+    Btree_Frame *frame = btree_cache_pin_latched(btree, offset, load);
+    pthread_mutex_unlock(cache->latch);
+    return frame;
+}
+
+Btree_Frame *btree_cache_pin_latched(const Btree *btree, size_t offset, bool load) {
+    Btree_Cache *cache = btree->cache;
+
+    int bucket = btree_cache_bucket(cache, offset);
+    for (int i = cache->buckets[bucket]; i != -1; i = cache->frames[i].next) {
+        Btree_Frame *frame = &cache->frames[i];
+        if (frame->offset == offset) {
+            btree_count(&btree->counters.cache_hits, 1);
+            frame->pins++;
+            frame->referenced = true;
+            return frame;
+        }
+    }
+
+    Btree_Frame *frame = btree_cache_evict(btree);
+    if (frame == NULL) {
+        btree_log(btree, BTREE_LOG_WARN, "Every cached node is pinned, bypassing cache");
+        return NULL;
+    }
+
+    if (load) {
+        btree_count(&btree->counters.cache_misses, 1);
+        ssize_t bytes_read = pread(btree->fd, frame->data, btree_node_size_in_file(btree), offset);
+        btree_count_bytes(&btree->counters.bytes_read, bytes_read);
+        if (bytes_read == -1) {
+            btree_log(btree, BTREE_LOG_ERROR, "Failed to read node: %s", btree_strerr(BTREE_ERROR_UNIX));
+            return NULL;
+        }
+    }
+
+    frame->offset = offset;
+    frame->lsn = 0;
+    frame->logged_from = frame->logged_to = 0;
+    frame->logged_children = false;
+    frame->pins = 1;
+    frame->dirty = false;
+    frame->referenced = true;
+    frame->next = cache->buckets[bucket];
+    cache->buckets[bucket] = frame - cache->frames;
+    return frame;
+}
+
+// Copies the node image at offset if it is cached, without loading it otherwise.
+bool btree_cache_peek(const Btree *btree, size_t offset, uint8_t *data) {
+    Btree_Cache *cache = btree->cache;
+    if (cache == NULL) {
+        return false;
+    }
+
+    if (cache->latch != NULL) {
+        pthread_mutex_lock(cache->latch);
+    }
+    bool found = false;
+    for (int i = cache->buckets[btree_cache_bucket(cache, offset)]; i != -1 && !found; i = cache->frames[i].next) {
+        Btree_Frame *frame = &cache->frames[i];
+        if (frame->offset == offset) {
+            memcpy(data, frame->data, btree_node_size_in_file(btree));
+            frame->referenced = true;
+            found = true;
+            btree_count(&btree->counters.cache_hits, 1);
+        }
+    }
+    if (cache->latch != NULL) {
+        pthread_mutex_unlock(cache->latch);
+    }
+    return found;
+}
+
+void btree_cache_unpin(const Btree *btree, Btree_Frame *frame, bool dirty) {
+    Btree_Cache *cache = btree->cache;
+    if (cache->latch != NULL) {
+        pthread_mutex_lock(cache->latch);
+    }
+    assert(frame->pins > 0);
+    frame->pins--;
+    frame->dirty |= dirty;
+    if (dirty && btree->wal != NULL) {
+        btree_wal_touch(btree, frame);
+    }
+    if (cache->latch != NULL) {
+        pthread_mutex_unlock(cache->latch);
+    }
+}
+
+// Writes back every dirty frame, one pwritev for each run of them that sit next to each other in the file.
+bool btree_cache_flush(const Btree *btree) {
+    Btree_Cache *cache = btree->cache;
+    if (cache == NULL) {
+        return true;
+    }
+
+    Btree_Frame **dirty = (Btree_Frame **)malloc((cache->count > 0 ? cache->count : 1) * sizeof(*dirty));
+    int count_dirty = 0;
+    bool ok = true;
+    for (int i = 0; i < cache->count; i++) {
+        Btree_Frame *frame = &cache->frames[i];
+        if (frame->offset != 0 && frame->dirty) {
+            if (dirty != NULL) {
+                dirty[count_dirty++] = frame;
+            } else {
+                ok &= btree_cache_write_back(btree, frame);
+            }
+        }
+    }
+    if (dirty == NULL) {
+        return ok;
+    }
+
+    qsort(dirty, count_dirty, sizeof(*dirty), btree_frame_cmp);
+    for (int a = 0, b; a < count_dirty; a = b) {
+        size_t end = dirty[a]->offset + btree_node_io_size(btree, dirty[a]->data);
+        for (b = a + 1; b < count_dirty && b - a < IOV_MAX && dirty[b]->offset == end; b++) {
+            end += btree_node_io_size(btree, dirty[b]->data);
+        }
+
+        struct iovec vec[b - a];
+        for (int i = a; i < b; i++) {
+            vec[i - a].iov_base = dirty[i]->data;
+            vec[i - a].iov_len = btree_node_io_size(btree, dirty[i]->data);
+        }
+        ssize_t bytes_written = pwritev(btree->fd, vec, b - a, dirty[a]->offset);
+        btree_count_bytes(&btree->counters.bytes_written, bytes_written);
+        btree_count(&btree->counters.file_writes, 1);
+        if (bytes_written == -1) {
+            btree_log(btree, BTREE_LOG_ERROR, "Failed to write back nodes: %s", btree_strerr(BTREE_ERROR_UNIX));
+            ok = false;
+            continue;
+        }
+        for (int i = a; i < b; i++) {
+            dirty[i]->dirty = false;
+        }
+    }
+    free(dirty);
+    return ok;
+}
+
+int btree_frame_cmp(const void *a, const void *b) {
+    const Btree_Frame *x = *(Btree_Frame *const *)a;
+    const Btree_Frame *y = *(Btree_Frame *const *)b;
+    return x->offset < y->offset ? -1 : x->offset > y->offset;
+}
+
+// Forgets the cached nodes from end on, which must be written back or no longer needed.
+void btree_cache_drop(const Btree *btree, size_t end) {
+    Btree_Cache *cache = btree->cache;
+    if (cache == NULL) {
+        return;
+    }
+
+    for (int i = 0; i < cache->count; i++) {
+        Btree_Frame *frame = &cache->frames[i];
+        if (frame->offset >= end) {
+            assert(frame->pins == 0);
+            btree_cache_unlink(cache, frame);
+            frame->dirty = false;
+        }
+    }
+}
+
+void btree_cache_destroy(Btree *btree) {
+    Btree_Cache *cache = btree->cache;
+    if (cache == NULL) {
+        return;
+    }
+    if (cache->latch != NULL) {
+        pthread_mutex_destroy(cache->latch);
+        free(cache->latch);
+    }
+    free(cache->buckets);
+    free(cache->frames);
+    free(cache->data);
+    free(cache);
+    btree->cache = NULL;
+}
+
+// The whole address range is reserved once so pointers into it stay valid; growing only extends the file.
+bool btree_map_init(Btree *btree, size_t map_size) {
+    struct stat st = {0};
+    if (btree->fd != -1 && fstat(btree->fd, &st) == -1) {
+        return false;
+    }
+
+    void *map = btree->fd != -1
+                    ? mmap(NULL, map_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_NORESERVE, btree->fd, 0)
+                    : mmap(NULL, map_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (map == MAP_FAILED) {
+        return false;
+    }
+
+    btree->map = (uint8_t *)map;
+    btree->map_size = map_size;
+    btree->file_size = st.st_size;
+    return true;
+}
+
+bool btree_map_grow(Btree *btree, size_t end) {
+    if (end <= btree->file_size) {
+        return true;
+    }
+
+    size_t size = btree->file_size < 4096 ? 4096 : btree->file_size;
+    while (size < end) {
+        size *= 2;
+    }
+    if (size > btree->map_size) {
+        size = end;
+    }
+    // a file can outgrow the mapping and be reached with plain reads, an in-memory tree has nowhere else to go
+    if (btree->fd == -1 && size > btree->map_size) {
+        errno = ENOMEM;
+        btree_log(btree, BTREE_LOG_ERROR, "Failed to grow in-memory tree: %s", btree_strerr(BTREE_ERROR_UNIX));
+        return false;
+    }
+
+    if (btree->fd != -1 && ftruncate(btree->fd, size) == -1) {
+        btree_log(btree, BTREE_LOG_ERROR, "Failed to grow mapped file: %s", btree_strerr(BTREE_ERROR_UNIX));
+        return false;
+    }
+    __atomic_store_n(&btree->file_size, size, __ATOMIC_RELEASE);
+    return true;
+}
+
+uint8_t *btree_map_node(const Btree *btree, size_t offset) {
+    size_t end = offset + btree_node_size_in_file(btree);
+    if (end > __atomic_load_n(&btree->file_size, __ATOMIC_ACQUIRE) || end > btree->map_size) {
+        return NULL;
+    }
+    return btree->map + offset;
+}
+
+// Unmaps the tree, first syncing the file and trimming it to the nodes in use when write_back is set.
+bool btree_map_destroy(Btree *btree, bool write_back) {
+    if (btree->map == NULL) {
+        return true;
+    }
+
+    bool ok = !write_back || btree->fd == -1 || msync(btree->map, btree->file_size, MS_SYNC) != -1;
+    ok &= munmap(btree->map, btree->map_size) != -1;
+    ok &= !write_back || btree->fd == -1 || ftruncate(btree->fd, btree->header.next_offset) != -1;
+    btree->map = NULL;
+    return ok;
+}
+
+Btree_Result btree_commit(Btree *btree, Btree_Result res) {
+    return btree_wal_commit(btree) ? res : BTREE_ERROR_UNIX;
+}
+
+uint64_t btree_checksum(const uint8_t *data, size_t len) {
+    uint64_t hash = 0xCBF29CE484222325ULL;
+    for (size_t i = 0; i < len; i++) {
+        hash = (hash ^ data[i]) * 0x100000001B3ULL;
+    }
+    return hash;
+}
+
+uint64_t btree_now_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+uint64_t btree_now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+Btree_Result btree_wal_open(Btree *btree, Btree_Options options, bool replay) {
+    if (!options.wal) {
+        return BTREE_OK;
+    }
+
+    if (options.backend == BTREE_BACKEND_MMAP || options.path == NULL) {
+        return BTREE_ERROR_OPTIONS;
+    }
+
+    size_t len = strlen(options.path);
+    char *path = (char *)malloc(len + sizeof("-wal"));
+    Btree_Wal *wal = (Btree_Wal *)calloc(1, sizeof(*wal));
+    if (path == NULL || wal == NULL) {
+        free(path);
+        free(wal);
+        return BTREE_ERROR_UNIX;
+    }
+
+    memcpy(path, options.path, len);
+    memcpy(path + len, "-wal", sizeof("-wal"));
+    wal->fd = open(path, O_RDWR | O_CREAT, S_IRUSR | S_IWUSR);
+    free(path);
+    if (wal->fd == -1) {
+        free(wal);
+        return BTREE_ERROR_UNIX;
+    }
+
+    wal->sync_ops = options.wal_sync_ops;
+    wal->sync_us = options.wal_sync_us;
+    wal->checkpoint_size =
+        options.wal_checkpoint_size ? options.wal_checkpoint_size : BTREE_DEFAULT_WAL_CHECKPOINT_SIZE;
+    wal->last_sync_us = btree_now_us();
+    btree->wal = wal;
+
+    if ((replay ? !btree_wal_replay(btree) : ftruncate(wal->fd, 0) == -1) || !btree_wal_flusher_init(btree)) {
+        btree_wal_destroy(btree);
+        return BTREE_ERROR_UNIX;
+    }
+    return BTREE_OK;
+}
+
+// Records are {lsn, length} followed by length bytes of {offset, size, bytes} entries and a checksum of
+// all of it. Replay stops at the first torn or corrupt record, which can only be the tail of the log.
+bool btree_wal_replay(Btree *btree) {
+    Btree_Wal *wal = btree->wal;
+    size_t pos = 0;
+    int count_records = 0;
+    uint64_t head[2];
+
+    struct stat st;
+    if (fstat(wal->fd, &st) == -1) {
+        return false;
+    }
+
+    while (pread(wal->fd, head, sizeof(head), pos) == sizeof(head)) {
+        // a tail too short for even an empty record is torn too, and bounds the length before it is trusted
+        size_t left = (size_t)st.st_size - pos;
+        if (left < sizeof(head) + sizeof(uint64_t) || head[1] > left - sizeof(head) - sizeof(uint64_t)) {
+            break;
+        }
+        size_t len = sizeof(head) + head[1] + sizeof(uint64_t);
+        uint8_t *record = (uint8_t *)malloc(len);
+        if (record == NULL) {
+            return false;
+        }
+
+        uint64_t checksum = 0;
+        bool whole = pread(wal->fd, record, len, pos) == (ssize_t)len;
+        memcpy(&checksum, record + len - sizeof(checksum), sizeof(checksum));
+        if (!whole || checksum != btree_checksum(record, len - sizeof(checksum))) {
+            free(record);
+            break;
+        }
+
+        for (uint8_t *entry = record + sizeof(head); entry < record + len - sizeof(checksum);) {
+            uint64_t offset = 0;
+            uint32_t size = 0;
+            memcpy(&offset, entry, sizeof(offset));
+            memcpy(&size, entry + sizeof(offset), sizeof(size));
+            entry += sizeof(offset) + sizeof(size);
+            if (pwrite(btree->fd, entry, size, offset) != (ssize_t)size) {
+                free(record);
+                return false;
+            }
+            entry += size;
+        }
+
+        free(record);
+        pos += len;
+        count_records++;
+    }
+
+    if (count_records > 0) {
+        btree_log(btree, BTREE_LOG_INFO, "Replayed %d log records", count_records);
+        if (fsync(btree->fd) == -1) {
+            return false;
+        }
+    }
+    return ftruncate(wal->fd, 0) != -1 && fsync(wal->fd) != -1;
+}
+
+void btree_wal_touch(const Btree *btree, Btree_Frame *frame) {
+    Btree_Wal *wal = btree->wal;
+    if (frame->lsn == BTREE_LSN_UNCOMMITTED) {
+        return;
+    }
+
+    if (wal->count_touched == wal->capacity_touched) {
+        int capacity = wal->capacity_touched ? 2 * wal->capacity_touched : 64;
+        int *touched = (int *)realloc(wal->touched, capacity * sizeof(*touched));
+        if (touched == NULL) {
+            btree_log(btree, BTREE_LOG_ERROR, "Failed to track changed node: %s", btree_strerr(BTREE_ERROR_UNIX));
+            return;
+        }
+        wal->touched = touched;
+        wal->capacity_touched = capacity;
+    }
+
+    frame->lsn = BTREE_LSN_UNCOMMITTED;
+    wal->touched[wal->count_touched++] = frame - btree->cache->frames;
+}
+
+// Widens the slots of frame the next log record takes in to [from, to) of node, or to all of it when no slots
+// of node are marked dirty.
+void btree_wal_mark(Btree_Frame *frame, const Btree_Node *node, int from, int to) {
+    if (to <= from || frame->logged_to < 0) {
+        frame->logged_to = -1;
+        return;
+    }
+    if (frame->logged_from != frame->logged_to) {
+        from = from < frame->logged_from ? from : frame->logged_from;
+        to = to > frame->logged_to ? to : frame->logged_to;
+    }
+    frame->logged_from = from;
+    frame->logged_to = to;
+    frame->logged_children |= !node->is_leaf;
+}
+
+bool btree_wal_append(Btree_Wal *wal, const void *data, size_t len) {
+    if (wal->count_buffer + len > wal->capacity_buffer) {
+        size_t capacity = wal->capacity_buffer ? wal->capacity_buffer : 4096;
+        while (capacity < wal->count_buffer + len) {
+            capacity *= 2;
+        }
+        uint8_t *buffer = (uint8_t *)realloc(wal->buffer, capacity);
+        if (buffer == NULL) {
+            return false;
+        }
+        wal->buffer = buffer;
+        wal->capacity_buffer = capacity;
+    }
+    memcpy(wal->buffer + wal->count_buffer, data, len);
+    wal->count_buffer += len;
+    return true;
+}
+
+bool btree_wal_append_entry(Btree_Wal *wal, uint64_t offset, const void *data, uint32_t size) {
+    return btree_wal_append(wal, &offset, sizeof(offset)) && btree_wal_append(wal, &size, sizeof(size)) &&
+           btree_wal_append(wal, data, size);
+}
+
+// Appends the parts of the frame changed since the last record: its head and the slots marked, or the whole
+// image. A free list link lives in the head, so a frame changed only by one logs just the head.
+bool btree_wal_append_frame(const Btree *btree, const Btree_Frame *frame) {
+    Btree_Wal *wal = btree->wal;
+    if (frame->logged_to < 0) {
+        return btree_wal_append_entry(wal, frame->offset, frame->data, btree_node_image_size(btree, frame->data));
+    }
+    if (frame->logged_from == frame->logged_to) {
+        return btree_wal_append_entry(wal, frame->offset, frame->data, BTREE_NODE_HEADER_SIZE);
+    }
+
+    size_t spans[4][2];
+    int count_spans = btree_node_spans(btree, !frame->logged_children, frame->logged_from, frame->logged_to, spans);
+    bool ok = true;
+    for (int s = 0; s < count_spans && ok; s++) {
+        ok = btree_wal_append_entry(wal, frame->offset + spans[s][0], frame->data + spans[s][0],
+                                    spans[s][1] - spans[s][0]);
+    }
+    return ok;
+}
+
+bool btree_wal_write(const Btree *btree) {
+    Btree_Wal *wal = btree->wal;
+    size_t done = 0;
+    while (done < wal->count_buffer) {
+        ssize_t bytes_written = pwrite(wal->fd, wal->buffer + done, wal->count_buffer - done, wal->size + done);
+        btree_count_bytes(&btree->counters.bytes_written, bytes_written);
+        if (bytes_written == -1) {
+            btree_log(btree, BTREE_LOG_ERROR, "Failed to write log: %s", btree_strerr(BTREE_ERROR_UNIX));
+            return false;
+        }
+        done += bytes_written;
+    }
+    wal->size += done;
+    wal->count_buffer = 0;
+    return true;
+}
+
+// Logs the bytes the finished operation changed in every node it touched, plus the header, as one record.
+bool btree_wal_commit(Btree *btree) {
+    Btree_Wal *wal = btree->wal;
+    if (wal == NULL) {
+        return true;
+    }
+    if (wal->broken) {
+        return false;
+    }
+    if (wal->count_touched == 0) {
+        return true;
+    }
+
+    btree_wal_lock(wal);
+    bool ok = btree_wal_record(btree);
+    bool by_count = wal->sync_ops > 0 && wal->pending_ops >= wal->sync_ops;
+    bool by_time = wal->sync_us > 0 && btree_now_us() - wal->last_sync_us >= (uint64_t)wal->sync_us;
+    if (ok && (by_count || by_time || (wal->sync_ops <= 0 && wal->sync_us <= 0))) {
+        ok = btree_wal_sync(btree);
+    } else if (ok && wal->count_buffer >= BTREE_WAL_BUFFER_SIZE) {
+        ok = btree_wal_write(btree);
+    }
+
+    if (ok && wal->size + wal->count_buffer >= wal->checkpoint_size) {
+        ok = btree_wal_checkpoint(btree);
+    }
+    btree_wal_unlock(wal);
+    return ok;
+}
+
+// Appends the record of the touched frames to the log buffer, which leaves them free to be evicted.
+bool btree_wal_record(const Btree *btree) {
+    Btree_Wal *wal = btree->wal;
+    size_t start = wal->count_buffer;
+    uint64_t head[2] = {wal->lsn + 1, 0};
+    uint8_t header[sizeof(btree_magic_bytes) + sizeof(btree->header)];
+    size_t header_size = btree_header_image(btree, header);
+
+    bool ok = btree_wal_append(wal, head, sizeof(head));
+    for (int i = 0; i < wal->count_touched && ok; i++) {
+        ok = btree_wal_append_frame(btree, &btree->cache->frames[wal->touched[i]]);
+    }
+    ok = ok && btree_wal_append_entry(wal, 0, header, header_size);
+    if (!ok) {
+        wal->count_buffer = start;
+        btree_log(btree, BTREE_LOG_ERROR, "Failed to build log record: %s", btree_strerr(BTREE_ERROR_UNIX));
+        return false;
+    }
+
+    head[1] = wal->count_buffer - start - sizeof(head);
+    memcpy(wal->buffer + start, head, sizeof(head));
+    uint64_t checksum = btree_checksum(wal->buffer + start, wal->count_buffer - start);
+    if (!btree_wal_append(wal, &checksum, sizeof(checksum))) {
+        wal->count_buffer = start;
+        return false;
+    }
+
+    for (int i = 0; i < wal->count_touched; i++) {
+        Btree_Frame *frame = &btree->cache->frames[wal->touched[i]];
+        frame->lsn = head[0];
+        frame->logged_from = frame->logged_to = 0;
+        frame->logged_children = false;
+    }
+    wal->count_touched = 0;
+    wal->lsn = head[0];
+    wal->pending_ops++;
+    return true;
+}
+
+// Operations that touch more nodes than the cache can hold in place commit what they did so far.
+void btree_wal_commit_if_full(Btree *btree) {
+    if (btree->wal != NULL && btree->wal->count_touched >= btree->cache->capacity / 2) {
+        btree_wal_commit(btree);
+    }
+}
+
+bool btree_wal_sync(const Btree *btree) {
+    Btree_Wal *wal = btree->wal;
+    btree_wal_lock(wal);
+    bool ok = btree_wal_write(btree);
+    if (ok && fdatasync(wal->fd) == -1) {
+        btree_log(btree, BTREE_LOG_ERROR, "Failed to sync log: %s", btree_strerr(BTREE_ERROR_UNIX));
+        ok = false;
+    }
+    if (ok) {
+        wal->durable_lsn = wal->lsn;
+        wal->pending_ops = 0;
+        wal->last_sync_us = btree_now_us();
+    }
+    btree_wal_unlock(wal);
+    return ok;
+}
+
+// Moves everything logged into the tree file, then empties the log.
+bool btree_wal_checkpoint(Btree *btree) {
+    Btree_Wal *wal = btree->wal;
+    if (wal == NULL) {
+        return true;
+    }
+
+    btree_wal_lock(wal);
+    bool ok = btree_wal_commit(btree) && btree_wal_sync(btree) && btree_cache_flush(btree);
+    if (ok) {
+        btree_header_flush(btree);
+        ok = fsync(btree->fd) != -1 && ftruncate(wal->fd, 0) != -1 && fsync(wal->fd) != -1;
+        if (!ok) {
+            btree_log(btree, BTREE_LOG_ERROR, "Failed to checkpoint: %s", btree_strerr(BTREE_ERROR_UNIX));
+        }
+    }
+    if (ok) {
+        wal->size = 0;
+    }
+    btree_wal_unlock(wal);
+    return ok;
+}
+
+void btree_wal_destroy(Btree *btree) {
+    Btree_Wal *wal = btree->wal;
+    if (wal == NULL) {
+        return;
+    }
+    btree_wal_flusher_stop(btree);
+    close(wal->fd);
+    free(wal->buffer);
+    free(wal->touched);
+    free(wal);
+    btree->wal = NULL;
+}
+
+bool btree_wal_flusher_init(Btree *btree) {
+    Btree_Wal *wal = btree->wal;
+    if (wal->sync_us <= 0) {
+        return true;
+    }
+
+    Btree_Wal_Flusher *flusher = (Btree_Wal_Flusher *)calloc(1, sizeof(*flusher));
+    if (flusher == NULL) {
+        return false;
+    }
+    pthread_mutexattr_t mutex_attr;
+    pthread_mutexattr_init(&mutex_attr);
+    pthread_mutexattr_settype(&mutex_attr, PTHREAD_MUTEX_RECURSIVE);
+    pthread_mutex_init(&flusher->mutex, &mutex_attr);
+    pthread_mutexattr_destroy(&mutex_attr);
+    // deadlines come from btree_now_us, so the wait runs on the same clock
+    pthread_condattr_t cond_attr;
+    pthread_condattr_init(&cond_attr);
+    pthread_condattr_setclock(&cond_attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&flusher->wake, &cond_attr);
+    pthread_condattr_destroy(&cond_attr);
+
+    wal->flusher = flusher;
+    if (pthread_create(&flusher->thread, NULL, btree_wal_flusher_worker, btree) != 0) {
+        pthread_mutex_destroy(&flusher->mutex);
+        pthread_cond_destroy(&flusher->wake);
+        free(flusher);
+        wal->flusher = NULL;
+        return false;
+    }
+    return true;
+}
+
+void *btree_wal_flusher_worker(void *arg) {
+    Btree *btree = arg;
+    Btree_Wal *wal = btree->wal;
+    Btree_Wal_Flusher *flusher = wal->flusher;
+    pthread_mutex_lock(&flusher->mutex);
+    while (!flusher->stop) {
+        uint64_t deadline = wal->last_sync_us + (uint64_t)wal->sync_us;
+        if (btree_now_us() < deadline) {
+            struct timespec ts = {.tv_sec = deadline / 1000000, .tv_nsec = deadline % 1000000 * 1000};
+            pthread_cond_timedwait(&flusher->wake, &flusher->mutex, &ts);
+            continue;
+        }
+
+        // with nothing waiting the clock restarts, so an operation logged next is synced a full period later
+        if (wal->pending_ops == 0 && wal->count_buffer == 0) {
+            wal->last_sync_us = btree_now_us();
+        } else if (!btree_wal_sync(btree)) {
+            // the failure is logged; the next operation to commit meets it again
+            wal->last_sync_us = btree_now_us();
+        }
+    }
+    pthread_mutex_unlock(&flusher->mutex);
+    return NULL;
+}
+
+void btree_wal_flusher_stop(Btree *btree) {
+    Btree_Wal_Flusher *flusher = btree->wal != NULL ? btree->wal->flusher : NULL;
+    if (flusher == NULL) {
+        return;
+    }
+    pthread_mutex_lock(&flusher->mutex);
+    flusher->stop = true;
+    pthread_cond_signal(&flusher->wake);
+    pthread_mutex_unlock(&flusher->mutex);
+    pthread_join(flusher->thread, NULL);
+    pthread_mutex_destroy(&flusher->mutex);
+    pthread_cond_destroy(&flusher->wake);
+    free(flusher);
+    btree->wal->flusher = NULL;
+}
+
+void btree_wal_lock(const Btree_Wal *wal) {
+    if (wal->flusher != NULL) {
+        pthread_mutex_lock(&wal->flusher->mutex);
+    }
+}
+
+void btree_wal_unlock(const Btree_Wal *wal) {
+    if (wal->flusher != NULL) {
+        pthread_mutex_unlock(&wal->flusher->mutex);
+    }
+}
+
+bool btree_latch_init(Btree *btree, Btree_Options options) {
+    if (!options.concurrent && !options.concurrent_puts && !(options.lazy_delete && options.compact_background)) {
+        return true;
+    }
+
+    pthread_rwlockattr_t attr;
+    pthread_rwlockattr_init(&attr);
+#ifdef __GLIBC__
+    // a steady stream of lookups must not starve writers
+    pthread_rwlockattr_setkind_np(&attr, PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+#endif
+    btree->latch = (pthread_rwlock_t *)malloc(sizeof(*btree->latch));
+    if (btree->latch != NULL && pthread_rwlock_init(btree->latch, &attr) != 0) {
+        free(btree->latch);
+        btree->latch = NULL;
+    }
+    pthread_rwlockattr_destroy(&attr);
+    bool ok = btree->latch != NULL;
+
+    Btree_Cache *cache = btree->cache;
+    if (ok && cache != NULL) {
+        cache->latch = (pthread_mutex_t *)malloc(sizeof(*cache->latch));
+        if (cache->latch != NULL && pthread_mutex_init(cache->latch, NULL) != 0) {
+            free(cache->latch);
+            cache->latch = NULL;
+        }
+        ok = cache->latch != NULL;
+    }
+
+    Btree_Paths *paths = btree->paths;
+    if (ok) {
+        paths->latch = (pthread_mutex_t *)malloc(sizeof(*paths->latch));
+        if (paths->latch != NULL && pthread_mutex_init(paths->latch, NULL) != 0) {
+            free(paths->latch);
+            paths->latch = NULL;
+        }
+        ok = paths->latch != NULL;
+    }
+
+    // a log record must hold whole operations, so logged trees keep puts exclusive
+    if (ok && options.concurrent_puts && btree->wal == NULL) {
+        ok = btree_node_latches_init(btree);
+    }
+
+    if (!ok) {
+        btree_log(btree, BTREE_LOG_ERROR, "Failed to create latches: %s", btree_strerr(BTREE_ERROR_UNIX));
+    }
+    return ok;
+}
+
+void btree_latch_shared(const Btree *btree) {
+    if (btree->latch != NULL) {
+        pthread_rwlock_rdlock(btree->latch);
+    }
+}
+
+void btree_latch_exclusive(const Btree *btree) {
+    if (btree->latch != NULL) {
+        pthread_rwlock_wrlock(btree->latch);
+    }
+}
+
+void btree_latch_release(const Btree *btree) {
+    if (btree->latch != NULL) {
+        pthread_rwlock_unlock(btree->latch);
+    }
+}
+
+void btree_latch_destroy(Btree *btree) {
+    if (btree->latch != NULL) {
+        pthread_rwlock_destroy(btree->latch);
+        free(btree->latch);
+        btree->latch = NULL;
+    }
+
+    if (btree->header_latch != NULL) {
+        pthread_mutex_destroy(btree->header_latch);
+        free(btree->header_latch);
+        btree->header_latch = NULL;
+    }
+
+    if (btree->node_latches != NULL) {
+        for (int i = 0; i < BTREE_LATCH_BUCKETS; i++) {
+            Btree_Latch_Bucket *bucket = &btree->node_latches[i];
+            assert(bucket->latches == NULL);
+            while (bucket->spare != NULL) {
+                Btree_Node_Latch *next = bucket->spare->next;
+                free(bucket->spare);
+                bucket->spare = next;
+            }
+            pthread_mutex_destroy(&bucket->mutex);
+            pthread_cond_destroy(&bucket->released);
+        }
+        free(btree->node_latches);
+        btree->node_latches = NULL;
+    }
+}
+
+bool btree_node_latches_init(Btree *btree) {
+    btree->header_latch = (pthread_mutex_t *)malloc(sizeof(*btree->header_latch));
+    if (btree->header_latch == NULL || pthread_mutex_init(btree->header_latch, NULL) != 0) {
+        free(btree->header_latch);
+        btree->header_latch = NULL;
+        return false;
+    }
+
+    btree->node_latches = (Btree_Latch_Bucket *)calloc(BTREE_LATCH_BUCKETS, sizeof(*btree->node_latches));
+    if (btree->node_latches == NULL) {
+        return false;
+    }
+    for (int i = 0; i < BTREE_LATCH_BUCKETS; i++) {
+        pthread_mutex_init(&btree->node_latches[i].mutex, NULL);
+        pthread_cond_init(&btree->node_latches[i].released, NULL);
+    }
+    return true;
+}
+
+// Walks over many nodes that hold no node latches, so crabbing writers must be kept out as well.
+void btree_latch_scan(const Btree *btree) {
+    if (btree->node_latches != NULL) {
+        btree_latch_exclusive(btree);
+    } else {
+        btree_latch_shared(btree);
+    }
+}
+
+// Latches are taken top-down along one path, so waiting on one while holding its ancestors cannot deadlock.
+void btree_node_latch(const Btree *btree, size_t offset, bool exclusive) {
+    if (btree->node_latches == NULL) {
+        return;
+    }
+
+    Btree_Latch_Bucket *bucket = &btree->node_latches[(offset / btree_node_size_in_file(btree)) % BTREE_LATCH_BUCKETS];
+    pthread_mutex_lock(&bucket->mutex);
+    Btree_Node_Latch *latch = bucket->latches;
+    while (latch != NULL && latch->offset != offset) {
+        latch = latch->next;
+    }
+
+    if (latch == NULL) {
+        latch = bucket->spare;
+        if (latch != NULL) {
+            bucket->spare = latch->next;
+        } else {
+            latch = (Btree_Node_Latch *)malloc(sizeof(*latch));
+            assert(latch != NULL && "Out of memory for node latches");
+        }
+        *latch = (Btree_Node_Latch){.offset = offset, .next = bucket->latches};
+        bucket->latches = latch;
+    }
+
+    latch->waiters++;
+    while (exclusive ? latch->readers != 0 : latch->readers < 0) {
+        pthread_cond_wait(&bucket->released, &bucket->mutex);
+    }
+    latch->waiters--;
+    latch->readers = exclusive ? -1 : latch->readers + 1;
+    pthread_mutex_unlock(&bucket->mutex);
+}
+
+void btree_node_unlatch(const Btree *btree, size_t offset) {
+    if (btree->node_latches == NULL) {
+        return;
+    }
+
+    Btree_Latch_Bucket *bucket = &btree->node_latches[(offset / btree_node_size_in_file(btree)) % BTREE_LATCH_BUCKETS];
+    pthread_mutex_lock(&bucket->mutex);
+    Btree_Node_Latch **link = &bucket->latches;
+    while ((*link)->offset != offset) {
+        link = &(*link)->next;
+    }
+
+    Btree_Node_Latch *latch = *link;
+    latch->readers = latch->readers < 0 ? 0 : latch->readers - 1;
+    if (latch->readers == 0 && latch->waiters == 0) {
+        *link = latch->next;
+        latch->next = bucket->spare;
+        bucket->spare = latch;
+    } else if (latch->readers == 0) {
+        pthread_cond_broadcast(&bucket->released);
+    }
+    pthread_mutex_unlock(&bucket->mutex);
+}
+
+Btree_Result btree_snapshot_open(Btree *btree, Btree_Snapshot *snapshot) {
+    if (btree == NULL || snapshot == NULL) {
+        return BTREE_ERROR_NIL;
+    }
+
+    btree_latch_exclusive(btree);
+    *snapshot = (Btree_Snapshot){
+        .btree = btree,
+        .root_offset = btree->header.root_offset,
+        .generation = btree->header.generation,
+        .older = btree->snapshots,
+    };
+    if (btree->snapshots != NULL) {
+        btree->snapshots->newer = snapshot;
+    }
+    btree->snapshots = snapshot;
+
+    // everything written from now on is newer than the snapshot; the bump must be on disk before such writes
+    btree->header.generation++;
+    btree_header_write(btree);
+    Btree_Result res = btree_commit(btree, BTREE_OK);
+    btree_latch_release(btree);
+    return res;
+}
+
+Btree_Result btree_snapshot_find(const Btree_Snapshot *snapshot, int key, int *value) {
+    if (snapshot == NULL) {
+        return BTREE_ERROR_NIL;
+    }
+
+    const Btree *btree = snapshot->btree;
+    Btree_Node *node = btree_node_init(btree);
+    if (node == NULL) {
+        return BTREE_ERROR_UNIX;
+    }
+
+    Btree_Result res = BTREE_ERROR_KEY_NOT_FOUND;
+    btree_node_read_at(btree, node, snapshot->root_offset, false);
+    while (true) {
+        int i = btree_search_lower(node->keys, node->count_keys, key);
+        if (i < node->count_keys && node->keys[i] == key) {
+            if (value) {
+                *value = node->values[i];
+            }
+            res = BTREE_OK;
+            break;
+        }
+        if (node->is_leaf) {
+            break;
+        }
+        btree_node_read_at(btree, node, node->children[i], false);
+    }
+
+    btree_node_destroy(node);
+    return res;
+}
+
+Btree_Result btree_snapshot_cursor_open(const Btree_Snapshot *snapshot, Btree_Cursor *cursor) {
+    if (snapshot == NULL) {
+        return BTREE_ERROR_NIL;
+    }
+
+    Btree_Result res = btree_cursor_open(snapshot->btree, cursor);
+    if (res == BTREE_OK) {
+        cursor->root_offset = snapshot->root_offset;
+    }
+    return res;
+}
+
+Btree_Result btree_snapshot_close(Btree *btree, Btree_Snapshot *snapshot) {
+    if (btree == NULL || snapshot == NULL) {
+        return BTREE_ERROR_NIL;
+    }
+
+    btree_latch_exclusive(btree);
+    if (snapshot->newer != NULL) {
+        snapshot->newer->older = snapshot->older;
+    } else {
+        btree->snapshots = snapshot->older;
+    }
+    if (snapshot->older != NULL) {
+        snapshot->older->newer = snapshot->newer;
+    }
+    btree_retired_free(btree, false);
+    Btree_Result res = btree_commit(btree, BTREE_OK);
+    btree_latch_release(btree);
+    return res;
+}
+
+// A node version is shared when some open snapshot was taken after it was written.
+bool btree_node_is_shared(const Btree *btree, const Btree_Node *node) {
+    return btree->snapshots != NULL && node->generation <= btree->snapshots->generation;
+}
+
+// Reads child i of x for changing it. A child that snapshots can still see is first copied to a fresh
+// offset, which x, already private, then points at.
+void btree_node_read_child(Btree *btree, Btree_Node *x, int i, Btree_Node *node) {
+    btree_node_read2(btree, node, x->children[i]);
+    if (!btree_node_is_shared(btree, node)) {
+        return;
+    }
+
+    btree_node_relocate(btree, node);
+    x->children[i] = node->offset;
+    btree_node_dirty(x, i, i + 1);
+    btree_node_write(btree, x);
+}
+
+void btree_node_copy(const Btree *btree, Btree_Node *dst, const Btree_Node *src) {
+    dst->count_keys = src->count_keys;
+    dst->is_leaf = src->is_leaf;
+    memcpy(dst->keys, src->keys, (btree->header.M - 1) * sizeof(*dst->keys));
+    memcpy(dst->values, src->values, (btree->header.M - 1) * sizeof(*dst->values));
+    memcpy(dst->children, src->children, btree->header.M * sizeof(*dst->children));
+}
+
+// Moves the contents of node to a fresh offset and retires the old one.
+void btree_node_relocate(Btree *btree, Btree_Node *node) {
+    size_t offset = node->offset;
+    Btree_Node *copy = btree_append_node(btree);
+    btree_node_copy(btree, copy, node);
+    btree_node_write(btree, copy);
+    btree_node_read2(btree, node, copy->offset);
+    btree_node_destroy(copy);
+    btree_retire(btree, offset);
+}
+
+// Gives a writer a root it may change in place. Needs the tree exclusively.
+void btree_root_own(Btree *btree) {
+    if (btree_node_is_shared(btree, btree->root)) {
+        btree_node_relocate(btree, btree->root);
+        btree->header.root_offset = btree->root->offset;
+        btree_header_write(btree);
+    }
+}
+
+void btree_retire(Btree *btree, size_t offset) {
+    if (btree->header_latch != NULL) {
+        pthread_mutex_lock(btree->header_latch);
+    }
+
+    if (btree->count_retired == btree->capacity_retired) {
+        int capacity = btree->capacity_retired ? 2 * btree->capacity_retired : 64;
+        Btree_Retired *retired = (Btree_Retired *)realloc(btree->retired, capacity * sizeof(*retired));
+        if (retired != NULL) {
+            btree->retired = retired;
+            btree->capacity_retired = capacity;
+        }
+    }
+    // a node that cannot be retired is never freed, which only costs its slot
+    if (btree->count_retired < btree->capacity_retired) {
+        btree->retired[btree->count_retired++] = (Btree_Retired){offset, btree->snapshots->generation};
+    } else {
+        btree_log(btree, BTREE_LOG_WARN, "Failed to retire node: %s", btree_strerr(BTREE_ERROR_UNIX));
+    }
+
+    if (btree->header_latch != NULL) {
+        pthread_mutex_unlock(btree->header_latch);
+    }
+}
+
+// Frees the retired nodes no open snapshot can reach any more, or all of them.
+void btree_retired_free(Btree *btree, bool all) {
+    Btree_Snapshot *oldest = btree->snapshots;
+    while (oldest != NULL && oldest->older != NULL) {
+        oldest = oldest->older;
+    }
+
+    int kept = 0;
+    for (int i = 0; i < btree->count_retired; i++) {
+        Btree_Retired retired = btree->retired[i];
+        if (!all && oldest != NULL && retired.generation >= oldest->generation) {
+            btree->retired[kept++] = retired;
+            continue;
+        }
+
+        Btree_Node *node = btree_node_init(btree);
+        node->offset = retired.offset;
+        btree_remove_node(btree, node);
+        btree_node_destroy(node);
+    }
+
+    if (kept < btree->count_retired) {
+        btree->count_retired = kept;
+        btree_header_write(btree);
+    }
+}
+
+Btree_Result btree_replay(Btree *btree, const char *trace_path, Btree_Replay *replay) {
+    if (btree == NULL || trace_path == NULL || replay == NULL) {
+        return BTREE_ERROR_NIL;
+    }
+
+    memset(replay, 0, sizeof(*replay));
+    size_t size = 0;
+    uint8_t *data = btree_trace_read(trace_path, &size);
+    if (data == NULL) {
+        return BTREE_ERROR_UNIX;
+    }
+    uint32_t version = 0;
+    size_t pos = sizeof(btree_trace_magic_bytes) + sizeof(version);
+    if (size >= pos) {
+        memcpy(&version, data + sizeof(btree_trace_magic_bytes), sizeof(version));
+    }
+    if (size < pos || memcmp(data, btree_trace_magic_bytes, sizeof(btree_trace_magic_bytes)) != 0 ||
+        version != BTREE_TRACE_VERSION) {
+        free(data);
+        return BTREE_ERROR_FORMAT;
+    }
+
+    Btree_Result res = BTREE_OK;
+    uint64_t start = btree_now_ns();
+    while (pos < size && (res == BTREE_OK || res == BTREE_ERROR_KEY_NOT_FOUND)) {
+        uint8_t op = data[pos];
+        size_t len = 1 + (op == BTREE_TRACE_PUT ? 2 : 1) * sizeof(int);
+        if (op < BTREE_TRACE_FIND || op > BTREE_TRACE_DELETE || pos + len > size) {
+            res = BTREE_ERROR_FORMAT;
+            break;
+        }
+
+        int key, value = 0;
+        memcpy(&key, data + pos + 1, sizeof(key));
+        if (op == BTREE_TRACE_FIND) {
+            res = btree_find(btree, key, &value);
+        } else if (op == BTREE_TRACE_PUT) {
+            memcpy(&value, data + pos + 1 + sizeof(key), sizeof(value));
+            res = btree_put(btree, key, value);
+        } else {
+            res = btree_delete(btree, key);
+        }
+        replay->count_ops[op]++;
+        replay->count_missing += res == BTREE_ERROR_KEY_NOT_FOUND;
+        pos += len;
+    }
+    replay->elapsed_ns = btree_now_ns() - start;
+
+    free(data);
+    return res == BTREE_ERROR_KEY_NOT_FOUND ? BTREE_OK : res;
+}
+
+// Loads the whole trace, so reading it does not show in the timing of the replay.
+uint8_t *btree_trace_read(const char *trace_path, size_t *size) {
+    int fd = open(trace_path, O_RDONLY);
+    struct stat st;
+    if (fd == -1 || fstat(fd, &st) == -1) {
+        if (fd != -1) {
+            close(fd);
+        }
+        return NULL;
+    }
+
+    uint8_t *data = (uint8_t *)malloc(st.st_size > 0 ? st.st_size : 1);
+    size_t done = 0;
+    while (data != NULL && done < (size_t)st.st_size) {
+        ssize_t bytes_read = read(fd, data + done, st.st_size - done);
+        if (bytes_read <= 0) {
+            free(data);
+            data = NULL;
+            break;
+        }
+        done += bytes_read;
+    }
+    close(fd);
+    *size = done;
+    return data;
+}
+
+bool btree_trace_init(Btree *btree, Btree_Options options) {
+    if (options.trace_path == NULL) {
+        return true;
+    }
+
+    Btree_Trace *trace = (Btree_Trace *)malloc(sizeof(*trace));
+    if (trace == NULL) {
+        return false;
+    }
+    trace->fd = open(options.trace_path, O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR);
+    if (trace->fd == -1 || pthread_mutex_init(&trace->latch, NULL) != 0) {
+        btree_log(btree, BTREE_LOG_ERROR, "Failed to open trace: %s", btree_strerr(BTREE_ERROR_UNIX));
+        if (trace->fd != -1) {
+            close(trace->fd);
+        }
+        free(trace);
+        return false;
+    }
+
+    uint32_t version = BTREE_TRACE_VERSION;
+    memcpy(trace->buffer, btree_trace_magic_bytes, sizeof(btree_trace_magic_bytes));
+    memcpy(trace->buffer + sizeof(btree_trace_magic_bytes), &version, sizeof(version));
+    trace->count_buffer = sizeof(btree_trace_magic_bytes) + sizeof(version);
+    btree->trace = trace;
+    return true;
+}
+
+void btree_trace_record(const Btree *btree, Btree_Trace_Op op, int key, int value) {
+    Btree_Trace *trace = btree->trace;
+    if (trace == NULL) {
+        return;
+    }
+
+    pthread_mutex_lock(&trace->latch);
+    if (trace->count_buffer + 1 + 2 * sizeof(int) > BTREE_TRACE_BUFFER_SIZE) {
+        btree_trace_flush(btree);
+    }
+    uint8_t *record = trace->buffer + trace->count_buffer;
+    record[0] = (uint8_t)op;
+    memcpy(record + 1, &key, sizeof(key));
+    trace->count_buffer += 1 + sizeof(key);
+    if (op == BTREE_TRACE_PUT) {
+        memcpy(record + 1 + sizeof(key), &value, sizeof(value));
+        trace->count_buffer += sizeof(value);
+    }
+    pthread_mutex_unlock(&trace->latch);
+}
+
+// Writes out the buffered records. Called with the trace latched.
+bool btree_trace_flush(const Btree *btree) {
+    Btree_Trace *trace = btree->trace;
+    if (trace == NULL) {
+        return true;
+    }
+
+    size_t done = 0;
+    while (done < trace->count_buffer) {
+        ssize_t bytes_written = write(trace->fd, trace->buffer + done, trace->count_buffer - done);
+        if (bytes_written == -1) {
+            btree_log(btree, BTREE_LOG_ERROR, "Failed to write trace: %s", btree_strerr(BTREE_ERROR_UNIX));
+            trace->count_buffer = 0;
+            return false;
+        }
+        done += bytes_written;
+    }
+    trace->count_buffer = 0;
+    return true;
+}
+
+bool btree_trace_sync(const Btree *btree) {
+    Btree_Trace *trace = btree->trace;
+    if (trace == NULL) {
+        return true;
+    }
+
+    pthread_mutex_lock(&trace->latch);
+    bool ok = btree_trace_flush(btree);
+    pthread_mutex_unlock(&trace->latch);
+    return ok;
+}
+
+bool btree_trace_destroy(Btree *btree) {
+    Btree_Trace *trace = btree->trace;
+    if (trace == NULL) {
+        return true;
+    }
+
+    bool ok = btree_trace_flush(btree);
+    ok &= close(trace->fd) != -1;
+    pthread_mutex_destroy(&trace->latch);
+    free(trace);
+    btree->trace = NULL;
+    return ok;
+}
+
+void btree_io_init(Btree *btree, Btree_Options options) {
+    if (options.io_engine == BTREE_IO_SYNC) {
+        return;
+    }
+
+    Btree_Io *io = (Btree_Io *)calloc(1, sizeof(*io));
+    if (io == NULL) {
+        btree_log(btree, BTREE_LOG_WARN, "No memory for the I/O engine, lookups stay synchronous");
+        return;
+    }
+    io->engine = options.io_engine;
+    io->depth = options.io_depth > 0 ? options.io_depth : BTREE_DEFAULT_IO_DEPTH;
+    io->fd = btree->fd;
+    io->size = btree_node_size_in_file(btree);
+    io->ring_fd = -1;
+    pthread_mutex_init(&io->busy, NULL);
+
+    if (io->engine == BTREE_IO_URING && !btree_io_uring_init(io)) {
+        btree_log(btree, BTREE_LOG_INFO, "io_uring unavailable, reading nodes from a thread pool");
+        io->engine = BTREE_IO_THREADS;
+    }
+    if (io->engine == BTREE_IO_THREADS && !btree_io_threads_init(io)) {
+        btree_log(btree, BTREE_LOG_WARN, "Failed to start I/O threads: %s", btree_strerr(BTREE_ERROR_UNIX));
+        pthread_mutex_destroy(&io->busy);
+        free(io);
+        return;
+    }
+    btree->io = io;
+}
+
+bool btree_io_uring_init(Btree_Io *io) {
+#ifdef __NR_io_uring_setup
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    int fd = syscall(__NR_io_uring_setup, io->depth, &params);
+    if (fd < 0) {
+        return false;
+    }
+    if (!btree_io_uring_probe(fd)) {
+        close(fd);
+        return false;
+    }
+
+    io->sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(uint32_t);
+    io->cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        io->sq_ring_size = io->cq_ring_size = io->sq_ring_size > io->cq_ring_size ? io->sq_ring_size : io->cq_ring_size;
+    }
+
+    io->sq_ring = mmap(NULL, io->sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+    io->cq_ring = io->sq_ring;
+    if (io->sq_ring != MAP_FAILED && !(params.features & IORING_FEAT_SINGLE_MMAP)) {
+        io->cq_ring =
+            mmap(NULL, io->cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+    }
+    io->sqes = mmap(NULL, params.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE,
+                    MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+    if (io->sq_ring == MAP_FAILED || io->cq_ring == MAP_FAILED || io->sqes == MAP_FAILED) {
+        if (io->sq_ring != MAP_FAILED) {
+            munmap(io->sq_ring, io->sq_ring_size);
+        }
+        if (io->cq_ring != MAP_FAILED && io->cq_ring != io->sq_ring) {
+            munmap(io->cq_ring, io->cq_ring_size);
+        }
+        if (io->sqes != MAP_FAILED) {
+            munmap(io->sqes, params.sq_entries * sizeof(struct io_uring_sqe));
+        }
+        close(fd);
+        return false;
+    }
+
+    io->in_flight = (Btree_Io_Request *)calloc(params.sq_entries, sizeof(*io->in_flight));
+    if (io->in_flight == NULL) {
+        munmap(io->sqes, params.sq_entries * sizeof(struct io_uring_sqe));
+        if (io->cq_ring != io->sq_ring) {
+            munmap(io->cq_ring, io->cq_ring_size);
+        }
+        munmap(io->sq_ring, io->sq_ring_size);
+        close(fd);
+        return false;
+    }
+
+    io->ring_fd = fd;
+    io->depth = params.sq_entries;
+    io->sq_tail = (uint32_t *)(io->sq_ring + params.sq_off.tail);
+    io->sq_mask = (uint32_t *)(io->sq_ring + params.sq_off.ring_mask);
+    io->sq_array = (uint32_t *)(io->sq_ring + params.sq_off.array);
+    io->cq_head = (uint32_t *)(io->cq_ring + params.cq_off.head);
+    io->cq_tail = (uint32_t *)(io->cq_ring + params.cq_off.tail);
+    io->cq_mask = (uint32_t *)(io->cq_ring + params.cq_off.ring_mask);
+    io->cqes = io->cq_ring + params.cq_off.cqes;
+    return true;
+#else
+    BTREE_UNUSED(io);
+    return false;
+#endif
+}
+
+// Rings older than Linux 5.6 take no IORING_OP_READ, and they refuse the probe as well.
+bool btree_io_uring_probe(int ring_fd) {
+#ifdef __NR_io_uring_register
+    int count_ops = 256;
+    struct io_uring_probe *probe =
+        (struct io_uring_probe *)calloc(1, sizeof(*probe) + count_ops * sizeof(struct io_uring_probe_op));
+    if (probe == NULL) {
+        return false;
+    }
+    bool ok = syscall(__NR_io_uring_register, ring_fd, IORING_REGISTER_PROBE, probe, count_ops) == 0 &&
+              probe->ops_len > IORING_OP_READ && (probe->ops[IORING_OP_READ].flags & IO_URING_OP_SUPPORTED);
+    free(probe);
+    return ok;
+#else
+    BTREE_UNUSED(ring_fd);
+    return false;
+#endif
+}
+
+bool btree_io_threads_init(Btree_Io *io) {
+    io->depth = io->depth < BTREE_IO_MAX_THREADS ? io->depth : BTREE_IO_MAX_THREADS;
+    io->pending = (Btree_Io_Request *)malloc(io->depth * sizeof(*io->pending));
+    io->done = (Btree_Io_Request *)malloc(io->depth * sizeof(*io->done));
+    io->threads = (pthread_t *)malloc(io->depth * sizeof(*io->threads));
+    if (io->pending == NULL || io->done == NULL || io->threads == NULL) {
+        free(io->pending);
+        free(io->done);
+        free(io->threads);
+        return false;
+    }
 
-        if (sibbling_right) {
-            btree_node_destroy(sibbling_right);
+    pthread_mutex_init(&io->mutex, NULL);
+    pthread_cond_init(&io->submitted, NULL);
+    pthread_cond_init(&io->completed, NULL);
+    for (; io->count_threads < io->depth; io->count_threads++) {
+        if (pthread_create(&io->threads[io->count_threads], NULL, btree_io_worker, io) != 0) {
+            break;
         }
+    }
 
-        return sibbling_left;
+    // fewer threads only means fewer reads in flight
+    io->depth = io->count_threads;
+    if (io->count_threads == 0) {
+        pthread_mutex_destroy(&io->mutex);
+        pthread_cond_destroy(&io->submitted);
+        pthread_cond_destroy(&io->completed);
+        free(io->pending);
+        free(io->done);
+        free(io->threads);
+        return false;
     }
+    return true;
+}
 
-    btree_node_merge(btree, x, x_ci, sibbling_right, i);
+void *btree_io_worker(void *arg) {
+    Btree_Io *io = arg;
+    pthread_mutex_lock(&io->mutex);
+    while (true) {
+        while (!io->stop && io->count_pending == 0) {
+            pthread_cond_wait(&io->submitted, &io->mutex);
+        }
+        if (io->stop) {
+            break;
+        }
 
-    if (sibbling_left) {
-        btree_node_destroy(sibbling_left);
+        Btree_Io_Request request = io->pending[--io->count_pending];
+        pthread_mutex_unlock(&io->mutex);
+        request.failed = pread(io->fd, request.data, io->size, request.offset) != (ssize_t)io->size;
+        pthread_mutex_lock(&io->mutex);
+        io->done[io->count_done++] = request;
+        pthread_cond_signal(&io->completed);
     }
+    pthread_mutex_unlock(&io->mutex);
+    return NULL;
+}
 
-    return x_ci;
+// Queues a read of the node image at offset into data. Callers never have more than depth reads in flight.
+void btree_io_submit(const Btree *btree, size_t offset, uint8_t *data, int tag) {
+    Btree_Io *io = btree->io;
+#ifdef __NR_io_uring_setup
+    if (io->engine == BTREE_IO_URING) {
+        uint32_t tail = *io->sq_tail;
+        uint32_t index = tail & *io->sq_mask;
+        struct io_uring_sqe *sqe = (struct io_uring_sqe *)io->sqes + index;
+        memset(sqe, 0, sizeof(*sqe));
+        sqe->opcode = IORING_OP_READ;
+        sqe->fd = io->fd;
+        sqe->off = offset;
+        sqe->addr = (uintptr_t)data;
+        sqe->len = io->size;
+        sqe->user_data = (uint64_t)++io->count_submitted << 32 | (uint32_t)tag;
+        io->in_flight[tag] = (Btree_Io_Request){.offset = offset, .data = data, .tag = tag, .id = sqe->user_data};
+        io->sq_array[index] = index;
+        __atomic_store_n(io->sq_tail, tail + 1, __ATOMIC_RELEASE);
+        io->count_unsubmitted++;
+        return;
+    }
+#endif
+
+    pthread_mutex_lock(&io->mutex);
+    io->pending[io->count_pending++] = (Btree_Io_Request){.offset = offset, .data = data, .tag = tag};
+    pthread_cond_signal(&io->submitted);
+    pthread_mutex_unlock(&io->mutex);
 }
 
-void btree_node_rotate_left(const Btree *btree, Btree_Node *x, Btree_Node *y, Btree_Node *z, int i) {
-    y->items[y->count_keys] = x->items[i];
-    if (!y->is_leaf) {
-        y->children[y->count_keys + 1] = z->children[0];
+// Blocks until at least one read completes and returns how many did. When the ring fails, every read still
+// in flight is redone with pread instead, so a caller waiting on them always gets them back.
+int btree_io_wait(const Btree *btree, Btree_Io_Request *completed) {
+    Btree_Io *io = btree->io;
+    int n = 0;
+#ifdef __NR_io_uring_setup
+    if (io->engine == BTREE_IO_URING) {
+        int submitted = syscall(__NR_io_uring_enter, io->ring_fd, io->count_unsubmitted, 1, IORING_ENTER_GETEVENTS,
+                                NULL, 0);
+        bool broken = submitted < 0 && errno != EINTR;
+        if (broken) {
+            btree_log(btree, BTREE_LOG_ERROR, "Failed to submit reads: %s", btree_strerr(BTREE_ERROR_UNIX));
+        } else if (submitted > 0) {
+            io->count_unsubmitted -= submitted;
+        }
+
+        uint32_t head = *io->cq_head;
+        uint32_t tail = __atomic_load_n(io->cq_tail, __ATOMIC_ACQUIRE);
+        for (; head != tail; head++) {
+            struct io_uring_cqe *cqe = (struct io_uring_cqe *)io->cqes + (head & *io->cq_mask);
+            Btree_Io_Request *request = &io->in_flight[(uint32_t)cqe->user_data];
+            if (request->data != NULL && request->id == cqe->user_data) {
+                completed[n++] = (Btree_Io_Request){.tag = request->tag, .failed = cqe->res != (int)io->size};
+                request->data = NULL;
+            }
+        }
+        __atomic_store_n(io->cq_head, head, __ATOMIC_RELEASE);
+        if (!broken) {
+            return n;
+        }
+
+        // the entries the kernel never took are withdrawn, so they cannot be read a second time later
+        __atomic_store_n(io->sq_tail, *io->sq_tail - io->count_unsubmitted, __ATOMIC_RELEASE);
+        io->count_unsubmitted = 0;
+        for (int tag = 0; tag < io->depth; tag++) {
+            Btree_Io_Request *request = &io->in_flight[tag];
+            if (request->data != NULL) {
+                bool failed = pread(io->fd, request->data, io->size, request->offset) != (ssize_t)io->size;
+                completed[n++] = (Btree_Io_Request){.tag = tag, .failed = failed};
+                request->data = NULL;
+            }
+        }
+        return n;
     }
-    y->count_keys++;
+#endif
 
-    x->items[i] = z->items[0];
+    pthread_mutex_lock(&io->mutex);
+    while (io->count_done == 0) {
+        pthread_cond_wait(&io->completed, &io->mutex);
+    }
+    for (; n < io->count_done; n++) {
+        completed[n] = io->done[n];
+    }
+    io->count_done = 0;
+    pthread_mutex_unlock(&io->mutex);
+    return n;
+}
 
-    memmove(z->items, z->items + 1, (z->count_keys - 1) * sizeof(*z->items));
-    if (!z->is_leaf) {
-        memmove(z->children, z->children + 1, z->count_keys * sizeof(*z->children));
+void btree_io_destroy(Btree *btree) {
+    Btree_Io *io = btree->io;
+    if (io == NULL) {
+        return;
     }
-    z->count_keys--;
-    memset(&z->items[z->count_keys], 0, sizeof(*z->items));
-    if (!z->is_leaf) {
-        z->children[z->count_keys + 1] = 0;
+
+    if (io->engine == BTREE_IO_URING) {
+        if (io->cq_ring != io->sq_ring) {
+            munmap(io->cq_ring, io->cq_ring_size);
+        }
+        munmap(io->sq_ring, io->sq_ring_size);
+#ifdef __NR_io_uring_setup
+        munmap(io->sqes, io->depth * sizeof(struct io_uring_sqe));
+#endif
+        close(io->ring_fd);
+        free(io->in_flight);
+    } else {
+        pthread_mutex_lock(&io->mutex);
+        io->stop = true;
+        pthread_cond_broadcast(&io->submitted);
+        pthread_mutex_unlock(&io->mutex);
+        for (int i = 0; i < io->count_threads; i++) {
+            pthread_join(io->threads[i], NULL);
+        }
+        pthread_mutex_destroy(&io->mutex);
+        pthread_cond_destroy(&io->submitted);
+        pthread_cond_destroy(&io->completed);
+        free(io->pending);
+        free(io->done);
+        free(io->threads);
     }
+    pthread_mutex_destroy(&io->busy);
+    free(io);
+    btree->io = NULL;
+}
 
-    btree_node_write(btree, x);
-    btree_node_write(btree, y);
-    btree_node_write(btree, z);
+Btree_Result btree_bytes_init(Btree_Bytes *btree, Btree_Options options) {
+    if (btree == NULL) {
+        return BTREE_ERROR_NIL;
+    }
+
+    memset(btree, 0, sizeof(*btree));
+    btree->log_handler = options.log_handler;
+    btree->fd = open(options.path, O_RDWR);
+
+    if (btree->fd == -1 && errno == ENOENT) {
+        btree->header.t = options.t;
+        btree->header.M = 2 * options.t;
+        btree->header.page_size = BTREE_BYTES_PAGE_SIZE;
+        if (options.t < 2 || !btree_bytes_layout(btree)) {
+            return BTREE_ERROR_BAD_T;
+        }
+
+        btree->header.next_offset = btree->header.page_size;
+        btree->fd = open(options.path, O_RDWR | O_CREAT, S_IRUSR | S_IWUSR);
+        if (btree->fd == -1) {
+            return BTREE_ERROR_UNIX;
+        }
+
+        btree->root = btree_bytes_append_node(btree);
+        if (btree->root == NULL) {
+            close(btree->fd);
+            return BTREE_ERROR_UNIX;
+        }
+        btree->header.root_offset = btree->root->offset;
+        btree_bytes_header_write(btree);
+        return BTREE_OK;
+    }
+
+    if (btree->fd == -1) {
+        return BTREE_ERROR_UNIX;
+    }
+
+    uint8_t magic_bytes[sizeof(btree_bytes_magic_bytes)] = {0};
+    btree_bytes_header_read(btree, magic_bytes);
+    if (memcmp(magic_bytes, btree_bytes_magic_bytes, sizeof(magic_bytes)) != 0 || !btree_bytes_layout(btree)) {
+        close(btree->fd);
+        return BTREE_ERROR_FORMAT;
+    }
+
+    btree->root = btree_bytes_node_init(btree);
+    if (btree->root == NULL) {
+        close(btree->fd);
+        return BTREE_ERROR_UNIX;
+    }
+    btree_bytes_node_read(btree, btree->root, btree->header.root_offset);
+    return BTREE_OK;
 }
 
-void btree_node_rotate_right(const Btree *btree, Btree_Node *x, Btree_Node *y, Btree_Node *z, int i) {
-    memmove(z->items + 1, z->items, z->count_keys * sizeof(*z->items));
-    if (!z->is_leaf) {
-        memmove(z->children + 1, z->children, (z->count_keys + 1) * sizeof(*z->children));
+// Splits what a page has left after its fixed part evenly among M-1 entries, so preemptive splits and merges
+// never overflow a node. Returns false when that share is too small to be useful.
+bool btree_bytes_layout(Btree_Bytes *btree) {
+    int M = btree->header.M;
+    int page_size = btree->header.page_size;
+    if (M < 4 || page_size < BTREE_BYTES_NODE_HEADER_SIZE || page_size > UINT16_MAX + 1) {
+        return false;
     }
-    z->items[0] = x->items[i];
-    if (!z->is_leaf) {
-        z->children[0] = y->children[y->count_keys];
+
+    long fixed = BTREE_BYTES_NODE_HEADER_SIZE + M * sizeof(size_t) + (M - 1) * sizeof(Btree_Bytes_Slot);
+    btree->max_local = fixed < page_size ? (page_size - fixed) / (M - 1) : 0;
+    return btree->max_local >= BTREE_BYTES_MIN_LOCAL;
+}
+
+size_t btree_bytes_max_key(const Btree_Bytes *btree) {
+    size_t max_key = btree->max_local - sizeof(size_t);
+    return max_key < UINT16_MAX ? max_key : UINT16_MAX;
+}
+
+Btree_Result btree_bytes_put(Btree_Bytes *btree, const void *key, size_t key_len, const void *value,
+                             size_t value_len) {
+    if (btree == NULL || (key == NULL && key_len > 0) || (value == NULL && value_len > 0)) {
+        return BTREE_ERROR_NIL;
+    }
+    if (key_len > btree_bytes_max_key(btree) || value_len >= BTREE_BYTES_OVERFLOW) {
+        return BTREE_ERROR_TOO_LONG;
     }
-    z->count_keys++;
 
-    x->items[i] = y->items[y->count_keys - 1];
+    uint8_t local[btree->max_local];
+    uint32_t stored_len = value_len;
+    memcpy(local, key, key_len);
+    if (key_len + value_len <= (size_t)btree->max_local) {
+        memcpy(local + key_len, value, value_len);
+    } else {
+        size_t first = btree_bytes_overflow_write(btree, value, value_len);
+        if (first == 0) {
+            return BTREE_ERROR_UNIX;
+        }
+        memcpy(local + key_len, &first, sizeof(first));
+        stored_len |= BTREE_BYTES_OVERFLOW;
+    }
 
-    y->count_keys--;
-    memset(&y->items[y->count_keys], 0, sizeof(*y->items));
+    if (btree->root->count_keys == btree->header.M - 1) {
+        btree_bytes_grow_root(btree);
+    }
+    return btree_bytes_node_put_nonfull(btree, btree->root, local, key_len, stored_len);
+}
+
+void btree_bytes_grow_root(Btree_Bytes *btree) {
+    Btree_Bytes_Node *s = btree_bytes_append_node(btree);
+    s->is_leaf = false;
+    s->children[0] = btree->root->offset;
+    btree_bytes_node_split_child(btree, s, btree->root, 0);
+    btree_bytes_node_destroy(btree->root);
+    btree->root = s;
+    btree->header.root_offset = s->offset;
+    btree_bytes_header_write(btree);
+}
+
+Btree_Result btree_bytes_node_put_nonfull(Btree_Bytes *btree, Btree_Bytes_Node *x, const uint8_t *local, int key_len,
+                                          uint32_t value_len) {
+    int i = btree_bytes_search(x, local, key_len, true);
+
+    if (x->is_leaf) {
+        btree_bytes_node_insert(btree, x, i, local, key_len, value_len);
+        btree_bytes_node_write(btree, x);
+        return BTREE_OK;
+    }
+
+    Btree_Bytes_Node *x_ci = btree_bytes_node_init(btree);
+    if (x_ci == NULL) {
+        return BTREE_ERROR_UNIX;
+    }
+    btree_bytes_node_read(btree, x_ci, x->children[i]);
+
+    if (x_ci->count_keys == btree->header.M - 1) {
+        btree_bytes_node_split_child(btree, x, x_ci, i);
+        if (btree_bytes_cmp(local, key_len, btree_bytes_key(x, i), x->slots[i].key_len) > 0) {
+            i++;
+            btree_bytes_node_read(btree, x_ci, x->children[i]);
+        }
+    }
+
+    Btree_Result res = btree_bytes_node_put_nonfull(btree, x_ci, local, key_len, value_len);
+    btree_bytes_node_destroy(x_ci);
+    return res;
+}
+
+void btree_bytes_node_split_child(Btree_Bytes *btree, Btree_Bytes_Node *x, Btree_Bytes_Node *y, int i) {
+    Btree_Bytes_Node *z = btree_bytes_append_node(btree);
+    int t = btree->header.t;
+
+    z->is_leaf = y->is_leaf;
+    for (int j = 0; j < t - 1; j++) {
+        btree_bytes_node_copy(btree, z, j, y, t + j);
+    }
     if (!y->is_leaf) {
-        y->children[y->count_keys + 1] = 0;
+        memcpy(z->children, y->children + t, t * sizeof(*z->children));
     }
 
-    btree_node_write(btree, x);
-    btree_node_write(btree, y);
-    btree_node_write(btree, z);
+    memmove(x->children + i + 1, x->children + i, (x->count_keys - i + 1) * sizeof(*x->children));
+    x->children[i + 1] = z->offset;
+    btree_bytes_node_copy(btree, x, i, y, t - 1);
+    btree_bytes_node_truncate(y, t - 1);
+    if (!y->is_leaf) {
+        memset(y->children + t, 0, t * sizeof(*y->children));
+    }
+
+    btree_bytes_node_write(btree, x);
+    btree_bytes_node_write(btree, y);
+    btree_bytes_node_write(btree, z);
+    btree_bytes_header_write(btree);
+    btree_bytes_node_destroy(z);
 }
 
-const char *btree_strerr(int err) {
-    switch (err) {
-    case BTREE_OK:
-        return "Ok";
-    case BTREE_ERROR_BAD_T:
-        return "Param t must be >= 2";
-    case BTREE_ERROR_KEY_NOT_FOUND:
-        return "Key not found";
-    case BTREE_ERROR_NIL:
-        return "Null pointer to struct";
-    case BTREE_ERROR_FORMAT:
-        return "Invalid file format";
-    case BTREE_ERROR_UNIX:
-        return strerror(errno); // fallback to errno
-    default:
-        return "Unknown";
+Btree_Result btree_bytes_find(const Btree_Bytes *btree, const void *key, size_t key_len, void *value,
+                              size_t *value_len) {
+    if (btree == NULL || (key == NULL && key_len > 0)) {
+        return BTREE_ERROR_NIL;
+    }
+
+    const Btree_Bytes_Node *x = btree->root;
+    Btree_Bytes_Node *node = NULL;
+    Btree_Result res = BTREE_ERROR_KEY_NOT_FOUND;
+    while (true) {
+        int i = btree_bytes_search(x, key, key_len, false);
+        if (i < x->count_keys && btree_bytes_cmp(btree_bytes_key(x, i), x->slots[i].key_len, key, key_len) == 0) {
+            res = btree_bytes_value_read(btree, x, i, value, value_len);
+            break;
+        }
+        if (x->is_leaf) {
+            break;
+        }
+
+        if (node == NULL && (node = btree_bytes_node_init(btree)) == NULL) {
+            res = BTREE_ERROR_UNIX;
+            break;
+        }
+        btree_bytes_node_read(btree, node, x->children[i]);
+        x = node;
     }
+
+    btree_bytes_node_destroy(node);
+    return res;
 }
 
-void btree_header_read(Btree *btree, uint8_t *magic_bytes) {
-    int n = 2;
-    struct iovec vec[n];
-    vec[0].iov_base = magic_bytes;
-    vec[0].iov_len = sizeof(btree_magic_bytes);
-    vec[1].iov_base = &btree->header;
-    vec[1].iov_len = sizeof(btree->header);
-    ssize_t bytes_read = preadv(btree->fd, vec, n, 0);
-    if (bytes_read == -1) {
-        btree_log(btree, BTREE_LOG_ERROR, "Failed to read header: %s", btree_strerr(BTREE_ERROR_UNIX));
+Btree_Result btree_bytes_value_read(const Btree_Bytes *btree, const Btree_Bytes_Node *node, int i, void *value,
+                                    size_t *value_len) {
+    const Btree_Bytes_Slot *slot = &node->slots[i];
+    size_t len = slot->value_len & ~BTREE_BYTES_OVERFLOW;
+    size_t capacity = value_len != NULL ? *value_len : 0;
+    if (value_len != NULL) {
+        *value_len = len;
+    }
+    if (value == NULL || capacity == 0) {
+        return BTREE_OK;
+    }
+
+    size_t n = len < capacity ? len : capacity;
+    const uint8_t *local = btree_bytes_key(node, i) + slot->key_len;
+    if (!(slot->value_len & BTREE_BYTES_OVERFLOW)) {
+        memcpy(value, local, n);
+        return BTREE_OK;
     }
+
+    size_t first;
+    memcpy(&first, local, sizeof(first));
+    return btree_bytes_overflow_read(btree, first, value, n) ? BTREE_OK : BTREE_ERROR_UNIX;
 }
 
-void btree_header_write(const Btree *btree) {
-    int n = 2;
-    struct iovec vec[n];
-    vec[0].iov_base = (uint8_t *)btree_magic_bytes;
-    vec[0].iov_len = sizeof(btree_magic_bytes);
-    vec[1].iov_base = (Btree_Header *)&btree->header;
-    vec[1].iov_len = sizeof(btree->header);
-    ssize_t bytes_written = pwritev(btree->fd, vec, n, 0);
-    if (bytes_written == -1) {
-        btree_log(btree, BTREE_LOG_ERROR, "Failed to write header: %s", btree_strerr(BTREE_ERROR_UNIX));
+Btree_Result btree_bytes_delete(Btree_Bytes *btree, const void *key, size_t key_len) {
+    if (btree == NULL || (key == NULL && key_len > 0)) {
+        return BTREE_ERROR_NIL;
+    }
+    return btree_bytes_node_delete(btree, btree->root, key, key_len, true);
+}
+
+// drop frees the overflow pages of the entry deleted. It is cleared once they are gone, or when the entry
+// deleted is a copy that moved up into an ancestor and still owns them.
+Btree_Result btree_bytes_node_delete(Btree_Bytes *btree, Btree_Bytes_Node *node, const uint8_t *key, size_t key_len,
+                                     bool drop) {
+    int t = btree->header.t;
+    Btree_Bytes_Node *y = NULL, *z = NULL, *x_ci = NULL, *sibbling_left = NULL, *sibbling_right = NULL;
+    Btree_Result res = BTREE_OK;
+
+    int i = btree_bytes_search(node, key, key_len, false);
+
+    if (i < node->count_keys && btree_bytes_cmp(btree_bytes_key(node, i), node->slots[i].key_len, key, key_len) == 0) {
+        if (drop) {
+            btree_bytes_value_drop(btree, node, i);
+        }
+
+        if (node->is_leaf) {
+            btree_bytes_node_remove(node, i);
+            btree_bytes_node_write(btree, node);
+            return BTREE_OK;
+        }
+
+        y = btree_bytes_node_init(btree);
+        btree_bytes_node_read(btree, y, node->children[i]);
+
+        if (y->count_keys >= t) {
+            Btree_Bytes_Node *pred = btree_bytes_node_get_pred(btree, node, i);
+            int last = pred->count_keys - 1;
+            btree_bytes_node_remove(node, i);
+            btree_bytes_node_copy(btree, node, i, pred, last);
+            btree_bytes_node_write(btree, node);
+            res = btree_bytes_node_delete(btree, y, btree_bytes_key(pred, last), pred->slots[last].key_len, false);
+            btree_bytes_node_destroy(pred);
+            btree_bytes_node_destroy(y);
+            return res;
+        }
+
+        z = btree_bytes_node_init(btree);
+        btree_bytes_node_read(btree, z, node->children[i + 1]);
+
+        if (z->count_keys >= t) {
+            btree_bytes_node_destroy(y);
+            Btree_Bytes_Node *post = btree_bytes_node_get_post(btree, node, i);
+            btree_bytes_node_remove(node, i);
+            btree_bytes_node_copy(btree, node, i, post, 0);
+            btree_bytes_node_write(btree, node);
+            res = btree_bytes_node_delete(btree, z, btree_bytes_key(post, 0), post->slots[0].key_len, false);
+            btree_bytes_node_destroy(post);
+            btree_bytes_node_destroy(z);
+            return res;
+        }
+
+        btree_bytes_node_merge(btree, node, y, z, i);
+        res = btree_bytes_node_delete(btree, y, key, key_len, false);
+        if (btree->root != y) {
+            btree_bytes_node_destroy(y);
+        }
+
+        return res;
+    }
+
+    if (node->is_leaf) {
+        return BTREE_ERROR_KEY_NOT_FOUND;
+    }
+
+    x_ci = btree_bytes_node_init(btree);
+    btree_bytes_node_read(btree, x_ci, node->children[i]);
+
+    if (x_ci->count_keys > t - 1) {
+        res = btree_bytes_node_delete(btree, x_ci, key, key_len, drop);
+        btree_bytes_node_destroy(x_ci);
+        return res;
+    }
+
+    if (i > 0) {
+        sibbling_left = btree_bytes_node_init(btree);
+        btree_bytes_node_read(btree, sibbling_left, node->children[i - 1]);
+    }
+
+    if (i < node->count_keys) {
+        sibbling_right = btree_bytes_node_init(btree);
+        btree_bytes_node_read(btree, sibbling_right, node->children[i + 1]);
+    }
+
+    if (btree_bytes_node_redistribute(btree, node, x_ci, sibbling_left, sibbling_right, i)) {
+        btree_bytes_node_destroy(sibbling_left);
+        btree_bytes_node_destroy(sibbling_right);
+        res = btree_bytes_node_delete(btree, x_ci, key, key_len, drop);
+    } else {
+        x_ci = btree_bytes_node_concatenate(btree, node, x_ci, sibbling_left, sibbling_right, i);
+        res = btree_bytes_node_delete(btree, x_ci, key, key_len, drop);
+    }
+
+    if (btree->root != x_ci) {
+        btree_bytes_node_destroy(x_ci);
+    }
+
+    return res;
+}
+
+// Returns the leaf holding the predecessor of entry i as its last entry.
+Btree_Bytes_Node *btree_bytes_node_get_pred(const Btree_Bytes *btree, const Btree_Bytes_Node *node, int i) {
+    Btree_Bytes_Node *pred = btree_bytes_node_init(btree);
+    btree_bytes_node_read(btree, pred, node->children[i]);
+
+    while (!pred->is_leaf) {
+        btree_bytes_node_read(btree, pred, pred->children[pred->count_keys]);
+    }
+
+    return pred;
+}
+
+// Returns the leaf holding the successor of entry i as its first entry.
+Btree_Bytes_Node *btree_bytes_node_get_post(const Btree_Bytes *btree, const Btree_Bytes_Node *node, int i) {
+    Btree_Bytes_Node *post = btree_bytes_node_init(btree);
+    btree_bytes_node_read(btree, post, node->children[i + 1]);
+
+    while (!post->is_leaf) {
+        btree_bytes_node_read(btree, post, post->children[0]);
     }
+
+    return post;
 }
 
-Btree_Result btree_display(const Btree *btree, FILE *fp) {
-    if (btree == NULL) {
-        return BTREE_ERROR_NIL;
+void btree_bytes_node_merge(Btree_Bytes *btree, Btree_Bytes_Node *x, Btree_Bytes_Node *y, Btree_Bytes_Node *z, int i) {
+    int t = btree->header.t;
+    btree_bytes_node_copy(btree, y, y->count_keys, x, i);
+    btree_bytes_node_remove(x, i);
+    memmove(x->children + i + 1, x->children + i + 2, (x->count_keys - i) * sizeof(*x->children));
+    x->children[x->count_keys + 1] = 0;
+    for (int j = 0; j < z->count_keys; j++) {
+        btree_bytes_node_copy(btree, y, y->count_keys, z, j);
+    }
+    if (!y->is_leaf) {
+        memcpy(y->children + t, z->children, t * sizeof(*y->children));
     }
 
-    size_t last_level_offset = btree->root->offset;
-    Btree_Queue queue;
-    if (!btree_queue_init(&queue, btree->header.count_nodes)) {
-        btree_log(btree, BTREE_LOG_ERROR, "Error to init offset queue");
-        return BTREE_ERROR_UNIX;
+    btree_bytes_node_write(btree, x);
+
+    if (btree->root == x && x->count_keys == 0) {
+        btree_bytes_remove_node(btree, x);
+        btree->root = y;
+        btree->header.root_offset = y->offset;
     }
-    btree_queue_enqueue(&queue, btree->root->offset);
-    Btree_Node *node = btree_node_init(btree);
 
-    while (queue.count > 0) {
-        size_t offset = btree_queue_dequeue(&queue);
-        btree_node_read2(btree, node, offset);
+    btree_bytes_remove_node(btree, z);
+    btree_bytes_node_write(btree, y);
+    btree_bytes_header_write(btree);
+}
 
-        fprintf(fp, "[ ");
-        for (int i = 0; i < node->count_keys; i++) {
-            fprintf(fp, "%d ", node->items[i].key);
-        }
-        fprintf(fp, "] ");
+bool btree_bytes_node_redistribute(Btree_Bytes *btree, Btree_Bytes_Node *x, Btree_Bytes_Node *x_ci,
+                                   Btree_Bytes_Node *sibbling_left, Btree_Bytes_Node *sibbling_right, int i) {
+    int t = btree->header.t;
 
-        if (offset == last_level_offset) {
-            last_level_offset = node->children[node->count_keys];
-            fprintf(fp, "\n");
-        }
+    if (sibbling_left && sibbling_left->count_keys >= t) {
+        btree_bytes_node_rotate_right(btree, x, sibbling_left, x_ci, i - 1);
+        return true;
+    }
 
-        if (!node->is_leaf) {
-            for (int i = 0; i <= node->count_keys; i++) {
-                btree_queue_enqueue(&queue, node->children[i]);
-            }
-        }
+    if (sibbling_right && sibbling_right->count_keys >= t) {
+        btree_bytes_node_rotate_left(btree, x, x_ci, sibbling_right, i);
+        return true;
     }
 
-    btree_node_destroy(node);
-    btree_queue_destroy(&queue);
-    return BTREE_OK;
+    return false;
 }
 
-Btree_Node *btree_node_init(const Btree *btree) {
-    size_t node_size = sizeof(*btree->root);
-    size_t items_size = (btree->header.M - 1) * sizeof(*btree->root->items);
-    size_t children_size = (btree->header.M) * sizeof(*btree->root->children);
-    Btree_Node *node = (Btree_Node *)calloc(1, node_size + items_size + children_size);
-    if (node == NULL) {
-        return NULL;
+Btree_Bytes_Node *btree_bytes_node_concatenate(Btree_Bytes *btree, Btree_Bytes_Node *x, Btree_Bytes_Node *x_ci,
+                                               Btree_Bytes_Node *sibbling_left, Btree_Bytes_Node *sibbling_right,
+                                               int i) {
+    if (sibbling_left) {
+        btree_bytes_node_merge(btree, x, sibbling_left, x_ci, i - 1);
+        btree_bytes_node_destroy(sibbling_right);
+        return sibbling_left;
     }
-    node->items = (Item *)((uint8_t *)node + node_size);
-    node->children = (size_t *)((uint8_t *)node + node_size + items_size);
-    return node;
+
+    btree_bytes_node_merge(btree, x, x_ci, sibbling_right, i);
+    return x_ci;
 }
 
-void btree_node_read2(const Btree *btree, Btree_Node *node, size_t offset) {
-    node->offset = offset;
-    int n = 3;
-    struct iovec vec[n];
-    vec[0].iov_base = &node->count_keys;
-    vec[0].iov_len = sizeof(node->count_keys);
-    vec[1].iov_base = node->items;
-    vec[1].iov_len = (btree->header.M - 1) * sizeof(*node->items);
-    vec[2].iov_base = node->children;
-    vec[2].iov_len = (btree->header.M) * sizeof(*node->children);
-    ssize_t bytes_read = preadv(btree->fd, vec, n, offset);
-    if (bytes_read == -1) {
-        btree_log(btree, BTREE_LOG_ERROR, "Failed to read node: %s", btree_strerr(BTREE_ERROR_UNIX));
+void btree_bytes_node_rotate_left(const Btree_Bytes *btree, Btree_Bytes_Node *x, Btree_Bytes_Node *y,
+                                  Btree_Bytes_Node *z, int i) {
+    if (!y->is_leaf) {
+        y->children[y->count_keys + 1] = z->children[0];
     }
-    node->is_leaf = node->children[0] == 0;
-}
+    btree_bytes_node_copy(btree, y, y->count_keys, x, i);
 
-void btree_node_write(const Btree *btree, const Btree_Node *node) {
-    int n = 3;
-    struct iovec vec[n];
-    vec[0].iov_base = (int *)&node->count_keys;
-    vec[0].iov_len = sizeof(node->count_keys);
-    vec[1].iov_base = node->items;
-    vec[1].iov_len = (btree->header.M - 1) * sizeof(*node->items);
-    vec[2].iov_base = node->children;
-    vec[2].iov_len = (btree->header.M) * sizeof(*node->children);
-    ssize_t bytes_written = pwritev(btree->fd, vec, n, node->offset);
-    if (bytes_written == -1) {
-        btree_log(btree, BTREE_LOG_ERROR, "Failed to write node: %s", btree_strerr(BTREE_ERROR_UNIX));
+    btree_bytes_node_remove(x, i);
+    btree_bytes_node_copy(btree, x, i, z, 0);
+
+    btree_bytes_node_remove(z, 0);
+    if (!z->is_leaf) {
+        memmove(z->children, z->children + 1, (z->count_keys + 1) * sizeof(*z->children));
+        z->children[z->count_keys + 1] = 0;
     }
+
+    btree_bytes_node_write(btree, x);
+    btree_bytes_node_write(btree, y);
+    btree_bytes_node_write(btree, z);
 }
 
-void btree_set_root(Btree *btree, Btree_Node *node) {
-    btree->root = node;
-    btree->header.root_offset = node->offset;
+void btree_bytes_node_rotate_right(const Btree_Bytes *btree, Btree_Bytes_Node *x, Btree_Bytes_Node *y,
+                                   Btree_Bytes_Node *z, int i) {
+    if (!z->is_leaf) {
+        memmove(z->children + 1, z->children, (z->count_keys + 1) * sizeof(*z->children));
+        z->children[0] = y->children[y->count_keys];
+    }
+    btree_bytes_node_copy(btree, z, 0, x, i);
+
+    btree_bytes_node_remove(x, i);
+    btree_bytes_node_copy(btree, x, i, y, y->count_keys - 1);
+
+    btree_bytes_node_remove(y, y->count_keys - 1);
+    if (!y->is_leaf) {
+        y->children[y->count_keys + 1] = 0;
+    }
+
+    btree_bytes_node_write(btree, x);
+    btree_bytes_node_write(btree, y);
+    btree_bytes_node_write(btree, z);
 }
 
-size_t btree_node_size_in_file(const Btree *btree) {
-    return sizeof(btree->root->count_keys) + (btree->header.M - 1) * sizeof(*btree->root->items) +
-           (btree->header.M) * sizeof(*btree->root->children);
+Btree_Result btree_bytes_destroy(Btree_Bytes *btree) {
+    if (btree == NULL) {
+        return BTREE_ERROR_NIL;
+    }
+    btree_bytes_header_write(btree);
+    btree_bytes_node_destroy(btree->root);
+    if (close(btree->fd) == -1) {
+        return BTREE_ERROR_UNIX;
+    }
+    return BTREE_OK;
 }
 
-int btree_is_valid(const Btree *btree) {
+int btree_bytes_is_valid(const Btree_Bytes *btree) {
     if (btree->header.M != btree->header.t * 2) {
         return 0;
     }
-    return btree_node_is_valid(btree, btree->root);
+    return btree_bytes_node_is_valid(btree, btree->root);
 }
 
-int btree_node_is_valid(const Btree *btree, const Btree_Node *node) {
+int btree_bytes_node_is_valid(const Btree_Bytes *btree, const Btree_Bytes_Node *node) {
     int t = btree->header.t;
     int M = btree->header.M;
 
     if (btree->root != node && !(t - 1 <= node->count_keys && node->count_keys <= M - 1)) {
-        btree_log(btree, BTREE_LOG_ERROR, "Keys out of bounds [t-1,2t-1]");
+        btree_bytes_log(btree, BTREE_LOG_ERROR, "Keys out of bounds [t-1,2t-1]");
         return 0;
     }
 
-    if (node->is_leaf) {
-        for (int i = 0; i <= node->count_keys; i++) {
-            if (node->children[i] != 0) {
-                btree_log(btree, BTREE_LOG_ERROR, "Dirty children in leaf node");
-                return 0;
-            }
-        }
-    } else {
-        for (int i = 0; i <= node->count_keys; i++) {
-            if (node->children[i] == 0) {
-                btree_log(btree, BTREE_LOG_ERROR, "Fewer children");
-                return 0;
-            }
-        }
-        for (int i = node->count_keys + 1; i < M; i++) {
-            if (node->children[i] != 0) {
-                btree_log(btree, BTREE_LOG_ERROR, "Dirty children in internal node");
-                return 0;
-            }
+    for (int i = 0; i < M; i++) {
+        if ((i <= node->count_keys && !node->is_leaf) != (node->children[i] != 0)) {
+            btree_bytes_log(btree, BTREE_LOG_ERROR, "Children do not match keys");
+            return 0;
         }
     }
 
-    for (int i = 1; i < node->count_keys; i++) {
-        if (node->items[i].key < node->items[i - 1].key) {
-            btree_log(btree, BTREE_LOG_ERROR, "Unordered keys");
+    for (int i = 0; i < node->count_keys; i++) {
+        const Btree_Bytes_Slot *slot = &node->slots[i];
+        if (slot->offset < node->heap || slot->offset + btree_bytes_local_size(slot) > btree->header.page_size) {
+            btree_bytes_log(btree, BTREE_LOG_ERROR, "Entry outside of the heap");
+            return 0;
+        }
+        if (i > 0 && btree_bytes_cmp(btree_bytes_key(node, i), slot->key_len, btree_bytes_key(node, i - 1),
+                                     node->slots[i - 1].key_len) < 0) {
+            btree_bytes_log(btree, BTREE_LOG_ERROR, "Unordered keys");
             return 0;
         }
     }
@@ -723,86 +6451,290 @@ int btree_node_is_valid(const Btree *btree, const Btree_Node *node) {
         return 1;
     }
 
-    Btree_Node *child = btree_node_init(btree);
+    Btree_Bytes_Node *child = btree_bytes_node_init(btree);
     for (int i = 0; i <= node->count_keys; i++) {
-        btree_node_read2(btree, child, node->children[i]);
-        if (!btree_node_is_valid(btree, child)) {
-            btree_node_destroy(child);
+        btree_bytes_node_read(btree, child, node->children[i]);
+        if (!btree_bytes_node_is_valid(btree, child)) {
+            btree_bytes_node_destroy(child);
             return 0;
         }
     }
 
-    btree_node_destroy(child);
+    btree_bytes_node_destroy(child);
     return 1;
 }
 
-#define LOG_LEVELS                                                                                                     \
-    LEVEL(BTREE_LOG_DEBUG, "DEBUG")                                                                                    \
-    LEVEL(BTREE_LOG_WARN, "WARN")                                                                                      \
-    LEVEL(BTREE_LOG_INFO, "INFO")                                                                                      \
-    LEVEL(BTREE_LOG_ERROR, "ERROR")
+// The page image follows the struct, in the same allocation.
+Btree_Bytes_Node *btree_bytes_node_init(const Btree_Bytes *btree) {
+    Btree_Bytes_Node *node = (Btree_Bytes_Node *)calloc(1, sizeof(*node) + btree->header.page_size);
+    if (node == NULL) {
+        return NULL;
+    }
 
-void btree_default_log_handler(Btree_Log_Level level, const char *fmt, va_list args) {
-    switch (level) {
-#define LEVEL(kind, prefix)                                                                                            \
-    case kind:                                                                                                         \
-        fprintf(stderr, "[%s] ", prefix);                                                                              \
-        break;
-        LOG_LEVELS
-#undef LEVEL
+    node->page = (uint8_t *)(node + 1);
+    node->children = (size_t *)(node->page + BTREE_BYTES_NODE_HEADER_SIZE);
+    node->slots = (Btree_Bytes_Slot *)(node->children + btree->header.M);
+    node->is_leaf = true;
+    node->heap = btree->header.page_size;
+    return node;
+}
+
+void btree_bytes_node_destroy(Btree_Bytes_Node *node) {
+    free(node);
+}
+
+Btree_Bytes_Node *btree_bytes_append_node(Btree_Bytes *btree) {
+    Btree_Bytes_Node *node = btree_bytes_node_init(btree);
+    if (node == NULL) {
+        return NULL;
     }
 
-    vfprintf(stderr, fmt, args);
-    fprintf(stderr, "\n");
+    node->offset = btree_bytes_pop_free_offset(btree);
+    btree->header.count_nodes++;
+    btree_bytes_node_write(btree, node);
+    return node;
 }
 
-void btree_discard_log_handler(Btree_Log_Level level, const char *fmt, va_list args) {
-    BTREE_UNUSED(level);
-    BTREE_UNUSED(fmt);
-    BTREE_UNUSED(args);
+void btree_bytes_remove_node(Btree_Bytes *btree, Btree_Bytes_Node *x) {
+    btree_bytes_free_page(btree, x->offset);
+    btree_bytes_node_destroy(x);
+    btree->header.count_nodes--;
 }
 
-void btree_log(const Btree *btree, Btree_Log_Level level, const char *fmt, ...) {
-    va_list args;
-    va_start(args, fmt);
-    btree->log_handler(level, fmt, args);
-    va_end(args);
+// Node pages and overflow pages share one free list, linked through the first bytes of every free page.
+size_t btree_bytes_pop_free_offset(Btree_Bytes *btree) {
+    if (btree->header.next_free_offset == 0) {
+        size_t offset = btree->header.next_offset;
+        btree->header.next_offset += btree->header.page_size;
+        return offset;
+    }
+
+    size_t offset = btree->header.next_free_offset;
+    size_t next = 0;
+    if (pread(btree->fd, &next, sizeof(next), offset) == -1) {
+        btree_bytes_log(btree, BTREE_LOG_ERROR, "Failed to read freed offset: %s", btree_strerr(BTREE_ERROR_UNIX));
+    }
+    btree->header.next_free_offset = next;
+    return offset;
 }
 
-bool btree_queue_init(Btree_Queue *queue, int capacity) {
-    if (queue == NULL) {
-        return false;
+void btree_bytes_free_page(Btree_Bytes *btree, size_t offset) {
+    if (pwrite(btree->fd, &btree->header.next_free_offset, sizeof(btree->header.next_free_offset), offset) == -1) {
+        btree_bytes_log(btree, BTREE_LOG_ERROR, "Failed to write freed offset: %s", btree_strerr(BTREE_ERROR_UNIX));
     }
-    memset(queue, 0, sizeof(*queue));
-    queue->capacity = capacity;
-    queue->items = (size_t *)malloc(capacity * sizeof(*queue->items));
-    return queue->items != NULL;
+    btree->header.next_free_offset = offset;
 }
 
-bool btree_queue_enqueue(Btree_Queue *queue, size_t offset) {
-    if (queue == NULL || offset == 0 || queue->count == queue->capacity) {
-        return false;
+void btree_bytes_node_read(const Btree_Bytes *btree, Btree_Bytes_Node *node, size_t offset) {
+    node->offset = offset;
+    ssize_t bytes_read = pread(btree->fd, node->page, btree->header.page_size, offset);
+    if (bytes_read == -1) {
+        btree_bytes_log(btree, BTREE_LOG_ERROR, "Failed to read node: %s", btree_strerr(BTREE_ERROR_UNIX));
     }
-    queue->items[queue->head++] = offset;
-    queue->head %= queue->capacity;
-    queue->count++;
-    return true;
+
+    uint16_t heap;
+    memcpy(&node->count_keys, node->page, sizeof(node->count_keys));
+    memcpy(&heap, node->page + sizeof(node->count_keys), sizeof(heap));
+    node->heap = heap == 0 ? btree->header.page_size : heap;
+    node->is_leaf = node->page[sizeof(node->count_keys) + sizeof(heap)];
 }
 
-size_t btree_queue_dequeue(Btree_Queue *queue) {
-    if (queue == NULL || queue->count == 0) {
-        return 0;
+// An empty heap starts at the end of the page, which is stored as 0 since it does not fit 16 bits.
+void btree_bytes_node_write(const Btree_Bytes *btree, Btree_Bytes_Node *node) {
+    uint16_t heap = node->heap == btree->header.page_size ? 0 : node->heap;
+    memcpy(node->page, &node->count_keys, sizeof(node->count_keys));
+    memcpy(node->page + sizeof(node->count_keys), &heap, sizeof(heap));
+    node->page[sizeof(node->count_keys) + sizeof(heap)] = node->is_leaf;
+
+    ssize_t bytes_written = pwrite(btree->fd, node->page, btree->header.page_size, node->offset);
+    if (bytes_written == -1) {
+        btree_bytes_log(btree, BTREE_LOG_ERROR, "Failed to write node: %s", btree_strerr(BTREE_ERROR_UNIX));
     }
-    size_t offset = queue->items[queue->tail++];
-    queue->tail %= queue->capacity;
-    queue->count--;
-    return offset;
 }
 
-void btree_queue_destroy(Btree_Queue *queue) {
-    if (queue == NULL) {
-        return;
+uint8_t *btree_bytes_key(const Btree_Bytes_Node *node, int i) {
+    return node->page + node->slots[i].offset;
+}
+
+int btree_bytes_local_size(const Btree_Bytes_Slot *slot) {
+    return slot->key_len + (slot->value_len & BTREE_BYTES_OVERFLOW ? sizeof(size_t) : slot->value_len);
+}
+
+int btree_bytes_cmp(const uint8_t *a, size_t a_len, const uint8_t *b, size_t b_len) {
+    int cmp = memcmp(a, b, a_len < b_len ? a_len : b_len);
+    return cmp != 0 ? cmp : (a_len > b_len) - (a_len < b_len);
+}
+
+// First entry not below key, or with upper the first entry above it.
+int btree_bytes_search(const Btree_Bytes_Node *node, const uint8_t *key, size_t key_len, bool upper) {
+    int lo = 0, hi = node->count_keys;
+    while (lo < hi) {
+        int mid = lo + (hi - lo) / 2;
+        int cmp = btree_bytes_cmp(btree_bytes_key(node, mid), node->slots[mid].key_len, key, key_len);
+        if (cmp < 0 || (upper && cmp == 0)) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
     }
-    free(queue->items);
-    memset(queue, 0, sizeof(*queue));
+    return lo;
+}
+
+// Inserts the entry held in local at slot i. When the gap between the slots and the heap is too small the
+// heap is compacted first; the bound on entry sizes leaves room for M-1 entries after that.
+void btree_bytes_node_insert(const Btree_Bytes *btree, Btree_Bytes_Node *node, int i, const uint8_t *local,
+                             int key_len, uint32_t value_len) {
+    Btree_Bytes_Slot slot = {0, key_len, value_len};
+    int size = btree_bytes_local_size(&slot);
+    int slots_end = (uint8_t *)(node->slots + btree->header.M - 1) - node->page;
+    if (node->heap - size < slots_end) {
+        btree_bytes_node_compact(btree, node);
+    }
+
+    node->heap -= size;
+    memcpy(node->page + node->heap, local, size);
+    slot.offset = node->heap;
+    memmove(node->slots + i + 1, node->slots + i, (node->count_keys - i) * sizeof(*node->slots));
+    node->slots[i] = slot;
+    node->count_keys++;
+}
+
+// Inserts a copy of entry j of src, which must be another node, at slot i.
+void btree_bytes_node_copy(const Btree_Bytes *btree, Btree_Bytes_Node *node, int i, const Btree_Bytes_Node *src,
+                           int j) {
+    btree_bytes_node_insert(btree, node, i, btree_bytes_key(src, j), src->slots[j].key_len, src->slots[j].value_len);
+}
+
+// Drops slot i. Its bytes stay in the heap until the next compaction.
+void btree_bytes_node_remove(Btree_Bytes_Node *node, int i) {
+    memmove(node->slots + i, node->slots + i + 1, (node->count_keys - i - 1) * sizeof(*node->slots));
+    btree_bytes_node_truncate(node, node->count_keys - 1);
+}
+
+void btree_bytes_node_truncate(Btree_Bytes_Node *node, int count) {
+    memset(node->slots + count, 0, (node->count_keys - count) * sizeof(*node->slots));
+    node->count_keys = count;
+}
+
+// Moves every entry to the end of the page in slot order, leaving one gap between the slots and the heap.
+void btree_bytes_node_compact(const Btree_Bytes *btree, Btree_Bytes_Node *node) {
+    int page_size = btree->header.page_size;
+    uint8_t heap[page_size];
+    int top = page_size;
+    for (int i = 0; i < node->count_keys; i++) {
+        Btree_Bytes_Slot *slot = &node->slots[i];
+        int size = btree_bytes_local_size(slot);
+        top -= size;
+        memcpy(heap + top, node->page + slot->offset, size);
+        slot->offset = top;
+    }
+    memcpy(node->page + top, heap + top, page_size - top);
+    node->heap = top;
+}
+
+// Stores value in a chain of overflow pages and returns the offset of the first one, or 0 when it fails.
+// Every page starts with the offset of the next one and the bytes it holds.
+size_t btree_bytes_overflow_write(Btree_Bytes *btree, const uint8_t *value, size_t len) {
+    size_t chunk = btree->header.page_size - BTREE_BYTES_OVERFLOW_HEADER_SIZE;
+    uint8_t head[BTREE_BYTES_OVERFLOW_HEADER_SIZE] = {0};
+    size_t next = 0;
+    // written back to front, so each page knows the one after it
+    for (size_t p = (len + chunk - 1) / chunk; p-- > 0;) {
+        uint32_t n = p * chunk + chunk < len ? chunk : len - p * chunk;
+        size_t offset = btree_bytes_pop_free_offset(btree);
+        memcpy(head, &next, sizeof(next));
+        memcpy(head + sizeof(next), &n, sizeof(n));
+
+        struct iovec vec[2];
+        vec[0].iov_base = head;
+        vec[0].iov_len = sizeof(head);
+        vec[1].iov_base = (uint8_t *)value + p * chunk;
+        vec[1].iov_len = n;
+        if (pwritev(btree->fd, vec, 2, offset) != (ssize_t)(sizeof(head) + n)) {
+            btree_bytes_log(btree, BTREE_LOG_ERROR, "Failed to write overflow page: %s",
+                            btree_strerr(BTREE_ERROR_UNIX));
+            btree_bytes_free_page(btree, offset);
+            btree_bytes_overflow_free(btree, next);
+            return 0;
+        }
+        next = offset;
+    }
+    return next;
+}
+
+// Reads the first len bytes of the value stored from offset on.
+bool btree_bytes_overflow_read(const Btree_Bytes *btree, size_t offset, uint8_t *value, size_t len) {
+    size_t chunk = btree->header.page_size - BTREE_BYTES_OVERFLOW_HEADER_SIZE;
+    uint8_t head[BTREE_BYTES_OVERFLOW_HEADER_SIZE];
+    size_t done = 0;
+    while (done < len && offset != 0) {
+        struct iovec vec[2];
+        vec[0].iov_base = head;
+        vec[0].iov_len = sizeof(head);
+        vec[1].iov_base = value + done;
+        vec[1].iov_len = len - done < chunk ? len - done : chunk;
+        if (preadv(btree->fd, vec, 2, offset) != (ssize_t)(sizeof(head) + vec[1].iov_len)) {
+            btree_bytes_log(btree, BTREE_LOG_ERROR, "Failed to read overflow page: %s",
+                            btree_strerr(BTREE_ERROR_UNIX));
+            return false;
+        }
+        done += vec[1].iov_len;
+        memcpy(&offset, head, sizeof(offset));
+    }
+    return done == len;
+}
+
+void btree_bytes_overflow_free(Btree_Bytes *btree, size_t offset) {
+    while (offset != 0) {
+        size_t next = 0;
+        if (pread(btree->fd, &next, sizeof(next), offset) == -1) {
+            btree_bytes_log(btree, BTREE_LOG_ERROR, "Failed to read overflow page: %s",
+                            btree_strerr(BTREE_ERROR_UNIX));
+        }
+        btree_bytes_free_page(btree, offset);
+        offset = next;
+    }
+}
+
+// Frees the overflow pages of entry i, if it has any.
+void btree_bytes_value_drop(Btree_Bytes *btree, const Btree_Bytes_Node *node, int i) {
+    const Btree_Bytes_Slot *slot = &node->slots[i];
+    if (slot->value_len & BTREE_BYTES_OVERFLOW) {
+        size_t first;
+        memcpy(&first, btree_bytes_key(node, i) + slot->key_len, sizeof(first));
+        btree_bytes_overflow_free(btree, first);
+    }
+}
+
+void btree_bytes_header_read(Btree_Bytes *btree, uint8_t *magic_bytes) {
+    int n = 2;
+    struct iovec vec[n];
+    vec[0].iov_base = magic_bytes;
+    vec[0].iov_len = sizeof(btree_bytes_magic_bytes);
+    vec[1].iov_base = &btree->header;
+    vec[1].iov_len = sizeof(btree->header);
+    ssize_t bytes_read = preadv(btree->fd, vec, n, 0);
+    if (bytes_read == -1) {
+        btree_bytes_log(btree, BTREE_LOG_ERROR, "Failed to read header: %s", btree_strerr(BTREE_ERROR_UNIX));
+    }
+}
+
+void btree_bytes_header_write(const Btree_Bytes *btree) {
+    int n = 2;
+    struct iovec vec[n];
+    vec[0].iov_base = (uint8_t *)btree_bytes_magic_bytes;
+    vec[0].iov_len = sizeof(btree_bytes_magic_bytes);
+    vec[1].iov_base = (Btree_Bytes_Header *)&btree->header;
+    vec[1].iov_len = sizeof(btree->header);
+    ssize_t bytes_written = pwritev(btree->fd, vec, n, 0);
+    if (bytes_written == -1) {
+        btree_bytes_log(btree, BTREE_LOG_ERROR, "Failed to write header: %s", btree_strerr(BTREE_ERROR_UNIX));
+    }
+}
+
+void btree_bytes_log(const Btree_Bytes *btree, Btree_Log_Level level, const char *fmt, ...) {
+    va_list args;
+    va_start(args, fmt);
+    btree->log_handler(level, fmt, args);
+    va_end(args);
 }
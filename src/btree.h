@@ -1,6 +1,7 @@
 #ifndef BTREE_H
 #define BTREE_H
 
+#include <pthread.h>
 #include <stdarg.h>
 #include <stdbool.h>
 #include <stddef.h>
@@ -16,6 +17,11 @@ typedef enum btree_log_level {
     BTREE_LOG_ERROR,
 } Btree_Log_Level;
 
+typedef enum btree_backend {
+    BTREE_BACKEND_FILE,
+    BTREE_BACKEND_MMAP,
+} Btree_Backend;
+
 typedef void (*Btree_Log_Handler)(Btree_Log_Level level, const char *fmt, va_list args);
 
 typedef enum btree_result {
@@ -26,6 +32,12 @@ typedef enum btree_result {
     BTREE_ERROR_BAD_T,
     BTREE_ERROR_KEY_NOT_FOUND,
     BTREE_ERROR_FORMAT,
+    BTREE_ERROR_NOT_EMPTY,
+    BTREE_ERROR_UNSORTED,
+    BTREE_ERROR_END,
+    BTREE_ERROR_OPTIONS,
+    BTREE_ERROR_TOO_LONG,
+    BTREE_ERROR_BUSY,
 } Btree_Result;
 
 void btree_default_log_handler(Btree_Log_Level level, const char *fmt, va_list args);
@@ -40,11 +52,29 @@ typedef struct item {
 typedef struct btree_node {
     size_t offset;
     int count_keys;
+    uint32_t generation; // tree generation when this version of the node was written
     bool is_leaf;
-    Item *items;
+    int dirty_from; // slots changed since the node was read or written, both 0 for all of them; the next
+    int dirty_to;   // write covers only their keys, values and children when the file layout allows it, and
+                    // dirty_to is -1 while the file holds the node packed, so it goes out whole
+    int *keys;
+    int *values;
     size_t *children;
+    uint8_t *image; // whole node image as last read, for packed leaves and direct I/O; kept for the next read
 } Btree_Node;
 
+typedef struct btree_iterator {
+    bool (*next)(void *ctx, Item *item); // stores the next item and returns true, or returns false at the end
+    void *ctx;
+} Btree_Iterator;
+
+typedef struct btree_bulk_level {
+    Btree_Node *open;
+    Btree_Node *pending;
+    int sep_level;
+    int sep_index;
+} Btree_Bulk_Level;
+
 typedef struct btree_queue {
     int head;
     int tail;
@@ -57,25 +87,450 @@ typedef struct btree_header {
     int t;
     int M;
     int count_nodes;
+    uint32_t generation; // bumped by every snapshot, so nodes written before it can be told apart
     size_t next_offset;
     size_t next_free_offset;
     size_t root_offset;
+    size_t page_size; // 0 for trees created without one, whose header on disk ends before this field
 } Btree_Header;
 
+#define BTREE_MAX_HEIGHT 64
+
+typedef enum btree_io_engine {
+    BTREE_IO_SYNC,    // btree_find_async runs one lookup after the other
+    BTREE_IO_URING,   // node reads go through io_uring, or through threads when the kernel refuses it
+    BTREE_IO_THREADS, // node reads are handed to a pool of threads doing blocking reads
+} Btree_Io_Engine;
+
+typedef enum btree_layout {
+    BTREE_LAYOUT_BFS, // level by level, each level left to right
+    BTREE_LAYOUT_VEB, // van Emde Boas: the top half of the levels laid out the same way, then each subtree below
+} Btree_Layout;
+
+typedef struct btree_io_request {
+    size_t offset;
+    uint8_t *data;
+    int tag;
+    bool failed;
+    uint64_t id; // io_uring user_data, unique per read so a late completion cannot pass for a newer one
+} Btree_Io_Request;
+
+// Reads of whole node images kept in flight together. The ring pointers are mapped from the kernel; the
+// pool moves requests from pending to done.
+typedef struct btree_io {
+    Btree_Io_Engine engine;
+    int depth;
+    Btree_Fd fd;
+    size_t size;          // bytes per read, one node image
+    pthread_mutex_t busy; // one batch drives the engine at a time
+    int ring_fd;
+    int count_unsubmitted;
+    uint8_t *sq_ring;
+    uint8_t *cq_ring;
+    size_t sq_ring_size;
+    size_t cq_ring_size;
+    void *sqes;
+    uint32_t *sq_tail;
+    uint32_t *sq_mask;
+    uint32_t *sq_array;
+    uint32_t *cq_head;
+    uint32_t *cq_tail;
+    uint32_t *cq_mask;
+    void *cqes;
+    Btree_Io_Request *in_flight; // ring reads by tag, data NULL once done, kept to redo them when the ring fails
+    uint32_t count_submitted;
+    pthread_t *threads;
+    int count_threads;
+    pthread_mutex_t mutex;
+    pthread_cond_t submitted;
+    pthread_cond_t completed;
+    Btree_Io_Request *pending;
+    int count_pending;
+    Btree_Io_Request *done;
+    int count_done;
+    bool stop;
+} Btree_Io;
+
+typedef struct btree_frame {
+    size_t offset;
+    uint64_t lsn; // WAL record holding the latest image, BTREE_LSN_UNCOMMITTED while an operation changes it
+    int pins;
+    int next;
+    int logged_from; // slots changed since the last log record, besides the head; the whole image if logged_to < 0
+    int logged_to;
+    bool logged_children;
+    bool dirty;
+    bool referenced;
+    uint8_t *data;
+} Btree_Frame;
+
+typedef struct btree_cache {
+    int capacity;
+    int count;
+    int hand;
+    int count_buckets;
+    int *buckets;
+    Btree_Frame *frames;
+    uint8_t *data;
+    pthread_mutex_t *latch; // only set for concurrent trees, where readers share the pool
+} Btree_Cache;
+
+// Syncs the log once sync_us passed with operations waiting, so the last ones before a quiet spell do not
+// stay in the buffer until the next. Every access to the log holds the mutex, which is recursive as they nest.
+typedef struct btree_wal_flusher {
+    pthread_t thread;
+    pthread_mutex_t mutex;
+    pthread_cond_t wake;
+    bool stop;
+} Btree_Wal_Flusher;
+
+typedef struct btree_wal {
+    Btree_Fd fd;
+    int sync_ops;
+    long sync_us;
+    size_t checkpoint_size;
+    uint64_t lsn;
+    uint64_t durable_lsn;
+    int pending_ops;
+    uint64_t last_sync_us;
+    size_t size;
+    size_t count_buffer;
+    size_t capacity_buffer;
+    uint8_t *buffer;
+    int count_touched;
+    int capacity_touched;
+    int *touched;
+    Btree_Wal_Flusher *flusher; // only set with sync_us
+    bool broken;                // a change could not be logged, so no later commit may claim to be durable
+} Btree_Wal;
+
+// Latch on one node, for writers that only hold the tree shared. Entries exist while someone holds or
+// waits for them.
+typedef struct btree_node_latch {
+    size_t offset;
+    int readers; // -1 while held exclusively
+    int waiters;
+    struct btree_node_latch *next;
+} Btree_Node_Latch;
+
+typedef struct btree_latch_bucket {
+    pthread_mutex_t mutex;
+    pthread_cond_t released;
+    Btree_Node_Latch *latches;
+    Btree_Node_Latch *spare;
+} Btree_Latch_Bucket;
+
+// Read-only view of the tree as it was when the snapshot was opened. Writers copy the nodes it shares
+// before changing them, and nodes it may still read are only freed once it is closed.
+typedef struct btree_snapshot {
+    const struct btree *btree;
+    size_t root_offset;
+    uint32_t generation;
+    struct btree_snapshot *older;
+    struct btree_snapshot *newer;
+} Btree_Snapshot;
+
+// Node replaced while snapshots could still read it; freed once every snapshot up to generation is closed.
+typedef struct btree_retired {
+    size_t offset;
+    uint32_t generation;
+} Btree_Retired;
+
+// Free node slots. The stack mirrors the free list on disk, its top being header.next_free_offset, so taking
+// a slot needs no read; the bitmap marks the same slots by their index from the first node.
+typedef struct btree_free_space {
+    size_t *stack;
+    size_t count;
+    size_t capacity;
+    uint64_t *bits;
+    size_t count_words;
+} Btree_Free_Space;
+
+// Thread that compacts a tree with lazy deletes once BTREE_COMPACT_BATCH underfull leaves are waiting.
+typedef struct btree_compactor {
+    pthread_t thread;
+    pthread_mutex_t mutex;
+    pthread_cond_t pending;
+    bool stop;
+} Btree_Compactor;
+
+typedef enum btree_op {
+    BTREE_OP_FIND,
+    BTREE_OP_PUT,
+    BTREE_OP_DELETE,
+    BTREE_OP_FIND_BATCH,
+    BTREE_OP_PUT_BATCH,
+    BTREE_OP_FIND_ASYNC,
+    BTREE_COUNT_OPS,
+} Btree_Op;
+
+#define BTREE_STATS_LATENCY_BUCKETS 64
+
+#define BTREE_STATS_FILL_BUCKETS 10
+
+// Counted since the tree was opened or the last btree_stats_reset. Every field is a uint64_t, so the whole
+// struct can be read and cleared word by word.
+typedef struct btree_counters {
+    uint64_t node_reads; // from the mapping, the cache or the file
+    uint64_t node_writes;
+    uint64_t bytes_read; // by system calls on the tree file
+    uint64_t bytes_written; // by system calls on the tree file and its log
+    uint64_t file_writes;   // system calls writing the tree file
+    uint64_t splits;
+    uint64_t merges;
+    uint64_t rotations; // keys borrowed from a sibling by a delete
+    uint64_t free_pops; // nodes placed in a freed slot
+    uint64_t appends;   // nodes placed at the end of the file
+    uint64_t cache_hits;
+    uint64_t cache_misses;
+    // operations timed while btree_stats_latency is on, bucket b counting those that took [2^(b-1), 2^b) ns
+    uint64_t latencies[BTREE_COUNT_OPS][BTREE_STATS_LATENCY_BUCKETS];
+} Btree_Counters;
+
+typedef struct btree_stats {
+    Btree_Counters counters;
+    int height;
+    int count_nodes;
+    int count_underfull; // nodes other than the root under t - 1 keys, which only lazy deletes leave
+    uint64_t fill[BTREE_STATS_FILL_BUCKETS]; // nodes by tenth of their keys filled, full nodes in the last
+} Btree_Stats;
+
+// Trace records: an op byte and the key, then the value for puts, all in host byte order, after a header of
+// btree_trace_magic_bytes and BTREE_TRACE_VERSION as a uint32_t.
+typedef enum btree_trace_op {
+    BTREE_TRACE_FIND = 1,
+    BTREE_TRACE_PUT = 2,
+    BTREE_TRACE_DELETE = 3,
+} Btree_Trace_Op;
+
+#define BTREE_TRACE_VERSION 1
+
+#define BTREE_TRACE_BUFFER_SIZE ((size_t)1 << 16)
+
+typedef struct btree_trace {
+    Btree_Fd fd;
+    pthread_mutex_t latch; // lookups from many threads record at once
+    size_t count_buffer;
+    uint8_t buffer[BTREE_TRACE_BUFFER_SIZE];
+} Btree_Trace;
+
+typedef struct btree_replay {
+    uint64_t count_ops[BTREE_TRACE_DELETE + 1]; // indexed by Btree_Trace_Op
+    uint64_t count_missing;                     // finds and deletes of keys not in the tree
+    uint64_t elapsed_ns;                        // running the operations, after the trace was read
+} Btree_Replay;
+
+// Bytes between two changed ranges of a node below which they go out as one write.
+#define BTREE_WRITE_GAP 512
+
+// Staged bytes past which the writes of an operation are sent before it ends.
+#define BTREE_WRITES_BUFFER_SIZE ((size_t)1 << 20)
+
+typedef struct btree_write {
+    size_t offset;
+    size_t size;
+    size_t data; // where the bytes start in the batch buffer
+    int seq;     // order the write was staged in, later ones winning where they overlap
+} Btree_Write;
+
+// Writes held back while an operation has the tree exclusively, then sent as one pwritev per contiguous
+// range of the file. Only trees doing plain file I/O, with no cache or mapping to absorb the writes, have one.
+typedef struct btree_writes {
+    bool active;
+    int count;
+    int capacity;
+    Btree_Write *ranges;
+    uint8_t *buffer;
+    size_t count_buffer;
+    size_t capacity_buffer;
+} Btree_Writes;
+
+#define BTREE_PATH_SPARES 2
+
+// Node buffers for one descent, kept from one operation to the next: one for each level below the root,
+// created the first time a descent reaches it, and spares for siblings and split-off halves.
+typedef struct btree_path {
+    Btree_Node *nodes[BTREE_MAX_HEIGHT];
+    Btree_Node *spares[BTREE_PATH_SPARES];
+    struct btree_path *next;
+} Btree_Path;
+
+typedef struct btree_paths {
+    Btree_Path *idle;
+    pthread_mutex_t *latch; // only set for concurrent trees, where every running operation holds a path
+} Btree_Paths;
+
 typedef struct btree {
     Btree_Header header;
     Btree_Log_Handler log_handler;
     Btree_Fd fd;
     Btree_Node *root;
+    Btree_Cache *cache;
+    Btree_Paths *paths;
+    uint8_t *map;
+    size_t map_size;
+    size_t file_size;
+    size_t reserved; // nodes of an in-memory tree promised to puts still running
+    double fill_factor;
+    bool compress_leaves;
+    bool direct;
+    Btree_Wal *wal;
+    pthread_rwlock_t *latch;
+    Btree_Latch_Bucket *node_latches; // only set when puts run concurrently
+    pthread_mutex_t *header_latch;    // guards allocation while puts run concurrently
+    Btree_Io *io;
+    Btree_Snapshot *snapshots;        // newest open snapshot
+    Btree_Retired *retired;
+    int count_retired;
+    int capacity_retired;
+    Btree_Free_Space free_space;
+    Btree_Counters counters;
+    bool latency; // time every operation into counters.latencies
+    Btree_Trace *trace;
+    Btree_Writes *writes;
+    bool lazy_header;   // keep header changes in memory until a checkpoint
+    bool header_clean;  // the header on disk matches the tree and carries the clean magic
+    size_t header_root; // root offset last written to the header
+    int header_interval;
+    int header_pending; // header changes since the last checkpoint
+    bool lazy_delete;
+    int delete_min_keys;
+    int *underfull; // a key leading to each leaf lazy deletes left underfull, for btree_compact to visit
+    int count_underfull;
+    int capacity_underfull;
+    Btree_Compactor *compactor; // only set with compact_background
 } Btree;
 
+// Ordered traversal. The deepest node of the path holds the current key; every ancestor holds the index of
+// the child the path goes through. A cursor is invalidated by any write to the tree.
+typedef struct btree_cursor {
+    const Btree *btree;
+    size_t root_offset; // set for cursors over a snapshot, 0 follows the current root
+    int depth;          // 0 when the cursor is not positioned
+    Btree_Node *path[BTREE_MAX_HEIGHT];
+    int index[BTREE_MAX_HEIGHT];
+} Btree_Cursor;
+
 typedef struct btree_opt {
-    const char *path;
+    const char *path; // NULL keeps the whole tree in an anonymous mapping of map_size bytes, with no file or WAL
     int t;
     Btree_Log_Handler log_handler;
+    size_t cache_size; // memory budget in bytes for cached nodes, 0 disables the cache
+    Btree_Backend backend;
+    size_t map_size; // address space reserved for the mmap backend or in-memory tree, 0 picks the default
+    double fill_factor; // share of a node filled by btree_bulk_load, 0 picks BTREE_DEFAULT_FILL_FACTOR
+    bool wal;           // log every operation to <path>-wal before it reaches the tree file, needs the cache
+    int wal_sync_ops;   // fsync the log once this many operations are waiting, 0 disables the count limit
+    long wal_sync_us;   // or once this long passed since the last fsync, 0 disables the time limit; a background
+                        // thread syncs operations an idle tree still holds once the time is up
+                        // with both limits disabled every operation is synced
+    size_t wal_checkpoint_size; // log size that triggers a checkpoint, 0 picks BTREE_DEFAULT_WAL_CHECKPOINT_SIZE
+    bool concurrent; // let many threads share the tree: lookups run in parallel, writes take it exclusively
+    bool concurrent_puts; // implies concurrent, and puts into different subtrees run in parallel too
+    Btree_Io_Engine io_engine;
+    int io_depth; // node reads btree_find_async keeps in flight, 0 picks BTREE_DEFAULT_IO_DEPTH
+    bool compress_leaves; // write leaves as bit-packed offsets from their smallest key and value, trees written
+                          // either way open with or without it
+    size_t page_size; // power of two from BTREE_MIN_PAGE_SIZE: nodes are padded to whole pages, the first page
+                      // holds only the header, and t = 0 picks the largest t whose nodes fit one page
+    bool direct; // do all file I/O with O_DIRECT, bypassing the kernel page cache; needs a tree with a page_size
+                 // and rules out the mmap backend and the WAL
+    const char *trace_path; // record every find, put and delete to this file, replaced if it exists; batch and
+                            // async calls record one operation per key
+    bool lazy_header; // write the header only when the root moves and at checkpoints, btree_sync and
+                      // btree_destroy; a tree left without one is rebuilt from its root when it next opens.
+                      // Ignored with a WAL, which already defers the header
+    int header_interval; // with lazy_header, also checkpoint once this many header changes are waiting, 0 only
+                         // checkpoints when asked
+    bool lazy_delete; // deletes take the key out of its node without rebalancing on the way down, leaving leaves
+                      // with fewer than t - 1 keys to btree_compact. btree_is_valid accepts such leaves only
+                      // while the option is on
+    int delete_min_keys;     // with lazy_delete, fewest keys a leaf keeps before a delete rebalances as usual,
+                             // 0 picks 1 and more than t - 1 is taken as t - 1
+    bool compact_background; // with lazy_delete, compact from a thread of its own; implies concurrent
 } Btree_Options;
 
-static const uint8_t btree_magic_bytes[] = {0x7F, 'B', 'T', 'F'};
+// Directory entry of a slotted page. The key starts offset bytes into the page and the value follows it,
+// unless BTREE_BYTES_OVERFLOW is set in value_len and the key is followed by the offset of its overflow pages.
+typedef struct btree_bytes_slot {
+    uint16_t offset;
+    uint16_t key_len;
+    uint32_t value_len;
+} Btree_Bytes_Slot;
+
+// Node of a byte-string tree, held as its page image: a header, room for M children and M-1 slots, then free
+// space and a heap of keys and values growing down from the end of the page.
+typedef struct btree_bytes_node {
+    size_t offset;
+    int count_keys;
+    bool is_leaf;
+    int heap; // lowest heap byte in use
+    size_t *children;
+    Btree_Bytes_Slot *slots;
+    uint8_t *page;
+} Btree_Bytes_Node;
+
+typedef struct btree_bytes_header {
+    int t;
+    int M;
+    int count_nodes;
+    int page_size;
+    size_t next_offset;
+    size_t next_free_offset;
+    size_t root_offset;
+} Btree_Bytes_Header;
+
+// B-tree over variable-length byte-string keys and values, kept in its own file. Keys compare with memcmp,
+// a shorter key sorting first when it is a prefix of the other. Values that do not fit next to their key go
+// to a chain of overflow pages.
+//
+// It is a separate tree with its own node code, not a mode of Btree, and has none of its machinery: no
+// latches, so calls on one tree must not overlap, and no WAL, cache, snapshots or syncs, so nodes go
+// straight to the file and a crash in the middle of a put or delete can leave the tree torn.
+typedef struct btree_bytes {
+    Btree_Bytes_Header header;
+    Btree_Log_Handler log_handler;
+    Btree_Fd fd;
+    Btree_Bytes_Node *root;
+    int max_local; // bytes an entry may take in its node, key and inline value together
+} Btree_Bytes;
+
+// Bumped whenever the node layout changes. 'F' marked trees whose nodes held key-value pairs side by side
+// behind a 4-byte head, with the first node right after the header instead of on an 8-byte boundary.
+static const uint8_t btree_magic_bytes[] = {0x7F, 'B', 'T', 'N'};
+
+static const uint8_t btree_old_magic_bytes[] = {0x7F, 'B', 'T', 'F'};
+
+static const uint8_t btree_bytes_magic_bytes[] = {0x7F, 'B', 'T', 'S'};
+
+static const uint8_t btree_paged_magic_bytes[] = {0x7F, 'B', 'T', 'P'};
+
+static const uint8_t btree_trace_magic_bytes[] = {0x7F, 'B', 'T', 'R'};
+
+// Stand in for the two tree magics while a tree opened with lazy_header has changes its header does not show.
+static const uint8_t btree_dirty_magic_bytes[] = {0x7F, 'B', 'T', 'n'};
+
+static const uint8_t btree_paged_dirty_magic_bytes[] = {0x7F, 'B', 'T', 'p'};
+
+#define BTREE_MIN_PAGE_SIZE 512
+
+#define BTREE_DEFAULT_MAP_SIZE ((size_t)64 << 30)
+
+#define BTREE_DEFAULT_FILL_FACTOR 1.0
+
+#define BTREE_COMPACT_BATCH 64
+
+#define BTREE_DEFAULT_WAL_CHECKPOINT_SIZE ((size_t)64 << 20)
+
+#define BTREE_DEFAULT_IO_DEPTH 64
+
+#define BTREE_LSN_UNCOMMITTED UINT64_MAX
+
+#define BTREE_BYTES_PAGE_SIZE 4096
+
+#define BTREE_BYTES_OVERFLOW 0x80000000u
+
+#define BTREE_BYTES_MIN_LOCAL 32
 
 #define BTREE_UNUSED(x) (void)(x)
 
@@ -84,21 +539,596 @@ Btree_Result btree_init(Btree *btree, Btree_Options options);
 #define BTREE_INIT(btree, ...)                                                                                         \
     btree_init((btree), (Btree_Options){.log_handler = btree_default_log_handler, __VA_ARGS__})
 
+// On a tree opened with .concurrent, lookups, batch lookups, cursor moves, btree_display and btree_is_valid
+// may run from any number of threads at once, while the calls taking a non-const Btree wait for them and
+// run alone. With .concurrent_puts, puts also run alongside lookups and each other, latching only the
+// nodes on their path, while cursors, btree_display and btree_is_valid join the calls that run alone.
+// btree_init and btree_destroy must not overlap other calls, and the log handler may be called from
+// several threads.
 Btree_Result btree_find(const Btree *btree, int key, int *value);
 
 Btree_Result btree_put(Btree *btree, int key, int value);
 
+Btree_Result btree_find_batch(const Btree *btree, const int *keys, int count, int *values, Btree_Result *results);
+
+Btree_Result btree_put_batch(Btree *btree, const Item *items, int count);
+
+// Like btree_find_batch for keys that share no path: up to io_depth descents are in flight at once, each
+// advancing one level whenever its node read completes. Returns once every key is resolved.
+Btree_Result btree_find_async(const Btree *btree, const int *keys, int count, int *values, Btree_Result *results);
+
 Btree_Result btree_delete(Btree *btree, int key);
 
+Btree_Result btree_bulk_load(Btree *btree, Btree_Iterator iterator);
+
+Btree_Result btree_cursor_open(const Btree *btree, Btree_Cursor *cursor);
+
+Btree_Result btree_cursor_seek(Btree_Cursor *cursor, int key);
+
+Btree_Result btree_cursor_next(Btree_Cursor *cursor);
+
+Btree_Result btree_cursor_prev(Btree_Cursor *cursor);
+
+Btree_Result btree_cursor_get(const Btree_Cursor *cursor, int *key, int *value);
+
+void btree_cursor_close(Btree_Cursor *cursor);
+
+// Snapshot reads take no tree latch, so they may run in other threads while the tree is written as long as
+// the tree was opened with .concurrent or uses no cache.
+Btree_Result btree_snapshot_open(Btree *btree, Btree_Snapshot *snapshot);
+
+Btree_Result btree_snapshot_find(const Btree_Snapshot *snapshot, int key, int *value);
+
+Btree_Result btree_snapshot_cursor_open(const Btree_Snapshot *snapshot, Btree_Cursor *cursor);
+
+Btree_Result btree_snapshot_close(Btree *btree, Btree_Snapshot *snapshot);
+
+Btree_Result btree_sync(Btree *btree);
+
+// Writes back the cached nodes and the header, so that the tree opens without recovery. Unlike btree_sync it
+// does not fsync. With a WAL it checkpoints the log.
+Btree_Result btree_checkpoint(Btree *btree);
+
+// Moves the nodes at the end of the file into free slots nearer its start, then truncates the file after the
+// last node. Takes the tree to itself, and fails with BTREE_ERROR_BUSY while a snapshot is open.
+Btree_Result btree_vacuum(Btree *btree);
+
+// Rebalances the nodes lazy deletes left underfull. A count of 0 walks the whole tree, which also finds those
+// left before the tree was last opened; any other count visits at most that many of the leaves deletes
+// noted since, with the paths above them, so that a long compaction can be spread over many short calls.
+// Takes the tree to itself for each call.
+Btree_Result btree_compact(Btree *btree, int count);
+
+// Rewrites every node in the order of layout, right after the header, so that a descent or a scan reads
+// nearby offsets. The nodes are first copied past the end of the file and then back, switching the root at
+// each step, so the tree stays whole if a copy fails. Like btree_vacuum it truncates the file, takes the tree
+// to itself and fails with BTREE_ERROR_BUSY while a snapshot is open.
+Btree_Result btree_reorganize(Btree *btree, Btree_Layout layout);
+
 Btree_Result btree_destroy(Btree *btree);
 
 Btree_Result btree_display(const Btree *btree, FILE *fp);
 
 int btree_is_valid(const Btree *btree);
 
+// Copies the counters, then walks the tree for its height and how full its nodes are. The counters cost one
+// relaxed atomic add each and are always on; the walk reads every node, like btree_is_valid.
+Btree_Result btree_stats(const Btree *btree, Btree_Stats *stats);
+
+void btree_stats_reset(Btree *btree);
+
+// Turns timing of finds, puts, deletes and their batch forms on or off, at any time and from any thread.
+void btree_stats_latency(Btree *btree, bool enabled);
+
+// Reads a trace written through .trace_path, then runs its operations against the tree in order, one thread,
+// as fast as they go. Fails with BTREE_ERROR_FORMAT on a file that is not a whole trace.
+Btree_Result btree_replay(Btree *btree, const char *trace_path, Btree_Replay *replay);
+
+// Byte-string trees take path, t and log_handler from the options and ignore the rest. t is bounded by the
+// page: every node must have room for 2t-1 entries of at least BTREE_BYTES_MIN_LOCAL bytes.
+Btree_Result btree_bytes_init(Btree_Bytes *btree, Btree_Options options);
+
+#define BTREE_BYTES_INIT(btree, ...)                                                                                   \
+    btree_bytes_init((btree), (Btree_Options){.log_handler = btree_default_log_handler, __VA_ARGS__})
+
+// Keys longer than btree_bytes_max_key, or values of 2 GiB and more, fail with BTREE_ERROR_TOO_LONG. Like
+// btree_put, putting a key that is already there adds another entry for it.
+Btree_Result btree_bytes_put(Btree_Bytes *btree, const void *key, size_t key_len, const void *value, size_t value_len);
+
+// Copies up to *value_len bytes of the value and stores its full length in *value_len.
+Btree_Result btree_bytes_find(const Btree_Bytes *btree, const void *key, size_t key_len, void *value,
+                              size_t *value_len);
+
+Btree_Result btree_bytes_delete(Btree_Bytes *btree, const void *key, size_t key_len);
+
+size_t btree_bytes_max_key(const Btree_Bytes *btree);
+
+int btree_bytes_is_valid(const Btree_Bytes *btree);
+
+Btree_Result btree_bytes_destroy(Btree_Bytes *btree);
+
 const char *btree_strerr(int err);
 
 #ifdef BTREE_IMPLEMENTATION
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// Header of a tree stamped out by BTREE_DEFINE. Opening a file checks t and the key and value sizes against
+// the ones the tree was compiled with.
+typedef struct btree_typed_header {
+    int t;
+    int M;
+    int count_nodes;
+    int key_size;
+    int value_size;
+    int pad;
+    size_t next_offset;
+    size_t next_free_offset;
+    size_t root_offset;
+} Btree_Typed_Header;
+
+static const uint8_t btree_typed_magic_bytes[] = {0x7F, 'B', 'T', 'G'};
+
+// Nodes start past the magic bytes and the header, on a 64-byte boundary.
+#define BTREE_TYPED_DATA_OFFSET 64
+
+#ifndef BTREE_TYPED_NODE_BUDGET
+#define BTREE_TYPED_NODE_BUDGET 4096
+#endif
+
+// Largest t whose node image fits in BTREE_TYPED_NODE_BUDGET bytes.
+#define BTREE_TYPED_T(K, V)                                                                                            \
+    ((BTREE_TYPED_NODE_BUDGET - 8 + sizeof(K) + sizeof(V)) / (2 * (sizeof(K) + sizeof(V) + sizeof(size_t))))
+
+// Stamps out a file-backed B-tree called name, with keys of type K ordered by cmp(a, b) (negative, zero or
+// positive, like memcmp) and values of type V. Everything is static inline and sized at compile time, so
+// the search loop and every memmove work on constants. It follows the algorithms of btree.c without the
+// cache, WAL or concurrency, and provides name_init(tree, path), name_put, name_find, name_delete,
+// name_is_valid and name_destroy, returning Btree_Result like their btree_ counterparts. Nodes live on the
+// stack during operations, so t is best left to BTREE_DEFINE, which fits a node in BTREE_TYPED_NODE_BUDGET.
+//
+//     #define BTREE_IMPLEMENTATION
+//     #include "btree.h"
+//     BTREE_DEFINE(u64_tree, uint64_t, Payload, u64_cmp)
+#define BTREE_DEFINE(name, K, V, cmp) BTREE_DEFINE_T(name, K, V, cmp, BTREE_TYPED_T(K, V))
+
+#define BTREE_DEFINE_T(name, K, V, cmp, degree)                                                                        \
+    enum { name##_T = (degree), name##_M = 2 * (degree) };                                                             \
+    _Static_assert(name##_T >= 2, "t must be >= 2");                                                                   \
+                                                                                                                       \
+    typedef struct name##_node {                                                                                       \
+        int count_keys;                                                                                                \
+        int pad;                                                                                                       \
+        K keys[name##_M - 1];                                                                                          \
+        V values[name##_M - 1];                                                                                        \
+        size_t children[name##_M];                                                                                     \
+        size_t offset; /* not stored, the image ends before it */                                                      \
+    } name##_node;                                                                                                     \
+                                                                                                                       \
+    typedef struct name {                                                                                              \
+        Btree_Typed_Header header;                                                                                     \
+        Btree_Fd fd;                                                                                                   \
+        bool failed;                                                                                                   \
+        name##_node root;                                                                                              \
+    } name;                                                                                                            \
+                                                                                                                       \
+    enum { name##_NODE_SIZE = offsetof(name##_node, offset) };                                                         \
+                                                                                                                       \
+    static inline bool name##_is_leaf(const name##_node *node) {                                                       \
+        return node->children[0] == 0;                                                                                 \
+    }                                                                                                                  \
+                                                                                                                       \
+    static inline int name##_search(const name##_node *node, K key, bool upper) {                                      \
+        int lo = 0, hi = node->count_keys;                                                                             \
+        while (lo < hi) {                                                                                              \
+            int mid = (lo + hi) / 2;                                                                                   \
+            int c = cmp(node->keys[mid], key);                                                                         \
+            if (c < 0 || (upper && c == 0)) {                                                                          \
+                lo = mid + 1;                                                                                          \
+            } else {                                                                                                   \
+                hi = mid;                                                                                              \
+            }                                                                                                          \
+        }                                                                                                              \
+        return lo;                                                                                                     \
+    }                                                                                                                  \
+                                                                                                                       \
+    static inline bool name##_read(const name *tree, name##_node *node, size_t offset) {                               \
+        node->offset = offset;                                                                                         \
+        return pread(tree->fd, node, name##_NODE_SIZE, offset) == name##_NODE_SIZE;                                    \
+    }                                                                                                                  \
+                                                                                                                       \
+    static inline void name##_load(name *tree, name##_node *node, size_t offset) {                                     \
+        if (!name##_read(tree, node, offset)) {                                                                        \
+            tree->failed = true;                                                                                       \
+        }                                                                                                              \
+    }                                                                                                                  \
+                                                                                                                       \
+    static inline void name##_write(name *tree, const name##_node *node) {                                             \
+        if (pwrite(tree->fd, node, name##_NODE_SIZE, node->offset) != name##_NODE_SIZE) {                              \
+            tree->failed = true;                                                                                       \
+        }                                                                                                              \
+    }                                                                                                                  \
+                                                                                                                       \
+    static inline void name##_header_write(name *tree) {                                                               \
+        uint8_t image[sizeof(btree_typed_magic_bytes) + sizeof(tree->header)];                                         \
+        memcpy(image, btree_typed_magic_bytes, sizeof(btree_typed_magic_bytes));                                       \
+        memcpy(image + sizeof(btree_typed_magic_bytes), &tree->header, sizeof(tree->header));                          \
+        if (pwrite(tree->fd, image, sizeof(image), 0) != (ssize_t)sizeof(image)) {                                     \
+            tree->failed = true;                                                                                       \
+        }                                                                                                              \
+    }                                                                                                                  \
+                                                                                                                       \
+    static inline void name##_append(name *tree, name##_node *node) {                                                  \
+        memset(node, 0, sizeof(*node));                                                                                \
+        if (tree->header.next_free_offset == 0) {                                                                      \
+            node->offset = tree->header.next_offset;                                                                   \
+            tree->header.next_offset += name##_NODE_SIZE;                                                              \
+        } else {                                                                                                       \
+            node->offset = tree->header.next_free_offset;                                                              \
+            if (pread(tree->fd, &tree->header.next_free_offset, sizeof(size_t), node->offset) != sizeof(size_t)) {     \
+                tree->failed = true;                                                                                   \
+            }                                                                                                          \
+        }                                                                                                              \
+        tree->header.count_nodes++;                                                                                    \
+    }                                                                                                                  \
+                                                                                                                       \
+    static inline void name##_remove(name *tree, const name##_node *node) {                                            \
+        if (pwrite(tree->fd, &tree->header.next_free_offset, sizeof(size_t), node->offset) != sizeof(size_t)) {        \
+            tree->failed = true;                                                                                       \
+        }                                                                                                              \
+        tree->header.next_free_offset = node->offset;                                                                  \
+        tree->header.count_nodes--;                                                                                    \
+    }                                                                                                                  \
+                                                                                                                       \
+    static inline Btree_Result name##_done(name *tree, Btree_Result res) {                                             \
+        if (tree->failed) {                                                                                            \
+            tree->failed = false;                                                                                      \
+            return BTREE_ERROR_UNIX;                                                                                   \
+        }                                                                                                              \
+        return res;                                                                                                    \
+    }                                                                                                                  \
+                                                                                                                       \
+    static inline Btree_Result name##_init(name *tree, const char *path) {                                             \
+        if (tree == NULL) {                                                                                            \
+            return BTREE_ERROR_NIL;                                                                                    \
+        }                                                                                                              \
+                                                                                                                       \
+        memset(tree, 0, sizeof(*tree));                                                                                \
+        tree->fd = open(path, O_RDWR);                                                                                 \
+        if (tree->fd == -1 && errno == ENOENT) {                                                                       \
+            tree->fd = open(path, O_RDWR | O_CREAT, S_IRUSR | S_IWUSR);                                                \
+            if (tree->fd == -1) {                                                                                      \
+                return BTREE_ERROR_UNIX;                                                                               \
+            }                                                                                                          \
+            tree->header.t = name##_T;                                                                                 \
+            tree->header.M = name##_M;                                                                                 \
+            tree->header.key_size = sizeof(K);                                                                         \
+            tree->header.value_size = sizeof(V);                                                                       \
+            tree->header.next_offset = BTREE_TYPED_DATA_OFFSET;                                                        \
+            name##_append(tree, &tree->root);                                                                          \
+            tree->header.root_offset = tree->root.offset;                                                              \
+            name##_write(tree, &tree->root);                                                                           \
+            name##_header_write(tree);                                                                                 \
+            return name##_done(tree, BTREE_OK);                                                                        \
+        }                                                                                                              \
+                                                                                                                       \
+        if (tree->fd == -1) {                                                                                          \
+            return BTREE_ERROR_UNIX;                                                                                   \
+        }                                                                                                              \
+                                                                                                                       \
+        uint8_t image[sizeof(btree_typed_magic_bytes) + sizeof(tree->header)];                                         \
+        if (pread(tree->fd, image, sizeof(image), 0) != (ssize_t)sizeof(image) ||                                      \
+            memcmp(image, btree_typed_magic_bytes, sizeof(btree_typed_magic_bytes)) != 0) {                            \
+            close(tree->fd);                                                                                           \
+            return BTREE_ERROR_FORMAT;                                                                                 \
+        }                                                                                                              \
+        memcpy(&tree->header, image + sizeof(btree_typed_magic_bytes), sizeof(tree->header));                          \
+        if (tree->header.t != name##_T || tree->header.key_size != sizeof(K) ||                                        \
+            tree->header.value_size != sizeof(V)) {                                                                    \
+            close(tree->fd);                                                                                           \
+            return BTREE_ERROR_FORMAT;                                                                                 \
+        }                                                                                                              \
+        name##_load(tree, &tree->root, tree->header.root_offset);                                                      \
+        return name##_done(tree, BTREE_OK);                                                                            \
+    }                                                                                                                  \
+                                                                                                                       \
+    static inline Btree_Result name##_find(const name *tree, K key, V *value) {                                        \
+        if (tree == NULL) {                                                                                            \
+            return BTREE_ERROR_NIL;                                                                                    \
+        }                                                                                                              \
+                                                                                                                       \
+        const name##_node *x = &tree->root;                                                                            \
+        name##_node node;                                                                                              \
+        while (true) {                                                                                                 \
+            int i = name##_search(x, key, false);                                                                      \
+            if (i < x->count_keys && cmp(x->keys[i], key) == 0) {                                                      \
+                if (value) {                                                                                           \
+                    *value = x->values[i];                                                                             \
+                }                                                                                                      \
+                return BTREE_OK;                                                                                       \
+            }                                                                                                          \
+            if (name##_is_leaf(x)) {                                                                                   \
+                return BTREE_ERROR_KEY_NOT_FOUND;                                                                      \
+            }                                                                                                          \
+            if (!name##_read(tree, &node, x->children[i])) {                                                           \
+                return BTREE_ERROR_UNIX;                                                                               \
+            }                                                                                                          \
+            x = &node;                                                                                                 \
+        }                                                                                                              \
+    }                                                                                                                  \
+                                                                                                                       \
+    static inline void name##_split_child(name *tree, name##_node *x, name##_node *y, int i) {                         \
+        name##_node z;                                                                                                 \
+        name##_append(tree, &z);                                                                                       \
+        z.count_keys = name##_T - 1;                                                                                   \
+        memcpy(z.keys, y->keys + name##_T, sizeof(K) * (name##_T - 1));                                                \
+        memcpy(z.values, y->values + name##_T, sizeof(V) * (name##_T - 1));                                            \
+        memcpy(z.children, y->children + name##_T, sizeof(size_t) * name##_T);                                         \
+                                                                                                                       \
+        memmove(x->children + i + 1, x->children + i, sizeof(size_t) * (x->count_keys - i + 1));                       \
+        x->children[i + 1] = z.offset;                                                                                 \
+        memmove(x->keys + i + 1, x->keys + i, sizeof(K) * (x->count_keys - i));                                        \
+        memmove(x->values + i + 1, x->values + i, sizeof(V) * (x->count_keys - i));                                    \
+        x->keys[i] = y->keys[name##_T - 1];                                                                            \
+        x->values[i] = y->values[name##_T - 1];                                                                        \
+        x->count_keys++;                                                                                               \
+                                                                                                                       \
+        y->count_keys = name##_T - 1;                                                                                  \
+        memset(y->keys + name##_T - 1, 0, sizeof(K) * name##_T);                                                       \
+        memset(y->values + name##_T - 1, 0, sizeof(V) * name##_T);                                                     \
+        memset(y->children + name##_T, 0, sizeof(size_t) * name##_T);                                                  \
+                                                                                                                       \
+        name##_write(tree, x);                                                                                         \
+        name##_write(tree, y);                                                                                         \
+        name##_write(tree, &z);                                                                                        \
+        name##_header_write(tree);                                                                                     \
+    }                                                                                                                  \
+                                                                                                                       \
+    /* The descent alternates between two buffers, so a node and its child are both at hand for a split. */            \
+    static inline void name##_put_nonfull(name *tree, name##_node *x, K key, V value) {                                \
+        name##_node buffers[2];                                                                                        \
+        while (true) {                                                                                                 \
+            int i = name##_search(x, key, true);                                                                       \
+            if (name##_is_leaf(x)) {                                                                                   \
+                memmove(x->keys + i + 1, x->keys + i, sizeof(K) * (x->count_keys - i));                                \
+                memmove(x->values + i + 1, x->values + i, sizeof(V) * (x->count_keys - i));                            \
+                x->keys[i] = key;                                                                                      \
+                x->values[i] = value;                                                                                  \
+                x->count_keys++;                                                                                       \
+                name##_write(tree, x);                                                                                 \
+                return;                                                                                                \
+            }                                                                                                          \
+                                                                                                                       \
+            name##_node *child = x == &buffers[0] ? &buffers[1] : &buffers[0];                                         \
+            name##_load(tree, child, x->children[i]);                                                                  \
+            if (child->count_keys == name##_M - 1) {                                                                   \
+                name##_split_child(tree, x, child, i);                                                                 \
+                if (cmp(key, x->keys[i]) > 0) {                                                                        \
+                    name##_load(tree, child, x->children[i + 1]);                                                      \
+                }                                                                                                      \
+            }                                                                                                          \
+            x = child;                                                                                                 \
+        }                                                                                                              \
+    }                                                                                                                  \
+                                                                                                                       \
+    static inline Btree_Result name##_put(name *tree, K key, V value) {                                                \
+        if (tree == NULL) {                                                                                            \
+            return BTREE_ERROR_NIL;                                                                                    \
+        }                                                                                                              \
+                                                                                                                       \
+        if (tree->root.count_keys == name##_M - 1) {                                                                   \
+            name##_node s;                                                                                             \
+            name##_append(tree, &s);                                                                                   \
+            s.children[0] = tree->root.offset;                                                                         \
+            name##_split_child(tree, &s, &tree->root, 0);                                                              \
+            tree->root = s;                                                                                            \
+            tree->header.root_offset = s.offset;                                                                       \
+            name##_header_write(tree);                                                                                 \
+        }                                                                                                              \
+        name##_put_nonfull(tree, &tree->root, key, value);                                                             \
+        return name##_done(tree, BTREE_OK);                                                                            \
+    }                                                                                                                  \
+                                                                                                                       \
+    /* Moves entry i of x and all of z into y. Returns the node they ended up in, the root itself once the root */     \
+    /* gave up its last entry. */                                                                                      \
+    static inline name##_node *name##_merge(name *tree, name##_node *x, name##_node *y, name##_node *z, int i) {       \
+        y->keys[name##_T - 1] = x->keys[i];                                                                            \
+        y->values[name##_T - 1] = x->values[i];                                                                        \
+        memcpy(y->keys + name##_T, z->keys, sizeof(K) * (name##_T - 1));                                               \
+        memcpy(y->values + name##_T, z->values, sizeof(V) * (name##_T - 1));                                           \
+        memcpy(y->children + name##_T, z->children, sizeof(size_t) * name##_T);                                        \
+        y->count_keys = name##_M - 1;                                                                                  \
+                                                                                                                       \
+        memmove(x->keys + i, x->keys + i + 1, sizeof(K) * (x->count_keys - i - 1));                                    \
+        memmove(x->values + i, x->values + i + 1, sizeof(V) * (x->count_keys - i - 1));                                \
+        memmove(x->children + i + 1, x->children + i + 2, sizeof(size_t) * (x->count_keys - i - 1));                   \
+        x->count_keys--;                                                                                               \
+        memset(x->keys + x->count_keys, 0, sizeof(K));                                                                 \
+        memset(x->values + x->count_keys, 0, sizeof(V));                                                               \
+        x->children[x->count_keys + 1] = 0;                                                                            \
+                                                                                                                       \
+        name##_remove(tree, z);                                                                                        \
+        if (x == &tree->root && x->count_keys == 0) {                                                                  \
+            name##_remove(tree, x);                                                                                    \
+            tree->root = *y;                                                                                           \
+            tree->header.root_offset = y->offset;                                                                      \
+            y = &tree->root;                                                                                           \
+        } else {                                                                                                       \
+            name##_write(tree, x);                                                                                     \
+        }                                                                                                              \
+        name##_write(tree, y);                                                                                         \
+        name##_header_write(tree);                                                                                     \
+        return y;                                                                                                      \
+    }                                                                                                                  \
+                                                                                                                       \
+    static inline void name##_rotate_left(name *tree, name##_node *x, name##_node *y, name##_node *z, int i) {         \
+        y->keys[y->count_keys] = x->keys[i];                                                                           \
+        y->values[y->count_keys] = x->values[i];                                                                       \
+        y->children[y->count_keys + 1] = z->children[0];                                                               \
+        y->count_keys++;                                                                                               \
+                                                                                                                       \
+        x->keys[i] = z->keys[0];                                                                                       \
+        x->values[i] = z->values[0];                                                                                   \
+                                                                                                                       \
+        z->count_keys--;                                                                                               \
+        memmove(z->keys, z->keys + 1, sizeof(K) * z->count_keys);                                                      \
+        memmove(z->values, z->values + 1, sizeof(V) * z->count_keys);                                                  \
+        memmove(z->children, z->children + 1, sizeof(size_t) * (z->count_keys + 1));                                   \
+        memset(z->keys + z->count_keys, 0, sizeof(K));                                                                 \
+        memset(z->values + z->count_keys, 0, sizeof(V));                                                               \
+        z->children[z->count_keys + 1] = 0;                                                                            \
+                                                                                                                       \
+        name##_write(tree, x);                                                                                         \
+        name##_write(tree, y);                                                                                         \
+        name##_write(tree, z);                                                                                         \
+    }                                                                                                                  \
+                                                                                                                       \
+    static inline void name##_rotate_right(name *tree, name##_node *x, name##_node *y, name##_node *z, int i) {        \
+        memmove(z->keys + 1, z->keys, sizeof(K) * z->count_keys);                                                      \
+        memmove(z->values + 1, z->values, sizeof(V) * z->count_keys);                                                  \
+        memmove(z->children + 1, z->children, sizeof(size_t) * (z->count_keys + 1));                                   \
+        z->keys[0] = x->keys[i];                                                                                       \
+        z->values[0] = x->values[i];                                                                                   \
+        z->children[0] = y->children[y->count_keys];                                                                   \
+        z->count_keys++;                                                                                               \
+                                                                                                                       \
+        y->count_keys--;                                                                                               \
+        x->keys[i] = y->keys[y->count_keys];                                                                           \
+        x->values[i] = y->values[y->count_keys];                                                                       \
+        memset(y->keys + y->count_keys, 0, sizeof(K));                                                                 \
+        memset(y->values + y->count_keys, 0, sizeof(V));                                                               \
+        y->children[y->count_keys + 1] = 0;                                                                            \
+                                                                                                                       \
+        name##_write(tree, x);                                                                                         \
+        name##_write(tree, y);                                                                                         \
+        name##_write(tree, z);                                                                                         \
+    }                                                                                                                  \
+                                                                                                                       \
+    /* Same preemptive descent as btree_node_delete: every node entered below node keeps at least t keys. */           \
+    static inline Btree_Result name##_delete_from(name *tree, name##_node *node, K key) {                              \
+        name##_node buffers[2], sibbling, leaf;                                                                        \
+        while (true) {                                                                                                 \
+            name##_node *y = node == &buffers[0] ? &buffers[1] : &buffers[0];                                          \
+            int i = name##_search(node, key, false);                                                                   \
+            if (i < node->count_keys && cmp(node->keys[i], key) == 0) {                                                \
+                if (name##_is_leaf(node)) {                                                                            \
+                    node->count_keys--;                                                                                \
+                    memmove(node->keys + i, node->keys + i + 1, sizeof(K) * (node->count_keys - i));                   \
+                    memmove(node->values + i, node->values + i + 1, sizeof(V) * (node->count_keys - i));               \
+                    memset(node->keys + node->count_keys, 0, sizeof(K));                                               \
+                    memset(node->values + node->count_keys, 0, sizeof(V));                                             \
+                    name##_write(tree, node);                                                                          \
+                    return BTREE_OK;                                                                                   \
+                }                                                                                                      \
+                                                                                                                       \
+                name##_load(tree, y, node->children[i]);                                                               \
+                if (y->count_keys >= name##_T) {                                                                       \
+                    leaf = *y;                                                                                         \
+                    while (!name##_is_leaf(&leaf)) {                                                                   \
+                        name##_load(tree, &leaf, leaf.children[leaf.count_keys]);                                      \
+                    }                                                                                                  \
+                    key = node->keys[i] = leaf.keys[leaf.count_keys - 1];                                              \
+                    node->values[i] = leaf.values[leaf.count_keys - 1];                                                \
+                    name##_write(tree, node);                                                                          \
+                    node = y;                                                                                          \
+                    continue;                                                                                          \
+                }                                                                                                      \
+                                                                                                                       \
+                name##_load(tree, &sibbling, node->children[i + 1]);                                                   \
+                if (sibbling.count_keys >= name##_T) {                                                                 \
+                    leaf = sibbling;                                                                                   \
+                    while (!name##_is_leaf(&leaf)) {                                                                   \
+                        name##_load(tree, &leaf, leaf.children[0]);                                                    \
+                    }                                                                                                  \
+                    key = node->keys[i] = leaf.keys[0];                                                                \
+                    node->values[i] = leaf.values[0];                                                                  \
+                    name##_write(tree, node);                                                                          \
+                    *y = sibbling;                                                                                     \
+                    node = y;                                                                                          \
+                    continue;                                                                                          \
+                }                                                                                                      \
+                                                                                                                       \
+                node = name##_merge(tree, node, y, &sibbling, i);                                                      \
+                continue;                                                                                              \
+            }                                                                                                          \
+                                                                                                                       \
+            if (name##_is_leaf(node)) {                                                                                \
+                return BTREE_ERROR_KEY_NOT_FOUND;                                                                      \
+            }                                                                                                          \
+                                                                                                                       \
+            name##_load(tree, y, node->children[i]);                                                                   \
+            if (y->count_keys < name##_T) {                                                                            \
+                if (i > 0 && (name##_load(tree, &sibbling, node->children[i - 1]), sibbling.count_keys >= name##_T)) { \
+                    name##_rotate_right(tree, node, &sibbling, y, i - 1);                                              \
+                } else if (i < node->count_keys &&                                                                     \
+                           (name##_load(tree, &sibbling, node->children[i + 1]), sibbling.count_keys >= name##_T)) {   \
+                    name##_rotate_left(tree, node, y, &sibbling, i);                                                   \
+                } else if (i > 0) {                                                                                    \
+                    leaf = *y;                                                                                         \
+                    name##_load(tree, y, node->children[i - 1]);                                                       \
+                    node = name##_merge(tree, node, y, &leaf, i - 1);                                                  \
+                    continue;                                                                                          \
+                } else {                                                                                               \
+                    node = name##_merge(tree, node, y, &sibbling, i);                                                  \
+                    continue;                                                                                          \
+                }                                                                                                      \
+            }                                                                                                          \
+            node = y;                                                                                                  \
+        }                                                                                                              \
+    }                                                                                                                  \
+                                                                                                                       \
+    static inline Btree_Result name##_delete(name *tree, K key) {                                                      \
+        if (tree == NULL) {                                                                                            \
+            return BTREE_ERROR_NIL;                                                                                    \
+        }                                                                                                              \
+        return name##_done(tree, name##_delete_from(tree, &tree->root, key));                                          \
+    }                                                                                                                  \
+                                                                                                                       \
+    static inline int name##_node_is_valid(const name *tree, const name##_node *node, bool root) {                     \
+        if (!root && !(name##_T - 1 <= node->count_keys && node->count_keys <= name##_M - 1)) {                        \
+            return 0;                                                                                                  \
+        }                                                                                                              \
+        for (int i = 1; i < node->count_keys; i++) {                                                                   \
+            if (cmp(node->keys[i], node->keys[i - 1]) < 0) {                                                           \
+                return 0;                                                                                              \
+            }                                                                                                          \
+        }                                                                                                              \
+        for (int i = 0; i < name##_M; i++) {                                                                           \
+            if ((i <= node->count_keys && !name##_is_leaf(node)) != (node->children[i] != 0)) {                        \
+                return 0;                                                                                              \
+            }                                                                                                          \
+        }                                                                                                              \
+        if (name##_is_leaf(node)) {                                                                                    \
+            return 1;                                                                                                  \
+        }                                                                                                              \
+                                                                                                                       \
+        name##_node child;                                                                                             \
+        for (int i = 0; i <= node->count_keys; i++) {                                                                  \
+            if (!name##_read(tree, &child, node->children[i]) || !name##_node_is_valid(tree, &child, false)) {         \
+                return 0;                                                                                              \
+            }                                                                                                          \
+        }                                                                                                              \
+        return 1;                                                                                                      \
+    }                                                                                                                  \
+                                                                                                                       \
+    static inline int name##_is_valid(const name *tree) {                                                              \
+        return name##_node_is_valid(tree, &tree->root, true);                                                          \
+    }                                                                                                                  \
+                                                                                                                       \
+    static inline Btree_Result name##_destroy(name *tree) {                                                            \
+        if (tree == NULL) {                                                                                            \
+            return BTREE_ERROR_NIL;                                                                                    \
+        }                                                                                                              \
+        name##_header_write(tree);                                                                                     \
+        Btree_Result res = name##_done(tree, BTREE_OK);                                                                \
+        if (close(tree->fd) == -1) {                                                                                   \
+            return BTREE_ERROR_UNIX;                                                                                   \
+        }                                                                                                              \
+        return res;                                                                                                    \
+    }
 #endif // BTREE_IMPLEMENTATION
 
 #endif // BTREE_H
@@ -46,6 +46,19 @@ int main(int argc, const char **argv) {
                 printf("Bad input\n");
             }
             btree_delete(&btree, key);
+        } else if (op == 'R') {
+            int from = 0, to = 0, key = 0, value = 0;
+            if (sscanf(prompt, "R %d %d", &from, &to) != 2) {
+                printf("Bad input\n");
+            }
+            Btree_Cursor cursor;
+            btree_cursor_open(&btree, &cursor);
+            int res = btree_cursor_seek(&cursor, from);
+            while (res == BTREE_OK && btree_cursor_get(&cursor, &key, &value) == BTREE_OK && key < to) {
+                printf("%d %d\n", key, value);
+                res = btree_cursor_next(&cursor);
+            }
+            btree_cursor_close(&cursor);
         } else if (op == 'P') {
             btree_display(&btree, stdout);
         } else if (op == 'V') {
@@ -0,0 +1,152 @@
+#include <assert.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "../btree.h"
+
+// Puts keys 0..len-1 in a child that dies without destroying the tree, leaving the log to recover it. With
+// sync_us set the child first sits idle for a few periods.
+void crash_after_puts(int len, int t, int sync_ops, long sync_us, int random_deletes) {
+    pid_t pid = fork();
+    assert(pid != -1);
+    if (pid == 0) {
+        Btree btree;
+        int ok = BTREE_INIT(&btree, .path = "test10.db", .t = t, .cache_size = 4096, .wal = true,
+                            .wal_sync_ops = sync_ops, .wal_sync_us = sync_us, .wal_checkpoint_size = 1 << 18);
+        assert(ok == BTREE_OK && "Failed to init btree");
+        for (int i = 0; i < len; i++) {
+            assert(btree_put(&btree, i, -i) == BTREE_OK);
+            if (random_deletes && i % 3 == 0) {
+                assert(btree_delete(&btree, i) == BTREE_OK);
+            }
+        }
+        if (sync_us > 0) {
+            usleep(10 * sync_us);
+        }
+        _exit(0);
+    }
+    int status = 0;
+    waitpid(pid, &status, 0);
+    assert(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+}
+
+// Returns how many puts survived, asserting they are a prefix of what was done.
+int check_prefix(Btree *btree, int len, int deletes) {
+    int value = 0;
+    int count = 0;
+    for (; count < len; count++) {
+        bool deleted = deletes && count % 3 == 0;
+        Btree_Result res = btree_find(btree, count, &value);
+        if (deleted ? res != BTREE_ERROR_KEY_NOT_FOUND : res != BTREE_OK) {
+            break;
+        }
+        assert(deleted || value == -count);
+    }
+    // the put before a lost delete may have made it
+    if (count < len && deletes && count % 3 == 0 && btree_find(btree, count, &value) == BTREE_OK) {
+        count++;
+    }
+    for (int i = count; i < len; i++) {
+        assert(btree_find(btree, i, &value) == BTREE_ERROR_KEY_NOT_FOUND);
+    }
+    return count;
+}
+
+int main() {
+    int len = 3000;
+    Btree btree;
+
+    remove("test10.db");
+    remove("test10.db-wal");
+    assert(BTREE_INIT(&btree, .path = "test10.db", .t = 3, .wal = true, .backend = BTREE_BACKEND_MMAP) ==
+           BTREE_ERROR_OPTIONS);
+
+    // every operation synced: nothing is lost
+    remove("test10.db");
+    crash_after_puts(len, 3, 1, 0, 0);
+    assert(BTREE_INIT(&btree, .path = "test10.db", .wal = true) == BTREE_OK);
+    assert(btree_is_valid(&btree));
+    assert(check_prefix(&btree, len, 0) == len);
+    btree_destroy(&btree);
+
+    // group commit: a tail of unsynced operations may be lost, never a hole
+    remove("test10.db");
+    crash_after_puts(len, 3, 100, 0, 1);
+    assert(BTREE_INIT(&btree, .path = "test10.db", .wal = true) == BTREE_OK);
+    assert(btree_is_valid(&btree));
+    int count = check_prefix(&btree, len, 1);
+    assert(count > len - 100);
+    btree_destroy(&btree);
+
+    // a torn record at the end of the log is ignored
+    remove("test10.db");
+    crash_after_puts(len, 3, 1, 0, 0);
+    FILE *wal = fopen("test10.db-wal", "ab");
+    assert(wal != NULL);
+    for (int i = 0; i < 1000; i++) {
+        fputc(i * 7, wal);
+    }
+    fclose(wal);
+    assert(BTREE_INIT(&btree, .path = "test10.db", .wal = true) == BTREE_OK);
+    assert(btree_is_valid(&btree));
+    assert(check_prefix(&btree, len, 0) == len);
+    btree_destroy(&btree);
+
+    // so is a tail too short for a whole record, whatever length it claims
+    crash_after_puts(len, 3, 1, 0, 0);
+    wal = fopen("test10.db-wal", "ab");
+    assert(wal != NULL);
+    uint64_t head[2] = {(uint64_t)len + 1, UINT64_MAX / 4};
+    assert(fwrite(head, sizeof(head), 1, wal) == 1 && fwrite(head, 4, 1, wal) == 1);
+    fclose(wal);
+    assert(BTREE_INIT(&btree, .path = "test10.db", .wal = true) == BTREE_OK);
+    assert(btree_is_valid(&btree));
+    assert(check_prefix(&btree, len, 0) == len);
+    btree_destroy(&btree);
+
+    // a clean shutdown leaves an empty log and a tree readable without it
+    assert(BTREE_INIT(&btree, .path = "test10.db") == BTREE_OK);
+    assert(btree_is_valid(&btree));
+    assert(check_prefix(&btree, len, 0) == len);
+    btree_destroy(&btree);
+
+    // with big nodes a record holds the slots each operation changed, far less than the nodes themselves
+    remove("test10.db");
+    size_t node_size = 100 * (2 * 2 * sizeof(int) + 2 * sizeof(size_t));
+    assert(BTREE_INIT(&btree, .path = "test10.db", .t = 100, .cache_size = 1 << 20, .wal = true,
+                      .wal_sync_ops = 100, .wal_checkpoint_size = (size_t)1 << 30) == BTREE_OK);
+    for (int i = 0; i < len; i++) {
+        assert(btree_put(&btree, (i * 7919) % len, i) == BTREE_OK);
+    }
+    for (int i = 0; i < len; i += 3) {
+        assert(btree_delete(&btree, i) == BTREE_OK);
+    }
+    struct stat st;
+    assert(stat("test10.db-wal", &st) == 0);
+    assert(st.st_size > 0 && (size_t)st.st_size < (len + len / 3) * node_size / 2);
+    btree_destroy(&btree);
+
+    // and a crash loses none of them
+    remove("test10.db");
+    crash_after_puts(len, 100, 1, 0, 1);
+    assert(BTREE_INIT(&btree, .path = "test10.db", .wal = true) == BTREE_OK);
+    assert(btree_is_valid(&btree));
+    assert(check_prefix(&btree, len, 1) == len);
+    btree_destroy(&btree);
+
+    // operations an idle tree holds are synced once their time is up, without waiting for the next one
+    remove("test10.db");
+    crash_after_puts(len, 3, 1 << 30, 20000, 0);
+    assert(BTREE_INIT(&btree, .path = "test10.db", .wal = true) == BTREE_OK);
+    assert(btree_is_valid(&btree));
+    assert(check_prefix(&btree, len, 0) == len);
+    btree_destroy(&btree);
+
+    printf("All tests passed!\n");
+    return 0;
+}
@@ -0,0 +1,126 @@
+#include <assert.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "../btree.h"
+
+#define THREADS 8
+
+typedef struct reader {
+    Btree *btree;
+    int len;
+    int seed;
+} Reader;
+
+// Keys 0..len-1 are present from the start; the writer only adds keys from len on and removes them again.
+void *read_keys(void *arg) {
+    Reader *reader = arg;
+    unsigned int seed = reader->seed;
+    for (int i = 0; i < 20000; i++) {
+        int key = rand_r(&seed) % reader->len;
+        int value = 0;
+        assert(btree_find(reader->btree, key, &value) == BTREE_OK && value == -key);
+    }
+
+    int keys[64];
+    int values[64];
+    for (int i = 0; i < 200; i++) {
+        for (int j = 0; j < 64; j++) {
+            keys[j] = rand_r(&seed) % reader->len;
+        }
+        assert(btree_find_batch(reader->btree, keys, 64, values, NULL) == BTREE_OK);
+        for (int j = 0; j < 64; j++) {
+            assert(values[j] == -keys[j]);
+        }
+    }
+    return NULL;
+}
+
+typedef struct writer {
+    Btree *btree;
+    int from;
+    int to;
+} Writer;
+
+// Each writer owns its own negative keys, interleaved with the others so they meet in the same leaves too.
+void *write_keys(void *arg) {
+    Writer *writer = arg;
+    for (int i = writer->from; i < writer->to; i++) {
+        assert(btree_put(writer->btree, -1 - i * THREADS - writer->from / (writer->to - writer->from), i) == BTREE_OK);
+    }
+    return NULL;
+}
+
+void run(Btree_Options options) {
+    int len = 5000;
+    Btree btree;
+    remove(options.path);
+    assert(btree_init(&btree, options) == BTREE_OK);
+    for (int i = 0; i < len; i++) {
+        assert(btree_put(&btree, i, -i) == BTREE_OK);
+    }
+
+    pthread_t threads[THREADS];
+    Reader readers[THREADS];
+    for (int i = 0; i < THREADS; i++) {
+        readers[i] = (Reader){&btree, len, i + 1};
+        assert(pthread_create(&threads[i], NULL, read_keys, &readers[i]) == 0);
+    }
+
+    for (int round = 0; round < 3; round++) {
+        for (int i = len; i < 2 * len; i++) {
+            assert(btree_put(&btree, i, -i) == BTREE_OK);
+        }
+        for (int i = len; i < 2 * len; i++) {
+            assert(btree_delete(&btree, i) == BTREE_OK);
+        }
+    }
+
+    for (int i = 0; i < THREADS; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    assert(btree_is_valid(&btree));
+
+    if (options.concurrent_puts) {
+        int per_thread = 2000;
+        Writer writers[THREADS];
+        for (int i = 0; i < THREADS; i++) {
+            readers[i] = (Reader){&btree, len, i + 1};
+            writers[i] = (Writer){&btree, i * per_thread, (i + 1) * per_thread};
+            assert(pthread_create(&threads[i], NULL, i % 2 ? read_keys : write_keys,
+                                  i % 2 ? (void *)&readers[i] : (void *)&writers[i]) == 0);
+        }
+        for (int i = 0; i < THREADS; i++) {
+            pthread_join(threads[i], NULL);
+        }
+        assert(btree_is_valid(&btree));
+
+        int value = 0;
+        for (int i = 0; i < THREADS; i += 2) {
+            for (int j = writers[i].from; j < writers[i].to; j++) {
+                assert(btree_find(&btree, -1 - j * THREADS - i, &value) == BTREE_OK && value == j);
+            }
+        }
+    }
+    assert(btree_destroy(&btree) == BTREE_OK);
+}
+
+int main() {
+    Btree_Options options = {.path = "test11.db", .t = 4, .log_handler = btree_default_log_handler, .concurrent = true};
+    run(options);
+    options.cache_size = 1 << 14;
+    run(options);
+    options.backend = BTREE_BACKEND_MMAP;
+    run(options);
+
+    options.concurrent_puts = true;
+    run(options);
+    options.backend = BTREE_BACKEND_FILE;
+    run(options);
+    options.cache_size = 0;
+    run(options);
+
+    printf("All tests passed!\n");
+    return 0;
+}
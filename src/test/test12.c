@@ -0,0 +1,96 @@
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "../btree.h"
+#include "utils.h"
+
+// Checks the snapshot holds exactly the keys in [0, len) with a stride, valued -key.
+void check_snapshot(const Btree_Snapshot *snapshot, int len, int stride) {
+    int value = 0;
+    for (int key = 0; key < len; key++) {
+        Btree_Result res = btree_snapshot_find(snapshot, key, &value);
+        if (key % stride == 0) {
+            assert(res == BTREE_OK && value == -key);
+        } else {
+            assert(res == BTREE_ERROR_KEY_NOT_FOUND);
+        }
+    }
+    assert(btree_snapshot_find(snapshot, len + 1, NULL) == BTREE_ERROR_KEY_NOT_FOUND);
+
+    Btree_Cursor cursor;
+    int key = 0, expected = 0;
+    assert(btree_snapshot_cursor_open(snapshot, &cursor) == BTREE_OK);
+    for (Btree_Result res = btree_cursor_next(&cursor); res == BTREE_OK; res = btree_cursor_next(&cursor)) {
+        assert(btree_cursor_get(&cursor, &key, &value) == BTREE_OK);
+        assert(key == expected && value == -expected);
+        expected += stride;
+    }
+    assert(expected >= len && expected < len + stride);
+    btree_cursor_close(&cursor);
+}
+
+void run(Btree_Options options) {
+    int len = 3000;
+    int *keys = malloc(len * sizeof(*keys));
+    Btree btree;
+    remove(options.path);
+    assert(btree_init(&btree, options) == BTREE_OK);
+
+    Btree_Snapshot empty;
+    assert(btree_snapshot_open(&btree, &empty) == BTREE_OK);
+
+    for (int i = 0; i < len; i++) {
+        keys[i] = i;
+    }
+    shuffle(keys, len);
+    for (int i = 0; i < len; i++) {
+        assert(btree_put(&btree, keys[i], -keys[i]) == BTREE_OK);
+    }
+    check_snapshot(&empty, 0, 1);
+
+    Btree_Snapshot all, odd_gone;
+    assert(btree_snapshot_open(&btree, &all) == BTREE_OK);
+    for (int i = 0; i < len; i++) {
+        if (keys[i] % 2) {
+            assert(btree_delete(&btree, keys[i]) == BTREE_OK);
+        }
+    }
+    assert(btree_snapshot_open(&btree, &odd_gone) == BTREE_OK);
+    for (int i = len; i < 2 * len; i++) {
+        assert(btree_put(&btree, i, -i) == BTREE_OK);
+    }
+    assert(btree_is_valid(&btree));
+
+    check_snapshot(&all, len, 1);
+    check_snapshot(&odd_gone, len, 2);
+    assert(btree_snapshot_close(&btree, &empty) == BTREE_OK);
+    assert(btree_snapshot_close(&btree, &all) == BTREE_OK);
+    check_snapshot(&odd_gone, len, 2);
+
+    // with no snapshot left every replaced node is back on the free list
+    assert(btree_snapshot_close(&btree, &odd_gone) == BTREE_OK);
+    assert(btree.count_retired == 0);
+    assert(btree.header.next_free_offset != 0);
+    int value = 0;
+    for (int i = 0; i < 2 * len; i++) {
+        Btree_Result res = btree_find(&btree, i, &value);
+        assert(i < len && i % 2 ? res == BTREE_ERROR_KEY_NOT_FOUND : res == BTREE_OK && value == -i);
+    }
+    assert(btree_is_valid(&btree));
+    assert(btree_destroy(&btree) == BTREE_OK);
+    free(keys);
+}
+
+int main() {
+    srand48(42);
+    Btree_Options options = {.path = "test12.db", .t = 3, .log_handler = btree_default_log_handler};
+    run(options);
+    options.cache_size = 1 << 14;
+    run(options);
+    options.backend = BTREE_BACKEND_MMAP;
+    run(options);
+
+    printf("All tests passed!\n");
+    return 0;
+}
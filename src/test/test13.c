@@ -0,0 +1,78 @@
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "../btree.h"
+#include "utils.h"
+
+void run(Btree_Options options) {
+    int len = 5000;
+    int count = 3 * len;
+    Btree btree;
+    remove(options.path);
+    assert(btree_init(&btree, options) == BTREE_OK);
+
+    int *keys = malloc(count * sizeof(*keys));
+    int *values = malloc(count * sizeof(*values));
+    Btree_Result *results = malloc(count * sizeof(*results));
+    for (int i = 0; i < len; i++) {
+        keys[i] = 3 * i;
+    }
+    shuffle(keys, len);
+    for (int i = 0; i < len; i++) {
+        assert(btree_put(&btree, keys[i], -keys[i]) == BTREE_OK);
+    }
+
+    // every stored key once, in random order and with misses in between
+    for (int i = 0; i < count; i++) {
+        keys[i] = i;
+    }
+    shuffle(keys, count);
+    assert(btree_find_async(&btree, keys, count, values, results) == BTREE_ERROR_KEY_NOT_FOUND);
+    for (int i = 0; i < count; i++) {
+        if (keys[i] % 3 == 0) {
+            assert(results[i] == BTREE_OK && values[i] == -keys[i]);
+        } else {
+            assert(results[i] == BTREE_ERROR_KEY_NOT_FOUND);
+        }
+    }
+
+    for (int i = 0; i < count; i++) {
+        keys[i] = 3 * (i % len);
+    }
+    assert(btree_find_async(&btree, keys, count, NULL, NULL) == BTREE_OK);
+    assert(btree_find_async(&btree, keys, 0, NULL, NULL) == BTREE_OK);
+
+    // a ring that stops taking reads has them redone with pread instead of leaving the batch waiting
+    if (btree.io != NULL && btree.io->engine == BTREE_IO_URING) {
+        int ring_fd = dup(btree.io->ring_fd);
+        assert(ring_fd != -1 && dup2(btree.fd, btree.io->ring_fd) != -1);
+        assert(btree_find_async(&btree, keys, count, values, NULL) == BTREE_OK);
+        for (int i = 0; i < count; i++) {
+            assert(values[i] == -keys[i]);
+        }
+        assert(dup2(ring_fd, btree.io->ring_fd) != -1 && close(ring_fd) == 0);
+        assert(btree_find_async(&btree, keys, count, NULL, NULL) == BTREE_OK);
+    }
+    assert(btree_destroy(&btree) == BTREE_OK);
+
+    free(keys);
+    free(values);
+    free(results);
+}
+
+int main() {
+    srand48(42);
+    Btree_Io_Engine engines[] = {BTREE_IO_SYNC, BTREE_IO_URING, BTREE_IO_THREADS};
+    for (int i = 0; i < 3; i++) {
+        Btree_Options options = {.path = "test13.db", .t = 3, .io_engine = engines[i], .io_depth = 16,
+                                 .log_handler = btree_discard_log_handler};
+        run(options);
+        options.cache_size = 1 << 14;
+        run(options);
+    }
+
+    printf("All tests passed!\n");
+    return 0;
+}
@@ -0,0 +1,104 @@
+#include <assert.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "../btree.h"
+#include "utils.h"
+
+// Writes len keys spread stride apart, deletes every fifth one and checks them, then reopens the tree with
+// reopened and checks again.
+void run(Btree_Options options, Btree_Options reopened, int len, int stride) {
+    Btree btree;
+    remove(options.path);
+    assert(btree_init(&btree, options) == BTREE_OK);
+
+    int *keys = malloc(len * sizeof(*keys));
+    for (int i = 0; i < len; i++) {
+        keys[i] = (i - len / 2) * stride;
+    }
+    shuffle(keys, len);
+    for (int i = 0; i < len; i++) {
+        assert(btree_put(&btree, keys[i], keys[i] ^ 0x5555) == BTREE_OK);
+    }
+    for (int i = 0; i < len; i += 5) {
+        assert(btree_delete(&btree, keys[i]) == BTREE_OK);
+    }
+    assert(btree_is_valid(&btree));
+
+    for (int pass = 0; pass < 2; pass++) {
+        int value = 0;
+        Btree_Stats before, after;
+        assert(btree_stats(&btree, &before) == BTREE_OK);
+        for (int i = 0; i < len; i++) {
+            Btree_Result res = btree_find(&btree, keys[i], &value);
+            if (i % 5 == 0) {
+                assert(res == BTREE_ERROR_KEY_NOT_FOUND);
+            } else {
+                assert(res == BTREE_OK && value == (keys[i] ^ 0x5555));
+            }
+        }
+        // every node, packed or not, takes at most one read of its slot behind the 8-byte node head
+        assert(btree_stats(&btree, &after) == BTREE_OK);
+        size_t node_size = 8 + (btree.header.M - 1) * 2 * sizeof(int) + btree.header.M * sizeof(size_t);
+        assert(after.counters.bytes_read - before.counters.bytes_read <=
+               (after.counters.node_reads - before.counters.node_reads) * node_size);
+        assert(btree_find(&btree, stride == 1 ? len : 1, &value) == BTREE_ERROR_KEY_NOT_FOUND);
+
+        int *values = malloc(len * sizeof(*values));
+        Btree_Result *results = malloc(len * sizeof(*results));
+        assert(btree_find_async(&btree, keys, len, values, results) == BTREE_ERROR_KEY_NOT_FOUND);
+        for (int i = 0; i < len; i++) {
+            assert(i % 5 == 0 ? results[i] == BTREE_ERROR_KEY_NOT_FOUND : values[i] == (keys[i] ^ 0x5555));
+        }
+        free(values);
+        free(results);
+
+        Btree_Cursor cursor;
+        int key, last = 0, count = 0;
+        assert(btree_cursor_open(&btree, &cursor) == BTREE_OK);
+        assert(btree_cursor_seek(&cursor, INT_MIN) == BTREE_OK);
+        while (btree_cursor_get(&cursor, &key, &value) == BTREE_OK) {
+            assert(count == 0 || key > last);
+            assert(value == (key ^ 0x5555));
+            last = key;
+            count++;
+            btree_cursor_next(&cursor);
+        }
+        btree_cursor_close(&cursor);
+        assert(count == len - (len + 4) / 5);
+
+        assert(btree_destroy(&btree) == BTREE_OK);
+        if (pass == 0) {
+            assert(btree_init(&btree, reopened) == BTREE_OK);
+        }
+    }
+
+    free(keys);
+}
+
+int main() {
+    srand48(42);
+    int strides[] = {1, 7, 1 << 17};
+    for (int i = 0; i < 3; i++) {
+        Btree_Options options = {.path = "test14.db", .t = 8, .compress_leaves = true};
+        Btree_Options plain = {.path = "test14.db"};
+        run(options, options, 20000, strides[i]);
+        run(options, plain, 20000, strides[i]);
+
+        options.cache_size = 1 << 16;
+        plain.cache_size = 1 << 16;
+        run(options, options, 20000, strides[i]);
+        run(options, plain, 20000, strides[i]);
+
+        // packed leaves written through the cache are read back through the map and the other way round
+        plain.backend = BTREE_BACKEND_MMAP;
+        run(options, plain, 20000, strides[i]);
+        options.cache_size = 0;
+        options.backend = BTREE_BACKEND_MMAP;
+        run(options, options, 20000, strides[i]);
+    }
+
+    remove("test14.db");
+    return 0;
+}
@@ -0,0 +1,133 @@
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../btree.h"
+#include "utils.h"
+
+#define COUNT 5000
+
+// Key i is its decimal digits, padded with a letter to at most 56 bytes, so many keys are
+// prefixes of others. Values grow with i, and every 97th one spills into overflow pages.
+int make_key(int i, char *key) {
+    int len = sprintf(key, "%d", i);
+    int pad = i % 53;
+    memset(key + len, 'a' + i % 26, pad);
+    return len + pad;
+}
+
+size_t make_value(int i, char *value) {
+    size_t len = i % 97 == 0 ? (size_t)(3 * BTREE_BYTES_PAGE_SIZE + i) : (size_t)(i % 40);
+    for (size_t j = 0; j < len; j++) {
+        value[j] = (char)(i + j);
+    }
+    return len;
+}
+
+void check(const Btree_Bytes *btree, const int *ids, char *buffer) {
+    char key[64], value[4 * BTREE_BYTES_PAGE_SIZE + COUNT];
+    for (int k = 0; k < COUNT; k++) {
+        int i = ids[k];
+        int key_len = make_key(i, key);
+        size_t value_len = sizeof(value);
+        Btree_Result res = btree_bytes_find(btree, key, key_len, buffer, &value_len);
+        if (i % 3 == 0) {
+            assert(res == BTREE_ERROR_KEY_NOT_FOUND);
+            continue;
+        }
+
+        assert(res == BTREE_OK);
+        size_t len = make_value(i, value);
+        assert(value_len == len && memcmp(buffer, value, len) == 0);
+
+        // short buffers get a prefix and the full length
+        value_len = 5;
+        assert(btree_bytes_find(btree, key, key_len, buffer, &value_len) == BTREE_OK);
+        assert(value_len == len && memcmp(buffer, value, len < 5 ? len : 5) == 0);
+    }
+}
+
+int main() {
+    srand(42);
+    const char *path = "test15.db";
+    remove(path);
+
+    Btree_Bytes btree;
+    assert(BTREE_BYTES_INIT(&btree, .path = path, .t = 1) == BTREE_ERROR_BAD_T);
+    assert(BTREE_BYTES_INIT(&btree, .path = path, .t = 1000) == BTREE_ERROR_BAD_T);
+    assert(BTREE_BYTES_INIT(&btree, .path = path, .t = 4) == BTREE_OK);
+
+    char key[BTREE_BYTES_PAGE_SIZE];
+    memset(key, 'k', sizeof(key));
+    assert(btree_bytes_put(&btree, key, btree_bytes_max_key(&btree) + 1, "v", 1) == BTREE_ERROR_TOO_LONG);
+    assert(btree_bytes_put(&btree, key, btree_bytes_max_key(&btree), "v", 1) == BTREE_OK);
+    assert(btree_bytes_delete(&btree, key, btree_bytes_max_key(&btree)) == BTREE_OK);
+
+    // the empty key sorts before every other key
+    assert(btree_bytes_put(&btree, "", 0, "empty", 5) == BTREE_OK);
+
+    int *ids = malloc(COUNT * sizeof(*ids));
+    char *value = malloc(4 * BTREE_BYTES_PAGE_SIZE + COUNT);
+    char *buffer = malloc(4 * BTREE_BYTES_PAGE_SIZE + COUNT);
+    for (int i = 0; i < COUNT; i++) {
+        ids[i] = i;
+    }
+    shuffle(ids, COUNT);
+    for (int k = 0; k < COUNT; k++) {
+        int key_len = make_key(ids[k], key);
+        size_t value_len = make_value(ids[k], value);
+        assert(btree_bytes_put(&btree, key, key_len, value, value_len) == BTREE_OK);
+    }
+    assert(btree_bytes_is_valid(&btree));
+
+    shuffle(ids, COUNT);
+    for (int k = 0; k < COUNT; k++) {
+        if (ids[k] % 3 == 0) {
+            int key_len = make_key(ids[k], key);
+            assert(btree_bytes_delete(&btree, key, key_len) == BTREE_OK);
+            assert(btree_bytes_delete(&btree, key, key_len) == BTREE_ERROR_KEY_NOT_FOUND);
+        }
+    }
+    assert(btree_bytes_is_valid(&btree));
+    check(&btree, ids, buffer);
+
+    size_t value_len = 0;
+    assert(btree_bytes_find(&btree, "", 0, NULL, &value_len) == BTREE_OK && value_len == 5);
+    assert(btree_bytes_destroy(&btree) == BTREE_OK);
+
+    assert(BTREE_BYTES_INIT(&btree, .path = path) == BTREE_OK);
+    assert(btree_bytes_is_valid(&btree));
+    check(&btree, ids, buffer);
+
+    // deleting everything returns the overflow pages to the free list, so putting them back reuses them
+    size_t next_offset = btree.header.next_offset;
+    for (int k = 0; k < COUNT; k++) {
+        if (ids[k] % 3 != 0) {
+            int key_len = make_key(ids[k], key);
+            assert(btree_bytes_delete(&btree, key, key_len) == BTREE_OK);
+        }
+    }
+    assert(btree_bytes_delete(&btree, "", 0) == BTREE_OK);
+    assert(btree_bytes_is_valid(&btree));
+    assert(btree.header.count_nodes == 1 && btree.root->count_keys == 0);
+    for (int k = 0; k < COUNT; k++) {
+        if (ids[k] % 3 != 0) {
+            int key_len = make_key(ids[k], key);
+            size_t value_len = make_value(ids[k], value);
+            assert(btree_bytes_put(&btree, key, key_len, value, value_len) == BTREE_OK);
+        }
+    }
+    assert(btree.header.next_offset == next_offset);
+    check(&btree, ids, buffer);
+    assert(btree_bytes_destroy(&btree) == BTREE_OK);
+
+    Btree int_tree;
+    assert(BTREE_INIT(&int_tree, .path = path) == BTREE_ERROR_FORMAT);
+
+    free(ids);
+    free(value);
+    free(buffer);
+    remove(path);
+    return 0;
+}
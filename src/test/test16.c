@@ -0,0 +1,85 @@
+#include <assert.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#define BTREE_IMPLEMENTATION
+#include "../btree.h"
+#include "utils.h"
+
+typedef struct payload {
+    uint64_t id;
+    uint64_t check;
+} Payload;
+
+static inline int u64_cmp(uint64_t a, uint64_t b) {
+    return (a > b) - (a < b);
+}
+
+BTREE_DEFINE(wide_tree, uint64_t, Payload, u64_cmp)
+
+BTREE_DEFINE_T(narrow_tree, uint64_t, Payload, u64_cmp, 3)
+
+// Keys use the high bits, so they only sort right as 64-bit values.
+#define KEY(i) (((uint64_t)(i) << 33) | 0x5u)
+
+#define RUN(tree_type, path, count)                                                                                    \
+    do {                                                                                                               \
+        tree_type tree;                                                                                                \
+        remove(path);                                                                                                  \
+        assert(tree_type##_init(&tree, path) == BTREE_OK);                                                             \
+        int *ids = malloc((count) * sizeof(*ids));                                                                     \
+        for (int i = 0; i < (count); i++) {                                                                            \
+            ids[i] = i;                                                                                                \
+        }                                                                                                              \
+        shuffle(ids, count);                                                                                           \
+        for (int i = 0; i < (count); i++) {                                                                            \
+            Payload payload = {KEY(ids[i]), ~KEY(ids[i])};                                                             \
+            assert(tree_type##_put(&tree, KEY(ids[i]), payload) == BTREE_OK);                                          \
+        }                                                                                                              \
+        assert(tree_type##_is_valid(&tree));                                                                           \
+        shuffle(ids, count);                                                                                           \
+        for (int i = 0; i < (count); i += 2) {                                                                         \
+            assert(tree_type##_delete(&tree, KEY(ids[i])) == BTREE_OK);                                                \
+        }                                                                                                              \
+        assert(tree_type##_delete(&tree, KEY(count)) == BTREE_ERROR_KEY_NOT_FOUND);                                    \
+        assert(tree_type##_is_valid(&tree));                                                                           \
+        assert(tree_type##_destroy(&tree) == BTREE_OK);                                                                \
+                                                                                                                       \
+        assert(tree_type##_init(&tree, path) == BTREE_OK);                                                             \
+        for (int i = 0; i < (count); i++) {                                                                            \
+            Payload payload = {0, 0};                                                                                  \
+            Btree_Result res = tree_type##_find(&tree, KEY(ids[i]), &payload);                                         \
+            if (i % 2 == 0) {                                                                                          \
+                assert(res == BTREE_ERROR_KEY_NOT_FOUND);                                                              \
+            } else {                                                                                                   \
+                assert(res == BTREE_OK && payload.id == KEY(ids[i]) && payload.check == ~KEY(ids[i]));                 \
+            }                                                                                                          \
+        }                                                                                                              \
+        for (int i = 1; i < (count); i += 2) {                                                                         \
+            assert(tree_type##_delete(&tree, KEY(ids[i])) == BTREE_OK);                                                \
+        }                                                                                                              \
+        assert(tree_type##_is_valid(&tree));                                                                           \
+        assert(tree.root.count_keys == 0 && tree.header.count_nodes == 1);                                             \
+        assert(tree_type##_destroy(&tree) == BTREE_OK);                                                                \
+        free(ids);                                                                                                     \
+    } while (0)
+
+int main() {
+    srand(42);
+    assert(wide_tree_T == 64 && wide_tree_NODE_SIZE <= BTREE_TYPED_NODE_BUDGET);
+    RUN(wide_tree, "test16.db", 100000);
+    RUN(narrow_tree, "test16.db", 20000);
+
+    // a file written with other sizes does not open
+    narrow_tree narrow;
+    assert(narrow_tree_init(&narrow, "test16.db") == BTREE_OK);
+    assert(narrow_tree_destroy(&narrow) == BTREE_OK);
+    wide_tree wide;
+    assert(wide_tree_init(&wide, "test16.db") == BTREE_ERROR_FORMAT);
+
+    Btree btree;
+    assert(BTREE_INIT(&btree, .path = "test16.db") == BTREE_ERROR_FORMAT);
+    remove("test16.db");
+    return 0;
+}
@@ -0,0 +1,143 @@
+#include <assert.h>
+#include <errno.h>
+#include <limits.h>
+#include <stdlib.h>
+
+#include "../btree.h"
+#include "utils.h"
+
+#define LEN 50000
+#define BATCH 1000
+
+typedef struct range {
+    int next;
+    int end;
+} Range;
+
+bool range_next(void *ctx, Item *item) {
+    Range *range = ctx;
+    if (range->next >= range->end) {
+        return false;
+    }
+    item->key = range->next;
+    item->value = -range->next;
+    range->next++;
+    return true;
+}
+
+void run(Btree_Options options) {
+    Btree btree;
+    assert(btree_init(&btree, options) == BTREE_OK);
+    assert(btree.fd == -1);
+
+    int *keys = malloc(LEN * sizeof(*keys));
+    for (int i = 0; i < LEN; i++) {
+        keys[i] = i * 3;
+    }
+    shuffle(keys, LEN);
+    for (int i = 0; i < LEN; i++) {
+        assert(btree_put(&btree, keys[i], -keys[i]) == BTREE_OK);
+    }
+    assert(btree_is_valid(&btree));
+
+    Btree_Snapshot snapshot;
+    assert(btree_snapshot_open(&btree, &snapshot) == BTREE_OK);
+    for (int i = 0; i < LEN; i += 2) {
+        assert(btree_delete(&btree, keys[i]) == BTREE_OK);
+    }
+    assert(btree_delete(&btree, 1) == BTREE_ERROR_KEY_NOT_FOUND);
+    assert(btree_is_valid(&btree));
+    assert(btree_sync(&btree) == BTREE_OK);
+
+    int value = 0;
+    for (int i = 0; i < LEN; i++) {
+        Btree_Result res = btree_find(&btree, keys[i], &value);
+        assert(i % 2 == 0 ? res == BTREE_ERROR_KEY_NOT_FOUND : res == BTREE_OK && value == -keys[i]);
+        assert(btree_snapshot_find(&snapshot, keys[i], &value) == BTREE_OK && value == -keys[i]);
+    }
+    assert(btree_snapshot_close(&btree, &snapshot) == BTREE_OK);
+
+    Btree_Cursor cursor;
+    int key, last = INT_MIN, count = 0;
+    assert(btree_cursor_open(&btree, &cursor) == BTREE_OK);
+    assert(btree_cursor_seek(&cursor, INT_MIN) == BTREE_OK);
+    while (btree_cursor_get(&cursor, &key, &value) == BTREE_OK) {
+        assert(key > last && value == -key);
+        last = key;
+        count++;
+        btree_cursor_next(&cursor);
+    }
+    btree_cursor_close(&cursor);
+    assert(count == LEN / 2);
+
+    // freed nodes are reused rather than growing the arena
+    size_t next_offset = btree.header.next_offset;
+    for (int i = 0; i < LEN; i += 2) {
+        assert(btree_put(&btree, keys[i], -keys[i]) == BTREE_OK);
+    }
+    assert(btree_is_valid(&btree));
+    assert(btree.header.next_offset <= next_offset + (next_offset >> 2));
+
+    assert(btree_destroy(&btree) == BTREE_OK);
+    free(keys);
+}
+
+// Fills a small arena until puts fail, which must leave a valid tree holding everything put before.
+void exhaust(int mode) {
+    Btree btree;
+    assert(BTREE_INIT(&btree, .t = 4, .map_size = 1 << 16) == BTREE_OK);
+
+    int count = 0;
+    Btree_Result res = BTREE_OK;
+    if (mode == 0) {
+        for (; res == BTREE_OK; count++) {
+            res = btree_put(&btree, count, -count);
+        }
+        count--;
+    } else if (mode == 1) {
+        Item items[BATCH];
+        for (; res == BTREE_OK; count += BATCH) {
+            for (int i = 0; i < BATCH; i++) {
+                items[i] = (Item){.key = count + i, .value = -(count + i)};
+            }
+            res = btree_put_batch(&btree, items, BATCH);
+        }
+        count -= BATCH;
+    } else {
+        Range range = {0, 1 << 20};
+        res = btree_bulk_load(&btree, (Btree_Iterator){range_next, &range});
+        count = range.next - 1;
+    }
+    assert(res == BTREE_ERROR_UNIX && errno == ENOMEM);
+    assert(count > 0);
+    assert(btree_is_valid(&btree));
+    assert(btree.header.next_offset <= btree.map_size);
+
+    int value = 0;
+    for (int i = 0; i < count; i++) {
+        assert(btree_find(&btree, i, &value) == BTREE_OK && value == -i);
+    }
+    // deletes need no new nodes, and the room they free is taken again
+    for (int i = 0; i < count / 2; i++) {
+        assert(btree_delete(&btree, i) == BTREE_OK);
+    }
+    assert(btree_put(&btree, 0, 0) == BTREE_OK);
+    assert(btree_is_valid(&btree));
+    assert(btree_destroy(&btree) == BTREE_OK);
+}
+
+int main() {
+    srand48(42);
+    Btree btree;
+    assert(BTREE_INIT(&btree, .t = 1) == BTREE_ERROR_BAD_T);
+    assert(BTREE_INIT(&btree, .t = 4, .wal = true, .cache_size = 1 << 16) == BTREE_ERROR_OPTIONS);
+
+    run((Btree_Options){.t = 4});
+    run((Btree_Options){.t = 16, .map_size = 1 << 26});
+    run((Btree_Options){.t = 8, .compress_leaves = true});
+    run((Btree_Options){.t = 8, .concurrent = true});
+    exhaust(0);
+    exhaust(1);
+    exhaust(2);
+    return 0;
+}
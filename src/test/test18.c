@@ -0,0 +1,99 @@
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "../btree.h"
+#include "utils.h"
+
+#define LEN 30000
+
+// Puts LEN keys, deletes every third and checks the rest, then reopens the tree with reopened and checks
+// again. Every node must sit on a page boundary.
+void run(Btree_Options options, Btree_Options reopened) {
+    Btree btree;
+    remove(options.path);
+    assert(btree_init(&btree, options) == BTREE_OK);
+    size_t page_size = btree.header.page_size;
+    assert(page_size == options.page_size);
+    assert(btree.header.root_offset % page_size == 0 && btree.header.next_offset % page_size == 0);
+
+    int *keys = malloc(LEN * sizeof(*keys));
+    for (int i = 0; i < LEN; i++) {
+        keys[i] = i;
+    }
+    shuffle(keys, LEN);
+    for (int i = 0; i < LEN; i++) {
+        assert(btree_put(&btree, keys[i], ~keys[i]) == BTREE_OK);
+    }
+    for (int i = 0; i < LEN; i += 3) {
+        assert(btree_delete(&btree, keys[i]) == BTREE_OK);
+    }
+    assert(btree_is_valid(&btree));
+    assert(btree.header.next_offset % page_size == 0 && btree.header.next_free_offset % page_size == 0);
+
+    for (int pass = 0; pass < 2; pass++) {
+        int value = 0;
+        for (int i = 0; i < LEN; i++) {
+            Btree_Result res = btree_find(&btree, keys[i], &value);
+            assert(i % 3 == 0 ? res == BTREE_ERROR_KEY_NOT_FOUND : res == BTREE_OK && value == ~keys[i]);
+        }
+
+        int *values = malloc(LEN * sizeof(*values));
+        Btree_Result *results = malloc(LEN * sizeof(*results));
+        assert(btree_find_async(&btree, keys, LEN, values, results) == BTREE_ERROR_KEY_NOT_FOUND);
+        for (int i = 0; i < LEN; i++) {
+            assert(i % 3 == 0 ? results[i] == BTREE_ERROR_KEY_NOT_FOUND : values[i] == ~keys[i]);
+        }
+        free(values);
+        free(results);
+
+        size_t next_offset = btree.header.next_offset;
+        assert(btree_destroy(&btree) == BTREE_OK);
+        if (pass == 0) {
+            assert(btree_init(&btree, reopened) == BTREE_OK);
+            assert(btree.header.page_size == page_size && btree.header.next_offset == next_offset);
+            assert(btree_is_valid(&btree));
+        }
+    }
+    free(keys);
+}
+
+int main() {
+    srand48(42);
+    const char *path = "test18.db";
+    Btree btree;
+    assert(BTREE_INIT(&btree, .path = path, .page_size = 1000) == BTREE_ERROR_OPTIONS);
+    assert(BTREE_INIT(&btree, .path = path, .page_size = 256) == BTREE_ERROR_OPTIONS);
+    assert(BTREE_INIT(&btree, .path = path, .page_size = 4096, .direct = true, .wal = true) == BTREE_ERROR_OPTIONS);
+    assert(BTREE_INIT(&btree, .page_size = 4096, .direct = true) == BTREE_ERROR_OPTIONS);
+    assert(BTREE_INIT(&btree, .path = path, .page_size = 4096, .direct = true, .backend = BTREE_BACKEND_MMAP) ==
+           BTREE_ERROR_OPTIONS);
+
+    // t comes from the page unless given, and a node never spills into the next page
+    size_t page_sizes[] = {4096, 16384, 65536};
+    for (int i = 0; i < 3; i++) {
+        remove(path);
+        assert(BTREE_INIT(&btree, .path = path, .page_size = page_sizes[i]) == BTREE_OK);
+        assert(btree.header.t == (int)page_sizes[i] / 32);
+        assert(btree_destroy(&btree) == BTREE_OK);
+    }
+
+    Btree_Options direct = {.path = path, .page_size = 4096, .direct = true};
+    Btree_Options plain = {.path = path};
+    run(direct, direct);
+    run(direct, plain);
+    run((Btree_Options){.path = path, .page_size = 512, .t = 3}, direct);
+
+    direct.cache_size = 1 << 18;
+    run(direct, direct);
+    direct.compress_leaves = true;
+    run(direct, (Btree_Options){.path = path, .backend = BTREE_BACKEND_MMAP});
+
+    // an unpaged tree has no page to align to
+    remove(path);
+    assert(BTREE_INIT(&btree, .path = path, .t = 4) == BTREE_OK);
+    assert(btree_destroy(&btree) == BTREE_OK);
+    assert(BTREE_INIT(&btree, .path = path, .direct = true) == BTREE_ERROR_OPTIONS);
+    remove(path);
+    return 0;
+}
@@ -0,0 +1,128 @@
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/stat.h>
+
+#include "../btree.h"
+#include "utils.h"
+
+#define LEN 40000
+
+size_t file_size(const char *path) {
+    struct stat st;
+    assert(stat(path, &st) == 0);
+    return st.st_size;
+}
+
+// Fills a tree, deletes most keys in a run from the middle so the nodes left are spread over the file, then
+// vacuums. The file must shrink to the nodes left, and freed slots must be reused before it grows again.
+void run(Btree_Options options, Btree_Options reopened) {
+    Btree btree;
+    options.log_handler = btree_default_log_handler;
+    if (options.path != NULL) {
+        remove(options.path);
+    }
+    assert(btree_init(&btree, options) == BTREE_OK);
+
+    int *keys = malloc(LEN * sizeof(*keys));
+    for (int i = 0; i < LEN; i++) {
+        keys[i] = i;
+    }
+    shuffle(keys, LEN);
+    for (int i = 0; i < LEN; i++) {
+        assert(btree_put(&btree, keys[i], -keys[i]) == BTREE_OK);
+    }
+    for (int i = LEN / 10; i < LEN; i++) {
+        if (i % 50 != 0) {
+            assert(btree_delete(&btree, i) == BTREE_OK);
+        }
+    }
+    assert(btree_is_valid(&btree));
+
+    Btree_Snapshot snapshot;
+    assert(btree_snapshot_open(&btree, &snapshot) == BTREE_OK);
+    assert(btree_vacuum(&btree) == BTREE_ERROR_BUSY);
+    assert(btree_snapshot_close(&btree, &snapshot) == BTREE_OK);
+
+    // every node ends up in the first count_nodes slots, right after the header
+    size_t before = btree.header.next_offset;
+    size_t node_size = btree.header.page_size != 0 ? btree.header.page_size : 16 * (size_t)btree.header.M;
+    size_t data_offset = btree.header.page_size != 0 ? btree.header.page_size : 48;
+    assert(btree_vacuum(&btree) == BTREE_OK);
+    assert(btree_is_valid(&btree));
+    assert(btree.header.next_offset < before);
+    assert(btree.header.next_offset == data_offset + btree.header.count_nodes * node_size);
+    if (options.path != NULL) {
+        assert(file_size(options.path) == btree.header.next_offset);
+    }
+
+    for (int pass = 0; pass < 2; pass++) {
+        int value = 0;
+        for (int i = 0; i < LEN; i++) {
+            Btree_Result res = btree_find(&btree, i, &value);
+            assert(i < LEN / 10 || i % 50 == 0 ? res == BTREE_OK && value == -i : res == BTREE_ERROR_KEY_NOT_FOUND);
+        }
+        if (options.path == NULL || pass == 1) {
+            break;
+        }
+
+        size_t next_offset = btree.header.next_offset;
+        assert(btree_destroy(&btree) == BTREE_OK);
+        assert(btree_init(&btree, reopened) == BTREE_OK);
+        assert(btree.header.next_offset == next_offset && btree_is_valid(&btree));
+    }
+
+    // slots freed by later deletes are taken before the file grows
+    for (int i = 0; i < LEN / 20; i++) {
+        assert(btree_delete(&btree, i) == BTREE_OK);
+    }
+    size_t next_offset = btree.header.next_offset;
+    for (int i = 0; i < LEN / 20; i++) {
+        assert(btree_put(&btree, i, -i) == BTREE_OK);
+    }
+    assert(btree_is_valid(&btree));
+    assert(btree.header.next_offset <= next_offset + (next_offset >> 2));
+
+    assert(btree_destroy(&btree) == BTREE_OK);
+    if (options.path != NULL) {
+        remove(options.path);
+    }
+    free(keys);
+}
+
+int main() {
+    srand48(42);
+    const char *path = "test19.db";
+    assert(btree_vacuum(NULL) == BTREE_ERROR_NIL);
+
+    Btree_Options plain = {.path = path, .t = 4};
+    run(plain, plain);
+    run((Btree_Options){.path = path, .t = 8, .cache_size = 1 << 16}, plain);
+    run((Btree_Options){.path = path, .t = 8, .backend = BTREE_BACKEND_MMAP}, (Btree_Options){.path = path});
+    run((Btree_Options){.path = path, .t = 8, .compress_leaves = true}, plain);
+    run((Btree_Options){.path = path, .t = 4, .wal = true, .cache_size = 1 << 16}, plain);
+    run((Btree_Options){.path = path, .page_size = 4096, .direct = true}, (Btree_Options){.path = path});
+    run((Btree_Options){.t = 4}, plain);
+    run((Btree_Options){.t = 8, .concurrent = true}, plain);
+
+    // the free list on disk is walked once at open, and a vacuum leaves none of it
+    remove(path);
+    Btree btree;
+    assert(BTREE_INIT(&btree, .path = path, .t = 3) == BTREE_OK);
+    for (int i = 0; i < 5000; i++) {
+        assert(btree_put(&btree, i, i) == BTREE_OK);
+    }
+    for (int i = 0; i < 5000; i += 2) {
+        assert(btree_delete(&btree, i) == BTREE_OK);
+    }
+    size_t count_free = btree.free_space.count;
+    assert(count_free > 0);
+    assert(btree_destroy(&btree) == BTREE_OK);
+    assert(BTREE_INIT(&btree, .path = path) == BTREE_OK);
+    assert(btree.free_space.count == count_free && btree_is_valid(&btree));
+    assert(btree_vacuum(&btree) == BTREE_OK);
+    assert(btree.free_space.count == 0 && btree.header.next_free_offset == 0);
+    assert(btree_destroy(&btree) == BTREE_OK);
+    remove(path);
+    return 0;
+}
@@ -0,0 +1,136 @@
+#include <assert.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/stat.h>
+
+#include "../btree.h"
+#include "utils.h"
+
+#define LEN 30000
+
+// Walks the tree in the file level by level. With BFS every node must sit exactly at its place in the walk;
+// with vEB the top half of the levels must fill the first slots. Returns how many nodes that top half holds.
+int check_layout(const char *path, Btree_Header header, Btree_Layout layout) {
+    size_t node_size = header.page_size != 0 ? header.page_size : 16 * (size_t)header.M;
+    size_t data_offset = header.page_size != 0 ? header.page_size : 48;
+    size_t *offsets = malloc(header.count_nodes * sizeof(*offsets));
+    uint8_t *image = malloc(node_size);
+    int level_ends[64];
+    offsets[0] = header.root_offset;
+    int listed = 1, height = 0;
+
+    FILE *file = fopen(path, "rb");
+    assert(file != NULL);
+    for (int i = 0; i < listed; i++) {
+        if (i == 0 || i == level_ends[height - 1]) {
+            level_ends[height++] = listed;
+        }
+        if (layout == BTREE_LAYOUT_BFS) {
+            assert(offsets[i] == data_offset + i * node_size);
+        }
+
+        assert(fseek(file, offsets[i], SEEK_SET) == 0 && fread(image, node_size, 1, file) == 1);
+        int count_keys = *(int *)image;
+        size_t *children = (size_t *)(image + 8 + 2 * (header.M - 1) * sizeof(int));
+        for (int j = 0; children[0] != 0 && j <= count_keys; j++) {
+            offsets[listed++] = children[j];
+        }
+    }
+    assert(listed == header.count_nodes);
+    fclose(file);
+
+    int count_top = level_ends[height / 2 - 1];
+    for (int i = 0; i < count_top; i++) {
+        assert(offsets[i] < data_offset + count_top * node_size);
+    }
+    free(image);
+    free(offsets);
+    return count_top;
+}
+
+void run(Btree_Options options, Btree_Options reopened, Btree_Layout layout) {
+    Btree btree;
+    options.log_handler = btree_default_log_handler;
+    if (options.path != NULL) {
+        remove(options.path);
+    }
+    assert(btree_init(&btree, options) == BTREE_OK);
+
+    int *keys = malloc(LEN * sizeof(*keys));
+    for (int i = 0; i < LEN; i++) {
+        keys[i] = i;
+    }
+    shuffle(keys, LEN);
+    for (int i = 0; i < LEN; i++) {
+        assert(btree_put(&btree, keys[i], ~keys[i]) == BTREE_OK);
+    }
+    for (int i = 0; i < LEN; i += 4) {
+        assert(btree_delete(&btree, keys[i]) == BTREE_OK);
+    }
+
+    Btree_Snapshot snapshot;
+    assert(btree_snapshot_open(&btree, &snapshot) == BTREE_OK);
+    assert(btree_reorganize(&btree, layout) == BTREE_ERROR_BUSY);
+    assert(btree_snapshot_close(&btree, &snapshot) == BTREE_OK);
+
+    int count_nodes = btree.header.count_nodes;
+    assert(btree_reorganize(&btree, layout) == BTREE_OK);
+    assert(btree.header.count_nodes == count_nodes && btree.header.next_free_offset == 0);
+    assert(btree_is_valid(&btree));
+    if (options.path != NULL) {
+        struct stat st;
+        assert(stat(options.path, &st) == 0 && (size_t)st.st_size == btree.header.next_offset);
+    }
+
+    for (int pass = 0; pass < 2; pass++) {
+        int value = 0;
+        for (int i = 0; i < LEN; i++) {
+            Btree_Result res = btree_find(&btree, keys[i], &value);
+            assert(i % 4 == 0 ? res == BTREE_ERROR_KEY_NOT_FOUND : res == BTREE_OK && value == ~keys[i]);
+        }
+        if (options.path == NULL || pass == 1) {
+            break;
+        }
+        Btree_Header header = btree.header;
+        assert(btree_destroy(&btree) == BTREE_OK);
+        if (!options.compress_leaves) {
+            assert(check_layout(options.path, header, layout) > 1);
+        }
+        assert(btree_init(&btree, reopened) == BTREE_OK);
+        assert(btree_is_valid(&btree));
+    }
+
+    // the tree keeps growing normally after it
+    for (int i = 0; i < LEN; i += 4) {
+        assert(btree_put(&btree, keys[i], ~keys[i]) == BTREE_OK);
+    }
+    assert(btree_is_valid(&btree));
+    assert(btree_destroy(&btree) == BTREE_OK);
+    if (options.path != NULL) {
+        remove(options.path);
+    }
+    free(keys);
+}
+
+int main() {
+    srand48(42);
+    const char *path = "test20.db";
+    Btree btree;
+    assert(btree_reorganize(NULL, BTREE_LAYOUT_BFS) == BTREE_ERROR_NIL);
+    assert(BTREE_INIT(&btree, .t = 4) == BTREE_OK);
+    assert(btree_reorganize(&btree, (Btree_Layout)7) == BTREE_ERROR_OPTIONS);
+    assert(btree_destroy(&btree) == BTREE_OK);
+
+    Btree_Options plain = {.path = path, .log_handler = btree_default_log_handler};
+    for (Btree_Layout layout = BTREE_LAYOUT_BFS; layout <= BTREE_LAYOUT_VEB; layout++) {
+        run((Btree_Options){.path = path, .t = 3}, plain, layout);
+        run((Btree_Options){.path = path, .t = 8, .cache_size = 1 << 16}, plain, layout);
+        run((Btree_Options){.path = path, .t = 8, .backend = BTREE_BACKEND_MMAP}, plain, layout);
+        run((Btree_Options){.path = path, .t = 4, .compress_leaves = true}, plain, layout);
+        run((Btree_Options){.path = path, .t = 4, .wal = true, .cache_size = 1 << 16}, plain, layout);
+        run((Btree_Options){.path = path, .page_size = 512, .t = 3, .direct = true}, plain, layout);
+        run((Btree_Options){.t = 2}, plain, layout);
+    }
+    return 0;
+}
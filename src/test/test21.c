@@ -0,0 +1,127 @@
+#include <assert.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "../btree.h"
+#include "utils.h"
+
+#define LEN 20000
+#define THREADS 4
+
+uint64_t count_latencies(const Btree_Stats *stats, Btree_Op op) {
+    uint64_t count = 0;
+    for (int i = 0; i < BTREE_STATS_LATENCY_BUCKETS; i++) {
+        count += stats->counters.latencies[op][i];
+    }
+    return count;
+}
+
+void *find_all(void *arg) {
+    Btree *btree = arg;
+    int value = 0;
+    for (int key = 0; key < LEN; key++) {
+        assert(btree_find(btree, key, &value) == BTREE_OK && value == -key);
+    }
+    return NULL;
+}
+
+int main() {
+    srand48(42);
+    const char *path = "test21.db";
+    Btree btree;
+    Btree_Stats stats;
+    remove(path);
+    assert(btree_stats(NULL, &stats) == BTREE_ERROR_NIL);
+    assert(BTREE_INIT(&btree, .path = path, .t = 3) == BTREE_OK);
+
+    int *keys = malloc(LEN * sizeof(*keys));
+    for (int i = 0; i < LEN; i++) {
+        keys[i] = i;
+    }
+    shuffle(keys, LEN);
+    for (int i = 0; i < LEN; i++) {
+        assert(btree_put(&btree, keys[i], -keys[i]) == BTREE_OK);
+    }
+
+    assert(btree_stats(&btree, &stats) == BTREE_OK);
+    Btree_Counters *counters = &stats.counters;
+    assert(stats.count_nodes == btree.header.count_nodes && stats.height >= 5);
+    assert(counters->splits == (uint64_t)stats.count_nodes - stats.height);
+    assert(counters->appends == (uint64_t)stats.count_nodes && counters->free_pops == 0);
+    assert(counters->merges == 0 && counters->rotations == 0);
+    assert(counters->node_reads > 0 && counters->node_writes > 0 && counters->bytes_written > 0);
+    assert(counters->cache_hits == 0 && counters->cache_misses == 0);
+    assert(count_latencies(&stats, BTREE_OP_PUT) == 0);
+
+    // below the root a node holds at least t - 1 = 2 of 5 keys, which is bucket 4
+    uint64_t count_filled = 0;
+    for (int i = 0; i < BTREE_STATS_FILL_BUCKETS; i++) {
+        assert(i >= 4 || stats.fill[i] <= 1);
+        count_filled += stats.fill[i];
+    }
+    assert(count_filled == (uint64_t)stats.count_nodes);
+
+    // deletes borrow and merge, and the puts after them take the freed slots
+    for (int i = 0; i < LEN; i += 2) {
+        assert(btree_delete(&btree, keys[i]) == BTREE_OK);
+    }
+    for (int i = 0; i < LEN; i += 2) {
+        assert(btree_put(&btree, keys[i], -keys[i]) == BTREE_OK);
+    }
+    assert(btree_stats(&btree, &stats) == BTREE_OK);
+    assert(counters->merges > 0 && counters->rotations > 0 && counters->free_pops > 0);
+
+    // a lookup reads one node per level below the root, which stays in memory
+    btree_stats_reset(&btree);
+    int value = 0;
+    assert(btree_find(&btree, keys[0], &value) == BTREE_OK);
+    assert(btree_stats(&btree, &stats) == BTREE_OK);
+    assert(counters->node_reads == (uint64_t)stats.height - 1 && counters->node_writes == 0);
+    assert(counters->bytes_read > 0 && counters->bytes_written == 0);
+
+    btree_stats_latency(&btree, true);
+    for (int i = 0; i < 100; i++) {
+        assert(btree_find(&btree, keys[i], &value) == BTREE_OK);
+    }
+    assert(btree_put(&btree, LEN, 0) == BTREE_OK);
+    assert(btree_delete(&btree, LEN) == BTREE_OK);
+    Btree_Result results[10];
+    assert(btree_find_async(&btree, keys, 10, NULL, results) == BTREE_OK);
+    assert(btree_find_batch(&btree, keys, 10, NULL, results) == BTREE_OK);
+    btree_stats_latency(&btree, false);
+    assert(btree_find(&btree, keys[0], &value) == BTREE_OK);
+    assert(btree_stats(&btree, &stats) == BTREE_OK);
+    // without an I/O engine, find_async runs one find per key
+    assert(count_latencies(&stats, BTREE_OP_FIND) == 100 + 10);
+    assert(count_latencies(&stats, BTREE_OP_PUT) == 1 && count_latencies(&stats, BTREE_OP_DELETE) == 1);
+    assert(count_latencies(&stats, BTREE_OP_FIND_ASYNC) == 1 && count_latencies(&stats, BTREE_OP_FIND_BATCH) == 1);
+    assert(btree_destroy(&btree) == BTREE_OK);
+
+    // with a cache, the second pass over the keys finds most nodes cached
+    assert(BTREE_INIT(&btree, .path = path, .cache_size = 1 << 20, .concurrent = true) == BTREE_OK);
+    find_all(&btree);
+    assert(btree_stats(&btree, &stats) == BTREE_OK);
+    assert(counters->cache_misses > 0 && counters->cache_misses <= (uint64_t)stats.count_nodes);
+    uint64_t misses = counters->cache_misses;
+
+    // counters and latencies add up across threads
+    btree_stats_reset(&btree);
+    btree_stats_latency(&btree, true);
+    pthread_t threads[THREADS];
+    for (int i = 0; i < THREADS; i++) {
+        pthread_create(&threads[i], NULL, find_all, &btree);
+    }
+    for (int i = 0; i < THREADS; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    assert(btree_stats(&btree, &stats) == BTREE_OK);
+    assert(count_latencies(&stats, BTREE_OP_FIND) == THREADS * LEN);
+    assert(counters->cache_hits + counters->cache_misses == counters->node_reads);
+    assert(counters->cache_misses < misses);
+    assert(btree_destroy(&btree) == BTREE_OK);
+
+    remove(path);
+    free(keys);
+    return 0;
+}
@@ -0,0 +1,204 @@
+#include <assert.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#include "../btree.h"
+#include "utils.h"
+
+#define LEN 20000
+#define BATCH 100
+#define THREADS 3
+
+uint64_t count_missing_found;
+
+size_t file_size(const char *path) {
+    struct stat st;
+    assert(stat(path, &st) == 0);
+    return st.st_size;
+}
+
+// Replays the trace into a new tree opened with the options given, which must end up holding what the
+// recorded tree held.
+void check_replay(Btree_Options options, const char *trace_path, Btree *recorded, uint64_t count_missing) {
+    Btree btree;
+    options.log_handler = btree_default_log_handler;
+    if (options.path != NULL) {
+        remove(options.path);
+    }
+    assert(btree_init(&btree, options) == BTREE_OK);
+
+    Btree_Replay replay;
+    assert(btree_replay(&btree, trace_path, &replay) == BTREE_OK);
+    assert(replay.count_ops[BTREE_TRACE_PUT] == LEN + BATCH);
+    assert(replay.count_ops[BTREE_TRACE_DELETE] == LEN / 2 + 1);
+    assert(replay.count_ops[BTREE_TRACE_FIND] == LEN + BATCH);
+    assert(replay.count_missing == count_missing);
+    assert(btree_is_valid(&btree));
+
+    for (int key = -BATCH; key < LEN; key++) {
+        int expected = 0, value = 0;
+        Btree_Result res = btree_find(recorded, key, &expected);
+        assert(btree_find(&btree, key, &value) == res && value == expected);
+    }
+    assert(btree_destroy(&btree) == BTREE_OK);
+    if (options.path != NULL) {
+        remove(options.path);
+    }
+}
+
+void *find_all(void *arg) {
+    const Btree *btree = arg;
+    int value = 0;
+    for (int key = 0; key < LEN; key++) {
+        if (btree_find(btree, key, &value) == BTREE_ERROR_KEY_NOT_FOUND) {
+            __atomic_add_fetch(&count_missing_found, 1, __ATOMIC_RELAXED);
+        }
+    }
+    return NULL;
+}
+
+void *delete_even(void *arg) {
+    Btree *btree = arg;
+    for (int key = 0; key < LEN; key += 2) {
+        assert(btree_delete(btree, key) == BTREE_OK);
+    }
+    return NULL;
+}
+
+// Finds race deletes of the same keys from other threads; the trace keeps the order the tree ran them in, so
+// a replay misses exactly the keys the finds missed. With .concurrent_puts, puts race them as well.
+void run_threads(Btree_Options options, const char *trace_path) {
+    Btree btree;
+    options.log_handler = btree_default_log_handler;
+    options.trace_path = trace_path;
+    remove(options.path);
+    assert(btree_init(&btree, options) == BTREE_OK);
+    for (int key = 1; key < LEN; key += 2) {
+        assert(btree_put(&btree, key, -key) == BTREE_OK);
+    }
+
+    pthread_t threads[THREADS];
+    count_missing_found = 0;
+    for (int i = 0; i < THREADS; i++) {
+        pthread_create(&threads[i], NULL, find_all, &btree);
+    }
+    for (int key = 0; key < LEN; key += 2) {
+        assert(btree_put(&btree, key, -key) == BTREE_OK);
+    }
+    pthread_t deleter;
+    pthread_create(&deleter, NULL, delete_even, &btree);
+    for (int i = 0; i < THREADS; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    pthread_join(deleter, NULL);
+    assert(btree_destroy(&btree) == BTREE_OK);
+
+    Btree_Replay replay;
+    assert(BTREE_INIT(&btree, .t = 4) == BTREE_OK);
+    assert(btree_replay(&btree, trace_path, &replay) == BTREE_OK);
+    assert(replay.count_ops[BTREE_TRACE_FIND] == THREADS * LEN);
+    assert(replay.count_missing == count_missing_found);
+    assert(btree_is_valid(&btree));
+    assert(btree_destroy(&btree) == BTREE_OK);
+    remove(options.path);
+    remove(trace_path);
+}
+
+int main() {
+    srand48(42);
+    const char *path = "test22.db";
+    const char *trace_path = "test22.trace";
+    Btree btree;
+    Btree_Replay replay;
+    remove(path);
+    remove(trace_path);
+    assert(btree_replay(NULL, trace_path, &replay) == BTREE_ERROR_NIL);
+    assert(BTREE_INIT(&btree, .path = path, .t = 4, .trace_path = trace_path) == BTREE_OK);
+
+    int *keys = malloc(LEN * sizeof(*keys));
+    for (int i = 0; i < LEN; i++) {
+        keys[i] = i;
+    }
+    shuffle(keys, LEN);
+    for (int i = 0; i < LEN; i++) {
+        assert(btree_put(&btree, keys[i], -keys[i]) == BTREE_OK);
+    }
+
+    // records are written once the buffer fills, and btree_sync writes out the rest
+    size_t header_size = sizeof(btree_trace_magic_bytes) + sizeof(uint32_t);
+    size_t put_size = 1 + 2 * sizeof(int), key_size = 1 + sizeof(int);
+    assert(file_size(trace_path) > header_size && file_size(trace_path) < header_size + LEN * put_size);
+    assert(btree_sync(&btree) == BTREE_OK);
+    assert(file_size(trace_path) == header_size + LEN * put_size);
+
+    for (int i = 0; i < LEN; i += 2) {
+        assert(btree_delete(&btree, keys[i]) == BTREE_OK);
+    }
+    assert(btree_delete(&btree, LEN) == BTREE_ERROR_KEY_NOT_FOUND);
+
+    // a find misses on every deleted key
+    int value = 0;
+    uint64_t count_missing = 1;
+    for (int i = 0; i < LEN - BATCH; i++) {
+        count_missing += btree_find(&btree, keys[i], &value) == BTREE_ERROR_KEY_NOT_FOUND;
+    }
+
+    // batches are recorded one operation per item, in the order they were given
+    Item items[BATCH];
+    for (int i = 0; i < BATCH; i++) {
+        items[i] = (Item){.key = -1 - i, .value = i};
+    }
+    assert(btree_put_batch(&btree, items, BATCH) == BTREE_OK);
+    int values[BATCH];
+    Btree_Result results[BATCH];
+    btree_find_batch(&btree, keys + LEN - BATCH, BATCH, values, results);
+    for (int i = 0; i < BATCH; i++) {
+        count_missing += results[i] == BTREE_ERROR_KEY_NOT_FOUND;
+    }
+    btree_find_async(&btree, keys, BATCH, values, results);
+    for (int i = 0; i < BATCH; i++) {
+        count_missing += results[i] == BTREE_ERROR_KEY_NOT_FOUND;
+    }
+    assert(btree_destroy(&btree) == BTREE_OK);
+    size_t count_records = LEN / 2 + 1 + LEN + BATCH;
+    assert(file_size(trace_path) == header_size + (LEN + BATCH) * put_size + count_records * key_size);
+
+    FILE *file = fopen(trace_path, "rb");
+    uint8_t header[8];
+    assert(file != NULL && fread(header, sizeof(header), 1, file) == 1);
+    assert(memcmp(header, btree_trace_magic_bytes, sizeof(btree_trace_magic_bytes)) == 0);
+    assert(*(uint32_t *)(header + 4) == BTREE_TRACE_VERSION);
+    fclose(file);
+
+    // replaying into any kind of tree gives back the same content and the same misses
+    assert(BTREE_INIT(&btree, .path = path) == BTREE_OK);
+    check_replay((Btree_Options){.t = 2}, trace_path, &btree, count_missing);
+    check_replay((Btree_Options){.path = "test22.replay.db", .t = 16, .cache_size = 1 << 16}, trace_path, &btree,
+                 count_missing);
+    check_replay((Btree_Options){.path = "test22.replay.db", .page_size = 4096, .compress_leaves = true}, trace_path,
+                 &btree, count_missing);
+    assert(btree_destroy(&btree) == BTREE_OK);
+
+    // anything but a whole trace is refused
+    assert(BTREE_INIT(&btree, .t = 3) == BTREE_OK);
+    assert(btree_replay(&btree, "test22.missing", &replay) == BTREE_ERROR_UNIX);
+    assert(btree_replay(&btree, path, &replay) == BTREE_ERROR_FORMAT);
+    file = fopen(trace_path, "r+b");
+    assert(file != NULL && fseek(file, 0, SEEK_END) == 0 && fputc(BTREE_TRACE_PUT, file) != EOF);
+    fclose(file);
+    assert(btree_replay(&btree, trace_path, &replay) == BTREE_ERROR_FORMAT);
+    assert(replay.count_ops[BTREE_TRACE_PUT] == LEN + BATCH);
+    assert(btree_destroy(&btree) == BTREE_OK);
+
+    run_threads((Btree_Options){.path = path, .t = 4, .concurrent = true}, trace_path);
+    run_threads((Btree_Options){.path = path, .t = 4, .concurrent_puts = true}, trace_path);
+
+    remove(path);
+    remove(trace_path);
+    free(keys);
+    return 0;
+}
@@ -0,0 +1,188 @@
+#include <assert.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "../btree.h"
+#include "utils.h"
+
+#define LEN 30000
+
+// Runs puts, deletes and batches with a snapshot open part of the time, so nodes are also copied, then checks
+// the tree against what it must hold, before and after reopening it.
+void run(Btree_Options options, Btree_Options reopened) {
+    Btree btree;
+    options.log_handler = btree_default_log_handler;
+    remove(options.path);
+    assert(btree_init(&btree, options) == BTREE_OK);
+
+    int *keys = malloc(LEN * sizeof(*keys));
+    for (int i = 0; i < LEN; i++) {
+        keys[i] = i;
+    }
+    shuffle(keys, LEN);
+    for (int i = 0; i < LEN / 2; i++) {
+        assert(btree_put(&btree, keys[i], -keys[i]) == BTREE_OK);
+    }
+
+    Btree_Snapshot snapshot;
+    assert(btree_snapshot_open(&btree, &snapshot) == BTREE_OK);
+    for (int i = 0; i < LEN / 2; i += 3) {
+        assert(btree_delete(&btree, keys[i]) == BTREE_OK);
+    }
+    assert(btree_snapshot_close(&btree, &snapshot) == BTREE_OK);
+
+    Item items[1000];
+    for (int done = LEN / 2; done < LEN; done += 1000) {
+        for (int i = 0; i < 1000; i++) {
+            items[i] = (Item){.key = keys[done + i], .value = -keys[done + i]};
+        }
+        assert(btree_put_batch(&btree, items, 1000) == BTREE_OK);
+    }
+    for (int i = LEN / 2; i < LEN; i += 3) {
+        assert(btree_delete(&btree, keys[i]) == BTREE_OK);
+    }
+
+    for (int pass = 0; pass < 2; pass++) {
+        assert(btree_is_valid(&btree));
+        int value = 0;
+        for (int i = 0; i < LEN; i++) {
+            Btree_Result res = btree_find(&btree, keys[i], &value);
+            // both halves lost every third key, LEN / 2 being a multiple of 3
+            assert(i % 3 == 0 ? res == BTREE_ERROR_KEY_NOT_FOUND : res == BTREE_OK && value == -keys[i]);
+        }
+        assert(btree_destroy(&btree) == BTREE_OK);
+        if (pass == 0) {
+            assert(btree_init(&btree, reopened) == BTREE_OK);
+        }
+    }
+
+    remove(options.path);
+    free(keys);
+}
+
+// Finds every key below LEN / 2 through the snapshot, and walks it with a cursor, while the tree is written.
+void *read_snapshot(void *arg) {
+    const Btree_Snapshot *snapshot = arg;
+    int value = 0;
+    for (int key = 0; key < LEN / 2; key++) {
+        assert(btree_snapshot_find(snapshot, key, &value) == BTREE_OK && value == -key);
+    }
+
+    Btree_Cursor cursor;
+    int count = 0;
+    int key = 0;
+    assert(btree_snapshot_cursor_open(snapshot, &cursor) == BTREE_OK);
+    for (Btree_Result res = btree_cursor_seek(&cursor, 0); res == BTREE_OK; res = btree_cursor_next(&cursor)) {
+        assert(btree_cursor_get(&cursor, &key, &value) == BTREE_OK && key == count && value == -key);
+        count++;
+    }
+    assert(count == LEN / 2);
+    btree_cursor_close(&cursor);
+    return NULL;
+}
+
+// Reads a snapshot from another thread while puts and deletes stage their writes, which the reads leave alone.
+void run_threads(Btree_Options options) {
+    Btree btree;
+    options.log_handler = btree_default_log_handler;
+    remove(options.path);
+    assert(btree_init(&btree, options) == BTREE_OK);
+    for (int key = 0; key < LEN / 2; key++) {
+        assert(btree_put(&btree, key, -key) == BTREE_OK);
+    }
+
+    Btree_Snapshot snapshot;
+    assert(btree_snapshot_open(&btree, &snapshot) == BTREE_OK);
+    pthread_t thread;
+    pthread_create(&thread, NULL, read_snapshot, &snapshot);
+    for (int key = LEN / 2; key < LEN; key++) {
+        assert(btree_put(&btree, key, key) == BTREE_OK);
+    }
+    for (int key = 0; key < LEN / 2; key += 2) {
+        assert(btree_delete(&btree, key) == BTREE_OK);
+    }
+    pthread_join(thread, NULL);
+    assert(btree_snapshot_close(&btree, &snapshot) == BTREE_OK);
+
+    assert(btree_is_valid(&btree));
+    int value = 0;
+    for (int key = 0; key < LEN; key++) {
+        Btree_Result res = btree_find(&btree, key, &value);
+        assert(key >= LEN / 2 ? res == BTREE_OK && value == key
+                              : key % 2 == 0 ? res == BTREE_ERROR_KEY_NOT_FOUND : res == BTREE_OK && value == -key);
+    }
+    assert(btree_destroy(&btree) == BTREE_OK);
+    remove(options.path);
+}
+
+int main() {
+    srand48(42);
+    const char *path = "test23.db";
+    Btree btree;
+    Btree_Stats stats;
+    Btree_Counters *counters = &stats.counters;
+    remove(path);
+
+    // a put into a leaf with room writes the head and the one slot it took, not the node
+    assert(BTREE_INIT(&btree, .path = path, .t = 200) == BTREE_OK);
+    for (int key = 0; key < 300; key++) {
+        assert(btree_put(&btree, 2 * key, key) == BTREE_OK);
+    }
+    btree_stats_reset(&btree);
+    assert(btree_put(&btree, 1000, 0) == BTREE_OK);
+    assert(btree_stats(&btree, &stats) == BTREE_OK);
+    assert(counters->node_writes == 1 && counters->bytes_written == 8 + 2 * sizeof(int));
+    assert(counters->file_writes == 3);
+
+    // slots close enough to each other go out in one call
+    btree_stats_reset(&btree);
+    assert(btree_delete(&btree, 0) == BTREE_OK);
+    assert(btree_stats(&btree, &stats) == BTREE_OK);
+    assert(counters->file_writes == 1 && counters->bytes_written < 16 * 400);
+
+    // the nodes a batch appends one after the other reach the file together
+    Item items[4000];
+    for (int i = 0; i < 4000; i++) {
+        items[i] = (Item){.key = 2000 + i, .value = i};
+    }
+    btree_stats_reset(&btree);
+    assert(btree_put_batch(&btree, items, 4000) == BTREE_OK);
+    assert(btree_stats(&btree, &stats) == BTREE_OK);
+    assert(counters->node_writes > 10 && counters->file_writes < counters->node_writes / 2);
+    assert(btree_destroy(&btree) == BTREE_OK);
+
+    assert(BTREE_INIT(&btree, .path = path) == BTREE_OK);
+    int value = 0;
+    assert(btree_find(&btree, 1000, &value) == BTREE_OK && value == 0);
+    assert(btree_find(&btree, 0, &value) == BTREE_ERROR_KEY_NOT_FOUND);
+    assert(btree_find(&btree, 5999, &value) == BTREE_OK && value == 3999);
+    assert(btree_is_valid(&btree));
+    assert(btree_destroy(&btree) == BTREE_OK);
+    remove(path);
+
+    // dirty frames next to each other in the file are written back in one call
+    assert(BTREE_INIT(&btree, .path = path, .t = 4, .cache_size = 1 << 22) == BTREE_OK);
+    for (int key = 0; key < LEN; key++) {
+        assert(btree_put(&btree, key, key) == BTREE_OK);
+    }
+    btree_stats_reset(&btree);
+    assert(btree_sync(&btree) == BTREE_OK);
+    assert(btree_stats(&btree, &stats) == BTREE_OK);
+    assert(counters->file_writes > 0 && counters->file_writes < (uint64_t)stats.count_nodes / 10);
+    assert(btree_destroy(&btree) == BTREE_OK);
+    remove(path);
+
+    Btree_Options plain = {.path = path, .log_handler = btree_default_log_handler};
+    run((Btree_Options){.path = path, .t = 3}, plain);
+    run((Btree_Options){.path = path, .t = 64}, plain);
+    run((Btree_Options){.path = path, .page_size = 4096}, plain);
+    run((Btree_Options){.path = path, .t = 4, .compress_leaves = true}, plain);
+    run((Btree_Options){.path = path, .t = 4}, (Btree_Options){.path = path, .compress_leaves = true});
+    run((Btree_Options){.path = path, .t = 8, .concurrent_puts = true}, plain);
+    run((Btree_Options){.path = path, .t = 8, .cache_size = 1 << 16}, plain);
+
+    run_threads((Btree_Options){.path = path, .t = 3});
+    run_threads((Btree_Options){.path = path, .t = 4, .compress_leaves = true});
+    return 0;
+}
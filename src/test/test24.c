@@ -0,0 +1,195 @@
+#include <assert.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "../btree.h"
+#include "utils.h"
+
+#define LEN 20000
+
+size_t file_size(const char *path) {
+    struct stat st;
+    assert(stat(path, &st) == 0);
+    return st.st_size;
+}
+
+// Reads the magic at the start of the tree file.
+void read_magic(const char *path, uint8_t *magic_bytes) {
+    FILE *file = fopen(path, "rb");
+    assert(file != NULL && fread(magic_bytes, sizeof(btree_magic_bytes), 1, file) == 1);
+    fclose(file);
+}
+
+bool is_dirty(const char *path) {
+    uint8_t magic_bytes[sizeof(btree_magic_bytes)];
+    read_magic(path, magic_bytes);
+    return memcmp(magic_bytes, btree_dirty_magic_bytes, sizeof(magic_bytes)) == 0 ||
+           memcmp(magic_bytes, btree_paged_dirty_magic_bytes, sizeof(magic_bytes)) == 0;
+}
+
+// The header counts every node the tree reaches.
+void check_count_nodes(Btree *btree) {
+    Btree_Stats stats;
+    assert(btree_stats(btree, &stats) == BTREE_OK);
+    uint64_t count_nodes = 0;
+    for (int i = 0; i < BTREE_STATS_FILL_BUCKETS; i++) {
+        count_nodes += stats.fill[i];
+    }
+    assert(count_nodes == (uint64_t)stats.count_nodes);
+}
+
+// Every key below LEN was put and every third one deleted again.
+void check_content(Btree *btree) {
+    assert(btree_is_valid(btree));
+    check_count_nodes(btree);
+    int value = 0;
+    for (int key = 0; key < LEN; key++) {
+        Btree_Result res = btree_find(btree, key, &value);
+        assert(key % 3 == 0 ? res == BTREE_ERROR_KEY_NOT_FOUND : res == BTREE_OK && value == -key);
+    }
+}
+
+// Fills a tree in a child process that exits without closing it, then opens what it left behind.
+void run_crash(Btree_Options options) {
+    options.log_handler = btree_default_log_handler;
+    options.lazy_header = true;
+    remove(options.path);
+
+    pid_t pid = fork();
+    assert(pid != -1);
+    if (pid == 0) {
+        Btree btree;
+        assert(btree_init(&btree, options) == BTREE_OK);
+        int *keys = malloc(LEN * sizeof(*keys));
+        for (int i = 0; i < LEN; i++) {
+            keys[i] = i;
+        }
+        shuffle(keys, LEN);
+        for (int i = 0; i < LEN; i++) {
+            assert(btree_put(&btree, keys[i], -keys[i]) == BTREE_OK);
+        }
+        assert(btree_checkpoint(&btree) == BTREE_OK);
+
+        // the snapshot keeps the nodes the deletes replace, and nothing frees them before the exit
+        Btree_Snapshot snapshot;
+        assert(btree_snapshot_open(&btree, &snapshot) == BTREE_OK);
+        for (int key = 0; key < LEN; key += 3) {
+            assert(btree_delete(&btree, key) == BTREE_OK);
+        }
+        _exit(is_dirty(options.path) ? 0 : 1);
+    }
+    int status;
+    assert(waitpid(pid, &status, 0) == pid && WIFEXITED(status) && WEXITSTATUS(status) == 0);
+
+    Btree btree;
+    Btree_Options reopened = {.path = options.path, .log_handler = btree_default_log_handler};
+    assert(btree_init(&btree, reopened) == BTREE_OK);
+    assert(!is_dirty(options.path));
+    check_content(&btree);
+
+    // slots handed back by the recovery are taken again before the file grows
+    size_t size = file_size(options.path);
+    for (int key = 0; key < LEN; key += 3) {
+        assert(btree_put(&btree, key, -key) == BTREE_OK);
+    }
+    for (int key = 0; key < LEN; key += 3) {
+        assert(btree_delete(&btree, key) == BTREE_OK);
+    }
+    assert(file_size(options.path) == size);
+    check_content(&btree);
+    assert(btree_destroy(&btree) == BTREE_OK);
+
+    assert(btree_init(&btree, reopened) == BTREE_OK);
+    check_content(&btree);
+    assert(btree_destroy(&btree) == BTREE_OK);
+    remove(options.path);
+}
+
+// Puts LEN keys into a new tree and returns how many writes reached the file.
+uint64_t count_file_writes(Btree_Options options, uint64_t *splits) {
+    Btree btree;
+    Btree_Stats stats;
+    remove(options.path);
+    assert(btree_init(&btree, options) == BTREE_OK);
+    for (int key = 0; key < LEN; key++) {
+        assert(btree_put(&btree, key, -key) == BTREE_OK);
+    }
+    assert(btree_stats(&btree, &stats) == BTREE_OK);
+    assert(btree_destroy(&btree) == BTREE_OK);
+    remove(options.path);
+    *splits = stats.counters.splits;
+    return stats.counters.file_writes;
+}
+
+int main() {
+    srand48(42);
+    const char *path = "test24.db";
+    Btree btree;
+    remove(path);
+
+    // a put that splits no longer costs a header write; the splits of one put already shared theirs
+    uint64_t splits = 0;
+    uint64_t eager = count_file_writes((Btree_Options){.path = path, .t = 2}, &splits);
+    uint64_t lazy = count_file_writes((Btree_Options){.path = path, .t = 2, .lazy_header = true}, &splits);
+    assert(lazy < eager && eager - lazy > splits * 3 / 4);
+
+    // the header on disk is marked dirty until a checkpoint
+    assert(BTREE_INIT(&btree, .path = path, .t = 3, .lazy_header = true) == BTREE_OK);
+    for (int key = 0; key < LEN; key++) {
+        assert(btree_put(&btree, key, -key) == BTREE_OK);
+    }
+    assert(is_dirty(path));
+    assert(btree_checkpoint(&btree) == BTREE_OK);
+    assert(!is_dirty(path));
+    for (int key = 0; key < LEN; key += 3) {
+        assert(btree_delete(&btree, key) == BTREE_OK);
+    }
+    assert(is_dirty(path));
+    assert(btree_destroy(&btree) == BTREE_OK);
+    assert(!is_dirty(path));
+
+    assert(BTREE_INIT(&btree, .path = path) == BTREE_OK);
+    check_content(&btree);
+    assert(btree_destroy(&btree) == BTREE_OK);
+    remove(path);
+
+    // with an interval the header is written clean every so many changes, without being asked
+    assert(BTREE_INIT(&btree, .path = path, .t = 2, .cache_size = 1 << 16, .lazy_header = true,
+                      .header_interval = 10) == BTREE_OK);
+    int clean = 0;
+    for (int key = 0; key < LEN; key++) {
+        assert(btree_put(&btree, key, -key) == BTREE_OK);
+        clean += !is_dirty(path);
+    }
+    assert(clean > 0 && clean < LEN);
+    for (int key = 0; key < LEN; key += 3) {
+        assert(btree_delete(&btree, key) == BTREE_OK);
+    }
+    assert(btree_destroy(&btree) == BTREE_OK);
+    assert(BTREE_INIT(&btree, .path = path) == BTREE_OK);
+    check_content(&btree);
+    assert(btree_destroy(&btree) == BTREE_OK);
+    remove(path);
+
+    // a WAL already defers the header, so the option is left unused
+    assert(BTREE_INIT(&btree, .path = path, .t = 3, .cache_size = 1 << 16, .wal = true, .lazy_header = true) ==
+           BTREE_OK);
+    assert(btree_put(&btree, 1, 1) == BTREE_OK);
+    assert(!is_dirty(path));
+    assert(btree_checkpoint(&btree) == BTREE_OK);
+    assert(btree_destroy(&btree) == BTREE_OK);
+    remove(path);
+    remove("test24.db-wal");
+
+    run_crash((Btree_Options){.path = path, .t = 3});
+    run_crash((Btree_Options){.path = path, .t = 32});
+    run_crash((Btree_Options){.path = path, .page_size = 4096});
+    run_crash((Btree_Options){.path = path, .t = 4, .compress_leaves = true});
+    run_crash((Btree_Options){.path = path, .t = 4, .backend = BTREE_BACKEND_MMAP});
+    return 0;
+}
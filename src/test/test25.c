@@ -0,0 +1,158 @@
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "../btree.h"
+#include "utils.h"
+
+#define LEN 50000
+
+// Every key below LEN was put, and deleted again unless kept says otherwise.
+void check_content(Btree *btree, const bool *kept) {
+    assert(btree_is_valid(btree));
+    int value = 0;
+    for (int key = 0; key < LEN; key++) {
+        Btree_Result res = btree_find(btree, key, &value);
+        assert(kept[key] ? res == BTREE_OK && value == -key : res == BTREE_ERROR_KEY_NOT_FOUND);
+    }
+}
+
+// Puts every key below LEN in a random order and deletes a random share of them, then returns the node writes
+// the deletes took.
+uint64_t run_deletes(Btree *btree, int *keys, bool *kept, int count_deletes) {
+    for (int i = 0; i < LEN; i++) {
+        assert(btree_put(btree, keys[i], -keys[i]) == BTREE_OK);
+        kept[keys[i]] = true;
+    }
+    shuffle(keys, LEN);
+    btree_stats_reset(btree);
+    for (int i = 0; i < count_deletes; i++) {
+        assert(btree_delete(btree, keys[i]) == BTREE_OK);
+        kept[keys[i]] = false;
+    }
+    Btree_Stats stats;
+    assert(btree_stats(btree, &stats) == BTREE_OK);
+    return stats.counters.node_writes;
+}
+
+int main() {
+    srand48(42);
+    const char *path = "test25.db";
+    Btree btree;
+    Btree_Stats stats;
+    int *keys = malloc(LEN * sizeof(*keys));
+    bool *kept = malloc(LEN * sizeof(*kept));
+    for (int i = 0; i < LEN; i++) {
+        keys[i] = i;
+    }
+    shuffle(keys, LEN);
+    remove(path);
+
+    // deleting half the keys costs about a leaf write each, against several when every delete rebalances
+    assert(BTREE_INIT(&btree, .path = path, .t = 16) == BTREE_OK);
+    uint64_t eager = run_deletes(&btree, keys, kept, LEN / 2);
+    assert(btree_destroy(&btree) == BTREE_OK);
+    remove(path);
+    assert(BTREE_INIT(&btree, .path = path, .t = 16, .lazy_delete = true) == BTREE_OK);
+    uint64_t lazy = run_deletes(&btree, keys, kept, LEN / 2);
+    assert(lazy < eager * 3 / 5 && lazy < LEN / 2 * 11 / 10);
+    check_content(&btree, kept);
+
+    // a key that is not there costs no write at all
+    btree_stats_reset(&btree);
+    assert(btree_delete(&btree, LEN) == BTREE_ERROR_KEY_NOT_FOUND);
+    assert(btree_delete(&btree, keys[0]) == BTREE_ERROR_KEY_NOT_FOUND);
+    assert(btree_stats(&btree, &stats) == BTREE_OK);
+    assert(stats.counters.node_writes == 0);
+
+    // the leaves noted are compacted a few at a time, then a full pass leaves none underfull
+    assert(stats.count_underfull > 0);
+    int count_underfull = stats.count_underfull;
+    assert(btree_compact(&btree, 16) == BTREE_OK);
+    assert(btree_stats(&btree, &stats) == BTREE_OK);
+    assert(stats.count_underfull < count_underfull);
+    check_content(&btree, kept);
+    assert(btree_compact(&btree, 0) == BTREE_OK);
+    assert(btree_stats(&btree, &stats) == BTREE_OK);
+    assert(stats.count_underfull == 0);
+    assert(btree_destroy(&btree) == BTREE_OK);
+
+    // compacted, the tree is valid with no lazy deletes too
+    assert(BTREE_INIT(&btree, .path = path) == BTREE_OK);
+    check_content(&btree, kept);
+    assert(btree_destroy(&btree) == BTREE_OK);
+    remove(path);
+
+    // incremental calls alone get through every leaf they noted, and deletes keep working in between
+    assert(BTREE_INIT(&btree, .path = path, .t = 8, .lazy_delete = true, .delete_min_keys = 2) == BTREE_OK);
+    shuffle(keys, LEN);
+    run_deletes(&btree, keys, kept, LEN * 3 / 4);
+    for (int i = LEN * 3 / 4; i < LEN * 7 / 8; i++) {
+        assert(btree_compact(&btree, 1) == BTREE_OK);
+        assert(btree_delete(&btree, keys[i]) == BTREE_OK);
+        kept[keys[i]] = false;
+    }
+    check_content(&btree, kept);
+    while (btree.count_underfull > 0) {
+        assert(btree_compact(&btree, 8) == BTREE_OK);
+    }
+    assert(btree_stats(&btree, &stats) == BTREE_OK);
+    assert(stats.count_underfull == 0);
+    check_content(&btree, kept);
+    assert(btree_destroy(&btree) == BTREE_OK);
+    remove(path);
+
+    // a snapshot keeps seeing the keys lazy deletes and compaction took away
+    assert(BTREE_INIT(&btree, .path = path, .t = 4, .lazy_delete = true) == BTREE_OK);
+    shuffle(keys, LEN);
+    run_deletes(&btree, keys, kept, 0);
+    Btree_Snapshot snapshot;
+    assert(btree_snapshot_open(&btree, &snapshot) == BTREE_OK);
+    for (int i = 0; i < LEN / 2; i++) {
+        assert(btree_delete(&btree, keys[i]) == BTREE_OK);
+        kept[keys[i]] = false;
+    }
+    assert(btree_compact(&btree, 0) == BTREE_OK);
+    check_content(&btree, kept);
+    int value = 0;
+    for (int key = 0; key < LEN; key++) {
+        assert(btree_snapshot_find(&snapshot, key, &value) == BTREE_OK && value == -key);
+    }
+    assert(btree_snapshot_close(&btree, &snapshot) == BTREE_OK);
+    assert(btree_destroy(&btree) == BTREE_OK);
+    remove(path);
+
+    // a thread of its own compacts as the noted leaves pile up
+    assert(BTREE_INIT(&btree, .path = path, .t = 8, .cache_size = 1 << 20, .lazy_delete = true,
+                      .compact_background = true) == BTREE_OK);
+    shuffle(keys, LEN);
+    run_deletes(&btree, keys, kept, LEN * 3 / 4);
+    for (int wait = 0; wait < 1000 && __atomic_load_n(&btree.count_underfull, __ATOMIC_ACQUIRE) >= BTREE_COMPACT_BATCH;
+         wait++) {
+        usleep(1000);
+    }
+    assert(__atomic_load_n(&btree.count_underfull, __ATOMIC_ACQUIRE) < BTREE_COMPACT_BATCH);
+    assert(btree_stats(&btree, &stats) == BTREE_OK);
+    assert(stats.counters.merges > 0);
+    check_content(&btree, kept);
+    assert(btree_destroy(&btree) == BTREE_OK);
+
+    assert(BTREE_INIT(&btree, .path = path, .lazy_delete = true) == BTREE_OK);
+    check_content(&btree, kept);
+    assert(btree_destroy(&btree) == BTREE_OK);
+    remove(path);
+
+    // with delete_min_keys at t - 1 or more, no leaf is ever left underfull
+    assert(BTREE_INIT(&btree, .t = 3, .lazy_delete = true, .delete_min_keys = 100) == BTREE_OK);
+    shuffle(keys, LEN);
+    run_deletes(&btree, keys, kept, LEN / 2);
+    assert(btree_stats(&btree, &stats) == BTREE_OK);
+    assert(stats.count_underfull == 0);
+    check_content(&btree, kept);
+    assert(btree_destroy(&btree) == BTREE_OK);
+
+    free(keys);
+    free(kept);
+    return 0;
+}
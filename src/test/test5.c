@@ -0,0 +1,78 @@
+#include <assert.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "../btree.h"
+#include "utils.h"
+
+int main() {
+    int len = 2000; // the test size
+    long seed = 42;
+    int t = 3;
+    Btree btree;
+    remove("test5.db");
+    // a budget of a few nodes forces evictions and write-backs all the time
+    int ok = BTREE_INIT(&btree, .path = "test5.db", .t = t, .cache_size = 1024);
+    assert(ok == BTREE_OK && "Failed to init btree");
+    assert(btree.cache != NULL);
+    srand48(seed);
+    int *keys = malloc(len * sizeof(*keys));
+
+    for (int i = 0; i < len; i++) {
+        keys[i] = i + 1;
+    }
+
+    shuffle(keys, len);
+
+    for (int i = 0; i < len; i++) {
+        assert(btree_put(&btree, keys[i], -keys[i]) == BTREE_OK);
+    }
+    assert(btree_is_valid(&btree));
+
+    shuffle(keys, len);
+
+    for (int i = 0; i < len / 2; i++) {
+        assert(btree_delete(&btree, keys[i]) == BTREE_OK);
+    }
+    assert(btree_is_valid(&btree));
+    assert(btree_destroy(&btree) == BTREE_OK);
+
+    assert(BTREE_INIT(&btree, .path = "test5.db") == BTREE_OK);
+    assert(btree.cache == NULL);
+    assert(btree_is_valid(&btree));
+    for (int i = 0; i < len; i++) {
+        int value = 0;
+        Btree_Result res = btree_find(&btree, keys[i], &value);
+        if (i < len / 2) {
+            assert(res == BTREE_ERROR_KEY_NOT_FOUND);
+        } else {
+            assert(res == BTREE_OK && value == -keys[i]);
+        }
+    }
+
+    btree_destroy(&btree);
+
+    // an init that fails past opening the file closes it again, with the cache and the log it had set up
+    int fd = open("/dev/null", O_RDONLY);
+    close(fd);
+    struct stat st;
+    assert(stat("test5.db", &st) == 0);
+    assert(BTREE_INIT(&btree, .path = "test5.db", .cache_size = 1 << 16, .wal = true,
+                      .trace_path = "test5.missing/trace") == BTREE_ERROR_UNIX);
+    remove("test5.new.db");
+    assert(BTREE_INIT(&btree, .path = "test5.new.db", .t = t, .cache_size = 1 << 16,
+                      .trace_path = "test5.missing/trace") == BTREE_ERROR_UNIX);
+    remove("test5.new.db");
+    assert(open("/dev/null", O_RDONLY) == fd);
+    close(fd);
+
+    struct stat unchanged;
+    assert(stat("test5.db", &unchanged) == 0 && unchanged.st_size == st.st_size);
+    assert(unchanged.st_mtim.tv_sec == st.st_mtim.tv_sec && unchanged.st_mtim.tv_nsec == st.st_mtim.tv_nsec);
+    remove("test5.db-wal");
+    free(keys);
+    return 0;
+}
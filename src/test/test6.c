@@ -0,0 +1,67 @@
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "../btree.h"
+#include "utils.h"
+
+int main() {
+    int len = 5000; // the test size
+    long seed = 42;
+    int t = 4;
+    Btree btree;
+    remove("test6.db");
+    int ok = BTREE_INIT(&btree, .path = "test6.db", .t = t, .backend = BTREE_BACKEND_MMAP);
+    assert(ok == BTREE_OK && "Failed to init btree");
+    srand48(seed);
+    int *keys = malloc(len * sizeof(*keys));
+
+    for (int i = 0; i < len; i++) {
+        keys[i] = i + 1;
+    }
+
+    shuffle(keys, len);
+
+    for (int i = 0; i < len; i++) {
+        assert(btree_put(&btree, keys[i], 2 * keys[i]) == BTREE_OK);
+    }
+    assert(btree_is_valid(&btree));
+    assert(btree_sync(&btree) == BTREE_OK);
+
+    shuffle(keys, len);
+
+    for (int i = 0; i < len / 2; i++) {
+        assert(btree_delete(&btree, keys[i]) == BTREE_OK);
+    }
+    assert(btree_is_valid(&btree));
+    assert(btree_destroy(&btree) == BTREE_OK);
+
+    // the file written through the mapping must read back the same through preadv
+    Btree_Backend backends[] = {BTREE_BACKEND_FILE, BTREE_BACKEND_MMAP};
+    for (int b = 0; b < 2; b++) {
+        assert(BTREE_INIT(&btree, .path = "test6.db", .backend = backends[b]) == BTREE_OK);
+        assert(btree_is_valid(&btree));
+        for (int i = 0; i < len; i++) {
+            int value = 0;
+            Btree_Result res = btree_find(&btree, keys[i], &value);
+            if (i < len / 2) {
+                assert(res == BTREE_ERROR_KEY_NOT_FOUND);
+            } else {
+                assert(res == BTREE_OK && value == 2 * keys[i]);
+            }
+        }
+        assert(btree_destroy(&btree) == BTREE_OK);
+    }
+
+    // a tree from before keys and values were split cannot be read with the current layout
+    FILE *file = fopen("test6.db", "r+b");
+    assert(file != NULL);
+    assert(fwrite(btree_old_magic_bytes, sizeof(btree_old_magic_bytes), 1, file) == 1);
+    fclose(file);
+    for (int b = 0; b < 2; b++) {
+        assert(BTREE_INIT(&btree, .path = "test6.db", .backend = backends[b]) == BTREE_ERROR_FORMAT);
+    }
+
+    free(keys);
+    return 0;
+}
@@ -0,0 +1,93 @@
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "../btree.h"
+
+typedef struct range {
+    int next;
+    int end;
+} Range;
+
+bool range_next(void *ctx, Item *item) {
+    Range *range = ctx;
+    if (range->next >= range->end) {
+        return false;
+    }
+    item->key = range->next;
+    item->value = -range->next;
+    range->next++;
+    return true;
+}
+
+typedef struct array {
+    const int *keys;
+    int len;
+    int next;
+} Array;
+
+bool array_next(void *ctx, Item *item) {
+    Array *array = ctx;
+    if (array->next >= array->len) {
+        return false;
+    }
+    item->key = array->keys[array->next++];
+    item->value = item->key;
+    return true;
+}
+
+void check(int t, double fill_factor, int len) {
+    Btree btree;
+    remove("test7.db");
+    assert(BTREE_INIT(&btree, .path = "test7.db", .t = t, .fill_factor = fill_factor) == BTREE_OK);
+    Range range = {1, len + 1};
+    assert(btree_bulk_load(&btree, (Btree_Iterator){range_next, &range}) == BTREE_OK);
+    assert(btree_is_valid(&btree));
+    for (int key = 0; key <= len + 1; key++) {
+        int value = 0;
+        Btree_Result res = btree_find(&btree, key, &value);
+        assert(key >= 1 && key <= len ? res == BTREE_OK && value == -key : res == BTREE_ERROR_KEY_NOT_FOUND);
+    }
+
+    // the loaded tree has to keep working under regular puts and deletes
+    for (int key = 1; key <= len; key += 2) {
+        assert(btree_delete(&btree, key) == BTREE_OK);
+    }
+    for (int key = len + 1; key <= len + 50; key++) {
+        assert(btree_put(&btree, key, key) == BTREE_OK);
+    }
+    assert(btree_is_valid(&btree));
+    assert(btree_bulk_load(&btree, (Btree_Iterator){range_next, &range}) == BTREE_ERROR_NOT_EMPTY);
+    assert(btree_destroy(&btree) == BTREE_OK);
+}
+
+int main() {
+    double fill_factors[] = {0, 0.5, 0.7};
+    for (int t = 2; t <= 4; t++) {
+        for (int f = 0; f < 3; f++) {
+            for (int len = 0; len <= 400; len++) {
+                check(t, fill_factors[f], len);
+            }
+        }
+    }
+    check(50, 0.8, 100000);
+
+    Btree btree;
+    remove("test7.db");
+    assert(BTREE_INIT(&btree, .path = "test7.db", .t = 3) == BTREE_OK);
+    Range range = {10, 0};
+    assert(btree_bulk_load(&btree, (Btree_Iterator){range_next, &range}) == BTREE_OK);
+    assert(btree_is_valid(&btree));
+
+    // the sorted prefix before an out of order key is kept
+    int keys[] = {1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 5, 11};
+    Array array = {keys, sizeof(keys) / sizeof(*keys), 0};
+    assert(btree_bulk_load(&btree, (Btree_Iterator){array_next, &array}) == BTREE_ERROR_UNSORTED);
+    assert(btree_is_valid(&btree));
+    for (int i = 0; i < 10; i++) {
+        assert(btree_find(&btree, keys[i], NULL) == BTREE_OK);
+    }
+    assert(btree_find(&btree, 11, NULL) == BTREE_ERROR_KEY_NOT_FOUND);
+    assert(btree_destroy(&btree) == BTREE_OK);
+    return 0;
+}
@@ -0,0 +1,81 @@
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "../btree.h"
+#include "utils.h"
+
+int main() {
+    int len = 3000; // the test size
+    long seed = 42;
+    int t = 3;
+    Btree btree;
+    remove("test8.db");
+    int ok = BTREE_INIT(&btree, .path = "test8.db", .t = t);
+    assert(ok == BTREE_OK && "Failed to init btree");
+    srand48(seed);
+    int *keys = malloc(len * sizeof(*keys));
+
+    Btree_Cursor cursor;
+    assert(btree_cursor_open(&btree, &cursor) == BTREE_OK);
+    assert(btree_cursor_next(&cursor) == BTREE_ERROR_END);
+    assert(btree_cursor_seek(&cursor, 0) == BTREE_ERROR_END);
+
+    // even keys only, so seeks can land between keys
+    for (int i = 0; i < len; i++) {
+        keys[i] = 2 * (i + 1);
+    }
+    shuffle(keys, len);
+    for (int i = 0; i < len; i++) {
+        assert(btree_put(&btree, keys[i], -keys[i]) == BTREE_OK);
+    }
+
+    int key = 0, value = 0, expected = 2;
+    for (Btree_Result res = btree_cursor_next(&cursor); res == BTREE_OK; res = btree_cursor_next(&cursor)) {
+        assert(btree_cursor_get(&cursor, &key, &value) == BTREE_OK);
+        assert(key == expected && value == -expected);
+        expected += 2;
+    }
+    assert(expected == 2 * len + 2);
+    assert(btree_cursor_get(&cursor, &key, &value) == BTREE_ERROR_END);
+
+    expected = 2 * len;
+    for (Btree_Result res = btree_cursor_prev(&cursor); res == BTREE_OK; res = btree_cursor_prev(&cursor)) {
+        assert(btree_cursor_get(&cursor, &key, NULL) == BTREE_OK);
+        assert(key == expected);
+        expected -= 2;
+    }
+    assert(expected == 0);
+
+    for (int probe = 0; probe <= 2 * len + 1; probe++) {
+        Btree_Result res = btree_cursor_seek(&cursor, probe);
+        if (probe >= 2 * len + 1) {
+            assert(res == BTREE_ERROR_END);
+            continue;
+        }
+        int first = probe < 2 ? 2 : (probe + 1) / 2 * 2;
+        assert(res == BTREE_OK && btree_cursor_get(&cursor, &key, NULL) == BTREE_OK && key == first);
+
+        // a short range scan [probe, probe + 10) from the seek position
+        int count = 0;
+        for (; res == BTREE_OK; res = btree_cursor_next(&cursor)) {
+            btree_cursor_get(&cursor, &key, NULL);
+            if (key >= probe + 10) {
+                break;
+            }
+            count++;
+        }
+        int last = probe + 9 < 2 * len ? probe + 9 : 2 * len;
+        assert(count == (last >= first ? (last - first) / 2 + 1 : 0));
+
+        if (btree_cursor_seek(&cursor, probe) == BTREE_OK && first > 2) {
+            assert(btree_cursor_prev(&cursor) == BTREE_OK);
+            assert(btree_cursor_get(&cursor, &key, NULL) == BTREE_OK && key == first - 2);
+        }
+    }
+
+    btree_cursor_close(&cursor);
+    btree_destroy(&btree);
+    free(keys);
+    return 0;
+}
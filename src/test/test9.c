@@ -0,0 +1,63 @@
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "../btree.h"
+#include "utils.h"
+
+int main() {
+    int len = 20000; // the test size
+    int batch = 700;
+    long seed = 42;
+    int t = 3;
+    Btree btree;
+    remove("test9.db");
+    int ok = BTREE_INIT(&btree, .path = "test9.db", .t = t);
+    assert(ok == BTREE_OK && "Failed to init btree");
+    srand48(seed);
+    int *keys = malloc(len * sizeof(*keys));
+    Item *items = malloc(batch * sizeof(*items));
+    int *values = malloc(len * sizeof(*values));
+    Btree_Result *results = malloc(len * sizeof(*results));
+
+    // odd keys only, so even probes must miss
+    for (int i = 0; i < len; i++) {
+        keys[i] = 2 * i + 1;
+    }
+    shuffle(keys, len);
+
+    // empty batches do nothing, whatever the arrays
+    assert(btree_put_batch(&btree, items, 0) == BTREE_OK);
+    assert(btree_find_batch(&btree, keys, 0, NULL, NULL) == BTREE_OK);
+
+    for (int i = 0; i < len; i += batch) {
+        int n = len - i < batch ? len - i : batch;
+        for (int j = 0; j < n; j++) {
+            items[j] = (Item){keys[i + j], -keys[i + j]};
+        }
+        assert(btree_put_batch(&btree, items, n) == BTREE_OK);
+        assert(btree_is_valid(&btree));
+    }
+
+    assert(btree_find_batch(&btree, keys, len, values, results) == BTREE_OK);
+    for (int i = 0; i < len; i++) {
+        assert(results[i] == BTREE_OK && values[i] == -keys[i]);
+    }
+
+    for (int i = 0; i < len; i++) {
+        keys[i] = i % 2 == 0 ? i : len - i;
+    }
+    assert(btree_find_batch(&btree, keys, len, values, results) == BTREE_ERROR_KEY_NOT_FOUND);
+    for (int i = 0; i < len; i++) {
+        int value = 0;
+        assert(results[i] == btree_find(&btree, keys[i], &value));
+        assert(results[i] != BTREE_OK || values[i] == value);
+    }
+
+    btree_destroy(&btree);
+    free(keys);
+    free(items);
+    free(values);
+    free(results);
+    return 0;
+}